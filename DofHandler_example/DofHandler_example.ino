@@ -11,6 +11,10 @@ DofHandler<SoftwareSerial> dofHandler(&dofSerial);
 // uncomment the next line
 //DofHandler<HardwareSerial> dofHandler(&Serial);
 
+// To use several 9DoFs together (for redundancy), give each its own DofHandler and add them
+// all to a DofManager, each through a DofHandlerSource, which services them and fuses their
+// data (see DofManager.h).
+
 
 
 void setup() {
@@ -18,8 +22,10 @@ void setup() {
   // communicate with the 9DoF
   Serial.begin(38400);
 
-  // Connect to the 9DoF at 9600 baud to tell it to
-  // upgrade to 28800 baud.
+  // Connect to the 9DoF at 9600 baud, then step the baud rate
+  // up (to 28800 baud at most) for as long as the link holds up.
+  // With HardwareSerial, 115200 may well work; see
+  // dofHandler.getBaudRate() for the rate it settled on.
   // (You should not call Serial.begin() in this case)
   dofHandler.begin(9600, 28800);
   
@@ -29,6 +35,11 @@ void setup() {
     - DOF_DATA_MODE_ALL = 0, Sends all of the sensor data (accel, magnetom, gyro).
     - DOF_DATA_MODE_GYRO = 1, Sends only the gyroscope data (X, Y, and Z).
     - DOF_DATA_MODE_EULER = 2, Sends the Euler angles (yaw, pitch, and roll).
+    - DOF_DATA_MODE_COMPACT = 3, Sends all of the sensor data, as small deltas
+      between periodic keyframes. Uses about half the bandwidth of
+      DOF_DATA_MODE_ALL, at the cost of precision (whole sensor units).
+    - DOF_DATA_MODE_QUATERNION = 4, Sends the orientation as a quaternion (w, x, y, z).
+      Unlike the Euler angles, it has no gimbal lock and needs no trig to use.
     
     Defaults to DOF_DATA_MODE_ALL.
   */
@@ -41,8 +52,40 @@ void setup() {
   // to be about the time it takes you process the data.
   dofHandler.setUpdateInterval(40);
   
+  // Optionally, have the 9DoF stamp every sample with the time its sensors were read.
+  // dofHandler.getSampleTime() then gives that time in micros() here, and
+  // dofHandler.getDataAge() the true age of the data, however long it took to arrive.
+  //dofHandler.setTimestamps(true);
+  
+  // Optionally, register a function that is called as soon as a good
+  // packet is received (see onDofFrame below). This is an alternative to
+  // polling isNewDataAvailable() in loop().
+  //dofHandler.onFrame(onDofFrame);
+  
+  // Optionally, have every sample decoded into a ring (see DofRing), so none are missed
+  // when loop() falls behind a burst, e.g. with batching:
+  //   DofRingBuffer<16> samples; // (a global)
+  //   dofHandler.setSampleRing(&samples);
+  // and in loop(): DofSample sample; while (samples.pop(sample)) { ... }
+  
   // Send out a request for data from the 9DoF.
   dofHandler.requestData();
+  
+  // Alternatively, keep several tagged requests in flight, so a new sample is on its way
+  // while the last one is being processed: set a pipeline depth here, and call
+  // dofHandler.requestDataPipelined() in loop() instead of requestData().
+  // dofHandler.getRequestLatency() then gives the round trip time of every answer.
+  //dofHandler.setPipelineDepth(4);
+}
+
+// Called from within checkStream() for every good packet, if registered
+// with onFrame(). The frame points straight into the DofHandler's buffer,
+// and only the fields that are accessed get decoded.
+void onDofFrame(const DofFrame &frame) {
+  if (frame.getMode() == DOF_DATA_MODE_GYRO) {
+    double gyroZ = frame.getGyroZ();
+    // Now, we can do stuff with our gyroscope data.
+  }
 }
 
 void loop() {
@@ -76,10 +119,15 @@ void loop() {
         GyroData gyro = dofHandler.getGyroData();
         // Now, we can do stuff with our gyroscope data.
         } break;
-      case DOF_DATA_MODE_ALL: {
+      case DOF_DATA_MODE_ALL:
+      case DOF_DATA_MODE_COMPACT: {
         DofData sensorData = dofHandler.getData();
         // Now, we can do stuff with our sensor data.
         } break;
+      case DOF_DATA_MODE_QUATERNION: {
+        QuatData quatData = dofHandler.getQuatData();
+        // Now, we can do stuff with our orientation.
+        } break;
       case DOF_DATA_MODE_EULER: {
         EulerData eulerData = dofHandler.getEulerData();
         // Now, we can do stuff with our euler data.
@@ -0,0 +1,96 @@
+//=====================================================================================================
+// MadgwickAHRSbatch.c
+//=====================================================================================================
+//
+// Batch version of Madgwick's AHRS algorithm (see MadgwickAHRS.c).
+//
+// The loop body is MadgwickAHRSupdateDt() and MadgwickAHRSupdateIMUDt() with the branches
+// turned into selects, over the same filter math (FusionCore.h), so each filter goes through
+// exactly the same arithmetic as in the scalar code. Filters with a zero magnetometer vector
+// take the IMU gradient step, filters with a zero accelerometer vector take no feedback step.
+//
+//=====================================================================================================
+
+//---------------------------------------------------------------------------------------------------
+// Header files
+
+#include "MadgwickAHRSbatch.h"
+#include "../Razor AHRS Firmware and Test Sketch v1.4.1/Arduino/Razor_AHRS/FusionCore.h"	// the filter math, shared with the firmware
+
+//====================================================================================================
+// Functions
+
+void MadgwickAHRSbatchInit(MadgwickAHRSbatch *batch, float beta) {
+	int i;
+	for(i = 0; i < batch->count; i++) {
+		batch->beta[i] = beta;
+		batch->q0[i] = 1.0f;
+		batch->q1[i] = 0.0f;
+		batch->q2[i] = 0.0f;
+		batch->q3[i] = 0.0f;
+	}
+}
+
+// The loop of MadgwickAHRSbatchUpdate(). Taking every array as a restrict parameter tells the
+// compiler the state and the inputs do not overlap, so the loop is vectorised without runtime checks.
+static void batchUpdate(int count, float * restrict Q0, float * restrict Q1, float * restrict Q2, float * restrict Q3,
+		const float * restrict BETA, const float * restrict GX, const float * restrict GY, const float * restrict GZ,
+		const float * restrict AX, const float * restrict AY, const float * restrict AZ,
+		const float * restrict MX, const float * restrict MY, const float * restrict MZ, const float * restrict DT) {
+	int i;
+
+	for(i = 0; i < count; i++) {
+		float q[4] = {Q0[i], Q1[i], Q2[i], Q3[i]};
+		float ax = AX[i], ay = AY[i], az = AZ[i];
+		float mx = MX[i], my = MY[i], mz = MZ[i];
+		float recipNorm;
+		float rate[4], s[4], imu[4];
+		int j;
+		// 1 for valid measurements, 0 for zero vectors. The selects below are done with these as
+		// factors and terms that are exact for 0 and 1: compilers keep ?: as branches in a loop this big.
+		float accelValid = (float)((ax != 0.0f) | (ay != 0.0f) | (az != 0.0f));
+		float magValid = (float)((mx != 0.0f) | (my != 0.0f) | (mz != 0.0f));
+
+		// Rate of change of quaternion from gyroscope
+		madgwick_gyro_rate(q, GX[i], GY[i], GZ[i], rate);
+
+		// Normalise accelerometer measurement (adding 1 to zero vectors keeps them from making NaNs)
+		recipNorm = fusion_inv_sqrt((ax * ax + ay * ay + az * az) + (1.0f - accelValid));
+		ax *= recipNorm;
+		ay *= recipNorm;
+		az *= recipNorm;
+
+		// Normalise magnetometer measurement
+		recipNorm = fusion_inv_sqrt((mx * mx + my * my + mz * mz) + (1.0f - magValid));
+		mx *= recipNorm;
+		my *= recipNorm;
+		mz *= recipNorm;
+
+		// Gradient decent algorithm corrective step, without magnetometer if it is invalid
+		madgwick_gradient(q, ax, ay, az, mx, my, mz, s);
+		madgwick_gradient_imu(q, ax, ay, az, imu);
+		for(j = 0; j < 4; j++) s[j] = magValid * s[j] + (1.0f - magValid) * imu[j];
+
+		recipNorm = fusion_inv_sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2] + s[3] * s[3]); // normalise step magnitude
+		for(j = 0; j < 4; j++) s[j] *= recipNorm;
+
+		// Apply feedback step, only if the accelerometer measurement is valid, and integrate
+		madgwick_integrate(q, rate, s, 0.5f * DT[i], (BETA[i] * accelValid) * DT[i]);
+
+		// Normalise quaternion
+		recipNorm = fusion_inv_sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+		Q0[i] = q[0] * recipNorm;
+		Q1[i] = q[1] * recipNorm;
+		Q2[i] = q[2] * recipNorm;
+		Q3[i] = q[3] * recipNorm;
+	}
+}
+
+void MadgwickAHRSbatchUpdate(MadgwickAHRSbatch *batch, const float *gx, const float *gy, const float *gz,
+		const float *ax, const float *ay, const float *az, const float *mx, const float *my, const float *mz, const float *dt) {
+	batchUpdate(batch->count, batch->q0, batch->q1, batch->q2, batch->q3, batch->beta, gx, gy, gz, ax, ay, az, mx, my, mz, dt);
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
@@ -0,0 +1,36 @@
+//=====================================================================================================
+// MadgwickAHRSbatch.h
+//=====================================================================================================
+//
+// Batch version of Madgwick's AHRS algorithm, for reprocessing logged data on a host.
+// Updates many independent filters per call; the state is kept in structure-of-arrays
+// layout so the compiler can vectorise the update loop (build with -O3 and e.g. -mavx2).
+// Every filter gives the same results as MadgwickAHRSupdateDt() on the same inputs.
+//
+//=====================================================================================================
+#ifndef MadgwickAHRSbatch_h
+#define MadgwickAHRSbatch_h
+
+//----------------------------------------------------------------------------------------------------
+// Type declaration
+
+typedef struct {
+	int count;					// number of filters
+	float *beta;				// algorithm gain of each filter
+	float *q0, *q1, *q2, *q3;	// quaternion of each filter
+} MadgwickAHRSbatch;
+
+//---------------------------------------------------------------------------------------------------
+// Function declarations
+
+// Sets every quaternion of the batch to identity and every gain to beta (all arrays are owned by the caller)
+void MadgwickAHRSbatchInit(MadgwickAHRSbatch *batch, float beta);
+
+// Runs one update of every filter; filter i takes element i of every array (dt in seconds)
+void MadgwickAHRSbatchUpdate(MadgwickAHRSbatch *batch, const float *gx, const float *gy, const float *gz,
+		const float *ax, const float *ay, const float *az, const float *mx, const float *my, const float *mz, const float *dt);
+
+#endif
+//=====================================================================================================
+// End of file
+//=====================================================================================================
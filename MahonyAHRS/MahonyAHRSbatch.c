@@ -0,0 +1,119 @@
+//=====================================================================================================
+// MahonyAHRSbatch.c
+//=====================================================================================================
+//
+// Batch version of Madgwick's implementation of Mayhony's AHRS algorithm (see MahonyAHRS.c).
+//
+// The loop body is MahonyAHRSupdateDt() and MahonyAHRSupdateIMUDt() with the branches turned
+// into selects, over the same filter math (FusionCore.h), so each filter goes through exactly
+// the same arithmetic as in the scalar code.
+// Filters with a zero magnetometer vector leave the magnetic field out of the error, filters
+// with a zero accelerometer vector take no feedback step and keep their integral terms.
+//
+//=====================================================================================================
+
+//---------------------------------------------------------------------------------------------------
+// Header files
+
+#include "MahonyAHRSbatch.h"
+#include "../Razor AHRS Firmware and Test Sketch v1.4.1/Arduino/Razor_AHRS/FusionCore.h"	// the filter math, shared with the firmware
+
+//====================================================================================================
+// Functions
+
+void MahonyAHRSbatchInit(MahonyAHRSbatch *batch, float twoKp, float twoKi) {
+	int i;
+	for(i = 0; i < batch->count; i++) {
+		batch->twoKp[i] = twoKp;
+		batch->twoKi[i] = twoKi;
+		batch->q0[i] = 1.0f;
+		batch->q1[i] = 0.0f;
+		batch->q2[i] = 0.0f;
+		batch->q3[i] = 0.0f;
+		batch->integralFBx[i] = 0.0f;
+		batch->integralFBy[i] = 0.0f;
+		batch->integralFBz[i] = 0.0f;
+	}
+}
+
+// The loop of MahonyAHRSbatchUpdate(). Taking every array as a restrict parameter tells the
+// compiler the state and the inputs do not overlap, so the loop is vectorised without runtime checks.
+static void batchUpdate(int count, float * restrict Q0, float * restrict Q1, float * restrict Q2, float * restrict Q3,
+		float * restrict IFBX, float * restrict IFBY, float * restrict IFBZ,
+		const float * restrict TWOKP, const float * restrict TWOKI, const float * restrict GX, const float * restrict GY, const float * restrict GZ,
+		const float * restrict AX, const float * restrict AY, const float * restrict AZ,
+		const float * restrict MX, const float * restrict MY, const float * restrict MZ, const float * restrict DT) {
+	int i;
+
+	for(i = 0; i < count; i++) {
+		float q[4] = {Q0[i], Q1[i], Q2[i], Q3[i]};
+		float gx = GX[i], gy = GY[i], gz = GZ[i];
+		float ax = AX[i], ay = AY[i], az = AZ[i];
+		float mx = MX[i], my = MY[i], mz = MZ[i];
+		float twoKiDt = TWOKI[i] * DT[i], twoKp = TWOKP[i];
+		float recipNorm;
+		float halfe[3], field[3];
+		// 1 for valid measurements and enabled integral feedback, 0 otherwise. The selects below are
+		// done with these as factors and terms that are exact for 0 and 1: compilers keep ?: as
+		// branches in a loop this big.
+		float accelValid = (float)((ax != 0.0f) | (ay != 0.0f) | (az != 0.0f));
+		float magValid = (float)((mx != 0.0f) | (my != 0.0f) | (mz != 0.0f));
+		float integralOn = (float)(TWOKI[i] > 0.0f);
+		float integralFBx, integralFBy, integralFBz;
+
+		// Normalise accelerometer measurement (zero vectors stay zero)
+		recipNorm = fusion_inv_sqrt(ax * ax + ay * ay + az * az + (1.0f - accelValid));
+		ax *= recipNorm;
+		ay *= recipNorm;
+		az *= recipNorm;
+
+		// Normalise magnetometer measurement (zero vectors stay zero)
+		recipNorm = fusion_inv_sqrt(mx * mx + my * my + mz * mz + (1.0f - magValid));
+		mx *= recipNorm;
+		my *= recipNorm;
+		mz *= recipNorm;
+
+		// Error is sum of cross product between estimated direction and measured direction of field vectors
+		mahony_gravity_error(q, ax, ay, az, halfe);
+		mahony_field_error(q, mx, my, mz, field);
+		halfe[0] += magValid * field[0];
+		halfe[1] += magValid * field[1];
+		halfe[2] += magValid * field[2];
+
+		// Integral feedback (reset if disabled, kept as is without a valid accelerometer measurement)
+		integralFBx = accelValid * (integralOn * (IFBX[i] + twoKiDt * halfe[0])) + (1.0f - accelValid) * IFBX[i];
+		integralFBy = accelValid * (integralOn * (IFBY[i] + twoKiDt * halfe[1])) + (1.0f - accelValid) * IFBY[i];
+		integralFBz = accelValid * (integralOn * (IFBZ[i] + twoKiDt * halfe[2])) + (1.0f - accelValid) * IFBZ[i];
+		IFBX[i] = integralFBx;
+		IFBY[i] = integralFBy;
+		IFBZ[i] = integralFBz;
+
+		// Apply integral and proportional feedback
+		gx += accelValid * integralFBx;
+		gy += accelValid * integralFBy;
+		gz += accelValid * integralFBz;
+		gx += accelValid * (twoKp * halfe[0]);
+		gy += accelValid * (twoKp * halfe[1]);
+		gz += accelValid * (twoKp * halfe[2]);
+
+		// Integrate rate of change of quaternion
+		mahony_integrate(q, gx, gy, gz, 0.5f * DT[i]);
+
+		// Normalise quaternion
+		recipNorm = fusion_inv_sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+		Q0[i] = q[0] * recipNorm;
+		Q1[i] = q[1] * recipNorm;
+		Q2[i] = q[2] * recipNorm;
+		Q3[i] = q[3] * recipNorm;
+	}
+}
+
+void MahonyAHRSbatchUpdate(MahonyAHRSbatch *batch, const float *gx, const float *gy, const float *gz,
+		const float *ax, const float *ay, const float *az, const float *mx, const float *my, const float *mz, const float *dt) {
+	batchUpdate(batch->count, batch->q0, batch->q1, batch->q2, batch->q3, batch->integralFBx, batch->integralFBy, batch->integralFBz,
+			batch->twoKp, batch->twoKi, gx, gy, gz, ax, ay, az, mx, my, mz, dt);
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
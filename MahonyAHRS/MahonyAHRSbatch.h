@@ -0,0 +1,38 @@
+//=====================================================================================================
+// MahonyAHRSbatch.h
+//=====================================================================================================
+//
+// Batch version of Madgwick's implementation of Mayhony's AHRS algorithm, for reprocessing
+// logged data on a host. Updates many independent filters per call; the state is kept in
+// structure-of-arrays layout so the compiler can vectorise the update loop (build with -O3
+// and e.g. -mavx2). Every filter gives the same results as MahonyAHRSupdateDt() on the same inputs.
+//
+//=====================================================================================================
+#ifndef MahonyAHRSbatch_h
+#define MahonyAHRSbatch_h
+
+//----------------------------------------------------------------------------------------------------
+// Type declaration
+
+typedef struct {
+	int count;								// number of filters
+	float *twoKp;							// 2 * proportional gain of each filter
+	float *twoKi;							// 2 * integral gain of each filter
+	float *q0, *q1, *q2, *q3;				// quaternion of each filter
+	float *integralFBx, *integralFBy, *integralFBz;	// integral error terms of each filter
+} MahonyAHRSbatch;
+
+//---------------------------------------------------------------------------------------------------
+// Function declarations
+
+// Resets every filter of the batch and sets its gains (all arrays are owned by the caller)
+void MahonyAHRSbatchInit(MahonyAHRSbatch *batch, float twoKp, float twoKi);
+
+// Runs one update of every filter; filter i takes element i of every array (dt in seconds)
+void MahonyAHRSbatchUpdate(MahonyAHRSbatch *batch, const float *gx, const float *gy, const float *gz,
+		const float *ax, const float *ay, const float *az, const float *mx, const float *my, const float *mz, const float *dt);
+
+#endif
+//=====================================================================================================
+// End of file
+//=====================================================================================================
@@ -0,0 +1,368 @@
+/* This file is part of the Razor AHRS Firmware */
+
+// Serial command parser (see the command list at the top of Razor_AHRS.ino)
+// read_commands() takes whatever bytes are available and returns; a command that is only
+// partly received is picked up again on the next call, so the sensor loop never waits for one.
+
+typedef void (*CommandHandler)(const byte *args);
+
+struct Command {
+  const char *name; // Characters after the '#'
+  byte args; // Argument bytes after the name
+  CommandHandler handler;
+};
+
+const Command commands[] = {
+  {"f", 0, command_frame},
+  {"F", 1, command_tagged_frame},
+  {"s", 2, command_synch},
+  {"t", 2, command_clock},
+  {"T", 1, command_timestamps},
+  {"on", 0, command_calibrate_next},
+  {"ot", 0, command_output_angles_text},
+  {"ob", 0, command_output_angles_binary},
+  {"oc", 0, command_output_calibration},
+  {"os", 2, command_output_sensors},
+  {"o0", 0, command_stream_off},
+  {"o1", 0, command_stream_on},
+  {"oe", 1, command_errors},
+  {"i", 2, command_output_interval},
+  {"I", 2, command_fusion_interval},
+  {"k", 1, command_batch_size},
+  {"p", 1, command_sensor_profile},
+  {"b", 1, command_baud_rate},
+  {"B", 1, command_baud_trial},
+  {"z", 0, command_zero_calibrate},
+  {"m", 1, command_data_mode},
+#if OUTPUT__HAS_RN_BLUETOOTH == true
+  // Messages from the bluetooth module
+  // For this to work, the connect/disconnect message prefix of the module has to be set to "#".
+  {"C", 0, command_stream_on}, // Bluetooth "#CONNECT" message (does the same as "#o1")
+  {"D", 0, command_stream_off}, // Bluetooth "#DISCONNECT" message (does the same as "#o0")
+#endif
+};
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+#define COMMAND_MAX_LENGTH 4 // Longest name plus arguments
+#define COMMAND_TIMEOUT 100 // Milliseconds a command may take to come in completely
+
+// Parser state
+byte command_bytes[COMMAND_MAX_LENGTH]; // Name and arguments read so far
+byte command_length = 0; // Bytes of the current command read so far, including the '#'; 0 if none
+const Command *command_found = NULL; // Command of the name read so far, once it is complete
+unsigned long command_start; // Time the current command started (millis())
+
+// Reads the available command bytes, and runs every command that is complete
+void read_commands()
+{
+  // Drop a command that stopped halfway, so its missing bytes are not taken from the next one
+  if (command_length > 0 && millis() - command_start > COMMAND_TIMEOUT) {
+    command_length = 0;
+    command_found = NULL;
+  }
+
+  while (Serial.available() > 0)
+  {
+    byte c = Serial.read();
+
+    if (command_length == 0) // Waiting for the start of a new command
+    {
+      if (c == '#') {
+        command_length = 1;
+        command_start = millis();
+      }
+      // Skip other characters
+      continue;
+    }
+
+    if (command_found == NULL) // Reading the name
+    {
+      if (c == '#') { // Start of another command, the last one was incomplete
+        command_length = 1;
+        command_start = millis();
+        continue;
+      }
+      command_bytes[command_length - 1] = c;
+      command_length++;
+      if (!find_command()) command_length = 0; // Unknown command, skip it
+    }
+    else // Reading the arguments (binary, so '#' is just another byte here)
+    {
+      command_bytes[command_length - 1] = c;
+      command_length++;
+    }
+
+    // Complete?
+    if (command_found != NULL) {
+      byte name_length = strlen(command_found->name);
+      if (command_length - 1 == name_length + command_found->args) {
+        const Command *command = command_found;
+        command_length = 0;
+        command_found = NULL;
+        command->handler(command_bytes + name_length);
+      }
+    }
+  }
+}
+
+// Looks the name read so far up in the command table. Sets command_found if it is a whole
+// name; returns false if no command starts with it.
+boolean find_command()
+{
+  byte name_length = command_length - 1;
+  command_found = NULL;
+  boolean prefix = false;
+  for (byte i = 0; i < COMMAND_COUNT; i++) {
+    if (strncmp(commands[i].name, (const char *) command_bytes, name_length) != 0) continue;
+    prefix = true;
+    if (commands[i].name[name_length] == '\0') command_found = &commands[i];
+  }
+  return prefix;
+}
+
+void command_frame(const byte *args) // Request one output _f_rame
+{
+  output_single_on = true;
+}
+
+void command_tagged_frame(const byte *args) // Request one output _F_rame, tagged with the argument byte
+{
+  // Answered by the sensor fusion steps to come, one request per step. Requests that do not fit
+  // are dropped; the receiver will not get an answer with their tag.
+  if (output_request_count < OUTPUT__MAX_REQUESTS) {
+    output_requests[output_request_count++] = args[0];
+  }
+}
+
+void command_synch(const byte *args) // _s_ynch request
+{
+  // Reply with synch message, with the two ID bytes of the request
+  output_queue.beginFrame();
+  output_queue.print("#SYNCH");
+  output_queue.write(args, 2);
+  output_queue.println();
+  output_queue.endFrame();
+}
+
+void command_clock(const byte *args) // Request the firmware clock, to sync _t_imestamps with
+{
+  // Reply with a clock packet: the two ID bytes of the request and micros(), MSB first.
+  // A clock packet does not take up a sequence number (see output_packet()).
+  unsigned long now = micros();
+  byte data[6] = {args[0], args[1], (byte) (now >> 24), (byte) (now >> 16), (byte) (now >> 8), (byte) now};
+  output_packet(DATA_MODE_CLOCK, data, 6);
+}
+
+void command_timestamps(const byte *args) // Turn sample _T_imestamps on or off
+{
+  if (args[0] == '0') output_timestamps = false;
+  else if (args[0] == '1') output_timestamps = true;
+  else return;
+  output_batch_count = 0; // Drop the samples collected with the other size
+}
+
+void command_calibrate_next(const byte *args) // Calibrate _n_ext sensor
+{
+  curr_calibration_sensor = (curr_calibration_sensor + 1) % 3;
+  reset_calibration_session_flag = true;
+}
+
+void command_output_angles_text(const byte *args) // Output angles as _t_ext
+{
+  output_mode = OUTPUT__MODE_ANGLES;
+  output_format = OUTPUT__FORMAT_TEXT;
+}
+
+void command_output_angles_binary(const byte *args) // Output angles in _b_inary format
+{
+  output_mode = OUTPUT__MODE_ANGLES;
+  output_format = OUTPUT__FORMAT_BINARY;
+}
+
+void command_output_calibration(const byte *args) // Go to _c_alibration mode
+{
+  output_mode = OUTPUT__MODE_CALIBRATE_SENSORS;
+  reset_calibration_session_flag = true;
+}
+
+void command_output_sensors(const byte *args) // Output _s_ensor values
+{
+  char values_param = args[0];
+  char format_param = args[1];
+  if (values_param == 'r')  // Output _r_aw sensor values
+    output_mode = OUTPUT__MODE_SENSORS_RAW;
+  else if (values_param == 'c')  // Output _c_alibrated sensor values
+    output_mode = OUTPUT__MODE_SENSORS_CALIB;
+  else if (values_param == 'b')  // Output _b_oth sensor values (raw and calibrated)
+    output_mode = OUTPUT__MODE_SENSORS_BOTH;
+
+  if (format_param == 't') // Output values as _t_text
+    output_format = OUTPUT__FORMAT_TEXT;
+  else if (format_param == 'b') // Output values in _b_inary format
+    output_format = OUTPUT__FORMAT_BINARY;
+}
+
+void command_stream_off(const byte *args) // Disable continuous streaming output
+{
+  turn_output_stream_off();
+  reset_calibration_session_flag = true;
+}
+
+void command_stream_on(const byte *args) // Enable continuous streaming output
+{
+  reset_calibration_session_flag = true;
+  turn_output_stream_on();
+}
+
+void command_errors(const byte *args) // _e_rror output settings
+{
+  char error_param = args[0];
+  if (error_param == '0') output_errors = false;
+  else if (error_param == '1') output_errors = true;
+  else if (error_param == 'c') // get error count
+  {
+    output_queue.beginFrame();
+    output_queue.print("#AMG-ERR:");
+    output_queue.print(num_accel_errors); output_queue.print(",");
+    output_queue.print(num_magn_errors); output_queue.print(",");
+    output_queue.println(num_gyro_errors);
+    output_queue.endFrame();
+  }
+}
+
+void command_output_interval(const byte *args) // Set output _i_nterval
+{
+  output_data_interval = (short) ((args[0] << 8) | args[1]);
+  update_output_decimation();
+}
+
+void command_fusion_interval(const byte *args) // Set sensor fusion _I_nterval
+{
+  set_fusion_interval((short) ((args[0] << 8) | args[1]));
+}
+
+void command_batch_size(const byte *args) // Set batch size
+{
+  output_batch_size = (args[0] > 0) ? args[0] : 1;
+  output_batch_count = 0;
+}
+
+void command_sensor_profile(const byte *args) // Set sensor _p_rofile
+{
+  set_sensor_profile(args[0] - '0');
+}
+
+void command_baud_rate(const byte *args) // Set _b_aud rate
+{
+  long baud = baud_from_id(args[0]);
+  if (baud != 0) {
+    baud_trial_fallback = 0;
+    set_baud_rate(baud);
+  }
+}
+
+void command_baud_trial(const byte *args) // Try out a _B_aud rate
+{
+  long baud = baud_from_id(args[0]);
+  if (baud == 0) return;
+
+  if (baud == baud_rate) {
+    // Confirmed: the receiver got through at this rate, so keep it
+    baud_trial_fallback = 0;
+    output_queue.beginFrame();
+    output_queue.print("#BAUD");
+    output_queue.println(baud);
+    output_queue.endFrame();
+  } else {
+    long previous = baud_rate;
+    set_baud_rate(baud);
+    baud_trial_fallback = previous;
+    baud_trial_start = millis();
+  }
+}
+
+// Goes back to the old baud rate once a rate set with "#B<n>" has not been confirmed in time
+void check_baud_trial()
+{
+  if (baud_trial_fallback != 0 && millis() - baud_trial_start > OUTPUT__BAUD_TRIAL_TIME) {
+    long baud = baud_trial_fallback;
+    baud_trial_fallback = 0;
+    output_queue.sendAll(Serial); // Meant for the receiver at the rate on trial
+    Serial.end();
+    Serial.begin(baud);
+    baud_rate = baud;
+  }
+}
+
+// Returns the baud rate of a "#b<n>" or "#B<n>" ID, or 0 if there is none
+long baud_from_id(char id)
+{
+  long baud = 0;
+  switch (id) {
+    case '1':
+      baud = 2400;
+      break;
+    case '2':
+      baud = 4800;
+      break;
+    case '3':
+      baud = 9600;
+      break;
+    case '4':
+      baud = 14400;
+      break;
+    case '5':
+      baud = 19200;
+      break;
+    case '6':
+      baud = 28800;
+      break;
+    case '7':
+      baud = 38400;
+      break;
+    case '8':
+      baud = 57600;
+      break;
+    case '9':
+      baud = 115200;
+      break;
+  }
+  return baud;
+}
+
+// Answers with "#BAUD<baud>" at the old rate, then changes to the new one
+void set_baud_rate(long baud)
+{
+  output_queue.beginFrame();
+  output_queue.print("#BAUD");
+  output_queue.println(baud);
+  output_queue.endFrame();
+  output_queue.sendAll(Serial);
+  Serial.end();
+  delay(10);
+  Serial.begin(baud);
+  baud_rate = baud;
+}
+
+void command_zero_calibrate(const byte *args) // _z_ero calibrate
+{
+  do_calibration = true;
+}
+
+void command_data_mode(const byte *args) // Set data _m_ode
+{
+  byte mode = args[0];
+  switch (mode) {
+    case DATA_MODE_ALL:
+    case DATA_MODE_GYRO:
+    case DATA_MODE_EULER:
+    case DATA_MODE_COMPACT:
+    case DATA_MODE_QUATERNION:
+      break;
+    default:
+      mode = DATA_MODE_DEFAULT;
+  }
+
+  data_mode = mode;
+  compact_packets_to_key = 0; // Start DATA_MODE_COMPACT with a keyframe
+  output_batch_count = 0; // Drop the samples of the old mode
+}
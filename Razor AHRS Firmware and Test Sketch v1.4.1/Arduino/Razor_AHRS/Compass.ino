@@ -9,15 +9,15 @@ void Compass_Heading()
   float cos_pitch;
   float sin_pitch;
   
-  cos_roll = cos(roll);
-  sin_roll = sin(roll);
-  cos_pitch = cos(pitch);
-  sin_pitch = sin(pitch);
+  cos_roll = FUSION_COS(roll);
+  sin_roll = FUSION_SIN(roll);
+  cos_pitch = FUSION_COS(pitch);
+  sin_pitch = FUSION_SIN(pitch);
   
   // Tilt compensated magnetic field X
   mag_x = magnetom[0] * cos_pitch + magnetom[1] * sin_roll * sin_pitch + magnetom[2] * cos_roll * sin_pitch;
   // Tilt compensated magnetic field Y
   mag_y = magnetom[1] * cos_roll - magnetom[2] * sin_roll;
   // Magnetic Heading
-  MAG_Heading = atan2(-mag_y, mag_x);
+  MAG_Heading = FUSION_ATAN2(-mag_y, mag_x);
 }
@@ -21,10 +21,28 @@
 #define OUTPUT__BAUD_RATE 9600
 
 // Sensor data output interval in milliseconds
-// This may not work, if faster than 20ms (=50Hz)
-// Code is tuned for 20ms, so better leave it like that
+// Output is decimated from the sensor fusion rate below, so it is rounded to a multiple of
+// FUSION__DATA_INTERVAL, and can not be faster than that.
 #define OUTPUT__DATA_INTERVAL 30 // in milliseconds
 
+// Sensor read and fusion interval in milliseconds, kept by a Timer1 interrupt.
+// The sensors are set up for 50Hz, so 20ms matches their output data rate.
+#define FUSION__DATA_INTERVAL 20 // in milliseconds
+#define FUSION__MAX_DATA_INTERVAL 250 // Longest interval Timer1 can count at 16MHz (do not change)
+
+// Sensor profiles (output data rates of the sensors), selectable with "#p<n>"
+#define SENSOR__PROFILE_STANDARD 0 // All sensors at 50Hz, fusion every 20ms
+#define SENSOR__PROFILE_HIGH_RATE 1 // Gyro 1kHz (read at 500Hz), accel 400Hz (read at 500Hz),
+                                    // magn 75Hz (50Hz on HMC5843), fusion every 2ms
+#define SENSOR__PROFILE_COUNT 2 // (do not change)
+// The profile sets the fusion interval as well (FUSION__DATA_INTERVAL is only used up to then)
+#define SENSOR__STARTUP_PROFILE SENSOR__PROFILE_STANDARD
+
+// If set true, the accelerometer runs its FIFO in stream mode. Every acquisition drains it and
+// averages all the samples it held, instead of reading just the latest one. In the standard
+// profile the accelerometer then runs at 200Hz, so four samples go into every reading.
+#define ACCEL__USE_FIFO false  // true or false
+
 // Output mode definitions (do not change)
 #define OUTPUT__MODE_CALIBRATE_SENSORS 0 // Outputs sensor min/max values as text for manual calibration
 #define OUTPUT__MODE_ANGLES 1 // Outputs yaw/pitch/roll in degrees
@@ -38,14 +56,71 @@
 #define DATA_MODE_ALL 0
 #define DATA_MODE_GYRO 1
 #define DATA_MODE_EULER 2
+#define DATA_MODE_COMPACT 3 // All sensors, as 16 bit keyframes followed by 8 bit deltas
+#define DATA_MODE_QUATERNION 4 // Orientation quaternion of the fusion filter (see FUSION__FILTER)
 #define DATA_MODE_DEFAULT DATA_MODE_ALL
 
+// Version of the binary packet framing sent by output_sensors_binary_packet() (do not change)
+#define OUTPUT__PACKET_VERSION 1
+// Set in a packet's data mode byte when it carries fixed point numbers (do not change)
+#define DATA_MODE_FIXED_POINT 0x80
+// Set in a packet's data mode byte when it carries a batch of samples (do not change)
+#define DATA_MODE_BATCH 0x40
+// Set in a packet's data mode byte when it answers a "#F<x>" request; its data then starts with x (do not change)
+#define DATA_MODE_TAGGED 0x20
+// Set in a packet's data mode byte when every sample starts with its acquisition time (do not change)
+#define DATA_MODE_TIMESTAMP 0x10
+// Data mode of the packets answering "#t<xy>", which carry the firmware clock (do not change)
+#define DATA_MODE_CLOCK 0x0F
+// Number of "#F<x>" requests the firmware holds on to. Each sensor fusion step answers the oldest
+// one, so a receiver that keeps several requests in flight gets every sample.
+#define OUTPUT__MAX_REQUESTS 8
+
+// Milliseconds a baud rate set with "#B<n>" is tried out for. Unless the receiver confirms it
+// in that time (with another "#B<n>" at the new rate), the firmware goes back to the old rate.
+#define OUTPUT__BAUD_TRIAL_TIME 1000
+
+// Samples sent per binary packet on startup, set with "#k<n>". Batches cut the framing overhead
+// (10 bytes per packet) and the number of packets the receiver handles. DATA_MODE_COMPACT is
+// never batched. A batch holds at most OUTPUT__BATCH_DATA_SIZE - 1 bytes of samples (so 4 samples
+// of DATA_MODE_ALL, 10 of DATA_MODE_EULER, 15 of DATA_MODE_QUATERNION, 20 of DATA_MODE_GYRO).
+#define OUTPUT__BATCH_SIZE 1
+#define OUTPUT__BATCH_DATA_SIZE 121 // (do not change, DofHandler relies on it)
+
+// If set true, binary packets carry Q16.16 fixed point numbers instead of floats for the
+// accelerometer, magnetometer and Euler angles. Sensor calibration and output of DATA_MODE_ALL,
+// DATA_MODE_GYRO and DATA_MODE_COMPACT packets then run without any floating point math (the DCM
+// is only run when Euler angles are requested).
+#define OUTPUT__FIXED_POINT false  // true or false
+
+// DATA_MODE_COMPACT sends a full 16 bit keyframe every this many packets, and deltas in between.
+// A lost packet is recovered from at the next keyframe at the latest.
+#define OUTPUT__COMPACT_KEYFRAME_INTERVAL 16
+
+// If set true, binary packets start every sample with the time it was acquired at (micros() of
+// the sensor tick), so the receiver can tell sensor time apart from transmission delays.
+// Adds 4 bytes per sample. Can be changed with "#T0" and "#T1".
+#define OUTPUT__TIMESTAMPS false  // true or false
+
 // Select your startup output mode and format here!
 int output_mode = OUTPUT__MODE_ANGLES;
 int output_format = OUTPUT__FORMAT_BINARY;
 
 int data_mode = DATA_MODE_ALL;
 
+// Sensor fusion filter used for the angle output (Euler angles and quaternion)
+#define FUSION__DCM 0 // Direction cosine matrix, the original Razor AHRS filter
+#define FUSION__MADGWICK 1 // Madgwick's gradient descent AHRS filter
+#define FUSION__MAHONY 2 // Mahony's complementary AHRS filter
+#define FUSION__FILTER FUSION__DCM
+// Filter gains
+#define FUSION__MADGWICK_BETA 0.1f // 2 * proportional gain
+#define FUSION__MAHONY_TWO_KP (2.0f * 0.5f) // 2 * proportional gain
+#define FUSION__MAHONY_TWO_KI (2.0f * 0.0f) // 2 * integral gain
+// Use the table and polynomial approximations of FastMath.h for the trig functions of the
+// fusion filters (errors below 1e-4 rad, see there) instead of the much slower math library.
+#define FUSION__FAST_MATH false  // true or false
+
 // Select if serial continuous streaming output is enabled per default on startup.
 #define OUTPUT__STARTUP_STREAM_ON false  // true or false
 
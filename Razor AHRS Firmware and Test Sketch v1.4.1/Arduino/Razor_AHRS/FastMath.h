@@ -0,0 +1,122 @@
+/* This file is part of the Razor AHRS Firmware */
+
+#ifndef FastMath_h
+#define FastMath_h
+
+#include <math.h>
+
+/**
+ * Approximations of the math functions in the sensor fusion hot path. The ATmega328 has no FPU,
+ * and the avr-libc sin/cos/atan2/asin take thousands of cycles each.
+ *
+ * Maximum errors over the whole input range (measured against double precision):
+ *   fast_sin, fast_cos   7.6e-5 (absolute)   65 entry quarter wave table, linear interpolation
+ *   fast_atan2           1.2e-5 rad          polynomial (Abramowitz & Stegun 4.4.47)
+ *   fast_asin            6.8e-5 rad          polynomial (Abramowitz & Stegun 4.4.45)
+ *
+ * Square roots stay with the math library: the bit level inverse square root with one Newton
+ * step (fusion_inv_sqrt() in FusionCore.h, which the MadgwickAHRS and MahonyAHRS libraries
+ * use) is off by up to 0.18%, which moves the output of the filters by degrees, and with two
+ * steps it is no faster than sqrt() and a division on AVR.
+ *
+ * The FUSION_* macros below are what the fusion code calls: the approximations if
+ * FUSION__FAST_MATH is true, the math library functions otherwise.
+ */
+
+#ifndef FUSION__FAST_MATH
+#define FUSION__FAST_MATH false
+#endif
+
+#if FUSION__FAST_MATH == true
+#define FUSION_SIN(x) fast_sin(x)
+#define FUSION_COS(x) fast_cos(x)
+#define FUSION_ATAN2(y, x) fast_atan2(y, x)
+#define FUSION_ASIN(x) fast_asin(x)
+#else
+#define FUSION_SIN(x) sin(x)
+#define FUSION_COS(x) cos(x)
+#define FUSION_ATAN2(y, x) atan2(y, x)
+#define FUSION_ASIN(x) asin(x)
+#endif
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define FAST_MATH_SIN_TABLE(i) pgm_read_float(&fast_math_sin_table[i])
+#else
+#define PROGMEM
+#define FAST_MATH_SIN_TABLE(i) fast_math_sin_table[i]
+#endif
+
+#define FAST_MATH_PI 3.14159265358979323846
+#define FAST_MATH_SIN_STEPS 64 // Table steps per quarter wave
+
+// The sine table is generated by the compiler: entry i is the Taylor series (up to x^13) of
+// sin(i * pi / 2 / FAST_MATH_SIN_STEPS), accurate to 1e-9 on the quarter wave.
+#define FAST_MATH_SIN_X2(i) (((i) * FAST_MATH_PI / 2 / FAST_MATH_SIN_STEPS) * ((i) * FAST_MATH_PI / 2 / FAST_MATH_SIN_STEPS))
+#define FAST_MATH_SIN(i) (float) (((i) * FAST_MATH_PI / 2 / FAST_MATH_SIN_STEPS) * (1 - FAST_MATH_SIN_X2(i) / 6 \
+  * (1 - FAST_MATH_SIN_X2(i) / 20 * (1 - FAST_MATH_SIN_X2(i) / 42 * (1 - FAST_MATH_SIN_X2(i) / 72 \
+  * (1 - FAST_MATH_SIN_X2(i) / 110 * (1 - FAST_MATH_SIN_X2(i) / 156)))))))
+#define FAST_MATH_SIN_4(i) FAST_MATH_SIN(i), FAST_MATH_SIN(i + 1), FAST_MATH_SIN(i + 2), FAST_MATH_SIN(i + 3)
+#define FAST_MATH_SIN_16(i) FAST_MATH_SIN_4(i), FAST_MATH_SIN_4(i + 4), FAST_MATH_SIN_4(i + 8), FAST_MATH_SIN_4(i + 12)
+
+static const float fast_math_sin_table[FAST_MATH_SIN_STEPS + 1] PROGMEM = {
+  FAST_MATH_SIN_16(0), FAST_MATH_SIN_16(16), FAST_MATH_SIN_16(32), FAST_MATH_SIN_16(48), FAST_MATH_SIN(64)
+};
+
+// Sine of an angle given in table steps (4 * FAST_MATH_SIN_STEPS per turn)
+inline float fast_sin_steps(float steps) {
+  long whole = (long) steps;
+  if (whole > steps) whole--; // Round towards minus infinity
+  float fraction = steps - whole;
+  int step = (int) (whole & (4 * FAST_MATH_SIN_STEPS - 1)); // Step within the turn
+  int index = step & (FAST_MATH_SIN_STEPS - 1); // Step within the quarter wave
+
+  float from, to;
+  if (step & FAST_MATH_SIN_STEPS) { // Falling quarter waves
+    from = FAST_MATH_SIN_TABLE(FAST_MATH_SIN_STEPS - index);
+    to = FAST_MATH_SIN_TABLE(FAST_MATH_SIN_STEPS - index - 1);
+  } else {
+    from = FAST_MATH_SIN_TABLE(index);
+    to = FAST_MATH_SIN_TABLE(index + 1);
+  }
+  float value = from + (to - from) * fraction;
+  return step & (2 * FAST_MATH_SIN_STEPS) ? -value : value; // Second half of the turn
+}
+
+// Sine of x (rad)
+inline float fast_sin(float x) {
+  return fast_sin_steps(x * (float) (2 * FAST_MATH_SIN_STEPS / FAST_MATH_PI));
+}
+
+// Cosine of x (rad)
+inline float fast_cos(float x) {
+  return fast_sin_steps(x * (float) (2 * FAST_MATH_SIN_STEPS / FAST_MATH_PI) + FAST_MATH_SIN_STEPS);
+}
+
+// Arc tangent of y / x in [-pi, pi] (rad)
+inline float fast_atan2(float y, float x) {
+  float abs_x = fabs(x);
+  float abs_y = fabs(y);
+  if (abs_x == 0 && abs_y == 0) return 0;
+
+  // Polynomial for |z| <= 1, the other octants follow from symmetry
+  float z = abs_y <= abs_x ? abs_y / abs_x : abs_x / abs_y;
+  float z2 = z * z;
+  float angle = z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f + z2 * (-0.0851330f + z2 * 0.0208351f))));
+
+  if (abs_y > abs_x) angle = (float) (FAST_MATH_PI / 2) - angle;
+  if (x < 0) angle = (float) FAST_MATH_PI - angle;
+  return y < 0 ? -angle : angle;
+}
+
+// Arc sine of x in [-pi / 2, pi / 2] (rad); x is clamped to [-1, 1]
+inline float fast_asin(float x) {
+  float abs_x = fabs(x);
+  if (abs_x > 1) abs_x = 1;
+
+  float angle = (float) (FAST_MATH_PI / 2) - sqrt(1 - abs_x)
+    * (1.5707288f + abs_x * (-0.2121144f + abs_x * (0.0742610f + abs_x * -0.0187293f)));
+  return x < 0 ? -angle : angle;
+}
+
+#endif
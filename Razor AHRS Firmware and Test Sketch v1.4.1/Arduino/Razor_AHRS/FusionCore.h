@@ -0,0 +1,207 @@
+/* This file is part of the Razor AHRS Firmware */
+
+#ifndef FusionCore_h
+#define FusionCore_h
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The math of Madgwick's and Mahony's AHRS filters (after Madgwick's MadgwickAHRS.c and
+ * MahonyAHRS.c, http://www.x-io.co.uk/node/8), shared by every implementation in the
+ * repository: MadgwickFilter and MahonyFilter in FusionFilter.h, and the MadgwickAHRS and
+ * MahonyAHRS libraries with their batch versions, which include this file from here.
+ *
+ * Plain C, so the libraries can use it too. The quaternion q is [w, x, y, z]. Normalising the
+ * measurements, the gradient step and the quaternion is left to the callers: the firmware
+ * divides by sqrt() (see FastMath.h), the libraries use fusion_inv_sqrt(), and the batch
+ * versions replace the branches on invalid measurements with selects.
+ */
+
+/*
+ * Fast inverse square root with one Newton step (off by up to 0.18%).
+ * See: http://en.wikipedia.org/wiki/Fast_inverse_square_root
+ */
+static inline float fusion_inv_sqrt(float x) {
+  float halfx = 0.5f * x;
+  float y = x;
+  int32_t i;
+  memcpy(&i, &y, sizeof(i)); // long is 64 bits on most hosts
+  i = 0x5f3759df - (i >> 1);
+  memcpy(&y, &i, sizeof(y));
+  y = y * (1.5f - (halfx * y * y));
+  return y;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Madgwick
+
+/*
+ * Sets rate to twice the rate of change of q from the gyroscope rates (rad/s).
+ */
+static inline void madgwick_gyro_rate(const float q[4], float gx, float gy, float gz, float rate[4]) {
+  rate[0] = -q[1] * gx - q[2] * gy - q[3] * gz;
+  rate[1] = q[0] * gx + q[2] * gz - q[3] * gy;
+  rate[2] = q[0] * gy - q[1] * gz + q[3] * gx;
+  rate[3] = q[0] * gz + q[1] * gy - q[2] * gx;
+}
+
+/*
+ * Sets s to the gradient descent corrective step (not normalised) for the normalised
+ * accelerometer and magnetometer vectors.
+ */
+static inline void madgwick_gradient(const float q[4], float ax, float ay, float az,
+    float mx, float my, float mz, float s[4]) {
+  float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+  float hx, hy;
+  float _2q0mx, _2q0my, _2q0mz, _2q1mx, _2bx, _2bz, _4bx, _4bz, _2q0, _2q1, _2q2, _2q3, _2q0q2, _2q2q3, q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+
+  // Auxiliary variables to avoid repeated arithmetic
+  _2q0mx = 2.0f * q0 * mx;
+  _2q0my = 2.0f * q0 * my;
+  _2q0mz = 2.0f * q0 * mz;
+  _2q1mx = 2.0f * q1 * mx;
+  _2q0 = 2.0f * q0;
+  _2q1 = 2.0f * q1;
+  _2q2 = 2.0f * q2;
+  _2q3 = 2.0f * q3;
+  _2q0q2 = 2.0f * q0 * q2;
+  _2q2q3 = 2.0f * q2 * q3;
+  q0q0 = q0 * q0;
+  q0q1 = q0 * q1;
+  q0q2 = q0 * q2;
+  q0q3 = q0 * q3;
+  q1q1 = q1 * q1;
+  q1q2 = q1 * q2;
+  q1q3 = q1 * q3;
+  q2q2 = q2 * q2;
+  q2q3 = q2 * q3;
+  q3q3 = q3 * q3;
+
+  // Reference direction of Earth's magnetic field
+  hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
+  hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 + _2q2 * mz * q3 - my * q3q3;
+  _2bx = sqrtf(hx * hx + hy * hy);
+  _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 - mz * q2q2 + mz * q3q3;
+  _4bx = 2.0f * _2bx;
+  _4bz = 2.0f * _2bz;
+
+  // Gradient decent algorithm corrective step
+  s[0] = -_2q2 * (2.0f * q1q3 - _2q0q2 - ax) + _2q1 * (2.0f * q0q1 + _2q2q3 - ay) - _2bz * q2 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (-_2bx * q3 + _2bz * q1) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + _2bx * q2 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+  s[1] = _2q3 * (2.0f * q1q3 - _2q0q2 - ax) + _2q0 * (2.0f * q0q1 + _2q2q3 - ay) - 4.0f * q1 * (1 - 2.0f * q1q1 - 2.0f * q2q2 - az) + _2bz * q3 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (_2bx * q2 + _2bz * q0) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + (_2bx * q3 - _4bz * q1) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+  s[2] = -_2q0 * (2.0f * q1q3 - _2q0q2 - ax) + _2q3 * (2.0f * q0q1 + _2q2q3 - ay) - 4.0f * q2 * (1 - 2.0f * q1q1 - 2.0f * q2q2 - az) + (-_4bx * q2 - _2bz * q0) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (_2bx * q1 + _2bz * q3) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + (_2bx * q0 - _4bz * q2) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+  s[3] = _2q1 * (2.0f * q1q3 - _2q0q2 - ax) + _2q2 * (2.0f * q0q1 + _2q2q3 - ay) + (-_4bx * q3 + _2bz * q1) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (-_2bx * q0 + _2bz * q2) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + _2bx * q1 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+}
+
+/*
+ * Same as madgwick_gradient(), without a magnetometer (the IMU algorithm).
+ */
+static inline void madgwick_gradient_imu(const float q[4], float ax, float ay, float az, float s[4]) {
+  float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+  float _2q0, _2q1, _2q2, _2q3, _4q0, _4q1, _4q2, _8q1, _8q2, q0q0, q1q1, q2q2, q3q3;
+
+  // Auxiliary variables to avoid repeated arithmetic
+  _2q0 = 2.0f * q0;
+  _2q1 = 2.0f * q1;
+  _2q2 = 2.0f * q2;
+  _2q3 = 2.0f * q3;
+  _4q0 = 4.0f * q0;
+  _4q1 = 4.0f * q1;
+  _4q2 = 4.0f * q2;
+  _8q1 = 8.0f * q1;
+  _8q2 = 8.0f * q2;
+  q0q0 = q0 * q0;
+  q1q1 = q1 * q1;
+  q2q2 = q2 * q2;
+  q3q3 = q3 * q3;
+
+  // Gradient decent algorithm corrective step
+  s[0] = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+  s[1] = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+  s[2] = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+  s[3] = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+}
+
+/*
+ * Integrates q (without normalising it) over one step: halfDt is 0.5 * dt, betaDt is beta * dt
+ * (0 for no feedback), rate is from madgwick_gyro_rate() and s the normalised corrective step.
+ */
+static inline void madgwick_integrate(float q[4], const float rate[4], const float s[4], float halfDt, float betaDt) {
+  q[0] += halfDt * rate[0] - betaDt * s[0];
+  q[1] += halfDt * rate[1] - betaDt * s[1];
+  q[2] += halfDt * rate[2] - betaDt * s[2];
+  q[3] += halfDt * rate[3] - betaDt * s[3];
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Mahony
+
+/*
+ * Sets halfe to half the error between the direction of gravity estimated from q and the
+ * normalised accelerometer vector (their cross product).
+ */
+static inline void mahony_gravity_error(const float q[4], float ax, float ay, float az, float halfe[3]) {
+  // Estimated direction of gravity
+  float halfvx = q[1] * q[3] - q[0] * q[2];
+  float halfvy = q[0] * q[1] + q[2] * q[3];
+  float halfvz = q[0] * q[0] - 0.5f + q[3] * q[3];
+
+  halfe[0] = ay * halfvz - az * halfvy;
+  halfe[1] = az * halfvx - ax * halfvz;
+  halfe[2] = ax * halfvy - ay * halfvx;
+}
+
+/*
+ * Sets halfe to half the error between the direction of the magnetic field estimated from q
+ * and the normalised magnetometer vector.
+ */
+static inline void mahony_field_error(const float q[4], float mx, float my, float mz, float halfe[3]) {
+  float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+  float q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+  float hx, hy, bx, bz;
+  float halfwx, halfwy, halfwz;
+
+  // Auxiliary variables to avoid repeated arithmetic
+  q0q1 = q0 * q1;
+  q0q2 = q0 * q2;
+  q0q3 = q0 * q3;
+  q1q1 = q1 * q1;
+  q1q2 = q1 * q2;
+  q1q3 = q1 * q3;
+  q2q2 = q2 * q2;
+  q2q3 = q2 * q3;
+  q3q3 = q3 * q3;
+
+  // Reference direction of Earth's magnetic field
+  hx = 2.0f * (mx * (0.5f - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+  hy = 2.0f * (mx * (q1q2 + q0q3) + my * (0.5f - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+  bx = sqrtf(hx * hx + hy * hy);
+  bz = 2.0f * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (0.5f - q1q1 - q2q2));
+
+  // Estimated direction of magnetic field
+  halfwx = bx * (0.5f - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+  halfwy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+  halfwz = bx * (q0q2 + q1q3) + bz * (0.5f - q1q1 - q2q2);
+
+  halfe[0] = my * halfwz - mz * halfwy;
+  halfe[1] = mz * halfwx - mx * halfwz;
+  halfe[2] = mx * halfwy - my * halfwx;
+}
+
+/*
+ * Integrates q (without normalising it) over one step, turning at the corrected rates g (rad/s)
+ * for halfDt = 0.5 * dt.
+ */
+static inline void mahony_integrate(float q[4], float gx, float gy, float gz, float halfDt) {
+  float qa = q[0], qb = q[1], qc = q[2];
+  gx *= halfDt; // pre-multiply common factors
+  gy *= halfDt;
+  gz *= halfDt;
+  q[0] += (-qb * gx - qc * gy - q[3] * gz);
+  q[1] += (qa * gx + qc * gz - q[3] * gy);
+  q[2] += (qa * gy - qb * gz + q[3] * gx);
+  q[3] += (qa * gz + qb * gy - qc * gx);
+}
+
+#endif
@@ -0,0 +1,412 @@
+/* This file is part of the Razor AHRS Firmware */
+
+#ifndef FusionFilter_h
+#define FusionFilter_h
+
+#include <math.h>
+#include "FastMath.h"
+#include "FusionCore.h"
+
+/**
+ * Common interface of the sensor fusion filters (DcmFilter, MadgwickFilter and MahonyFilter).
+ *
+ * Filters derive from FusionFilter<Filter> (CRTP), so the filter is picked at compile
+ * time and calls are not virtual. Code that works with any filter takes a
+ * FusionFilter<Filter> & in a template. Every filter keeps its own state, so several
+ * of them can run side by side (on the same data, for example).
+ *
+ * Vectors are in the sensor frame: X forward, Y right, Z down. The accelerometer
+ * vector is the NEGATED acceleration (equals gravity, if the board is not moving).
+ * Orientations rotate the sensor frame into the earth frame. Quaternions are [w, x, y, z].
+ *
+ * A filter implements updateFilter(), getFilterQuaternion(), getFilterEuler() and
+ * resetFilter(), with the same arguments as the public methods below.
+ */
+template <class Filter>
+class FusionFilter {
+  public:
+    /**
+     * Runs one filter step.
+     *
+     * @param gyro Angular rates (rad/s).
+     * @param accel Accelerometer vector (any unit; see DcmFilter).
+     * @param mag Magnetometer vector (any unit).
+     * @param dt Time since the last step (s).
+     */
+    void update(const float gyro[3], const float accel[3], const float mag[3], float dt)
+      { self().updateFilter(gyro, accel, mag, dt); }
+
+    /**
+     * Gets the orientation as a unit quaternion [w, x, y, z].
+     */
+    void getQuaternion(float q[4]) const { self().getFilterQuaternion(q); }
+
+    /**
+     * Gets the orientation as Euler angles (rad; intrinsic Z, Y', X'' rotations).
+     */
+    void getEuler(float &yaw, float &pitch, float &roll) const { self().getFilterEuler(yaw, pitch, roll); }
+
+    /**
+     * Restarts the filter from the given orientation (rad).
+     */
+    void reset(float yaw, float pitch, float roll) { self().resetFilter(yaw, pitch, roll); }
+
+    // Sets m to the rotation matrix of the Euler angles
+    // (right-handed, intrinsic, XYZ convention: rotate around body axes Z, Y', X'')
+    static void eulerToMatrix(float m[3][3], float yaw, float pitch, float roll);
+    // Converts a rotation matrix into a unit quaternion [w, x, y, z]
+    static void matrixToQuaternion(const float m[3][3], float q[4]);
+    // Converts a unit quaternion [w, x, y, z] into Euler angles
+    static void quaternionToEuler(const float q[4], float &yaw, float &pitch, float &roll);
+
+  private:
+    Filter &self() { return *static_cast<Filter *>(this); }
+    const Filter &self() const { return *static_cast<const Filter *>(this); }
+};
+
+/**
+ * Base of the quaternion filters (MadgwickFilter and MahonyFilter): keeps the quaternion.
+ */
+template <class Filter>
+class QuaternionFilter : public FusionFilter<Filter> {
+  public:
+    QuaternionFilter() { q[0] = 1; q[1] = 0; q[2] = 0; q[3] = 0; }
+
+    void getFilterQuaternion(float out[4]) const { out[0] = q[0]; out[1] = q[1]; out[2] = q[2]; out[3] = q[3]; }
+
+    void getFilterEuler(float &yaw, float &pitch, float &roll) const {
+      FusionFilter<Filter>::quaternionToEuler(q, yaw, pitch, roll);
+    }
+
+    void resetQuaternion(float yaw, float pitch, float roll) {
+      float m[3][3];
+      FusionFilter<Filter>::eulerToMatrix(m, yaw, pitch, roll);
+      FusionFilter<Filter>::matrixToQuaternion(m, q);
+    }
+
+  protected:
+    // Normalises a vector of size floats, unless it is all zeros; returns false if it is
+    static bool normalize(float *v, int size) {
+      float norm = 0;
+      for (int i = 0; i < size; i++) norm += v[i] * v[i];
+      if (norm == 0.0f) return false;
+      float recipNorm = 1.0f / sqrt(norm);
+      for (int i = 0; i < size; i++) v[i] *= recipNorm;
+      return true;
+    }
+
+    float q[4];
+};
+
+/**
+ * The direction cosine matrix filter of the original Razor AHRS firmware
+ * (by William Premerlani, Doug Weibel and Jose Julio).
+ */
+class DcmFilter : public FusionFilter<DcmFilter> {
+  public:
+    /**
+     * @param gravity Length of the accelerometer vector at 1 g.
+     * @param kpRollPitch, kiRollPitch Proportional and integral gains of the accelerometer feedback.
+     * @param kpYaw, kiYaw Proportional and integral gains of the magnetometer feedback.
+     * @param driftCorrection Integrate the corrected rates; false integrates the plain gyro rates.
+     */
+    DcmFilter(float gravity, float kpRollPitch, float kiRollPitch, float kpYaw, float kiYaw,
+        bool driftCorrection = true)
+      : gravity(gravity), kpRollPitch(kpRollPitch), kiRollPitch(kiRollPitch),
+        kpYaw(kpYaw), kiYaw(kiYaw), driftCorrection(driftCorrection)
+      { resetFilter(0, 0, 0); }
+
+    void updateFilter(const float gyro[3], const float accel[3], const float mag[3], float dt);
+    void getFilterQuaternion(float q[4]) const { matrixToQuaternion(dcm, q); }
+    void getFilterEuler(float &yaw, float &pitch, float &roll) const;
+    void resetFilter(float yaw, float pitch, float roll);
+
+  private:
+    float heading(const float mag[3]) const; // Tilt compensated magnetic heading
+    void normalize();
+    void correctDrift(const float accel[3], float magHeading);
+
+    float gravity;
+    float kpRollPitch, kiRollPitch, kpYaw, kiYaw;
+    bool driftCorrection;
+    float dcm[3][3];
+    float omegaP[3]; // Omega proportional correction
+    float omegaI[3]; // Omega integrator
+};
+
+/**
+ * Madgwick's gradient descent AHRS filter (the math is in FusionCore.h). Without a
+ * magnetometer vector it runs the IMU algorithm, without an accelerometer vector it only
+ * integrates the gyroscope.
+ */
+class MadgwickFilter : public QuaternionFilter<MadgwickFilter> {
+  public:
+    /**
+     * @param beta Algorithm gain (2 * proportional gain).
+     */
+    MadgwickFilter(float beta) : beta(beta) {}
+
+    void updateFilter(const float gyro[3], const float accel[3], const float mag[3], float dt);
+    void resetFilter(float yaw, float pitch, float roll) { resetQuaternion(yaw, pitch, roll); }
+
+  private:
+    float beta;
+};
+
+/**
+ * Mahony's complementary AHRS filter (the math is in FusionCore.h). Without a magnetometer
+ * vector it only corrects towards gravity, without an accelerometer vector it only integrates
+ * the gyroscope.
+ */
+class MahonyFilter : public QuaternionFilter<MahonyFilter> {
+  public:
+    /**
+     * @param twoKp 2 * proportional gain.
+     * @param twoKi 2 * integral gain (0 disables the integral feedback).
+     */
+    MahonyFilter(float twoKp, float twoKi) : twoKp(twoKp), twoKi(twoKi) { resetFilter(0, 0, 0); }
+
+    void updateFilter(const float gyro[3], const float accel[3], const float mag[3], float dt);
+    void resetFilter(float yaw, float pitch, float roll) {
+      resetQuaternion(yaw, pitch, roll);
+      integralFB[0] = integralFB[1] = integralFB[2] = 0;
+    }
+
+  private:
+    float twoKp, twoKi;
+    float integralFB[3]; // Integral error terms scaled by Ki
+};
+
+/////////////////////////////////////////////////////////////////////////////////////
+// FusionFilter implementation
+
+template <class Filter>
+void FusionFilter<Filter>::eulerToMatrix(float m[3][3], float yaw, float pitch, float roll) {
+  float c1 = cos(roll);
+  float s1 = sin(roll);
+  float c2 = cos(pitch);
+  float s2 = sin(pitch);
+  float c3 = cos(yaw);
+  float s3 = sin(yaw);
+
+  m[0][0] = c2 * c3;
+  m[0][1] = c3 * s1 * s2 - c1 * s3;
+  m[0][2] = s1 * s3 + c1 * c3 * s2;
+
+  m[1][0] = c2 * s3;
+  m[1][1] = c1 * c3 + s1 * s2 * s3;
+  m[1][2] = c1 * s2 * s3 - c3 * s1;
+
+  m[2][0] = -s2;
+  m[2][1] = c2 * s1;
+  m[2][2] = c1 * c2;
+}
+
+template <class Filter>
+void FusionFilter<Filter>::matrixToQuaternion(const float m[3][3], float q[4]) {
+  float trace = m[0][0] + m[1][1] + m[2][2];
+  float s;
+
+  // Use the biggest of the four diagonal combinations to stay away from dividing by (almost) zero
+  if (trace > 0) {
+    s = 0.5f / sqrt(trace + 1.0f);
+    q[0] = 0.25f / s;
+    q[1] = (m[2][1] - m[1][2]) * s;
+    q[2] = (m[0][2] - m[2][0]) * s;
+    q[3] = (m[1][0] - m[0][1]) * s;
+  } else if (m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+    s = 2.0f * sqrt(1.0f + m[0][0] - m[1][1] - m[2][2]);
+    q[0] = (m[2][1] - m[1][2]) / s;
+    q[1] = 0.25f * s;
+    q[2] = (m[0][1] + m[1][0]) / s;
+    q[3] = (m[0][2] + m[2][0]) / s;
+  } else if (m[1][1] > m[2][2]) {
+    s = 2.0f * sqrt(1.0f + m[1][1] - m[0][0] - m[2][2]);
+    q[0] = (m[0][2] - m[2][0]) / s;
+    q[1] = (m[0][1] + m[1][0]) / s;
+    q[2] = 0.25f * s;
+    q[3] = (m[1][2] + m[2][1]) / s;
+  } else {
+    s = 2.0f * sqrt(1.0f + m[2][2] - m[0][0] - m[1][1]);
+    q[0] = (m[1][0] - m[0][1]) / s;
+    q[1] = (m[0][2] + m[2][0]) / s;
+    q[2] = (m[1][2] + m[2][1]) / s;
+    q[3] = 0.25f * s;
+  }
+}
+
+template <class Filter>
+void FusionFilter<Filter>::quaternionToEuler(const float q[4], float &yaw, float &pitch, float &roll) {
+  // Same as DcmFilter::getFilterEuler(), on the rotation matrix of the quaternion
+  float sinPitch = 2.0f * (q[0] * q[2] - q[1] * q[3]);
+  if (sinPitch > 1.0f) sinPitch = 1.0f;
+  if (sinPitch < -1.0f) sinPitch = -1.0f;
+
+  pitch = FUSION_ASIN(sinPitch);
+  roll = FUSION_ATAN2(2.0f * (q[2] * q[3] + q[0] * q[1]), q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]);
+  yaw = FUSION_ATAN2(2.0f * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// DcmFilter implementation
+
+inline void DcmFilter::updateFilter(const float gyro[3], const float accel[3], const float mag[3], float dt) {
+  // Heading with the tilt of the last step
+  float magHeading = heading(mag);
+
+  float omega[3];
+  for (int i = 0; i < 3; i++) {
+    omega[i] = driftCorrection ? gyro[i] + omegaI[i] + omegaP[i] : gyro[i];
+  }
+
+  float update[3][3] = {
+    {0, -dt * omega[2], dt * omega[1]},
+    {dt * omega[2], 0, -dt * omega[0]},
+    {-dt * omega[1], dt * omega[0], 0}
+  };
+  float temporary[3][3];
+  for (int x = 0; x < 3; x++) { // temporary = dcm * update
+    for (int y = 0; y < 3; y++) {
+      temporary[x][y] = dcm[x][0] * update[0][y] + dcm[x][1] * update[1][y] + dcm[x][2] * update[2][y];
+    }
+  }
+  for (int x = 0; x < 3; x++) {
+    for (int y = 0; y < 3; y++) {
+      dcm[x][y] += temporary[x][y];
+    }
+  }
+
+  normalize();
+  correctDrift(accel, magHeading);
+}
+
+inline void DcmFilter::getFilterEuler(float &yaw, float &pitch, float &roll) const {
+  pitch = -FUSION_ASIN(dcm[2][0]);
+  roll = FUSION_ATAN2(dcm[2][1], dcm[2][2]);
+  yaw = FUSION_ATAN2(dcm[1][0], dcm[0][0]);
+}
+
+inline void DcmFilter::resetFilter(float yaw, float pitch, float roll) {
+  eulerToMatrix(dcm, yaw, pitch, roll);
+  for (int i = 0; i < 3; i++) {
+    omegaP[i] = 0;
+    omegaI[i] = 0;
+  }
+}
+
+inline float DcmFilter::heading(const float mag[3]) const {
+  float cos_roll, sin_roll, cos_pitch, sin_pitch;
+  float roll = FUSION_ATAN2(dcm[2][1], dcm[2][2]);
+  float pitch = -FUSION_ASIN(dcm[2][0]);
+
+  cos_roll = FUSION_COS(roll);
+  sin_roll = FUSION_SIN(roll);
+  cos_pitch = FUSION_COS(pitch);
+  sin_pitch = FUSION_SIN(pitch);
+
+  // Tilt compensated magnetic field X and Y
+  float mag_x = mag[0] * cos_pitch + mag[1] * sin_roll * sin_pitch + mag[2] * cos_roll * sin_pitch;
+  float mag_y = mag[1] * cos_roll - mag[2] * sin_roll;
+  return FUSION_ATAN2(-mag_y, mag_x);
+}
+
+inline void DcmFilter::normalize() {
+  float temporary[3][3];
+
+  float error = -(dcm[0][0] * dcm[1][0] + dcm[0][1] * dcm[1][1] + dcm[0][2] * dcm[1][2]) * .5f; //eq.19
+  for (int i = 0; i < 3; i++) {
+    temporary[0][i] = dcm[0][i] + dcm[1][i] * error; //eq.19
+    temporary[1][i] = dcm[1][i] + dcm[0][i] * error; //eq.19
+  }
+
+  // c = a x b //eq.20
+  temporary[2][0] = temporary[0][1] * temporary[1][2] - temporary[0][2] * temporary[1][1];
+  temporary[2][1] = temporary[0][2] * temporary[1][0] - temporary[0][0] * temporary[1][2];
+  temporary[2][2] = temporary[0][0] * temporary[1][1] - temporary[0][1] * temporary[1][0];
+
+  for (int r = 0; r < 3; r++) {
+    float renorm = .5f * (3 - (temporary[r][0] * temporary[r][0] + temporary[r][1] * temporary[r][1]
+      + temporary[r][2] * temporary[r][2])); //eq.21
+    for (int i = 0; i < 3; i++) dcm[r][i] = temporary[r][i] * renorm;
+  }
+}
+
+inline void DcmFilter::correctDrift(const float accel[3], float magHeading) {
+  //*****Roll and Pitch***************
+
+  // Calculate the magnitude of the accelerometer vector, scaled to gravity
+  float accelMagnitude = sqrt(accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2]) / gravity;
+  // Dynamic weighting of accelerometer info (reliability filter)
+  // Weight for accelerometer info (<0.5G = 0.0, 1G = 1.0 , >1.5G = 0.0)
+  float accelWeight = 1 - 2 * fabs(1 - accelMagnitude);
+  if (accelWeight < 0) accelWeight = 0;
+  if (accelWeight > 1) accelWeight = 1;
+
+  // Adjust the ground of reference
+  float errorRollPitch[3] = {
+    accel[1] * dcm[2][2] - accel[2] * dcm[2][1],
+    accel[2] * dcm[2][0] - accel[0] * dcm[2][2],
+    accel[0] * dcm[2][1] - accel[1] * dcm[2][0]
+  };
+
+  //*****YAW***************
+  // We make the gyro YAW drift correction based on compass magnetic heading
+
+  float errorCourse = (dcm[0][0] * FUSION_SIN(magHeading)) - (dcm[1][0] * FUSION_COS(magHeading)); // Calculating YAW error
+
+  for (int i = 0; i < 3; i++) {
+    // Applies the yaw correction to the XYZ rotation of the aircraft, depending on the position
+    float errorYaw = dcm[2][i] * errorCourse;
+    omegaP[i] = errorRollPitch[i] * kpRollPitch * accelWeight + errorYaw * kpYaw;
+    omegaI[i] += errorRollPitch[i] * kiRollPitch * accelWeight + errorYaw * kiYaw;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// MadgwickFilter implementation
+
+inline void MadgwickFilter::updateFilter(const float gyro[3], const float accel[3], const float mag[3], float dt) {
+  float a[3] = {accel[0], accel[1], accel[2]};
+  float m[3] = {mag[0], mag[1], mag[2]};
+  float rate[4];
+  float step[4] = {0, 0, 0, 0};
+
+  madgwick_gyro_rate(q, gyro[0], gyro[1], gyro[2], rate);
+  if (normalize(a, 3)) {
+    if (normalize(m, 3)) madgwick_gradient(q, a[0], a[1], a[2], m[0], m[1], m[2], step);
+    else madgwick_gradient_imu(q, a[0], a[1], a[2], step);
+    normalize(step, 4);
+  }
+  madgwick_integrate(q, rate, step, 0.5f * dt, beta * dt);
+  normalize(q, 4);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// MahonyFilter implementation
+
+inline void MahonyFilter::updateFilter(const float gyro[3], const float accel[3], const float mag[3], float dt) {
+  float gx = gyro[0], gy = gyro[1], gz = gyro[2];
+  float a[3] = {accel[0], accel[1], accel[2]};
+  float m[3] = {mag[0], mag[1], mag[2]};
+
+  if (normalize(a, 3)) {
+    float halfe[3];
+    mahony_gravity_error(q, a[0], a[1], a[2], halfe);
+    if (normalize(m, 3)) {
+      float field[3];
+      mahony_field_error(q, m[0], m[1], m[2], field);
+      for (int i = 0; i < 3; i++) halfe[i] += field[i];
+    }
+
+    // Integral feedback if enabled (reset otherwise, to prevent windup), then proportional feedback
+    for (int i = 0; i < 3; i++) integralFB[i] = twoKi > 0.0f ? integralFB[i] + twoKi * dt * halfe[i] : 0.0f;
+    gx += integralFB[0] + twoKp * halfe[0];
+    gy += integralFB[1] + twoKp * halfe[1];
+    gz += integralFB[2] + twoKp * halfe[2];
+  }
+
+  mahony_integrate(q, gx, gy, gz, 0.5f * dt);
+  normalize(q, 4);
+}
+
+#endif
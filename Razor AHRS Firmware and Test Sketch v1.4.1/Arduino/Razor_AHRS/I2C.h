@@ -0,0 +1,169 @@
+/* This file is part of the Razor AHRS Firmware */
+
+#ifndef I2C_h
+#define I2C_h
+
+#include <util/twi.h>
+
+/**
+ * Interrupt driven I2C (TWI) master. A transfer is started with i2c_start() and then runs
+ * in the TWI interrupt, one bus event at a time, so the main loop goes on meanwhile. This
+ * replaces the Wire library, which blocks until a transfer is done (and owns the TWI interrupt).
+ *
+ * A transfer is the register number, written to the device, followed by a repeated start and
+ * the data read from the device, or followed by the data written to the device.
+ */
+
+#define I2C_CLOCK 100000L // Default bus clock (Hz), the same as Wire uses
+#define I2C_TIMEOUT 50000UL // Microseconds i2c_write() waits for the bus, and for its write (a whole acquisition fits)
+
+typedef void (*I2cDoneCallback)(boolean ok);
+
+// Transfer state, shared with the TWI interrupt
+volatile boolean i2c_busy = false;
+volatile boolean i2c_ok = false; // Result of the last transfer
+byte i2c_address;
+byte i2c_register;
+byte *i2c_data;
+byte i2c_length;
+volatile byte i2c_count; // Data bytes transferred so far
+boolean i2c_reading;
+I2cDoneCallback i2c_done;
+byte i2c_write_value; // The byte i2c_write() writes, kept here as the transfer only has a pointer to it
+
+void i2c_init() {
+  // Internal pull-ups on, like Wire does
+  digitalWrite(SDA, HIGH);
+  digitalWrite(SCL, HIGH);
+
+  TWSR = 0; // Prescaler 1
+  TWBR = ((F_CPU / I2C_CLOCK) - 16) / 2;
+  TWCR = _BV(TWEN);
+}
+
+// Sets the bus clock (Hz, up to 400kHz); only call while no transfer is running
+void i2c_set_clock(long clock) {
+  TWBR = ((F_CPU / clock) - 16) / 2;
+}
+
+/**
+ * Starts a transfer in the background. The data buffer has to stay valid until it is done.
+ *
+ * @param address 7 bit device address.
+ * @param reg Register number the transfer starts at.
+ * @param data Bytes to write, or buffer for the bytes to read.
+ * @param length Number of data bytes (at least 1).
+ * @param read Read from the device if true, write to it otherwise.
+ * @param done Called from the interrupt when the transfer is done (can start the next one), or NULL.
+ * @return false if another transfer is still running.
+ */
+boolean i2c_start(byte address, byte reg, byte *data, byte length, boolean read, I2cDoneCallback done) {
+  if (i2c_busy) return false;
+
+  i2c_address = address;
+  i2c_register = reg;
+  i2c_data = data;
+  i2c_length = length;
+  i2c_count = 0;
+  i2c_reading = read;
+  i2c_done = done;
+  i2c_busy = true;
+  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA);
+  return true;
+}
+
+// Gives up on the running transfer: turns the TWI off and on again, which releases the bus,
+// and reports the transfer as failed
+void i2c_abort() {
+  TWCR = 0;
+  TWCR = _BV(TWEN);
+  i2c_ok = false;
+  i2c_busy = false;
+  if (i2c_done) i2c_done(false);
+}
+
+// Waits up to I2C_TIMEOUT for the running transfer (and the ones its callback starts) to be
+// done; false if the bus is still busy then
+boolean i2c_wait() {
+  unsigned long start = micros();
+  while (i2c_busy) {
+    if (micros() - start > I2C_TIMEOUT) return false;
+  }
+  return true;
+}
+
+/**
+ * Writes one register and waits until it is done (for setting up the sensors). A background
+ * read that is still running is waited for first. A transfer that takes longer than
+ * I2C_TIMEOUT is given up on (see i2c_abort()), so a stuck bus cannot hang the setup.
+ *
+ * @return false if the write failed or timed out, or the bus did not come free for it
+ */
+boolean i2c_write(byte address, byte reg, byte value) {
+  if (!i2c_wait()) i2c_abort();
+  i2c_write_value = value;
+  if (!i2c_start(address, reg, &i2c_write_value, 1, false, NULL)) return false;
+  if (!i2c_wait()) {
+    i2c_abort();
+    return false;
+  }
+  return i2c_ok;
+}
+
+// Acknowledges the last bus event; ack also acknowledges the next received byte
+inline void i2c_continue(boolean ack) {
+  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | (ack ? _BV(TWEA) : 0);
+}
+
+// Sends the stop condition and reports the result
+inline void i2c_finish(boolean ok) {
+  TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+  while (TWCR & _BV(TWSTO)) { } // Takes one bus clock cycle
+
+  i2c_ok = ok;
+  i2c_busy = false;
+  if (i2c_done) i2c_done(ok);
+}
+
+ISR(TWI_vect) {
+  switch (TW_STATUS) {
+    case TW_START: // Address the device for writing the register number
+      TWDR = (i2c_address << 1) | TW_WRITE;
+      i2c_continue(false);
+      break;
+    case TW_MT_SLA_ACK:
+      TWDR = i2c_register;
+      i2c_continue(false);
+      break;
+    case TW_MT_DATA_ACK:
+      if (i2c_reading) { // Register number sent, repeated start for reading
+        TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA);
+      } else if (i2c_count < i2c_length) {
+        TWDR = i2c_data[i2c_count++];
+        i2c_continue(false);
+      } else {
+        i2c_finish(true);
+      }
+      break;
+    case TW_REP_START:
+      TWDR = (i2c_address << 1) | TW_READ;
+      i2c_continue(false);
+      break;
+    case TW_MR_SLA_ACK: // Acknowledge every byte but the last
+      i2c_continue(i2c_length > 1);
+      break;
+    case TW_MR_DATA_ACK:
+      i2c_data[i2c_count++] = TWDR;
+      i2c_continue(i2c_count < i2c_length - 1);
+      break;
+    case TW_MR_DATA_NACK:
+      i2c_data[i2c_count++] = TWDR;
+      i2c_finish(true);
+      break;
+    default: // Not acknowledged by the device, lost arbitration or bus error
+      i2c_finish(false);
+      break;
+  }
+}
+
+#endif
@@ -1,23 +1,218 @@
 /* This file is part of the Razor AHRS Firmware */
 
+// Data sizes of the binary packet data modes (see output_sensors_binary_packet())
+// DATA_MODE_COMPACT keyframes are 18 bytes, its delta packets COMPACT_DELTA_SIZE bytes.
+const byte data_mode_size[] = {30, 6, 12, 18, 8};
+#define COMPACT_DELTA_SIZE 9
+#define TIMESTAMP_SIZE 4 // Acquisition time in front of every sample (see output_timestamps)
+
+// Updates a CRC-16 (CCITT: polynomial 0x1021, initial value 0xFFFF) with one more byte
+uint16_t crc16_update(uint16_t crc, byte data)
+{
+  crc = (crc >> 8) | (crc << 8);
+  crc ^= data;
+  crc ^= (crc & 0xFF) >> 4;
+  crc ^= crc << 12;
+  crc ^= (crc & 0xFF) << 5;
+  return crc;
+}
+
+// Gets the DATA_MODE_COMPACT values of the current sample: accelerometer in 1/256 g,
+// magnetometer rounded to whole units, and gyroscope like DATA_MODE_ALL.
+void read_compact_values(int *values) {
+#if OUTPUT__FIXED_POINT == true
+  values[0] = (accel_fixed[0] - accel_offset_fixed[0]) >> 8;
+  values[1] = (accel_fixed[1] - accel_offset_fixed[1]) >> 8;
+  values[2] = accel_fixed[2] >> 8;
+  for (int i = 0; i < 3; i++) {
+    values[3 + i] = (magnetom_fixed[i] + 0x8000) >> 16;
+    values[6 + i] = gyro_fixed[i] - gyro_offset_fixed[i];
+  }
+#else
+  // GRAVITY is 256, so 1/256 g is one calibrated accelerometer unit
+  values[0] = ROUND_TO_INT((accel[0] - accel_offset[0]) * (256.0f / GRAVITY));
+  values[1] = ROUND_TO_INT((accel[1] - accel_offset[1]) * (256.0f / GRAVITY));
+  values[2] = ROUND_TO_INT(accel[2] * (256.0f / GRAVITY));
+  for (int i = 0; i < 3; i++) {
+    values[3 + i] = ROUND_TO_INT(magnetom[i]);
+    values[6 + i] = (short)(gyro[i] - gyro_offset[i]);
+  }
+#endif
+}
+
 // Outputs in binary, but in a packet format so packet starts and ends can be located
-// Mid-stream
+// Mid-stream, and corrupted packets can be detected
 void output_sensors_binary_packet() {
-  // Format:
-  // MMMMAAAABBBBCCCCIIIIJJJJKKKKXXXXYYYYZZZZN (41 bytes long)
+  // Format (framing version 1):
+  // MMMMVSDL<data>CC (10 bytes + data long)
   // Where MMMM is the magic number "9DoF" (no null terminator),
+  // V is the framing version (OUTPUT__PACKET_VERSION),
+  // S is the sequence number of the packet (incremented for every packet, wraps after 255),
+  // D is the data mode (data_mode, with DATA_MODE_FIXED_POINT set if OUTPUT__FIXED_POINT and
+  // DATA_MODE_BATCH set for batch packets)
+  // and L is the length of the data in bytes,
+  // CC is the CRC-16 (CCITT, see crc16_update()) of VSDL<data>, MSB first.
+  // See read_packet_data() for <data>.
+  // With an output batch size (output_batch_size) above 1, samples are collected and sent
+  // together: <data> is then N<sample 1>...<sample N>, N being the number of samples, each
+  // the <data> of a packet of its own. DATA_MODE_COMPACT is never batched.
+  // With output_timestamps, DATA_MODE_TIMESTAMP is set and every sample starts with its acquisition
+  // time (see read_packet_data()).
+  // A packet answering a "#F<x>" request (output_tagged) is never batched: <data> is x followed by
+  // the <data> of an untagged packet, and DATA_MODE_TAGGED is set in its data mode.
+  byte mode = OUTPUT__FIXED_POINT ? (data_mode | DATA_MODE_FIXED_POINT) : data_mode;
+  if (output_timestamps) mode |= DATA_MODE_TIMESTAMP;
+  
+  if (output_tagged) {
+    byte data[1 + TIMESTAMP_SIZE + 30]; // Tag and the largest sample (DATA_MODE_ALL); output_packet_data may hold a batch
+    data[0] = output_tag;
+    byte length = read_packet_data(data + 1);
+    output_packet(mode | DATA_MODE_TAGGED, data, 1 + length);
+    return;
+  }
+  
+  if (output_batch_size <= 1 || data_mode == DATA_MODE_COMPACT) {
+    byte length = read_packet_data(output_packet_data);
+    output_packet(mode, output_packet_data, length);
+    return;
+  }
+  
+  byte size = data_mode_size[data_mode] + (output_timestamps ? TIMESTAMP_SIZE : 0);
+  read_packet_data(output_packet_data + 1 + output_batch_count * size);
+  output_batch_count++;
+  
+  // Send when the batch is full, when the next sample would not fit, or when a single frame was asked for
+  if (output_batch_count >= output_batch_size || 1 + (output_batch_count + 1) * size > OUTPUT__BATCH_DATA_SIZE
+      || output_single_on) {
+    output_packet_data[0] = output_batch_count;
+    output_packet(mode | DATA_MODE_BATCH, output_packet_data, 1 + output_batch_count * size);
+    output_batch_count = 0;
+  }
+}
+
+// Frames packet data and queues it for sending (see output_sensors_binary_packet())
+// DATA_MODE_CLOCK packets get the sequence number of the next packet, but do not use it up, so
+// they never break a chain of DATA_MODE_COMPACT deltas.
+void output_packet(byte mode, const byte *data, byte length) {
+  uint16_t crc = 0xFFFF;
+  output_queue.beginFrame();
+#define write_byte(BYTE) { byte b = BYTE; output_queue.write(b); crc = crc16_update(crc, b); }
+  // Magic number
+  output_queue.write('9'); output_queue.write('D');
+  output_queue.write('o'); output_queue.write('F');
+  
+  // Header
+  write_byte(OUTPUT__PACKET_VERSION);
+  write_byte(mode == DATA_MODE_CLOCK ? output_packet_sequence : output_packet_sequence++);
+  write_byte(mode);
+  write_byte(length);
+  
+  for (byte i = 0; i < length; i++) {
+    write_byte(data[i]);
+  }
+  
+  // Checksum
+  output_queue.write(crc >> 8);
+  output_queue.write(crc & 0xFF);
+  output_queue.endFrame();
+#undef write_byte
+}
+
+// Writes the packet data of the current sample in the current data mode to out and
+// returns its length
+byte read_packet_data(byte *out) {
+  // For DATA_MODE_ALL, <data> is AAAABBBBCCCCIIIIJJJJKKKKXXYYZZ (30 bytes), where
   // AAAA, BBBB, and CCCC are the X, Y and Z values (respectively) of the accelerometer
   // IIII, JJJJ, and KKKK are the X, Y and Z values (respectively) of the magnetometer
   // XX, YY, and ZZ are the X, Y and Z values (respectively) of the gyroscope (as signed shorts)
-  // N is a new line character (\n)
-
-// Caution: Dirty casting magic below. The bitshift operator is not defined for floating point numbers,
-// So, I dereference the double pointer that is casted to a long pointer.
-#define write_double(DOUBLE) { long val = *(long *)&DOUBLE; Serial.write(val >> 24); Serial.write(val >> 16); Serial.write(val >> 8); Serial.write(val);}
-#define write_short(SHORT) { short val = SHORT; Serial.write(val >> 8); Serial.write(val); }
-  // Magic number
-  Serial.write('9'); Serial.write('D');
-  Serial.write('o'); Serial.write('F');
+  // With OUTPUT__FIXED_POINT, the accelerometer, magnetometer and Euler angle values are sent as
+  // Q16.16 fixed point numbers (value * 65536) instead of floats; the data sizes stay the same.
+  // For DATA_MODE_COMPACT, <data> is either a keyframe AAAAAAIIIIIIXXXXXX (18 bytes) of the
+  // values from read_compact_values() as signed shorts, or AAAIIIXXX (COMPACT_DELTA_SIZE bytes),
+  // the difference of each value to the previous packet as signed bytes. A keyframe is sent
+  // every OUTPUT__COMPACT_KEYFRAME_INTERVAL packets, after a data mode change, and whenever a
+  // value changed too much for a delta.
+  // For DATA_MODE_QUATERNION, <data> is WWXXYYZZ (8 bytes), the unit quaternion of the fusion
+  // filter as signed shorts scaled by 32767, in both float and fixed point builds. It is not
+  // affected by the Euler angle offsets of the zero calibration.
+  // With output_timestamps, <data> starts with TTTT, the acquisition time of the sample
+  // (sensor_sample_micros, the micros() of its sensor tick), followed by the data above.
+  byte *start = out;
+#define write_byte(BYTE) { *out++ = BYTE; }
+// The bitshift operator is not defined for floating point numbers, so the bits of the (4 byte)
+// float are copied into a long. memcpy compiles to plain moves, and stays right where long or
+// double are 8 bytes wide (the host build).
+#define write_double(DOUBLE) { float f = DOUBLE; uint32_t val; memcpy(&val, &f, 4); write_byte(val >> 24); write_byte(val >> 16); write_byte(val >> 8); write_byte(val); }
+#define write_long(LONG) { long val = LONG; write_byte(val >> 24); write_byte(val >> 16); write_byte(val >> 8); write_byte(val); }
+#define write_short(SHORT) { short val = SHORT; write_byte(val >> 8); write_byte(val); }
+  
+  if (output_timestamps) {
+    write_long(sensor_sample_micros);
+  }
+  
+  if (data_mode == DATA_MODE_QUATERNION) { // 8 Bytes
+    float q[4];
+    fusion_filter.getQuaternion(q);
+    for (int i = 0; i < 4; i++) {
+      write_short(ROUND_TO_INT(q[i] * 32767.0f));
+    }
+  }
+  
+  if (data_mode == DATA_MODE_COMPACT) { // 18 or 9 Bytes
+    int values[9];
+    read_compact_values(values);
+    boolean delta = compact_packets_to_key > 0;
+    for (int i = 0; i < 9; i++) {
+      int diff = values[i] - compact_values[i];
+      if (diff < -128 || diff > 127) delta = false;
+    }
+    if (delta) {
+      compact_packets_to_key--;
+    } else {
+      compact_packets_to_key = OUTPUT__COMPACT_KEYFRAME_INTERVAL - 1;
+    }
+    
+    for (int i = 0; i < 9; i++) {
+      if (delta) {
+        write_byte(values[i] - compact_values[i]);
+      } else {
+        write_short(values[i]);
+      }
+      compact_values[i] = values[i];
+    }
+  }
+  
+#if OUTPUT__FIXED_POINT == true
+  switch (data_mode) {
+    case DATA_MODE_ALL: // 30 Bytes
+      // Accelerometer
+      write_long(accel_fixed[0] - accel_offset_fixed[0]);
+      write_long(accel_fixed[1] - accel_offset_fixed[1]);
+      write_long(accel_fixed[2]);
+      
+      // Magnetometer
+      write_long(magnetom_fixed[0]);
+      write_long(magnetom_fixed[1]);
+      write_long(magnetom_fixed[2]);
+      
+      // Gyroscope
+      write_short(gyro_fixed[0] - gyro_offset_fixed[0]);
+      write_short(gyro_fixed[1] - gyro_offset_fixed[1]);
+      write_short(gyro_fixed[2] - gyro_offset_fixed[2]);
+      break;
+    case DATA_MODE_GYRO: // 6 Bytes
+      write_short(gyro_fixed[0] - gyro_offset_fixed[0]);
+      write_short(gyro_fixed[1] - gyro_offset_fixed[1]);
+      write_short(gyro_fixed[2] - gyro_offset_fixed[2]);
+      break;
+    case DATA_MODE_EULER: // 12 Bytes
+      // The DCM works in floats, so only the conversion is left
+      write_long(TO_FIXED(roll - euler_offset[2]));
+      write_long(TO_FIXED(pitch - euler_offset[1]));
+      write_long(TO_FIXED(yaw - euler_offset[0]));
+      break;
+  }
+#else
   double temp;
   switch (data_mode) {
     case DATA_MODE_ALL: // 30 Bytes
@@ -45,7 +240,7 @@ void output_sensors_binary_packet() {
       write_short((short)(gyro[2] - gyro_offset[2]));
       break;
     case DATA_MODE_EULER: // 12 Bytes
-      double temp = roll - euler_offset[2];
+      temp = roll - euler_offset[2];
       write_double(temp);
       temp = pitch - euler_offset[1];
       write_double(temp);
@@ -53,76 +248,84 @@ void output_sensors_binary_packet() {
       write_double(temp);
       break;
   }
+#endif
   
-  Serial.write('\n');
-  
+#undef write_byte
 #undef write_double
+#undef write_long
+#undef write_short
+  return out - start;
 }
 
 void output_sensors_text()
 {
-  Serial.print("#A-"); Serial.print('=');
-  Serial.print(accel[0]); Serial.print(",");
-  Serial.print(accel[1]); Serial.print(",");
-  Serial.print(accel[2]); Serial.println();
-
-  Serial.print("#M-"); Serial.print('=');
-  Serial.print(magnetom[0]); Serial.print(",");
-  Serial.print(magnetom[1]); Serial.print(",");
-  Serial.print(magnetom[2]); Serial.println();
-
-  Serial.print("#G-"); Serial.print('=');
-  Serial.print(gyro[0]); Serial.print(",");
-  Serial.print(gyro[1]); Serial.print(",");
-  Serial.print(gyro[2]); Serial.println();
+  output_queue.beginFrame();
+  output_queue.print("#A-"); output_queue.print('=');
+  output_queue.print(accel[0]); output_queue.print(",");
+  output_queue.print(accel[1]); output_queue.print(",");
+  output_queue.print(accel[2]); output_queue.println();
+
+  output_queue.print("#M-"); output_queue.print('=');
+  output_queue.print(magnetom[0]); output_queue.print(",");
+  output_queue.print(magnetom[1]); output_queue.print(",");
+  output_queue.print(magnetom[2]); output_queue.println();
+
+  output_queue.print("#G-"); output_queue.print('=');
+  output_queue.print(gyro[0]); output_queue.print(",");
+  output_queue.print(gyro[1]); output_queue.print(",");
+  output_queue.print(gyro[2]); output_queue.println();
+  output_queue.endFrame();
 }
 
 void output_sensors_text_single() // Single line
 {
-  Serial.print("#A");
-  Serial.print(accel[0]); Serial.print(",");
-  Serial.print(accel[1]); Serial.print(",");
-  Serial.print(accel[2]); Serial.print(",");
-
-  Serial.print('M');
-  Serial.print(magnetom[0]); Serial.print(",");
-  Serial.print(magnetom[1]); Serial.print(",");
-  Serial.print(magnetom[2]); Serial.print(",");
-
-  Serial.print('G');
-  Serial.print(gyro[0]); Serial.print(",");
-  Serial.print(gyro[1]); Serial.print(",");
-  Serial.print(gyro[2]); Serial.print('\n');
+  output_queue.beginFrame();
+  output_queue.print("#A");
+  output_queue.print(accel[0]); output_queue.print(",");
+  output_queue.print(accel[1]); output_queue.print(",");
+  output_queue.print(accel[2]); output_queue.print(",");
+
+  output_queue.print('M');
+  output_queue.print(magnetom[0]); output_queue.print(",");
+  output_queue.print(magnetom[1]); output_queue.print(",");
+  output_queue.print(magnetom[2]); output_queue.print(",");
+
+  output_queue.print('G');
+  output_queue.print(gyro[0]); output_queue.print(",");
+  output_queue.print(gyro[1]); output_queue.print(",");
+  output_queue.print(gyro[2]); output_queue.print('\n');
+  output_queue.endFrame();
 }
 
 void output_calibration(int calibration_sensor)
 {
+  output_queue.beginFrame();
   if (calibration_sensor == 0)  // Accelerometer
   {
     // Output MIN/MAX values
-    Serial.print("accel x,y,z (min/max) = ");
+    output_queue.print("accel x,y,z (min/max) = ");
     for (int i = 0; i < 3; i++) {
       if (accel[i] < accel_min[i]) accel_min[i] = accel[i];
       if (accel[i] > accel_max[i]) accel_max[i] = accel[i];
-      Serial.print(accel_min[i]);
-      Serial.print("/");
-      Serial.print(accel_max[i]);
-      if (i < 2) Serial.print("  ");
-      else Serial.println();
+      output_queue.print(accel_min[i]);
+      output_queue.print("/");
+      output_queue.print(accel_max[i]);
+      if (i < 2) output_queue.print("  ");
+      else output_queue.println();
     }
   }
   else if (calibration_sensor == 1)  // Magnetometer
   {
     // Output MIN/MAX values
-    Serial.print("magn x,y,z (min/max) = ");
+    output_queue.print("magn x,y,z (min/max) = ");
     for (int i = 0; i < 3; i++) {
       if (magnetom[i] < magnetom_min[i]) magnetom_min[i] = magnetom[i];
       if (magnetom[i] > magnetom_max[i]) magnetom_max[i] = magnetom[i];
-      Serial.print(magnetom_min[i]);
-      Serial.print("/");
-      Serial.print(magnetom_max[i]);
-      if (i < 2) Serial.print("  ");
-      else Serial.println();
+      output_queue.print(magnetom_min[i]);
+      output_queue.print("/");
+      output_queue.print(magnetom_max[i]);
+      if (i < 2) output_queue.print("  ");
+      else output_queue.println();
     }
   }
   else if (calibration_sensor == 2)  // Gyroscope
@@ -133,15 +336,16 @@ void output_calibration(int calibration_sensor)
     gyro_num_samples++;
       
     // Output current and averaged gyroscope values
-    Serial.print("gyro x,y,z (current/average) = ");
+    output_queue.print("gyro x,y,z (current/average) = ");
     for (int i = 0; i < 3; i++) {
-      Serial.print(gyro[i]);
-      Serial.print("/");
-      Serial.print(gyro_average[i] / (float) gyro_num_samples);
-      if (i < 2) Serial.print("  ");
-      else Serial.println();
+      output_queue.print(gyro[i]);
+      output_queue.print("/");
+      output_queue.print(gyro_average[i] / (float) gyro_num_samples);
+      if (i < 2) output_queue.print("  ");
+      else output_queue.println();
     }
   }
+  output_queue.endFrame();
 }
 
 void output_sensors()
@@ -182,26 +386,30 @@ void output_sensors()
 
 void output_sensors_text(char raw_or_calibrated)
 {
-  Serial.print("#A-"); Serial.print(raw_or_calibrated); Serial.print('=');
-  Serial.print(accel[0]); Serial.print(",");
-  Serial.print(accel[1]); Serial.print(",");
-  Serial.print(accel[2]); Serial.println();
-
-  Serial.print("#M-"); Serial.print(raw_or_calibrated); Serial.print('=');
-  Serial.print(magnetom[0]); Serial.print(",");
-  Serial.print(magnetom[1]); Serial.print(",");
-  Serial.print(magnetom[2]); Serial.println();
-
-  Serial.print("#G-"); Serial.print(raw_or_calibrated); Serial.print('=');
-  Serial.print(gyro[0]); Serial.print(",");
-  Serial.print(gyro[1]); Serial.print(",");
-  Serial.print(gyro[2]); Serial.println();
+  output_queue.beginFrame();
+  output_queue.print("#A-"); output_queue.print(raw_or_calibrated); output_queue.print('=');
+  output_queue.print(accel[0]); output_queue.print(",");
+  output_queue.print(accel[1]); output_queue.print(",");
+  output_queue.print(accel[2]); output_queue.println();
+
+  output_queue.print("#M-"); output_queue.print(raw_or_calibrated); output_queue.print('=');
+  output_queue.print(magnetom[0]); output_queue.print(",");
+  output_queue.print(magnetom[1]); output_queue.print(",");
+  output_queue.print(magnetom[2]); output_queue.println();
+
+  output_queue.print("#G-"); output_queue.print(raw_or_calibrated); output_queue.print('=');
+  output_queue.print(gyro[0]); output_queue.print(",");
+  output_queue.print(gyro[1]); output_queue.print(",");
+  output_queue.print(gyro[2]); output_queue.println();
+  output_queue.endFrame();
 }
 
 void output_sensors_binary()
 {
-  Serial.write((byte*) accel, 12);
-  Serial.write((byte*) magnetom, 12);
-  Serial.write((byte*) gyro, 12);
+  output_queue.beginFrame();
+  output_queue.write((byte*) accel, 12);
+  output_queue.write((byte*) magnetom, 12);
+  output_queue.write((byte*) gyro, 12);
+  output_queue.endFrame();
 }
 
@@ -126,6 +126,42 @@
          required in larger intervals only. Though #f only requests one reply, replies are still
          bound to the internal 20ms (50Hz) time raster. So worst case delay that #f can add is 19.99ms.
          
+  "#F<x>" - Request one output frame tagged with x (an arbitrary byte). Up to OUTPUT__MAX_REQUESTS
+         requests are held, and every sensor fusion step answers the oldest of them, so several
+         requests can be in flight at once. Binary packets answering a request have DATA_MODE_TAGGED
+         set in their data mode byte, and their data starts with x.
+         
+         
+  "#T<n>" - Turn sample timestamps off ("#T0") or on ("#T1"). With timestamps, every sample in a binary
+         packet starts with the time (micros() on the Razor, 4 bytes, MSB first) its sensors were read at,
+         and DATA_MODE_TIMESTAMP is set in the packet's data mode byte.
+         
+  "#t<xy>" - Request the Razor's clock, to relate timestamps to the receiver's clock. The answer is a
+         binary packet of data mode DATA_MODE_CLOCK, whose data is x, y and micros() (4 bytes, MSB first)
+         at the time the request was read.
+         
+  "#i<hl>" - Set the output interval in milliseconds (h and l are its high and low byte). Output
+         frames are sent on every n-th sensor fusion step, n chosen to come nearest to the interval.
+         
+  "#I<hl>" - Set the sensor read and fusion interval in milliseconds (1 to 250, see #i for the
+         format). Fusion runs at this rate no matter how often frames are sent out.
+         
+  "#k<n>" - Set the number of samples sent per binary packet (n is a byte, 0 or 1 sends every sample
+         on its own). Batch packets have DATA_MODE_BATCH set in their data mode byte and carry the
+         number of samples, followed by the samples.
+         
+  "#p<n>" - Set the sensor profile: "#p0" runs all sensors at 50Hz (the default), "#p1" at high rate
+         (gyro and accelerometer read every 2ms, magnetometer at 75Hz). Also sets the fusion interval.
+         
+         
+  "#b<n>" - Set the baud rate: n is '1' to '9' for 2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600
+         or 115200 baud. The answer "#BAUD<baud>\r\n" is sent at the old rate, just before the change.
+         
+  "#B<n>" - Try out a baud rate (n as for #b). Like #b, but unless "#B<n>" comes in again at the new
+         rate within OUTPUT__BAUD_TRIAL_TIME, the Razor goes back to the old rate. Sent at the rate it
+         already runs at, #B<n> keeps the rate and is answered with "#BAUD<baud>\r\n" at it. This way
+         a receiver can try a faster rate, and if the link does not hold up, both ends fall back.
+         
          
   "#s<xy>" - Request synch token - useful to find out where the frame boundaries are in a continuous
          binary stream or to see if tracker is present and answering. The tracker will send
@@ -147,9 +183,11 @@
 
 boolean nop; // Required to force Arduino compiler to #include "Arduino.h" and to add prototypes in.
 
-#include <Wire.h>
 #include "Config.h"
+#include "FusionFilter.h"
+#include "TxQueue.h"
 #include "Vars.h"
+#include "I2C.h"
 #include "Util.h"
 
 void setup()
@@ -167,8 +205,13 @@ void setup()
   Accel_Init();
   Magn_Init();
   Gyro_Init();
+  set_sensor_profile(SENSOR__STARTUP_PROFILE);
+  Timer_Init();
+#if OUTPUT__FIXED_POINT == true
+  init_fixed_point_calibration();
+#endif
   
-  // Read sensors, init DCM algorithm
+  // Read sensors, init sensor fusion
   delay(20);  // Give sensors enough time to collect data
   reset_sensor_fusion();
 
@@ -185,202 +228,72 @@ void setup()
 // Main loop
 void loop()
 {
+  // Hand queued output on to the serial port, as far as it takes it without blocking
+  output_queue.send(Serial);
+  
   // Read incoming control messages
-  if (Serial.available() >= 2)
-  {
-    if (Serial.read() == '#') // Start of new control message
-    {
-      int command = Serial.read(); // Commands
-      if (command == 'f') // request one output _f_rame
-        output_single_on = true;
-      else if (command == 's') // _s_ynch request
-      {
-        // Read ID
-        byte id[2];
-        id[0] = readChar();
-        id[1] = readChar();
-        
-        // Reply with synch message
-        Serial.print("#SYNCH");
-        Serial.write(id, 2);
-        Serial.println();
-      }
-      else if (command == 'o') // Set _o_utput mode
-      {
-        char output_param = readChar();
-        if (output_param == 'n')  // Calibrate _n_ext sensor
-        {
-          curr_calibration_sensor = (curr_calibration_sensor + 1) % 3;
-          reset_calibration_session_flag = true;
-        }
-        else if (output_param == 't') // Output angles as _t_ext
-        {
-          output_mode = OUTPUT__MODE_ANGLES;
-          output_format = OUTPUT__FORMAT_TEXT;
-        }
-        else if (output_param == 'b') // Output angles in _b_inary format
-        {
-          output_mode = OUTPUT__MODE_ANGLES;
-          output_format = OUTPUT__FORMAT_BINARY;
-        }
-        else if (output_param == 'c') // Go to _c_alibration mode
-        {
-          output_mode = OUTPUT__MODE_CALIBRATE_SENSORS;
-          reset_calibration_session_flag = true;
-        }
-        else if (output_param == 's') // Output _s_ensor values
-        {
-          char values_param = readChar();
-          char format_param = readChar();
-          if (values_param == 'r')  // Output _r_aw sensor values
-            output_mode = OUTPUT__MODE_SENSORS_RAW;
-          else if (values_param == 'c')  // Output _c_alibrated sensor values
-            output_mode = OUTPUT__MODE_SENSORS_CALIB;
-          else if (values_param == 'b')  // Output _b_oth sensor values (raw and calibrated)
-            output_mode = OUTPUT__MODE_SENSORS_BOTH;
-
-          if (format_param == 't') // Output values as _t_text
-            output_format = OUTPUT__FORMAT_TEXT;
-          else if (format_param == 'b') // Output values in _b_inary format
-            output_format = OUTPUT__FORMAT_BINARY;
-        }
-        else if (output_param == '0') // Disable continuous streaming output
-        {
-          turn_output_stream_off();
-          reset_calibration_session_flag = true;
-        }
-        else if (output_param == '1') // Enable continuous streaming output
-        {
-          reset_calibration_session_flag = true;
-          turn_output_stream_on();
-        }
-        else if (output_param == 'e') // _e_rror output settings
-        {
-          char error_param = readChar();
-          if (error_param == '0') output_errors = false;
-          else if (error_param == '1') output_errors = true;
-          else if (error_param == 'c') // get error count
-          {
-            Serial.print("#AMG-ERR:");
-            Serial.print(num_accel_errors); Serial.print(",");
-            Serial.print(num_magn_errors); Serial.print(",");
-            Serial.println(num_gyro_errors);
-          }
-        }
-      } else if (command == 'i') { // Set output _i_nterval
-        while (Serial.available() < 2) {}
-        short interval = Serial.read();
-        interval <<= 8;
-        interval |= Serial.read();
-        output_data_interval = interval;
-      } else if (command == 'b') { // Set _b_aud rate
-        while (Serial.available() < 1) {}
-        
-        int rate = (char)Serial.read();
-        int baud = 0;
-        switch (rate) {
-          case '1':
-            baud = 2400;
-            break;
-          case '2':
-            baud = 4800;
-            break;
-          case '3':
-            baud = 9600;
-            break;
-          case '4':
-            baud = 14400;
-            break;
-          case '5':
-            baud = 19200;
-            break;
-          case '6':
-            baud = 28800;
-            break;
-          case '7':
-            baud = 38400;
-            break;
-          case '8':
-            baud = 57600;
-            break;
-          case '9':
-            baud = 115200;
-            break;
-        }
-        
-        if (baud != 0) {
-          Serial.print("#BAUD");
-          Serial.println(baud);
-          Serial.end();
-          delay(10);
-          Serial.begin(baud);
-        }
-      } else if (command == 'z') { // _z_ero calibrate
-        do_calibration = true;
-      } else if (command == 'm') { // Set data _m_ode
-        while (Serial.available() < 1) {}
-        
-        byte mode = (byte)Serial.read();
-        switch (mode) {
-          case DATA_MODE_ALL:
-          case DATA_MODE_GYRO:
-          case DATA_MODE_EULER:
-            break;
-          default:
-            mode = DATA_MODE_DEFAULT;
-        }
-        
-        data_mode = mode;
-        
-      }
-#if OUTPUT__HAS_RN_BLUETOOTH == true
-      // Read messages from bluetooth module
-      // For this to work, the connect/disconnect message prefix of the module has to be set to "#".
-      else if (command == 'C') // Bluetooth "#CONNECT" message (does the same as "#o1")
-        turn_output_stream_on();
-      else if (command == 'D') // Bluetooth "#DISCONNECT" message (does the same as "#o0")
-        turn_output_stream_off();
-#endif // OUTPUT__HAS_RN_BLUETOOTH == true
-    }
-    else
-    { } // Skip character
-  }
+  read_commands();
+  check_baud_trial();
   
-  // Time to read the sensors again?
-  if((millis() - timestamp) >= output_data_interval)
+  // Time to read the sensors again? The reads run in the background, meanwhile the loop goes on.
+  take_sensor_tick();
+  
+  // New sensor readings in?
+  if (sensor_sample_ready())
   {
-    timestamp_old = timestamp;
-    timestamp = millis();
-    if (timestamp > timestamp_old)
-      G_Dt = (float) (timestamp - timestamp_old) / 1000.0f; // Real time of loop run. We use this on the DCM algorithm (gyro integration time)
-    else G_Dt = 0;
-
     // Update sensor readings
+    unsigned long sample_micros_old = sensor_sample_micros;
     read_sensors();
+    timestamp = millis();
+    G_Dt = (sensor_sample_micros - sample_micros_old) / 1000000.0f; // Real time between the sensor ticks (gyro integration time)
+    
+    // Fusion runs on every sample, output only on every output_decimation-th
+    boolean output_due = output_single_on;
+    if (take_output_request()) output_due = true; // Every sample answers one pending "#F<x>"
+    if (output_stream_on && samples_to_output-- == 0) {
+      samples_to_output = output_decimation - 1;
+      output_due = true;
+    }
 
     if (output_mode == OUTPUT__MODE_CALIBRATE_SENSORS)  // We're in calibration mode
     {
       check_reset_calibration_session();  // Check if this session needs a reset
-      if (output_stream_on || output_single_on) output_calibration(curr_calibration_sensor);
+      if (output_due) output_calibration(curr_calibration_sensor);
     }
     else if (output_mode == OUTPUT__MODE_ANGLES)  // Output angles
     {
-      // Apply sensor calibration
-      compensate_sensor_errors();
-    
-      // Run DCM algorithm
-      Compass_Heading(); // Calculate magnetic heading
-      Matrix_update();
-      Normalize();
-      Drift_correction();
-      Euler_angles();
+      if (fixed_point_packets())
+      {
+        // Sensor data packets do not need the DCM; only apply the (fixed point) calibration
+        compensate_sensor_errors_fixed();
+        dcm_needs_reset = true;
+        
+        if (do_calibration) {
+          do_calibration = false;
+          Zero_Calibrate_fixed();
+        }
+      }
+      else
+      {
+        // The DCM was not kept up to date while sending fixed point sensor data packets
+        if (dcm_needs_reset) {
+          dcm_needs_reset = false;
+          reset_sensor_fusion();
+        }
+        
+        // Apply sensor calibration
+        compensate_sensor_errors();
       
-      if (do_calibration) {
-        do_calibration = false;
-        Zero_Calibrate();
+        // Run sensor fusion (DCM algorithm by default)
+        update_sensor_fusion();
+        
+        if (do_calibration) {
+          do_calibration = false;
+          Zero_Calibrate();
+        }
       }
       
-      if (output_stream_on || output_single_on){
+      if (output_due) {
         if (output_format == OUTPUT__FORMAT_TEXT) {
           //output_sensors_text();
           output_sensors_text_single();
@@ -391,16 +304,19 @@ void loop()
     }
     else  // Output sensor values
     {      
-      if (output_stream_on || output_single_on) output_sensors();
+      if (output_due) output_sensors();
     }
     
     output_single_on = false;
+    output_tagged = false;
     
 #if DEBUG__PRINT_LOOP_TIME == true
-    Serial.print("loop time (ms) = ");
-    Serial.println(millis() - timestamp);
+    output_queue.beginFrame();
+    output_queue.print("loop time (ms) = ");
+    output_queue.println(millis() - timestamp);
+    output_queue.endFrame();
 #endif
-  } else if (output_single_on) {
+  } else if (output_single_on && !sensor_sample_pending) {
     if (output_format == OUTPUT__FORMAT_TEXT) {
       //output_sensors_text();
       output_sensors_text_single();
@@ -413,7 +329,9 @@ void loop()
 #if DEBUG__PRINT_LOOP_TIME == true
   else
   {
-    Serial.println("waiting...");
+    output_queue.beginFrame();
+    output_queue.println("waiting...");
+    output_queue.endFrame();
   }
 #endif
 }
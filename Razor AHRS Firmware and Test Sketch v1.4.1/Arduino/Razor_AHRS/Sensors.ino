@@ -7,206 +7,365 @@
 #define MAGN_ADDRESS  ((int) 0x1E) // 0x1E = 0x3C / 2
 #define GYRO_ADDRESS  ((int) 0x68) // 0x68 = 0xD0 / 2
 
-// Arduino backward compatibility macros
-#if ARDUINO >= 100
-  #define WIRE_SEND(b) Wire.write((byte) b) 
-  #define WIRE_RECEIVE() Wire.read() 
+
+// Sensor profiles (see SENSOR__PROFILE_STANDARD and SENSOR__PROFILE_HIGH_RATE)
+struct SensorProfile {
+  byte gyro_dlpf_fs; // ITG-3200 DLPF_FS register (full-scale range and low pass filter)
+  byte gyro_smplrt_div; // ITG-3200 SMPLRT_DIV register
+  byte accel_bw_rate; // ADXL345 BW_RATE register
+  byte magn_cra; // HMC5843/HMC5883L configuration register A
+  long i2c_clock; // Bus clock (Hz)
+  byte fusion_interval; // Milliseconds between sensor ticks
+  byte accel_divider; // Accelerometer is read on every n-th tick
+  byte magn_divider; // Magnetometer is read on every n-th tick
+};
+
+// With the accelerometer FIFO the standard profile runs the accelerometer at 200Hz and averages
+// the four samples it takes per tick
+#if ACCEL__USE_FIFO == true
+  #define ACCEL_STANDARD_BW_RATE 0x0B // 200Hz
 #else
-  #define WIRE_SEND(b) Wire.send(b)
-  #define WIRE_RECEIVE() Wire.receive() 
+  #define ACCEL_STANDARD_BW_RATE 0x09 // 50Hz
 #endif
 
+const SensorProfile sensor_profiles[SENSOR__PROFILE_COUNT] = {
+  // Standard: 50Hz all around
+  // Gyro DLPF_CFG = 3 (42Hz, 1kHz internal), FS_SEL = 3, SMPLRT_DIV = 10; accel 50Hz (200Hz with
+  // the FIFO); magn 50Hz (HMC5843) / 75Hz (HMC5883L)
+  {0x1B, 0x0A, ACCEL_STANDARD_BW_RATE, 0b00011000, 100000L, 20, 1, 1},
+  // High rate: gyro and accel read every 2ms (500Hz), magn at its own top rate
+  // Gyro DLPF_CFG = 1 (188Hz, 1kHz internal), FS_SEL = 3, SMPLRT_DIV = 0 (1kHz); accel 400Hz;
+  // magn as above, read a little faster than it measures so none of its samples is skipped.
+  // The bus runs at 400kHz so all three reads fit in one tick.
+#if HW__VERSION_CODE == 10125 || HW__VERSION_CODE == 10183 || HW__VERSION_CODE == 10321
+  {0x19, 0x00, 0x0C, 0b00011000, 400000L, 2, 1, 9}, // HMC5843: 50Hz, read every 18ms
+#else
+  {0x19, 0x00, 0x0C, 0b00011000, 400000L, 2, 1, 6}, // HMC5883L: 75Hz, read every 12ms
+#endif
+};
 
 void I2C_Init()
 {
-  Wire.begin();
+  i2c_init();
+}
+
+// Writes a sensor register during the setup. A write that fails or times out (see i2c_write())
+// counts as an error of the sensor.
+void write_sensor(byte address, byte reg, byte value)
+{
+  if (i2c_write(address, reg, value)) return;
+  if (address == ACCEL_ADDRESS) num_accel_errors++;
+  else if (address == MAGN_ADDRESS) num_magn_errors++;
+  else num_gyro_errors++;
+  if (output_errors) output_error("!ERR: writing sensor register");
+}
+
+// Sets the sensor output data rates, the bus clock and the fusion interval of a sensor profile.
+// Waits for a running acquisition to finish first.
+void set_sensor_profile(byte profile)
+{
+  if (profile >= SENSOR__PROFILE_COUNT) return;
+  const SensorProfile &p = sensor_profiles[profile];
+  
+  while (acquisition_sensor < SENSOR_COUNT) { }
+  sensor_profile = profile;
+  i2c_set_clock(p.i2c_clock);
+  
+  write_sensor(GYRO_ADDRESS, 0x16, p.gyro_dlpf_fs);
+  write_sensor(GYRO_ADDRESS, 0x15, p.gyro_smplrt_div);
+  write_sensor(ACCEL_ADDRESS, 0x2C, p.accel_bw_rate);
+  write_sensor(MAGN_ADDRESS, 0x00, p.magn_cra);
+  delay(5);
+  
+  accel_ticks_left = magn_ticks_left = 0;
+  set_fusion_interval(p.fusion_interval);
 }
 
 void Accel_Init()
 {
-  Wire.beginTransmission(ACCEL_ADDRESS);
-  WIRE_SEND(0x2D);  // Power register
-  WIRE_SEND(0x08);  // Measurement mode
-  Wire.endTransmission();
+  write_sensor(ACCEL_ADDRESS, 0x2D, 0x08);  // Power register: measurement mode
   delay(5);
-  Wire.beginTransmission(ACCEL_ADDRESS);
-  WIRE_SEND(0x31);  // Data format register
-  WIRE_SEND(0x08);  // Set to full resolution
-  Wire.endTransmission();
+  write_sensor(ACCEL_ADDRESS, 0x31, 0x08);  // Data format register: full resolution
   delay(5);
-  
-  // Because our main loop runs at 50Hz we adjust the output data rate to 50Hz (25Hz bandwidth)
-  Wire.beginTransmission(ACCEL_ADDRESS);
-  WIRE_SEND(0x2C);  // Rate
-  WIRE_SEND(0x09);  // Set to 50Hz, normal operation
-  Wire.endTransmission();
+#if ACCEL__USE_FIFO == true
+  write_sensor(ACCEL_ADDRESS, 0x38, 0x80);  // FIFO control register: stream mode
   delay(5);
+#endif
+  
+  // The output data rate is set by set_sensor_profile()
 }
 
-// Reads x, y and z accelerometer registers
+// Decodes one accelerometer sample (six data register bytes). The register pairs hold 16 bit two's
+// complement numbers, so here and below they go through int16_t: int is wider on other platforms.
+void decode_accel(const byte *buff, int *values)
+{
+  // No multiply by -1 for coordinate system transformation here, because of double negation:
+  // We want the gravity vector, which is negated acceleration vector.
+  values[0] = (int16_t) ((buff[3] << 8) | buff[2]);  // X axis (internal sensor y axis)
+  values[1] = (int16_t) ((buff[1] << 8) | buff[0]);  // Y axis (internal sensor x axis)
+  values[2] = (int16_t) ((buff[5] << 8) | buff[4]);  // Z axis (internal sensor z axis)
+}
+
+// Takes x, y and z accelerometer registers from the last sensor acquisition.
+// With the FIFO, that is the average of all samples drained from it.
 void Read_Accel()
 {
-  int i = 0;
-  byte buff[6];
-  
-  Wire.beginTransmission(ACCEL_ADDRESS); 
-  WIRE_SEND(0x32);  // Send address to read from
-  Wire.endTransmission();
-  
-  Wire.beginTransmission(ACCEL_ADDRESS);
-  Wire.requestFrom(ACCEL_ADDRESS, 6);  // Request 6 bytes
-  while(Wire.available())  // ((Wire.available())&&(i<6))
-  { 
-    buff[i] = WIRE_RECEIVE();  // Read one byte
-    i++;
-  }
-  Wire.endTransmission();
-  
-  if (i == 6)  // All bytes received?
+  if (!(sensor_read_mask & _BV(SENSOR_ACCEL))) return;  // Not read this time, keep the last reading
+  if (sensor_read_ok & _BV(SENSOR_ACCEL))  // All bytes received?
   {
-    // No multiply by -1 for coordinate system transformation here, because of double negation:
-    // We want the gravity vector, which is negated acceleration vector.
-    accel[0] = (((int) buff[3]) << 8) | buff[2];  // X axis (internal sensor y axis)
-    accel[1] = (((int) buff[1]) << 8) | buff[0];  // Y axis (internal sensor x axis)
-    accel[2] = (((int) buff[5]) << 8) | buff[4];  // Z axis (internal sensor z axis)
+#if ACCEL__USE_FIFO == true
+    if (accel_fifo_count == 0) return;  // No new sample yet, keep the last reading
+    if (accel_fifo_overrun) num_accel_overruns++;
+    
+    long sum[3] = {0, 0, 0};
+    int values[3];
+    for (byte i = 0; i < accel_fifo_count; i++) {
+      decode_accel(accel_fifo[i], values);
+      for (int j = 0; j < 3; j++) sum[j] += values[j];
+    }
+    for (int j = 0; j < 3; j++)
+      accel_raw[j] = (sum[j] + (sum[j] < 0 ? -accel_fifo_count : accel_fifo_count) / 2) / accel_fifo_count;
+#else
+    decode_accel(sensor_data[SENSOR_ACCEL], accel_raw);
+#endif
   }
   else
   {
     num_accel_errors++;
-    if (output_errors) Serial.println("!ERR: reading accelerometer");
+    if (output_errors) output_error("!ERR: reading accelerometer");
   }
 }
 
 void Magn_Init()
 {
-  Wire.beginTransmission(MAGN_ADDRESS);
-  WIRE_SEND(0x02); 
-  WIRE_SEND(0x00);  // Set continuous mode (default 10Hz)
-  Wire.endTransmission();
-  delay(5);
-
-  Wire.beginTransmission(MAGN_ADDRESS);
-  WIRE_SEND(0x00);
-  WIRE_SEND(0b00011000);  // Set 50Hz
-  Wire.endTransmission();
+  write_sensor(MAGN_ADDRESS, 0x02, 0x00);  // Set continuous mode (default 10Hz)
   delay(5);
+  
+  // The output data rate is set by set_sensor_profile()
 }
 
+// Takes x, y and z magnetometer registers from the last sensor acquisition
 void Read_Magn()
 {
-  int i = 0;
-  byte buff[6];
+  const byte *buff = sensor_data[SENSOR_MAGN];
  
-  Wire.beginTransmission(MAGN_ADDRESS); 
-  WIRE_SEND(0x03);  // Send address to read from
-  Wire.endTransmission();
-  
-  Wire.beginTransmission(MAGN_ADDRESS); 
-  Wire.requestFrom(MAGN_ADDRESS, 6);  // Request 6 bytes
-  while(Wire.available())  // ((Wire.available())&&(i<6))
-  { 
-    buff[i] = WIRE_RECEIVE();  // Read one byte
-    i++;
-  }
-  Wire.endTransmission();
-  
-  if (i == 6)  // All bytes received?
+  if (!(sensor_read_mask & _BV(SENSOR_MAGN))) return;  // Not read this time, keep the last reading
+  if (sensor_read_ok & _BV(SENSOR_MAGN))  // All bytes received?
   {
 // 9DOF Razor IMU SEN-10125 using HMC5843 magnetometer
 #if HW__VERSION_CODE == 10125
     // MSB byte first, then LSB; X, Y, Z
-    magnetom[0] = -1 * ((((int) buff[2]) << 8) | buff[3]);  // X axis (internal sensor -y axis)
-    magnetom[1] = -1 * ((((int) buff[0]) << 8) | buff[1]);  // Y axis (internal sensor -x axis)
-    magnetom[2] = -1 * ((((int) buff[4]) << 8) | buff[5]);  // Z axis (internal sensor -z axis)
+    magnetom_raw[0] = -1 * ((int16_t) ((buff[2] << 8) | buff[3]));  // X axis (internal sensor -y axis)
+    magnetom_raw[1] = -1 * ((int16_t) ((buff[0] << 8) | buff[1]));  // Y axis (internal sensor -x axis)
+    magnetom_raw[2] = -1 * ((int16_t) ((buff[4] << 8) | buff[5]));  // Z axis (internal sensor -z axis)
 // 9DOF Razor IMU SEN-10736 using HMC5883L magnetometer
 #elif HW__VERSION_CODE == 10736
     // MSB byte first, then LSB; Y and Z reversed: X, Z, Y
-    magnetom[0] = -1 * ((((int) buff[4]) << 8) | buff[5]);  // X axis (internal sensor -y axis)
-    magnetom[1] = -1 * ((((int) buff[0]) << 8) | buff[1]);  // Y axis (internal sensor -x axis)
-    magnetom[2] = -1 * ((((int) buff[2]) << 8) | buff[3]);  // Z axis (internal sensor -z axis)
+    magnetom_raw[0] = -1 * ((int16_t) ((buff[4] << 8) | buff[5]));  // X axis (internal sensor -y axis)
+    magnetom_raw[1] = -1 * ((int16_t) ((buff[0] << 8) | buff[1]));  // Y axis (internal sensor -x axis)
+    magnetom_raw[2] = -1 * ((int16_t) ((buff[2] << 8) | buff[3]));  // Z axis (internal sensor -z axis)
 // 9DOF Sensor Stick SEN-10183 and SEN-10321 using HMC5843 magnetometer
 #elif (HW__VERSION_CODE == 10183) || (HW__VERSION_CODE == 10321)
     // MSB byte first, then LSB; X, Y, Z
-    magnetom[0] = (((int) buff[0]) << 8) | buff[1];         // X axis (internal sensor x axis)
-    magnetom[1] = -1 * ((((int) buff[2]) << 8) | buff[3]);  // Y axis (internal sensor -y axis)
-    magnetom[2] = -1 * ((((int) buff[4]) << 8) | buff[5]);  // Z axis (internal sensor -z axis)
+    magnetom_raw[0] = (int16_t) ((buff[0] << 8) | buff[1]);         // X axis (internal sensor x axis)
+    magnetom_raw[1] = -1 * ((int16_t) ((buff[2] << 8) | buff[3]));  // Y axis (internal sensor -y axis)
+    magnetom_raw[2] = -1 * ((int16_t) ((buff[4] << 8) | buff[5]));  // Z axis (internal sensor -z axis)
 // 9DOF Sensor Stick SEN-10724 using HMC5883L magnetometer
 #elif HW__VERSION_CODE == 10724
     // MSB byte first, then LSB; Y and Z reversed: X, Z, Y
-    magnetom[0] = (((int) buff[0]) << 8) | buff[1];         // X axis (internal sensor x axis)
-    magnetom[1] = -1 * ((((int) buff[4]) << 8) | buff[5]);  // Y axis (internal sensor -y axis)
-    magnetom[2] = -1 * ((((int) buff[2]) << 8) | buff[3]);  // Z axis (internal sensor -z axis)
+    magnetom_raw[0] = (int16_t) ((buff[0] << 8) | buff[1]);         // X axis (internal sensor x axis)
+    magnetom_raw[1] = -1 * ((int16_t) ((buff[4] << 8) | buff[5]));  // Y axis (internal sensor -y axis)
+    magnetom_raw[2] = -1 * ((int16_t) ((buff[2] << 8) | buff[3]));  // Z axis (internal sensor -z axis)
 #endif
   }
   else
   {
     num_magn_errors++;
-    if (output_errors) Serial.println("!ERR: reading magnetometer");
+    if (output_errors) output_error("!ERR: reading magnetometer");
   }
 }
 
 void Gyro_Init()
 {
   // Power up reset defaults
-  Wire.beginTransmission(GYRO_ADDRESS);
-  WIRE_SEND(0x3E);
-  WIRE_SEND(0x80);
-  Wire.endTransmission();
+  write_sensor(GYRO_ADDRESS, 0x3E, 0x80);
   delay(5);
   
-  // Select full-scale range of the gyro sensors
-  // Set LP filter bandwidth to 42Hz
-  Wire.beginTransmission(GYRO_ADDRESS);
-  WIRE_SEND(0x16);
-  WIRE_SEND(0x1B);  // DLPF_CFG = 3, FS_SEL = 3
-  Wire.endTransmission();
-  delay(5);
-  
-  // Set sample rato to 50Hz
-  Wire.beginTransmission(GYRO_ADDRESS);
-  WIRE_SEND(0x15);
-  WIRE_SEND(0x0A);  //  SMPLRT_DIV = 10 (50Hz)
-  Wire.endTransmission();
-  delay(5);
+  // Full-scale range, LP filter bandwidth and sample rate are set by set_sensor_profile()
 
   // Set clock to PLL with z gyro reference
-  Wire.beginTransmission(GYRO_ADDRESS);
-  WIRE_SEND(0x3E);
-  WIRE_SEND(0x00);
-  Wire.endTransmission();
+  write_sensor(GYRO_ADDRESS, 0x3E, 0x00);
   delay(5);
 }
 
-// Reads x, y and z gyroscope registers
+// Takes x, y and z gyroscope registers from the last sensor acquisition
 void Read_Gyro()
 {
-  int i = 0;
-  byte buff[6];
+  const byte *buff = sensor_data[SENSOR_GYRO];
   
-  Wire.beginTransmission(GYRO_ADDRESS); 
-  WIRE_SEND(0x1D);  // Sends address to read from
-  Wire.endTransmission();
-  
-  Wire.beginTransmission(GYRO_ADDRESS);
-  Wire.requestFrom(GYRO_ADDRESS, 6);  // Request 6 bytes
-  while(Wire.available())  // ((Wire.available())&&(i<6))
-  { 
-    buff[i] = WIRE_RECEIVE();  // Read one byte
-    i++;
-  }
-  Wire.endTransmission();
-  
-  if (i == 6)  // All bytes received?
+  if (sensor_read_ok & _BV(SENSOR_GYRO))  // All bytes received?
   {
-    gyro[0] = -1 * ((((int) buff[2]) << 8) | buff[3]);    // X axis (internal sensor -y axis)
-    gyro[1] = -1 * ((((int) buff[0]) << 8) | buff[1]);    // Y axis (internal sensor -x axis)
-    gyro[2] = -1 * ((((int) buff[4]) << 8) | buff[5]);    // Z axis (internal sensor -z axis)
+    gyro_raw[0] = -1 * ((int16_t) ((buff[2] << 8) | buff[3]));    // X axis (internal sensor -y axis)
+    gyro_raw[1] = -1 * ((int16_t) ((buff[0] << 8) | buff[1]));    // Y axis (internal sensor -x axis)
+    gyro_raw[2] = -1 * ((int16_t) ((buff[4] << 8) | buff[5]));    // Z axis (internal sensor -z axis)
   }
   else
   {
     num_gyro_errors++;
-    if (output_errors) Serial.println("!ERR: reading gyroscope");
+    if (output_errors) output_error("!ERR: reading gyroscope");
+  }
+}
+
+// Asynchronous sensor acquisition: the registers of the sensors in the read mask (gyroscope,
+// accelerometer and magnetometer) are read one after the other from the I2C interrupt (see I2C.h),
+// so the main loop goes on while the bus is busy. The sample is complete when
+// sensor_sample_ready() returns true.
+const byte sensor_addresses[SENSOR_COUNT] = {GYRO_ADDRESS, ACCEL_ADDRESS, MAGN_ADDRESS};
+const byte sensor_registers[SENSOR_COUNT] = {0x1D, 0x32, 0x03}; // First data register
+
+// Starts reading the next sensor in sensor_read_mask after the given one, if there is one
+void start_sensor_read(byte sensor)
+{
+  while (sensor < SENSOR_COUNT && !(sensor_read_mask & _BV(sensor))) sensor++;
+  acquisition_sensor = sensor;
+#if ACCEL__USE_FIFO == true
+  if (sensor == SENSOR_ACCEL) {
+    i2c_start(ACCEL_ADDRESS, 0x30, accel_fifo_read, 10, true, accel_fifo_first_read_done);
+    return;
+  }
+#endif
+  if (sensor < SENSOR_COUNT)
+    i2c_start(sensor_addresses[sensor], sensor_registers[sensor], sensor_data[sensor], 6, true, sensor_read_done);
+}
+
+#if ACCEL__USE_FIFO == true
+// Accelerometer FIFO: the samples are read one by one, one transfer each. The ADXL345 pops one
+// sample per read of the data registers and does not wrap around, so every read takes the six data
+// registers and goes on over the FIFO control register to the FIFO status register. That byte is
+// read long enough (one byte time) after the pop to be valid (the datasheet asks for 5us), so it
+// tells if another sample is left without a read of its own. The first read of an acquisition
+// starts two registers earlier, at the interrupt source register: its DATA_READY bit says if there
+// is a sample at all, and its overrun bit if the FIFO has lost samples since the last acquisition.
+
+// Called from the I2C interrupt when the first FIFO sample (if any) is read
+void accel_fifo_first_read_done(boolean ok)
+{
+  accel_fifo_count = 0;
+  accel_fifo_overrun = ok && (accel_fifo_read[0] & 0x01);  // Interrupt source: overrun
+  
+  if (ok && !(accel_fifo_read[0] & 0x80))  // Interrupt source: DATA_READY, clear if the FIFO is empty
+    sensor_read_done(true);
+  else
+    accel_fifo_read_done(ok);
+}
+
+// Called from the I2C interrupt when a FIFO sample is read; reads the next one, if there is one
+void accel_fifo_read_done(boolean ok)
+{
+  if (!ok) {
+    sensor_read_done(false);
+    return;
   }
+  
+  for (byte i = 0; i < 6; i++) accel_fifo[accel_fifo_count][i] = accel_fifo_read[2 + i];
+  accel_fifo_count++;
+  
+  byte entries = accel_fifo_read[9] & 0x3F;
+  if (entries > 0 && accel_fifo_count < ACCEL_FIFO_SIZE)
+    i2c_start(ACCEL_ADDRESS, 0x32, &accel_fifo_read[2], 8, true, accel_fifo_read_done);
+  else
+    sensor_read_done(true);
+}
+#endif
+
+void start_sensor_acquisition(unsigned long sample_micros, byte read_mask)
+{
+  acquisition_micros = sample_micros;
+  sensor_read_mask = read_mask;
+  sensor_read_ok = 0;
+  sensor_sample_pending = true;
+  start_sensor_read(0);
+}
+
+// Called from the I2C interrupt when a sensor read is done; starts the next one
+void sensor_read_done(boolean ok)
+{
+  if (ok) sensor_read_ok |= _BV(acquisition_sensor);
+  start_sensor_read(acquisition_sensor + 1);
+}
+
+// True if the started acquisition is done and its sample not taken by read_sensors() yet
+boolean sensor_sample_ready()
+{
+  return sensor_sample_pending && acquisition_sensor == SENSOR_COUNT;
+}
+
+// Sensor tick: Timer1 interrupts every fusion_data_interval milliseconds, and the main loop
+// starts an acquisition on every tick (see take_sensor_tick()). The sampling rate so does not
+// depend on how long the loop takes, and neither does G_Dt, which is measured between ticks.
+#define SENSOR_TICK_PRESCALER 64
+#define SENSOR_TICK_COUNTS_PER_MS (F_CPU / SENSOR_TICK_PRESCALER / 1000) // 125 at 8MHz
+
+void Timer_Init()
+{
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10); // CTC mode (TOP = OCR1A), prescaler 64
+  set_fusion_interval(fusion_data_interval);
+  TIMSK1 = _BV(OCIE1A);
+}
+
+// Sets the sensor read and fusion interval in milliseconds, clamped to 1..FUSION__MAX_DATA_INTERVAL
+void set_fusion_interval(int interval)
+{
+  if (interval < 1) interval = 1;
+  else if (interval > FUSION__MAX_DATA_INTERVAL) interval = FUSION__MAX_DATA_INTERVAL;
+  fusion_data_interval = interval;
+  
+  noInterrupts();
+  OCR1A = interval * SENSOR_TICK_COUNTS_PER_MS - 1;
+  TCNT1 = 0;
+  interrupts();
+  
+  update_output_decimation();
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+  sensor_tick_micros = micros();
+  if (sensor_ticks < 255) sensor_ticks++;
+}
+
+// Starts an acquisition if a sensor tick came in and the bus is free; ticks that came in while
+// the last sample was still pending are dropped (and counted in num_missed_ticks)
+void take_sensor_tick()
+{
+  if (sensor_ticks == 0 || sensor_sample_pending) return;
+  
+  noInterrupts();
+  byte ticks = sensor_ticks;
+  unsigned long tick_micros = sensor_tick_micros;
+  sensor_ticks = 0;
+  interrupts();
+  
+  num_missed_ticks += ticks - 1;
+  
+  // The gyroscope is read on every tick, the others at the rate of the sensor profile
+  const SensorProfile &p = sensor_profiles[sensor_profile];
+  byte read_mask = _BV(SENSOR_GYRO);
+  if (accel_ticks_left <= ticks) {
+    accel_ticks_left = p.accel_divider;
+    read_mask |= _BV(SENSOR_ACCEL);
+  } else {
+    accel_ticks_left -= ticks;
+  }
+  if (magn_ticks_left <= ticks) {
+    magn_ticks_left = p.magn_divider;
+    read_mask |= _BV(SENSOR_MAGN);
+  } else {
+    magn_ticks_left -= ticks;
+  }
+  
+  start_sensor_acquisition(tick_micros, read_mask);
 }
 
 void Zero_Calibrate() {
@@ -221,3 +380,13 @@ void Zero_Calibrate() {
   euler_offset[1] = pitch;
   euler_offset[2] = roll;
 }
+
+// Fixed point version of Zero_Calibrate() (see OUTPUT__FIXED_POINT)
+void Zero_Calibrate_fixed() {
+  accel_offset_fixed[0] = accel_fixed[0];
+  accel_offset_fixed[1] = accel_fixed[1];
+  
+  gyro_offset_fixed[0] = gyro_fixed[0];
+  gyro_offset_fixed[1] = gyro_fixed[1];
+  gyro_offset_fixed[2] = gyro_fixed[2];
+}
@@ -0,0 +1,131 @@
+/* This file is part of the Razor AHRS Firmware */
+
+#ifndef TxQueue_h
+#define TxQueue_h
+
+#define TX_QUEUE_SIZE 200 // Bytes the queue holds (at most 255)
+#define TX_QUEUE_FRAMES 8 // Frames the queue holds
+
+/**
+ * Output queue between the output functions and the serial port. Output is written in whole
+ * frames (beginFrame(), the bytes, endFrame()), and send() hands queued frames on to the serial
+ * port only as far as its transmit buffer has room, which the UART interrupt then drains. So the
+ * output functions never wait for the serial port, and neither does the sensor fusion.
+ *
+ * If the queue is full, the oldest frame that has not started going out is dropped (and counted,
+ * see getDroppedFrames()). If no such frame is left, the frame being written is dropped instead.
+ * Only whole frames are sent, so the receiver never sees part of a dropped frame.
+ */
+class TxQueue : public Print {
+  public:
+    TxQueue() : head(0), tail(0), frames(0), sentOfFirst(0), frameStart(0),
+      writing(false), dropping(false), droppedFrames(0) {}
+
+    // Starts a new frame; everything written up to endFrame() goes out together or not at all
+    void beginFrame() {
+      writing = true;
+      dropping = false;
+      frameStart = tail;
+    }
+
+    // Ends the frame started by beginFrame(), so it can be sent
+    void endFrame() {
+      writing = false;
+      if (dropping) return;
+      if (frames == TX_QUEUE_FRAMES) {
+        dropOldestFrame();
+      }
+      if (frames >= TX_QUEUE_FRAMES) {
+        // Nothing older could be dropped
+        tail = frameStart;
+        droppedFrames++;
+        return;
+      }
+      frameEnds[frames++] = tail;
+    }
+
+    virtual size_t write(uint8_t b) {
+      if (dropping) return 1;
+      if (tail == TX_QUEUE_SIZE) {
+        compact();
+        while (tail == TX_QUEUE_SIZE) {
+          if (!dropOldestFrame()) {
+            // Nothing older to drop, so the frame does not fit at all
+            tail = frameStart;
+            dropping = true;
+            droppedFrames++;
+            return 1;
+          }
+        }
+      }
+      buffer[tail++] = b;
+      return 1;
+    }
+    using Print::write;
+
+    // Moves queued bytes into the transmit buffer of out, as far as that does not block
+    void send(HardwareSerial &out) {
+      int room = out.availableForWrite();
+      while (room-- > 0 && frames > 0) {
+        out.write(buffer[head++]);
+        sentOfFirst++;
+        if (head == frameEnds[0]) popFrame();
+      }
+    }
+
+    // Sends everything queued and waits until it is out (before changing the baud rate)
+    void sendAll(HardwareSerial &out) {
+      while (frames > 0) send(out);
+      out.flush();
+    }
+
+    // Number of frames dropped because the queue was full
+    unsigned int getDroppedFrames() { return droppedFrames; }
+
+  private:
+    // Removes the first frame, which has been sent
+    void popFrame() {
+      frames--;
+      for (byte i = 0; i < frames; i++) frameEnds[i] = frameEnds[i + 1];
+      sentOfFirst = 0;
+    }
+
+    // Moves the unsent bytes to the front of the buffer
+    void compact() {
+      if (head == 0) return;
+      memmove(buffer, buffer + head, tail - head);
+      for (byte i = 0; i < frames; i++) frameEnds[i] -= head;
+      if (writing) frameStart -= head;
+      tail -= head;
+      head = 0;
+    }
+
+    // Drops the oldest queued frame that has not started going out; false if there is none
+    boolean dropOldestFrame() {
+      byte index = (sentOfFirst > 0) ? 1 : 0;
+      if (index >= frames) return false;
+
+      byte start = (index == 0) ? head : frameEnds[0];
+      byte length = frameEnds[index] - start;
+      memmove(buffer + start, buffer + frameEnds[index], tail - frameEnds[index]);
+      tail -= length;
+      if (writing) frameStart -= length;
+      frames--;
+      for (byte i = index; i < frames; i++) frameEnds[i] = frameEnds[i + 1] - length;
+      droppedFrames++;
+      return true;
+    }
+
+    byte buffer[TX_QUEUE_SIZE];
+    byte head; // Next byte to send
+    byte tail; // End of the queued bytes
+    byte frameEnds[TX_QUEUE_FRAMES]; // End of every queued frame
+    byte frames; // Number of queued (complete) frames
+    byte sentOfFirst; // Bytes of the first frame already sent
+    byte frameStart; // Start of the frame being written
+    boolean writing; // Between beginFrame() and endFrame()
+    boolean dropping; // The frame being written did not fit and is dropped
+    unsigned int droppedFrames;
+};
+
+#endif
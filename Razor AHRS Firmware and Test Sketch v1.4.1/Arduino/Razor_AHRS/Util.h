@@ -1,10 +1,33 @@
 #ifndef Util_h
 #define Util_h
 
+// True if the next packets can be made without any floating point math (see OUTPUT__FIXED_POINT)
+boolean fixed_point_packets() {
+  return OUTPUT__FIXED_POINT && output_mode == OUTPUT__MODE_ANGLES
+    && output_format == OUTPUT__FORMAT_BINARY
+    && data_mode != DATA_MODE_EULER && data_mode != DATA_MODE_QUATERNION;
+}
+
+// Takes the sensor sample of the running acquisition (see start_sensor_acquisition()),
+// starting one and waiting for it if needed
 void read_sensors() {
+  if (!sensor_sample_pending) start_sensor_acquisition(micros(), SENSOR_ALL);
+  while (!sensor_sample_ready()) { }
+  sensor_sample_pending = false;
+  sensor_sample_micros = acquisition_micros;
+  
   Read_Gyro(); // Read gyroscope
   Read_Accel(); // Read accelerometer
   Read_Magn(); // Read magnetometer
+  
+  // Fixed point packets are made straight from the raw readings
+  if (fixed_point_packets()) return;
+  
+  for (int i = 0; i < 3; i++) {
+    accel[i] = accel_raw[i];
+    magnetom[i] = magnetom_raw[i];
+    gyro[i] = gyro_raw[i];
+  }
 }
 
 // Read every sensor and record a time stamp
@@ -16,7 +39,6 @@ void reset_sensor_fusion() {
   float xAxis[] = {1.0f, 0.0f, 0.0f};
 
   read_sensors();
-  timestamp = millis();
   
   // GET PITCH
   // Using y-z-plane-component/x-component of gravity vector
@@ -35,8 +57,17 @@ void reset_sensor_fusion() {
   Compass_Heading();
   yaw = MAG_Heading;
   
-  // Init rotation matrix
-  init_rotation_matrix(DCM_Matrix, yaw, pitch, roll);
+  // Init sensor fusion filter
+  fusion_filter.reset(yaw, pitch, roll);
+}
+
+// Runs the sensor fusion filter on the calibrated sensor readings and updates yaw, pitch and roll
+void update_sensor_fusion() {
+  float gyro_rad[3];
+  for (int i = 0; i < 3; i++) gyro_rad[i] = GYRO_SCALED_RAD(gyro[i]);
+  
+  fusion_filter.update(gyro_rad, accel, magnetom, G_Dt);
+  fusion_filter.getEuler(yaw, pitch, roll);
 }
 
 // Apply calibration to raw sensor readings
@@ -63,6 +94,46 @@ void compensate_sensor_errors() {
     gyro[2] -= GYRO_AVERAGE_OFFSET_Z;
 }
 
+// Fixed point version of compensate_sensor_errors(): calibrates the raw sensor readings
+// into accel_fixed, magnetom_fixed and gyro_fixed without any floating point math
+void compensate_sensor_errors_fixed() {
+    // Compensate accelerometer error
+    accel_fixed[0] = ((long) (2 * accel_raw[0]) - (long) (ACCEL_X_MIN + ACCEL_X_MAX)) * ACCEL_X_SCALE_Q23 >> 8;
+    accel_fixed[1] = ((long) (2 * accel_raw[1]) - (long) (ACCEL_Y_MIN + ACCEL_Y_MAX)) * ACCEL_Y_SCALE_Q23 >> 8;
+    accel_fixed[2] = ((long) (2 * accel_raw[2]) - (long) (ACCEL_Z_MIN + ACCEL_Z_MAX)) * ACCEL_Z_SCALE_Q23 >> 8;
+
+    // Compensate magnetometer error
+#if CALIBRATION__MAGN_USE_EXTENDED == true
+    long magnetom_q4[3];
+    for (int i = 0; i < 3; i++)
+      magnetom_q4[i] = ((long) magnetom_raw[i] << 4) - magn_ellipsoid_center_q4[i];
+    for (int i = 0; i < 3; i++)
+      magnetom_fixed[i] = magn_ellipsoid_transform_q12[i][0] * magnetom_q4[0]
+        + magn_ellipsoid_transform_q12[i][1] * magnetom_q4[1]
+        + magn_ellipsoid_transform_q12[i][2] * magnetom_q4[2];
+#else
+    magnetom_fixed[0] = ((long) (2 * magnetom_raw[0]) - (long) (MAGN_X_MIN + MAGN_X_MAX)) * MAGN_X_SCALE_Q15;
+    magnetom_fixed[1] = ((long) (2 * magnetom_raw[1]) - (long) (MAGN_Y_MIN + MAGN_Y_MAX)) * MAGN_Y_SCALE_Q15;
+    magnetom_fixed[2] = ((long) (2 * magnetom_raw[2]) - (long) (MAGN_Z_MIN + MAGN_Z_MAX)) * MAGN_Z_SCALE_Q15;
+#endif
+
+    // Compensate gyroscope error
+    gyro_fixed[0] = gyro_raw[0] - GYRO_X_OFFSET_INT;
+    gyro_fixed[1] = gyro_raw[1] - GYRO_Y_OFFSET_INT;
+    gyro_fixed[2] = gyro_raw[2] - GYRO_Z_OFFSET_INT;
+}
+
+// Converts the extended magnetometer calibration to fixed point, once on startup
+void init_fixed_point_calibration() {
+#if CALIBRATION__MAGN_USE_EXTENDED == true
+  for (int i = 0; i < 3; i++) {
+    magn_ellipsoid_center_q4[i] = (long) (magn_ellipsoid_center[i] * 16.0f);
+    for (int j = 0; j < 3; j++)
+      magn_ellipsoid_transform_q12[i][j] = (int) (magn_ellipsoid_transform[i][j] * 4096.0f);
+  }
+#endif
+}
+
 // Reset calibration session if reset_calibration_session_flag is set
 void check_reset_calibration_session()
 {
@@ -84,6 +155,35 @@ void check_reset_calibration_session()
   reset_calibration_session_flag = false;
 }
 
+// Output goes out every output_decimation-th fusion sample, which is the nearest to
+// output_data_interval (but at most every sample)
+void update_output_decimation()
+{
+  int decimation = (output_data_interval + fusion_data_interval / 2) / fusion_data_interval;
+  output_decimation = constrain(decimation, 1, 255);
+  samples_to_output = 0;
+}
+
+// Takes the oldest "#F<x>" request off output_requests, to be answered with the current sample.
+// Returns false if there is none.
+boolean take_output_request()
+{
+  output_tagged = output_request_count > 0;
+  if (!output_tagged) return false;
+  output_tag = output_requests[0];
+  output_request_count--;
+  for (byte i = 0; i < output_request_count; i++) output_requests[i] = output_requests[i + 1];
+  return true;
+}
+
+// Queues an error message (see output_errors)
+void output_error(const char *message)
+{
+  output_queue.beginFrame();
+  output_queue.println(message);
+  output_queue.endFrame();
+}
+
 void turn_output_stream_on()
 {
   output_stream_on = true;
@@ -96,11 +196,4 @@ void turn_output_stream_off()
   digitalWrite(STATUS_LED_PIN, LOW);
 }
 
-// Blocks until another byte is available on serial port
-char readChar()
-{
-  while (Serial.available() < 1) { } // Block
-  return Serial.read();
-}
-
 #endif
@@ -27,6 +27,21 @@
 #define MAGN_Z_SCALE (100.0f / (MAGN_Z_MAX - MAGN_Z_OFFSET))
 
 
+// Fixed point sensor calibration (see OUTPUT__FIXED_POINT)
+// Calibrated values are computed from 2 * raw - (MIN + MAX), so that the offset stays an integer.
+// The scales are folded into integer constants at compile time; results are Q16.16 numbers.
+#define ACCEL_X_SCALE_Q23 ((long) (ACCEL_X_SCALE / GRAVITY * 8388608.0f)) // Result in g, >> 8 after multiplying
+#define ACCEL_Y_SCALE_Q23 ((long) (ACCEL_Y_SCALE / GRAVITY * 8388608.0f))
+#define ACCEL_Z_SCALE_Q23 ((long) (ACCEL_Z_SCALE / GRAVITY * 8388608.0f))
+#define MAGN_X_SCALE_Q15 ((long) (MAGN_X_SCALE * 32768.0f))
+#define MAGN_Y_SCALE_Q15 ((long) (MAGN_Y_SCALE * 32768.0f))
+#define MAGN_Z_SCALE_Q15 ((long) (MAGN_Z_SCALE * 32768.0f))
+#define ROUND_TO_INT(x) ((int) ((x) < 0 ? (x) - 0.5f : (x) + 0.5f))
+#define GYRO_X_OFFSET_INT ROUND_TO_INT(GYRO_AVERAGE_OFFSET_X)
+#define GYRO_Y_OFFSET_INT ROUND_TO_INT(GYRO_AVERAGE_OFFSET_Y)
+#define GYRO_Z_OFFSET_INT ROUND_TO_INT(GYRO_AVERAGE_OFFSET_Z)
+#define TO_FIXED(x) ((long) ((x) * 65536.0f)) // Float to Q16.16
+
 // Gain for gyroscope (ITG-3200)
 #define GYRO_GAIN 0.06957 // Same gain on all axes
 #define GYRO_SCALED_RAD(x) (x * TO_RAD(GYRO_GAIN)) // Calculate the scaled gyro readings in radians per second
@@ -43,6 +58,38 @@
 #define TO_RAD(x) (x * 0.01745329252)  // *pi/180
 #define TO_DEG(x) (x * 57.2957795131)  // *180/pi
 
+// Raw sensor readings
+int accel_raw[3];
+int magnetom_raw[3];
+int gyro_raw[3];
+
+// Sensor acquisition (see start_sensor_acquisition())
+#define SENSOR_GYRO 0 // Order of the reads, index into sensor_data
+#define SENSOR_ACCEL 1
+#define SENSOR_MAGN 2
+#define SENSOR_COUNT 3
+#define SENSOR_ALL (_BV(SENSOR_GYRO) | _BV(SENSOR_ACCEL) | _BV(SENSOR_MAGN))
+byte sensor_data[SENSOR_COUNT][6]; // Register bytes read by the last acquisition
+byte sensor_read_mask; // Bit per sensor, set if the last acquisition reads it
+volatile byte sensor_read_ok; // Bit per sensor, set if its read went through
+volatile byte acquisition_sensor = SENSOR_COUNT; // Sensor being read; SENSOR_COUNT when done
+boolean sensor_sample_pending = false; // Acquisition started, but its sample not taken yet
+unsigned long acquisition_micros; // Time stamp of the acquisition (start of the gyroscope read)
+unsigned long sensor_sample_micros; // Time stamp of the sample taken by read_sensors()
+volatile byte sensor_ticks = 0; // Sensor ticks since the last acquisition was started (see Timer_Init())
+volatile unsigned long sensor_tick_micros; // Time stamp of the last sensor tick
+unsigned int num_missed_ticks = 0; // Sensor ticks dropped because the last sample was not taken yet
+byte sensor_profile = SENSOR__STARTUP_PROFILE; // See set_sensor_profile()
+byte accel_ticks_left = 0; // Sensor ticks until the accelerometer is read again
+byte magn_ticks_left = 0; // Sensor ticks until the magnetometer is read again
+#if ACCEL__USE_FIFO == true
+#define ACCEL_FIFO_SIZE 32 // Samples the ADXL345 FIFO holds
+byte accel_fifo[ACCEL_FIFO_SIZE][6]; // Data register bytes of the samples drained from the FIFO
+volatile byte accel_fifo_count = 0; // Samples in accel_fifo
+boolean accel_fifo_overrun = false; // The FIFO had lost samples at the last acquisition
+byte accel_fifo_read[10]; // Registers 0x30 to 0x39 (interrupt source to FIFO status) of the last FIFO read
+#endif
+
 // Sensor variables
 float accel[3];  // Actually stores the NEGATED acceleration (equals gravity, if board not moving).
 float accel_min[3];
@@ -59,19 +106,27 @@ float gyro_average[3];
 int gyro_num_samples = 0;
 float gyro_offset[3] = {0, 0, 0}; // Store offsets for gyro calibration
 
-// DCM variables
-float MAG_Heading;
-float Accel_Vector[3]= {0, 0, 0}; // Store the acceleration in a vector
-float Gyro_Vector[3]= {0, 0, 0}; // Store the gyros turn rate in a vector
-float Omega_Vector[3]= {0, 0, 0}; // Corrected Gyro_Vector data
-float Omega_P[3]= {0, 0, 0}; // Omega Proportional correction
-float Omega_I[3]= {0, 0, 0}; // Omega Integrator
-float Omega[3]= {0, 0, 0};
-float errorRollPitch[3] = {0, 0, 0};
-float errorYaw[3] = {0, 0, 0};
-float DCM_Matrix[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
-float Update_Matrix[3][3] = {{0, 1, 2}, {3, 4, 5}, {6, 7, 8}};
-float Temporary_Matrix[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+// Fixed point sensor variables (see OUTPUT__FIXED_POINT)
+long accel_fixed[3]; // In g, Q16.16
+long accel_offset_fixed[3] = {0, 0, 0};
+long magnetom_fixed[3]; // Q16.16
+#if CALIBRATION__MAGN_USE_EXTENDED == true
+long magn_ellipsoid_center_q4[3]; // Computed from magn_ellipsoid_center on startup
+int magn_ellipsoid_transform_q12[3][3]; // Computed from magn_ellipsoid_transform on startup
+#endif
+int gyro_fixed[3];
+int gyro_offset_fixed[3] = {0, 0, 0};
+boolean dcm_needs_reset = false; // Set when the DCM was skipped for fixed point packets
+
+// Sensor fusion filter (see FUSION__FILTER and FusionFilter.h)
+float MAG_Heading; // Heading for the start-up orientation
+#if FUSION__FILTER == FUSION__MADGWICK
+MadgwickFilter fusion_filter(FUSION__MADGWICK_BETA);
+#elif FUSION__FILTER == FUSION__MAHONY
+MahonyFilter fusion_filter(FUSION__MAHONY_TWO_KP, FUSION__MAHONY_TWO_KI);
+#else
+DcmFilter fusion_filter(GRAVITY, Kp_ROLLPITCH, Ki_ROLLPITCH, Kp_YAW, Ki_YAW, !DEBUG__NO_DRIFT_CORRECTION);
+#endif
 
 // Euler angles
 float yaw;
@@ -79,20 +134,38 @@ float pitch;
 float roll;
 float euler_offset[3] = {0}; // [Yaw, pitch, roll]
 
-// DCM timing in the main loop
-unsigned long timestamp;
-unsigned long timestamp_old;
-float G_Dt; // Integration time for DCM algorithm
+// Sensor fusion timing in the main loop
+unsigned long timestamp; // Time the last sample was taken (millis())
+float G_Dt; // Integration time for the sensor fusion filter
+int fusion_data_interval = FUSION__DATA_INTERVAL; // Milliseconds between sensor ticks
 
 // More output-state variables
+TxQueue output_queue; // All output goes through here (see TxQueue.h)
 boolean output_stream_on;
 boolean output_single_on;
 int curr_calibration_sensor = 0;
 boolean reset_calibration_session_flag = true;
 int num_accel_errors = 0;
+int num_accel_overruns = 0; // Acquisitions that found the accelerometer FIFO full (see ACCEL__USE_FIFO)
 int num_magn_errors = 0;
 int num_gyro_errors = 0;
 int output_data_interval = OUTPUT__DATA_INTERVAL;
+byte output_decimation = 1; // Fusion samples per output frame (see update_output_decimation())
+byte samples_to_output = 0; // Fusion samples left until the next output frame
 boolean do_calibration = false; // Calibrate on next frame
+byte output_packet_sequence = 0; // Sequence number of the next binary packet
+byte output_packet_data[OUTPUT__BATCH_DATA_SIZE]; // Data of the binary packet being made
+byte output_batch_size = OUTPUT__BATCH_SIZE; // Samples per batch packet (1 to send every sample on its own)
+byte output_batch_count = 0; // Samples collected in output_packet_data for the next batch packet
+boolean output_timestamps = OUTPUT__TIMESTAMPS; // Start every binary sample with its acquisition time
+byte output_requests[OUTPUT__MAX_REQUESTS]; // Tags of the "#F<x>" requests not answered yet, the oldest first
+byte output_request_count = 0; // Number of tags in output_requests
+boolean output_tagged = false; // The current sample answers a "#F<x>" request (see take_output_request())
+byte output_tag; // The x of that request
+long baud_rate = OUTPUT__BAUD_RATE; // Baud rate of the serial port
+long baud_trial_fallback = 0; // Rate to go back to if the "#B<n>" rate is not confirmed; 0 if no rate is on trial
+unsigned long baud_trial_start; // Time the rate on trial was set (millis())
+int compact_values[9]; // Last values sent in DATA_MODE_COMPACT
+byte compact_packets_to_key = 0; // DATA_MODE_COMPACT packets left until the next keyframe
 
 #endif
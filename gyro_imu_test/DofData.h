@@ -28,6 +28,56 @@ struct EulerData {
   double yaw;
 };
 
+/**
+ * Fixed point version of DofData, for 9DoFs built with OUTPUT__FIXED_POINT.
+ * Accelerometer (in g) and magnetometer values are Q16.16 fixed point numbers
+ * (the value times 65536). Gyroscope values are the zeroed sensor readings;
+ * multiply them by DOF_GYRO_SCALE for the units used in DofData.
+ */
+struct DofDataFixed {
+  int32_t accelX;
+  int32_t accelY;
+  int32_t accelZ;
+  int32_t magX;
+  int32_t magY;
+  int32_t magZ;
+  int16_t gyroX;
+  int16_t gyroY;
+  int16_t gyroZ;
+};
+
+/**
+ * Fixed point version of EulerData. Angles are Q16.16 fixed point numbers
+ * (radians times 65536).
+ */
+struct EulerDataFixed {
+  int32_t roll;
+  int32_t pitch;
+  int32_t yaw;
+};
+
+/**
+ * Structure for orientation quaternion data (w, x, y, z), a unit quaternion that
+ * rotates the sensor frame into the earth frame.
+ */
+struct QuatData {
+  double w;
+  double x;
+  double y;
+  double z;
+};
+
+/**
+ * Fixed point version of QuatData. Components are Q1.15 fixed point numbers
+ * (the value times 32767).
+ */
+struct QuatDataFixed {
+  int16_t w;
+  int16_t x;
+  int16_t y;
+  int16_t z;
+};
+
 /**
  * Structure for Gyroscope angle data. Data has been scaled up 100 times.
  */
@@ -36,4 +86,18 @@ struct GyroData {
   char checkSum;
 };
 
+/**
+ * One decoded sample, as kept in a DofRing (see DofHandler::setSampleRing()).
+ * Which member of the union holds the values depends on the data mode.
+ */
+struct DofSample {
+  unsigned long time; // Acquisition time (micros(), see DofHandler::getSampleTime())
+  byte mode; // Data mode of the sample (without any flags)
+  union {
+    DofData data; // DOF_DATA_MODE_ALL, DOF_DATA_MODE_COMPACT and DOF_DATA_MODE_GYRO (gyroscope only)
+    EulerData euler; // DOF_DATA_MODE_EULER
+    QuatData quat; // DOF_DATA_MODE_QUATERNION
+  };
+};
+
 #endif
@@ -7,15 +7,548 @@
 
 #define DOF_DATA_DEFAULT_INTERVAL 35 // Default data interval
 #define DOF_DATA_DEFAULT_CONTINUOUS false
-#define DOF_DATA_SIZE 30 // Packet's max data size is 30
+#define DOF_DATA_SIZE 121 // Packet's max data size (a batch packet, see DOF_DATA_MODE_BATCH)
+#define DOF_MAGIC "9DoF" // Magic number at the start of every packet
+#define DOF_MAGIC_SIZE 4
+#define DOF_FRAME_VERSION 1 // Version of the packet framing understood by this DofHandler
+#define DOF_HEADER_SIZE 4 // Version, sequence number, data mode and data length
+#define DOF_CRC_SIZE 2 // CRC-16 (CCITT) of the header and data
+#define DOF_FRAME_OVERHEAD (DOF_MAGIC_SIZE + DOF_HEADER_SIZE + DOF_CRC_SIZE)
+// Bytes buffered from the stream between parses. Must hold at least one whole packet
+// (DOF_FRAME_OVERHEAD + DOF_DATA_SIZE).
+#define DOF_RX_BUFFER_SIZE 160
 #define DOF_GYRO_SCALE (0.00390625) // Factor to scale gyro data by (1 / 256)
 
+// The data structs a DofHandler decodes its last packet into, each only when it is asked for
+#define DOF_DECODED_DATA 0x01
+#define DOF_DECODED_EULER 0x02
+#define DOF_DECODED_GYRO 0x04
+#define DOF_DECODED_QUAT 0x08
+#define DOF_DECODED_ALL 0x0F
+
 #define DOF_DATA_MODE_ALL 0 // Send all sensor data (binary)
 #define DOF_DATA_MODE_GYRO 1 // Send Gyro data
 #define DOF_DATA_MODE_EULER 2 // Send "Euler" angles
+#define DOF_DATA_MODE_COMPACT 3 // Send all sensor data as 16 bit keyframes and 8 bit deltas
+#define DOF_DATA_MODE_QUATERNION 4 // Send the orientation quaternion
 #define DOF_DATA_MODE_DEFAULT DOF_DATA_MODE_ALL
+#define DOF_DATA_MODE_COUNT 5
+
+#define DOF_SENSOR_PROFILE_STANDARD 0 // All sensors at 50Hz, fusion every 20ms
+#define DOF_SENSOR_PROFILE_HIGH_RATE 1 // Gyro and accelerometer read every 2ms, magnetometer at 75Hz
+// Set in a packet's data mode when the 9DoF sends fixed point numbers instead of floats
+#define DOF_DATA_MODE_FIXED_POINT 0x80
+// Set in a packet's data mode when the packet carries a batch of samples (see DofFrame::getSample())
+#define DOF_DATA_MODE_BATCH 0x40
+// Set in a packet's data mode when the packet answers a tagged request (see DofHandler::requestDataTagged())
+#define DOF_DATA_MODE_TAGGED 0x20
+// Set in a packet's data mode when every sample starts with its acquisition time (see DofFrame::getTimestamp())
+#define DOF_DATA_MODE_TIMESTAMP 0x10
+// All of the flags above
+#define DOF_DATA_MODE_FLAGS (DOF_DATA_MODE_FIXED_POINT | DOF_DATA_MODE_BATCH | DOF_DATA_MODE_TAGGED | DOF_DATA_MODE_TIMESTAMP)
+// Data mode of the packets answering a clock request, which carry the 9DoF's clock (see DofHandler::syncClock())
+#define DOF_DATA_MODE_CLOCK 0x0F
+#define DOF_TIMESTAMP_SIZE 4 // Acquisition time (micros() on the 9DoF) in front of every sample
+#define DOF_CLOCK_SIZE 6 // Data of a clock packet: the request ID and the 9DoF's micros()
+#define DOF_MAX_REQUESTS 8 // Tagged requests the 9DoF holds on to, and so the most that can be in flight
+#define DOF_REQUEST_TIMEOUT 250 // Milliseconds after which an unanswered tagged request is given up on
+#define DOF_CLOCK_SYNC_INTERVAL 1000 // Milliseconds between clock requests once the clock is synced
+#define DOF_CLOCK_SETTLE_SYNCS 4 // Clock answers taken as they are, before the drift is estimated
+#define DOF_CLOCK_RTT_MARGIN 1000 // Microseconds a clock request may take above the quickest one to be used
+#define DOF_CLOCK_RTT_AGING 50 // Microseconds the quickest clock request time grows by per request
+#define DOF_CLOCK_OFFSET_GAIN 0.5 // Share of a clock answer's error that corrects the offset
+#define DOF_CLOCK_DRIFT_GAIN 0.0625 // Share of a clock answer's error rate that corrects the drift
+#define DOF_STATS_BINS 8 // Bins of the DofStats histograms
+#define DOF_STATS_FIRST_BIN 10 // The first histogram bin holds times below 2^this microseconds (1.024 ms)
+#define DOF_STATS_MAGIC "DoFS" // Magic number at the start of a DofHandler::writeStats() record
+#define DOF_STATS_VERSION 1 // Version of the writeStats() record format
+#define DOF_BAUD_RATE_COUNT 9 // Baud rates the 9DoF can be set to (see DOF_BAUD_RATES)
+#define DOF_BAUD_PROBE_SYNCHS 8 // Synch tokens ("#s<xy>") a baud rate is probed with
+#define DOF_BAUD_PROBE_FRAMES 4 // Tagged test frames a baud rate is probed with, after the synch tokens
+#define DOF_BAUD_MAX_ERRORS 1 // Lost or garbled answers a probed baud rate may have and still be kept
+#define DOF_BAUD_REPLY_TIMEOUT 20 // Milliseconds a text answer may take, on top of the time it takes to send
+#define DOF_BAUD_FRAME_TIMEOUT 100 // Milliseconds between test frame answers, on top of the fusion interval (if set)
+#define DOF_BAUD_SWITCH_TIME 20 // Milliseconds the 9DoF takes to change its baud rate once it has answered
+#define DOF_BAUD_TRIAL_TIME 1000 // Milliseconds the 9DoF tries a baud rate out for (OUTPUT__BAUD_TRIAL_TIME)
+#define DOF_BAUD_STARTUP_TIMEOUT 500 // Milliseconds negotiateBaudRate() waits for the 9DoF to answer at all
+#define DOF_FIXED_ONE 65536.0 // 1.0 as a Q16.16 fixed point number
+#define DOF_QUAT_ONE 32767.0 // 1.0 as a quaternion component (Q1.15 fixed point number)
+
+// Data sizes of the modes. DOF_DATA_MODE_COMPACT keyframes are 18 bytes,
+// its delta packets are DOF_COMPACT_DELTA_SIZE bytes.
+const byte DOF_DATA_MODE_SIZE[] = {30, 6, 12, 18, 8};
+// The DOF_DECODED_* structs that the modes have data for
+const byte DOF_DATA_MODE_DECODED[] = {DOF_DECODED_DATA | DOF_DECODED_GYRO, DOF_DECODED_DATA | DOF_DECODED_GYRO,
+  DOF_DECODED_EULER, DOF_DECODED_DATA | DOF_DECODED_GYRO, DOF_DECODED_QUAT};
+#define DOF_COMPACT_DELTA_SIZE 9
+#define DOF_COMPACT_VALUES 9 // Accelerometer, magnetometer and gyroscope X, Y and Z
+
+/**
+ * Updates a CRC-16 (CCITT: polynomial 0x1021, initial value 0xFFFF) with one more byte.
+ * This is the checksum the 9DoF appends to every packet.
+ */
+inline uint16_t dofCrc16Update(uint16_t crc, byte data) {
+  crc = (crc >> 8) | (crc << 8);
+  crc ^= data;
+  crc ^= (crc & 0xFF) >> 4;
+  crc ^= crc << 12;
+  crc ^= (crc & 0xFF) << 5;
+  return crc;
+}
+
+#ifdef __AVR__
+/**
+ * Updates a CRC-16 (see dofCrc16Update()) with length more bytes.
+ */
+inline uint16_t dofCrc16(uint16_t crc, const byte *data, byte length) {
+  while (length-- > 0) crc = dofCrc16Update(crc, *data++);
+  return crc;
+}
+#else
+// Off the AVR, memory is cheap enough for tables that take the CRC 4 bytes at a time: entry x
+// of row k is the CRC (from 0) of byte x followed by k zero bytes. The compiler generates them.
+constexpr uint16_t dofCrc16Step3(uint16_t crc) { return crc ^ ((crc & 0xFF) << 5); }
+constexpr uint16_t dofCrc16Step2(uint16_t crc) { return dofCrc16Step3(crc ^ (uint16_t)(crc << 12)); }
+constexpr uint16_t dofCrc16Byte(uint16_t x) { return dofCrc16Step2(x ^ ((x & 0xFF) >> 4)); }
+constexpr uint16_t dofCrc16Entry(byte k, uint16_t x) {
+  return k == 0 ? dofCrc16Byte(x) : (uint16_t)(dofCrc16Entry(k - 1, x) << 8) ^ dofCrc16Byte(dofCrc16Entry(k - 1, x) >> 8);
+}
+#define DOF_CRC_4(k, x) dofCrc16Entry(k, x), dofCrc16Entry(k, x + 1), dofCrc16Entry(k, x + 2), dofCrc16Entry(k, x + 3)
+#define DOF_CRC_16(k, x) DOF_CRC_4(k, x), DOF_CRC_4(k, x + 4), DOF_CRC_4(k, x + 8), DOF_CRC_4(k, x + 12)
+#define DOF_CRC_64(k, x) DOF_CRC_16(k, x), DOF_CRC_16(k, x + 16), DOF_CRC_16(k, x + 32), DOF_CRC_16(k, x + 48)
+#define DOF_CRC_ROW(k) {DOF_CRC_64(k, 0), DOF_CRC_64(k, 64), DOF_CRC_64(k, 128), DOF_CRC_64(k, 192)}
+
+static const uint16_t dofCrc16Table[4][256] = {DOF_CRC_ROW(0), DOF_CRC_ROW(1), DOF_CRC_ROW(2), DOF_CRC_ROW(3)};
+
+inline uint16_t dofCrc16(uint16_t crc, const byte *data, byte length) {
+  for (; length >= 4; length -= 4, data += 4) {
+    crc = dofCrc16Table[3][(crc >> 8) ^ data[0]] ^ dofCrc16Table[2][(crc & 0xFF) ^ data[1]]
+      ^ dofCrc16Table[1][data[2]] ^ dofCrc16Table[0][data[3]];
+  }
+  if (length >= 2) {
+    crc = dofCrc16Table[1][(crc >> 8) ^ data[0]] ^ dofCrc16Table[0][(crc & 0xFF) ^ data[1]];
+    length -= 2;
+    data += 2;
+  }
+  if (length > 0) crc = dofCrc16Update(crc, *data);
+  return crc;
+}
+#endif
+
+/**
+ * A lightweight view of a packet's data, pointing straight into the buffer it was received in.
+ * Nothing is decoded up front; each field is decoded when it is accessed, so a consumer that
+ * only wants the gyroscope out of a DOF_DATA_MODE_ALL packet never pays for the rest.
+ * 
+ * DOF_DATA_MODE_COMPACT frames always view a whole keyframe; the DofHandler applies delta
+ * packets to the previous values before handing out a frame.
+ * 
+ * Packets sent by a 9DoF built with OUTPUT__FIXED_POINT carry fixed point numbers instead of
+ * floats (see isFixedPoint()). The double accessors work for both kinds of packet; the *Fixed
+ * accessors decode fixed point packets without any floating point math.
+ * 
+ * A batch packet (see DofHandler::setBatchSize()) carries several samples of the same data mode.
+ * Its frame's accessors decode the newest sample; getSample() views each of them.
+ * 
+ * With timestamps turned on (see DofHandler::setTimestamps()), every sample carries the time it
+ * was acquired at, on the 9DoF's clock (see getTimestamp() and DofHandler::toLocalTime()).
+ * 
+ * A DofFrame is only valid until the next call into the DofHandler that produced it.
+ * Accessing a field that the frame's data mode does not carry returns 0.
+ */
+class DofFrame {
+  public:
+    /**
+     * @param mode the data mode byte of the packet (may include DOF_DATA_MODE_FIXED_POINT,
+     *   DOF_DATA_MODE_BATCH and DOF_DATA_MODE_TIMESTAMP)
+     * @param data the packet's data
+     */
+    DofFrame(byte mode, const byte *data)
+      : mode(mode & ~DOF_DATA_MODE_FLAGS),
+        fixed(mode & DOF_DATA_MODE_FIXED_POINT),
+        timed(mode & DOF_DATA_MODE_TIMESTAMP),
+        count((mode & DOF_DATA_MODE_BATCH) ? data[0] : 1),
+        samples((mode & DOF_DATA_MODE_BATCH) ? data + 1 : data),
+        data(samples + ((mode & DOF_DATA_MODE_BATCH) ? (count - 1) * getSampleSize() : 0)
+          + (timed ? DOF_TIMESTAMP_SIZE : 0)) {}
+    
+    /**
+     * Returns the data mode of the packet this frame views.
+     */
+    byte getMode() const { return mode; }
+    
+    /**
+     * Returns true if the packet carries fixed point numbers rather than floats.
+     */
+    boolean isFixedPoint() const { return fixed; }
+    
+    /**
+     * Returns true if the samples carry their acquisition time.
+     */
+    boolean hasTimestamp() const { return timed; }
+    
+    /**
+     * Returns the time the (newest) sample was acquired at, in microseconds on the 9DoF's clock,
+     * or 0 if the packet carries no timestamps. DofHandler::toLocalTime() converts it to micros().
+     */
+    uint32_t getTimestamp() const { return timed ? (uint32_t)readLong(data - DOF_TIMESTAMP_SIZE) : 0; }
+    
+    /**
+     * Returns the number of samples in the packet (1 unless it is a batch packet).
+     */
+    byte getSampleCount() const { return count; }
+    
+    /**
+     * Returns a view of one sample of the packet, the oldest first.
+     * 
+     * @param index the sample, from 0 to getSampleCount() - 1
+     */
+    DofFrame getSample(byte index) const {
+      byte flags = (fixed ? DOF_DATA_MODE_FIXED_POINT : 0) | (timed ? DOF_DATA_MODE_TIMESTAMP : 0);
+      return DofFrame(mode | flags, samples + index * getSampleSize());
+    }
+    
+    double getAccelX() const { return readSensor(0); }
+    double getAccelY() const { return readSensor(1); }
+    double getAccelZ() const { return readSensor(2); }
+    double getMagX() const { return readSensor(3); }
+    double getMagY() const { return readSensor(4); }
+    double getMagZ() const { return readSensor(5); }
+    double getGyroX() const { return readGyro(0) * DOF_GYRO_SCALE; }
+    double getGyroY() const { return readGyro(1) * DOF_GYRO_SCALE; }
+    double getGyroZ() const { return readGyro(2) * DOF_GYRO_SCALE; }
+    double getRoll() const { return readEuler(0); }
+    double getPitch() const { return readEuler(4); }
+    double getYaw() const { return readEuler(8); }
+    double getQuatW() const { return readQuat(0) / DOF_QUAT_ONE; }
+    double getQuatX() const { return readQuat(1) / DOF_QUAT_ONE; }
+    double getQuatY() const { return readQuat(2) / DOF_QUAT_ONE; }
+    double getQuatZ() const { return readQuat(3) / DOF_QUAT_ONE; }
+    
+    /**
+     * Returns true if the frame carries accelerometer and magnetometer data.
+     */
+    boolean hasSensorData() const { return mode == DOF_DATA_MODE_ALL || mode == DOF_DATA_MODE_COMPACT; }
+    
+    /**
+     * Returns true if the frame carries gyroscope data.
+     */
+    boolean hasGyroData() const { return hasSensorData() || mode == DOF_DATA_MODE_GYRO; }
+    
+    /**
+     * Decodes every field of a DOF_DATA_MODE_ALL, DOF_DATA_MODE_GYRO or DOF_DATA_MODE_COMPACT
+     * frame into out. Fields the frame does not carry are left untouched.
+     */
+    void getData(DofData &out) const {
+      if (hasSensorData()) {
+        out.accelX = getAccelX(); out.accelY = getAccelY(); out.accelZ = getAccelZ();
+        out.magX = getMagX(); out.magY = getMagY(); out.magZ = getMagZ();
+      }
+      if (hasGyroData()) {
+        out.gyroX = getGyroX(); out.gyroY = getGyroY(); out.gyroZ = getGyroZ();
+      }
+    }
+    
+    /**
+     * Decodes every field of a DOF_DATA_MODE_ALL, DOF_DATA_MODE_GYRO or DOF_DATA_MODE_COMPACT
+     * frame into out, as fixed point numbers. Fields the frame does not carry are left untouched.
+     * Only float packets need floating point math to be decoded this way.
+     */
+    void getDataFixed(DofDataFixed &out) const {
+      if (hasSensorData()) {
+        out.accelX = readSensorFixed(0); out.accelY = readSensorFixed(1); out.accelZ = readSensorFixed(2);
+        out.magX = readSensorFixed(3); out.magY = readSensorFixed(4); out.magZ = readSensorFixed(5);
+      }
+      if (hasGyroData()) {
+        out.gyroX = readGyro(0); out.gyroY = readGyro(1); out.gyroZ = readGyro(2);
+      }
+    }
+    
+    /**
+     * Decodes a DOF_DATA_MODE_EULER frame into out. Does nothing for other modes.
+     */
+    void getEulerData(EulerData &out) const {
+      if (mode == DOF_DATA_MODE_EULER) {
+        out.roll = getRoll(); out.pitch = getPitch(); out.yaw = getYaw();
+      }
+    }
+    
+    /**
+     * Decodes a DOF_DATA_MODE_EULER frame into out, as fixed point numbers.
+     * Does nothing for other modes.
+     */
+    void getEulerDataFixed(EulerDataFixed &out) const {
+      if (mode == DOF_DATA_MODE_EULER) {
+        out.roll = readEulerFixed(0); out.pitch = readEulerFixed(4); out.yaw = readEulerFixed(8);
+      }
+    }
+    
+    /**
+     * Decodes a DOF_DATA_MODE_QUATERNION frame into out. Does nothing for other modes.
+     */
+    void getQuatData(QuatData &out) const {
+      if (mode == DOF_DATA_MODE_QUATERNION) {
+        out.w = getQuatW(); out.x = getQuatX(); out.y = getQuatY(); out.z = getQuatZ();
+      }
+    }
+    
+    /**
+     * Decodes a DOF_DATA_MODE_QUATERNION frame into out, as fixed point numbers.
+     * Does nothing for other modes. Quaternion packets are always fixed point, so this
+     * does no math at all.
+     */
+    void getQuatDataFixed(QuatDataFixed &out) const {
+      if (mode == DOF_DATA_MODE_QUATERNION) {
+        out.w = readQuat(0); out.x = readQuat(1); out.y = readQuat(2); out.z = readQuat(3);
+      }
+    }
+    
+    /**
+     * Decodes the gyroscope of a DOF_DATA_MODE_ALL, DOF_DATA_MODE_GYRO or DOF_DATA_MODE_COMPACT
+     * frame into out (scaled up 100 times). Does nothing for other modes.
+     */
+    void getGyroData(GyroData &out) const {
+      if (hasGyroData()) {
+        // Same as readGyro() * DOF_GYRO_SCALE * 100, without the floating point math
+        out.x = (int32_t)readGyro(0) * 100 / 256;
+        out.y = (int32_t)readGyro(1) * 100 / 256;
+        out.z = (int32_t)readGyro(2) * 100 / 256;
+        out.checkSum = (out.x + out.y + out.z) % 10;
+      }
+    }
+    
+    /**
+     * Decodes a 4 byte, big endian float sent by the 9DoF (an AVR double is a float).
+     */
+    static double readFloat(const byte *in) {
+      // Go through a fixed width float to also decode correctly on hosts
+      // where long and double are 8 bytes wide.
+      uint32_t val = readLong(in);
+      float f;
+      memcpy(&f, &val, sizeof(f));
+      return f;
+    }
+    
+    /**
+     * Decodes a 4 byte, big endian long sent by the 9DoF.
+     */
+    static int32_t readLong(const byte *in) {
+      // Undo the shifting done on the 9DoF
+      uint32_t val = 0;
+      val |= in[0]; val <<= 8;
+      val |= in[1]; val <<= 8;
+      val |= in[2]; val <<= 8;
+      val |= in[3];
+      return val;
+    }
+    
+    /**
+     * Decodes a 2 byte, big endian short sent by the 9DoF.
+     */
+    static int16_t readShort(const byte *in) {
+      int16_t val = 0;
+      val |= in[0]; val <<= 8;
+      val |= in[1];
+      return val;
+    }
+  
+  private:
+    // Bytes per sample, including its timestamp
+    byte getSampleSize() const { return DOF_DATA_MODE_SIZE[mode] + (timed ? DOF_TIMESTAMP_SIZE : 0); }
+    
+    // Decodes a float or Q16.16 number as a double
+    double readNumber(const byte *in) const
+      { return fixed ? readLong(in) / DOF_FIXED_ONE : readFloat(in); }
+    // Decodes a float or Q16.16 number as a Q16.16 number
+    int32_t readNumberFixed(const byte *in) const
+      { return fixed ? readLong(in) : (int32_t)(readFloat(in) * DOF_FIXED_ONE); }
+    
+    // Index 0 to 2 are the accelerometer X, Y and Z, index 3 to 5 the magnetometer X, Y and Z.
+    // Compact accelerometer values are in 1/256 g, compact magnetometer values are whole units.
+    double readSensor(byte index) const {
+      if (mode == DOF_DATA_MODE_ALL) return readNumber(data + index * 4);
+      if (mode == DOF_DATA_MODE_COMPACT) return readShort(data + index * 2) / (index < 3 ? 256.0 : 1.0);
+      return 0;
+    }
+    int32_t readSensorFixed(byte index) const {
+      if (mode == DOF_DATA_MODE_ALL) return readNumberFixed(data + index * 4);
+      if (mode == DOF_DATA_MODE_COMPACT) return (int32_t)readShort(data + index * 2) * (index < 3 ? 256 : 65536L);
+      return 0;
+    }
+    double readEuler(byte offset) const
+      { return mode == DOF_DATA_MODE_EULER ? readNumber(data + offset) : 0; }
+    int32_t readEulerFixed(byte offset) const
+      { return mode == DOF_DATA_MODE_EULER ? readNumberFixed(data + offset) : 0; }
+    // Index 0 to 3 are the quaternion W, X, Y and Z
+    int16_t readQuat(byte index) const
+      { return mode == DOF_DATA_MODE_QUATERNION ? readShort(data + index * 2) : 0; }
+    // Index 0 to 2 are the gyroscope X, Y and Z
+    int16_t readGyro(byte index) const {
+      if (mode == DOF_DATA_MODE_ALL) return readShort(data + 24 + index * 2);
+      if (mode == DOF_DATA_MODE_GYRO) return readShort(data + index * 2);
+      if (mode == DOF_DATA_MODE_COMPACT) return readShort(data + 12 + index * 2);
+      return 0;
+    }
+    
+    byte mode;
+    boolean fixed;
+    boolean timed; // Every sample starts with its timestamp
+    byte count; // Samples in the packet
+    const byte *samples; // First sample
+    const byte *data; // Newest sample (after its timestamp)
+};
+
+/**
+ * Link statistics kept by a DofHandler (see DofHandler::getStats()). Counting is only a few
+ * additions per packet, so the statistics are always kept.
+ * 
+ * The histograms count times in microseconds on a log2 scale: bin 0 holds times below
+ * 2^DOF_STATS_FIRST_BIN us (about 1 ms), bin i times from 2^(DOF_STATS_FIRST_BIN + i - 1) up to
+ * twice that, and the last bin everything above.
+ */
+struct DofStats {
+  uint32_t goodPackets; // Packets received and decoded
+  uint32_t badPackets; // Packets with a bad checksum, and packets that could not be decoded
+  uint32_t lostPackets; // Packets missing from the sequence numbers of the received packets
+  uint32_t resyncs; // Number of times bytes had to be skipped to find the next packet
+  uint32_t bytesDiscarded; // Bytes skipped while looking for packets
+  uint32_t lostRequests; // Tagged requests that were never answered
+  uint32_t maxInterval; // Longest time between two good packets (micros)
+  uint32_t maxLatency; // Longest time a tagged request took to be answered (micros)
+  uint32_t intervalHistogram[DOF_STATS_BINS]; // Time between good packets
+  uint32_t latencyHistogram[DOF_STATS_BINS]; // Time tagged requests took to be answered
+};
+
+// Baud rates the 9DoF can be set to, slowest first. The ID of a rate in the "#b<n>" and "#B<n>"
+// commands is its index plus 1.
+const long DOF_BAUD_RATES[DOF_BAUD_RATE_COUNT] = {2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600, 115200};
+
+// Keeps the compiler from moving memory accesses across it. The DofRing indices are single
+// bytes, which 8 bit AVRs (and single core ARMs) read and write atomically, so this is all the
+// ordering a DofRing shared with an interrupt needs.
+#define DOF_MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/**
+ * A single producer, single consumer ring of decoded samples, which a DofHandler fills as
+ * packets come in (see DofHandler::setSampleRing()). Bursts of samples are held until the
+ * application gets to them, and recent samples can be looked back on in place.
+ * 
+ * The producer only ever moves the head and the consumer only the tail, so one of them may
+ * run in an interrupt without either turning interrupts off. A sample that does not fit is
+ * dropped (see getDropped()) rather than overwriting one, so a sample stays put until the
+ * consumer lets go of it.
+ * 
+ * The storage comes with DofRingBuffer, which is templated on the capacity.
+ */
+class DofRing {
+  public:
+    // Consumer side
+    
+    /**
+     * Returns the number of samples in the ring.
+     */
+    byte available() const { return (byte)(head - tail); }
+    
+    /**
+     * Returns a sample in the ring, without copying it, or NULL if there are not that many.
+     * It stays valid until it is popped or discarded.
+     * 
+     * @param index 0 for the oldest sample, 1 for the one after it, and so on
+     */
+    const DofSample *peek(byte index = 0) const
+      { return index < available() ? &buffer[(byte)(tail + index) & mask] : NULL; }
+    
+    /**
+     * Same as peek(), counting back from the newest sample.
+     * 
+     * @param back 0 for the newest sample, 1 for the one before it, and so on
+     */
+    const DofSample *peekNewest(byte back = 0) const
+      { return back < available() ? &buffer[(byte)(head - 1 - back) & mask] : NULL; }
+    
+    /**
+     * Takes the oldest sample out of the ring.
+     * 
+     * @return false if the ring is empty
+     */
+    boolean pop(DofSample &out) {
+      if (available() == 0) return false;
+      out = buffer[tail & mask];
+      DOF_MEMORY_BARRIER();
+      tail++;
+      return true;
+    }
+    
+    /**
+     * Drops the oldest samples, without copying them. Keep the last few samples around for
+     * peekNewest() with discard(available() - n).
+     * 
+     * @param count number of samples to drop (at most all of them)
+     */
+    void discard(byte count = 1) {
+      byte n = available();
+      DOF_MEMORY_BARRIER();
+      tail += (count < n) ? count : n;
+    }
+    
+    /**
+     * Returns the number of samples dropped because the ring was full.
+     */
+    unsigned int getDropped() const { return dropped; }
+    
+    // Producer side
+    
+    /**
+     * Returns the slot for the next sample, to be filled in place and then published with
+     * commit(), or NULL if the ring is full (the sample is then counted as dropped).
+     */
+    DofSample *reserve() {
+      if ((byte)(head - tail) > mask) {
+        dropped++;
+        return NULL;
+      }
+      return &buffer[head & mask];
+    }
+    
+    /**
+     * Publishes the sample filled in since reserve().
+     */
+    void commit() {
+      DOF_MEMORY_BARRIER();
+      head++;
+    }
+  
+  protected:
+    DofRing(DofSample *buffer, byte capacity)
+      : buffer(buffer), mask(capacity - 1), head(0), tail(0), dropped(0) {}
+  
+  private:
+    DofSample *buffer;
+    byte mask; // Capacity - 1
+    volatile byte head; // Count of samples pushed (wraps at 256)
+    volatile byte tail; // Count of samples taken out (wraps at 256)
+    volatile unsigned int dropped;
+};
+
+/**
+ * A DofRing holding up to Capacity samples (a power of 2, at most 128).
+ * Each sample takes sizeof(DofSample) (41 bytes on the Arduino).
+ */
+template <byte Capacity> class DofRingBuffer : public DofRing {
+  public:
+    DofRingBuffer() : DofRing(storage, Capacity) {}
+  
+  private:
+    static_assert(Capacity > 0 && Capacity <= 128 && (Capacity & (Capacity - 1)) == 0,
+      "DofRingBuffer capacity must be a power of 2, at most 128");
+    DofSample storage[Capacity];
+};
 
-const byte DOF_DATA_MODE_SIZE[] = {30, 6, 12};
+/**
+ * Function called by a DofHandler when a good packet is received (once for a whole batch
+ * packet). See DofHandler::onFrame().
+ */
+typedef void (*DofFrameHandler)(const DofFrame &frame);
 
 /**
  * DofHandler is designed to handle communications between a 9Degrees of Freedom board
@@ -34,18 +567,21 @@ template <class StreamType> class DofHandler {
      * @param dofStream Pointer to the Stream used for communication with the 9DoF
      * @param baud Baud rate that the stream was opened at, if it was at all. Optional.
      */
-    DofHandler(StreamType *dofStream, int baud = 0);
+    DofHandler(StreamType *dofStream, long baud = 0);
     
     /**
      * Begins connection with the 9DoF. Does nothing if the stream has already been opened.
      * 
      * If changing the baud rate to something other than the inital rate, pass that in as well.
-     * Warning: this method will block for approximately 210 milliseconds if finalBaud is passed.
+     * A faster rate is negotiated (see negotiateBaudRate()), so the connection ends up at the
+     * fastest rate up to finalBaud that works; a slower one is set with setBaudRate().
+     * Warning: this method will block while the baud rate is changed (usually for a few
+     * hundred milliseconds, more than a second if a rate has to be fallen back from).
      * 
      * @param initialBaud The baud rate to first create the connection at.
      * @param baud If changing the baud rate, pass in the new baud rate here. Optional.
      */
-    void begin(int initialBaud, int finalBaud = 0);
+    void begin(long initialBaud, long finalBaud = 0);
     
     /**
      * Closes the stream's connections (calls end() on the stream).
@@ -59,10 +595,12 @@ template <class StreamType> class DofHandler {
      *
      * @param baud the baud rate that the stream is set to.
      */
-    void markOpen(int baud);
+    void markOpen(long baud);
     
     /**
      * Runs the code to check incoming stream data. Run this in the loop() function.
+     * Every byte available in the stream is moved into an internal buffer, and at most
+     * one packet is parsed out of that buffer per call.
      * 
      * @param loop Optional. If true, will loop through the check code until either a packet is found,
      *   or there are no more bytes available in the stream.
@@ -80,6 +618,43 @@ template <class StreamType> class DofHandler {
      */
     boolean checkStreamValid(boolean loop = false);
     
+    /**
+     * Turns interrupt mode on or off. In interrupt mode, the stream is parsed by
+     * serviceInterrupt(), called from an interrupt, so no packet is lost however long loop()
+     * takes; checkStream() then only keeps the clock synced and reports new data.
+     * 
+     * The samples are best taken from a sample ring (see setSampleRing()), which is safe to
+     * use while the interrupt fills it. Anything else the interrupt writes (getData(),
+     * getFrame(), getStats() and so on) should be read between lock() and unlock().
+     * 
+     * @param enable true for interrupt mode
+     */
+    void setInterruptMode(boolean enable) { interruptMode = enable; }
+    
+    /**
+     * Parses everything received so far, into the sample ring and the frame handler (see
+     * onFrame(), which is then called from the interrupt too). Call it only from an interrupt
+     * that comes at least as often as the stream's receive buffer fills up (64 bytes take
+     * 5.5 milliseconds at 115200 baud), such as a timer interrupt. Interrupts are turned back
+     * on while it parses, so the serial port's own receive interrupt is not held up.
+     * 
+     * Does nothing outside of interrupt mode, or while the DofHandler is locked.
+     */
+    void serviceInterrupt();
+    
+    /**
+     * Keeps serviceInterrupt() from running until unlock(), so what it writes can be read
+     * in one piece. The bytes that come in meanwhile wait in the stream's receive buffer, so
+     * keep it short. Calls nest. The calls that send commands or requests lock by themselves,
+     * so a frame handler that sends one from the interrupt cannot split theirs on the wire.
+     */
+    void lock() { locks++; }
+    
+    /**
+     * Lets serviceInterrupt() run again, see lock().
+     */
+    void unlock() { locks--; }
+    
     /**
      * If there is a character available to be read from the 9DoF stream, this echos that character.
      * 
@@ -92,16 +667,45 @@ template <class StreamType> class DofHandler {
      * 
      * @return the baud rate being used by the stream
      */
-    int getBaudRate() { return baudRate; }
+    long getBaudRate() { return baudRate; }
     
     /**
-     * Sets the baud rate of the connection. By default, it also (attempts) to tell the 9DoF to change
-     * its baud rate as well. This method may block for up to approximately 110 milliseconds.
+     * Sets the baud rate of the connection. By default, the 9DoF is told to change its baud rate
+     * as well, on trial: the link is probed at the new rate (see negotiateBaudRate()), and if it
+     * does not hold up, both ends go back to the old rate. This method blocks while the link is
+     * probed, and for about DOF_BAUD_TRIAL_TIME more if it has to fall back.
      * 
-     * @param newBaud The baud rate to change to.
+     * @param newBaud The baud rate to change to (one of DOF_BAUD_RATES).
      * @param internal Optional. If true, the 9DoF will not be told to change its baud rate as well. Defaults to false.
+     * 
+     * @return true if the baud rate was changed
+     */
+    boolean setBaudRate(long newBaud, boolean internal = false);
+    
+    /**
+     * Steps the baud rate up through DOF_BAUD_RATES, as far as the link holds up. Every rate is
+     * probed with DOF_BAUD_PROBE_SYNCHS synch tokens, one after the other, and a burst of
+     * DOF_BAUD_PROBE_FRAMES tagged test frames; it is kept if no more than DOF_BAUD_MAX_ERRORS of
+     * the answers are lost or garbled. The first rate that fails is fallen back from (the 9DoF
+     * does so by itself, as the new rate is only on trial), and the connection stays at the last
+     * good one. Tagged requests in flight are given up on.
+     * 
+     * Best called before continuous output is turned on. Blocks while it runs.
+     * 
+     * @param maxBaud Optional. The fastest rate to try. Defaults to the fastest there is.
+     * 
+     * @return the baud rate the connection settled on, or 0 if the 9DoF did not answer
+     *   reliably at the rate it started at (which is then kept)
+     */
+    long negotiateBaudRate(long maxBaud = DOF_BAUD_RATES[DOF_BAUD_RATE_COUNT - 1]);
+    
+    /**
+     * Gets the share of answers that were lost or garbled the last time the link was probed
+     * (see negotiateBaudRate()).
+     * 
+     * @return the error rate, from 0 to 1
      */
-    void setBaudRate(int newBaud, boolean internal = false);
+    float getLinkErrorRate() { return linkErrorRate; }
     
     /**
      * Gets the update interval as known by the DofHandler
@@ -117,6 +721,30 @@ template <class StreamType> class DofHandler {
      */
     void setUpdateInterval(short interval);
     
+    /**
+     * Gets the sensor fusion interval as known by the DofHandler
+     *
+     * @return the known fusion interval
+     */
+    short getFusionInterval() { return fusionInterval; }
+    
+    /**
+     * Tells the 9DoF to change the interval it reads its sensors and runs its fusion filter at.
+     * The update interval is rounded to a multiple of it.
+     * 
+     * @param interval The new fusion interval in milliseconds (1 to 250).
+     */
+    void setFusionInterval(short interval);
+    
+    /**
+     * Tells the 9DoF to switch its sensors to another output data rate profile.
+     * This also sets its fusion interval (20ms for DOF_SENSOR_PROFILE_STANDARD, 2ms for
+     * DOF_SENSOR_PROFILE_HIGH_RATE).
+     * 
+     * @param profile DOF_SENSOR_PROFILE_STANDARD or DOF_SENSOR_PROFILE_HIGH_RATE.
+     */
+    void setSensorProfile(byte profile);
+    
     /**
      * Returns true if the 9DoF is sending data continuously,
      * every update interval
@@ -133,7 +761,8 @@ template <class StreamType> class DofHandler {
     /**
      * Sets the data mode that is sent by the 9DoF.
      * See the DofHandler class documentation for details on
-     * the different modes.
+     * the different modes. Packets already on their way in are still
+     * received; each packet is decoded by the data mode in its header.
      */
     void setDataMode(byte mode, boolean force = false);
     
@@ -155,6 +784,17 @@ template <class StreamType> class DofHandler {
      */
     void zeroCalibrate();
     
+    /**
+     * Tells the 9DoF how many samples to send per packet. Batches of samples save framing
+     * overhead, and the frame handler is called once per batch. DOF_DATA_MODE_COMPACT is never
+     * batched, and a batch holds at most DOF_DATA_SIZE - 1 bytes of samples (4 samples of
+     * DOF_DATA_MODE_ALL, 10 of DOF_DATA_MODE_EULER, 15 of DOF_DATA_MODE_QUATERNION and
+     * 20 of DOF_DATA_MODE_GYRO); the 9DoF sends fuller batches in smaller packets.
+     * 
+     * @param size Samples per packet, 1 to send every sample on its own.
+     */
+    void setBatchSize(byte size);
+    
     /**
      * Requests a single data frame from the 9DoF.
      */
@@ -167,95 +807,370 @@ template <class StreamType> class DofHandler {
     void requestData(byte mode);
     
     /**
-     * Gets the most recent sensor data. Clears the newData flag.
-     *
-     * @return the most recent sensor data.
+     * Requests a single data frame from the 9DoF, tagged so that its answer can be matched to it.
+     * The 9DoF holds on to up to DOF_MAX_REQUESTS tagged requests and answers the oldest one at
+     * every sensor fusion step, so unlike requestData(), more requests can be sent before the
+     * first one is answered. The answer's latency is then available from getRequestLatency().
+     * 
+     * @return the tag of the request
      */
-    DofData getData() { newData = false; return data; }
+    byte requestDataTagged();
     
     /**
-     * Gets the most recent euler angles data (yaw, pitch, roll). Clears the newData flag.
-     *
-     * @return the most recent euler angle data
+     * Sends tagged requests (see requestDataTagged()) until the pipeline depth is in flight.
+     * Call this in the loop() function to get every sample the 9DoF produces without a
+     * continuous stream: while one answer is on its way, the next requests are already waiting
+     * on the 9DoF. Requests that are not answered within DOF_REQUEST_TIMEOUT milliseconds are
+     * given up on (see getLostRequests()).
+     * 
+     * @return the number of requests sent
      */
-    EulerData getEulerData() { newData = false; return eulerData; }
+    byte requestDataPipelined();
     
     /**
-     * Gets the most recent gyroscope data. Clears the newData flag.
-     *
-     * @return the most recent gyroscope data
+     * Sets how many tagged requests requestDataPipelined() keeps in flight.
+     * 
+     * @param depth Requests in flight, 1 to DOF_MAX_REQUESTS. Defaults to 1.
      */
-    GyroData getGyroData() { newData = false; return gyroData; }
+    void setPipelineDepth(byte depth) { pipelineDepth = constrain(depth, 1, DOF_MAX_REQUESTS); }
     
     /**
-     * Returns the newData flag. This is true when any packet (good or bad)
-     * has been received. Resets when a get*Data method is called,
-     * clearNewDataFlag() is called, or when true is passed into this method.
-     *
-     * @param clear clears the newData flag after returning the flag's state.
-     *
-     * @return the new data flag
+     * Returns the number of tagged requests that have not been answered yet.
      */
-    boolean isNewDataAvailable(boolean clear = false)
-      { if (newData) { newData = !clear; return true ;} return false; }
+    byte getRequestsInFlight() { return requestCount; }
     
     /**
-     * Clears the newData flag.
+     * Returns the tag of the last answered tagged request.
      */
-    void clearNewDataFlag() { newData = false; }
+    byte getLastRequestTag() { return lastRequestTag; }
     
     /**
-     * Gets the age (in milliseconds) of the last good data frame.
-     *
-     * @return the age of the most recently received data
+     * Returns the time (in microseconds) between sending the last answered tagged request and
+     * receiving its answer.
      */
-    unsigned long getDataAge() { return millis() - dataTime; }
+    unsigned long getRequestLatency() { return requestLatency; }
     
     /**
-     * Returns true if the last received packet was valid; false otherwise.
+     * Returns the number of tagged requests that were never answered: their answer was lost,
+     * or did not come in within DOF_REQUEST_TIMEOUT milliseconds.
+     */
+    unsigned long getLostRequests() { return stats.lostRequests; }
+    
+    /**
+     * Gets the link statistics collected since the DofHandler was made or resetStats() was called.
      *
-     * @return true if the last packet was valid and well formed, false otherwise
+     * @return the link statistics
      */
-    boolean isPacketGood() { return lastPacketGood; }
+    const DofStats &getStats() { return stats; }
     
     /**
-     * Prints out the sensor data to the passed in stream.
+     * Clears the link statistics.
      */
-    void printData(Stream &out);
-  
-  private:
-    StreamType *stream;
-    boolean open; // Has stream->begin been called?
-    int baudRate; // Baud rate of stream
+    void resetStats() { memset(&stats, 0, sizeof(stats)); statsSequenceValid = false; }
     
-    // Converts the baud rate to an ID used to configure baud of 9DoF remotely.
-    int baudRateToId(int rate);
-    boolean _checkStream(); // Private version of checkStream(boolean).
-    void readPacket(); // Reads the packet data stored in the buffer
+    /**
+     * Writes the link statistics to the passed in stream as a compact binary record, to be
+     * logged and compared over time. The record is "DoFS" (DOF_STATS_MAGIC), the format version
+     * (DOF_STATS_VERSION), the fields of DofStats in order as 4 byte big endian numbers, and the
+     * CRC-16 (CCITT, see dofCrc16Update()) of the version and fields, MSB first.
+     */
+    void writeStats(Stream &out);
+    
+    /**
+     * Gets the most recent sensor data. Clears the newData flag.
+     * Packets are only decoded the first time they are asked for, and only into the struct asked for.
+     *
+     * @return the most recent sensor data.
+     */
+    DofData getData() { newData = false; if (startDecoding(DOF_DECODED_DATA)) DofFrame(packetMode, packetData).getData(data); return data; }
+    
+    /**
+     * Gets the most recent euler angles data (yaw, pitch, roll). Clears the newData flag.
+     *
+     * @return the most recent euler angle data
+     */
+    EulerData getEulerData() { newData = false; if (startDecoding(DOF_DECODED_EULER)) DofFrame(packetMode, packetData).getEulerData(eulerData); return eulerData; }
+    
+    /**
+     * Gets the most recent gyroscope data. Clears the newData flag.
+     *
+     * @return the most recent gyroscope data
+     */
+    GyroData getGyroData() { newData = false; if (startDecoding(DOF_DECODED_GYRO)) DofFrame(packetMode, packetData).getGyroData(gyroData); return gyroData; }
+    
+    /**
+     * Gets the most recent orientation quaternion. Clears the newData flag.
+     *
+     * @return the most recent quaternion data
+     */
+    QuatData getQuatData() { newData = false; if (startDecoding(DOF_DECODED_QUAT)) DofFrame(packetMode, packetData).getQuatData(quatData); return quatData; }
+    
+    /**
+     * Gets the most recent sensor data as fixed point numbers (see DofDataFixed).
+     * Clears the newData flag. If the 9DoF sends fixed point packets, no floating point
+     * math is done.
+     *
+     * @return the most recent sensor data.
+     */
+    DofDataFixed getDataFixed() { newData = false; decodePacketFixed(); return dataFixed; }
+    
+    /**
+     * Gets the most recent euler angles as fixed point numbers (see EulerDataFixed).
+     * Clears the newData flag. If the 9DoF sends fixed point packets, no floating point
+     * math is done.
+     *
+     * @return the most recent euler angle data
+     */
+    EulerDataFixed getEulerDataFixed() { newData = false; decodePacketFixed(); return eulerDataFixed; }
+    
+    /**
+     * Gets the most recent orientation quaternion as fixed point numbers (see QuatDataFixed).
+     * Clears the newData flag. No floating point math is done.
+     *
+     * @return the most recent quaternion data
+     */
+    QuatDataFixed getQuatDataFixed() { newData = false; decodePacketFixed(); return quatDataFixed; }
+    
+    /**
+     * Gets a view of the most recent good packet, without decoding or copying it.
+     * Clears the newData flag. The frame is valid until the handler next reads the stream.
+     * Before the first good packet, it is a frame of the default data mode with every value 0.
+     *
+     * @return a view of the most recent good packet
+     */
+    DofFrame getFrame() { newData = false; return DofFrame(packetMode, packetData); }
+    
+    /**
+     * Returns the number of samples in the most recent good packet (1 unless it was a batch packet).
+     */
+    byte getBatchSize() { return DofFrame(packetMode, packetData).getSampleCount(); }
+    
+    /**
+     * Decodes all samples of the most recent good packet into an array, the oldest first.
+     * Clears the newData flag. The get*Data methods only return the newest sample.
+     * 
+     * @param out Array to decode the samples into.
+     * @param maxCount Length of the array.
+     * 
+     * @return the number of samples decoded
+     */
+    byte getBatch(DofData *out, byte maxCount);
+    byte getBatch(DofDataFixed *out, byte maxCount); // Same, as fixed point numbers
+    byte getBatch(EulerData *out, byte maxCount); // Same, for Euler angles
+    byte getBatch(QuatData *out, byte maxCount); // Same, for the quaternion
+    
+    /**
+     * Registers a function to be called as soon as a good packet is received, from within
+     * checkStream(). The frame passed to the handler points into the receive buffer and is
+     * only valid for the duration of the call. Pass NULL to remove the handler.
+     *
+     * @param handler the function to call for every good packet
+     */
+    void onFrame(DofFrameHandler handler) { frameHandler = handler; }
+    
+    /**
+     * Sets a ring that every sample of every good packet is decoded into, with its acquisition
+     * time (see getSampleTime()), from within checkStream(). Batch packets add all of their
+     * samples. Pass NULL to stop.
+     * 
+     * @param ring the ring, for example a DofRingBuffer<16>
+     */
+    void setSampleRing(DofRing *ring) { sampleRing = ring; }
+    
+    /**
+     * Returns the newData flag. This is true when any packet (good or bad)
+     * has been received. Resets when a get*Data method is called,
+     * clearNewDataFlag() is called, or when true is passed into this method.
+     *
+     * @param clear clears the newData flag after returning the flag's state.
+     *
+     * @return the new data flag
+     */
+    boolean isNewDataAvailable(boolean clear = false)
+      { if (newData) { newData = !clear; return true ;} return false; }
+    
+    /**
+     * Clears the newData flag.
+     */
+    void clearNewDataFlag() { newData = false; }
+    
+    /**
+     * Gets the age (in milliseconds) of the last good data frame. With timestamps (see
+     * setTimestamps()) and a synced clock, this is the time since its sensors were read;
+     * otherwise it is the time since it was received.
+     *
+     * @return the age of the most recently received data
+     */
+    unsigned long getDataAge();
+    
+    /**
+     * Gets the time (micros()) the newest sample of the last good data frame was acquired at.
+     * Without timestamps or before the clock is synced, this is the time it was received at.
+     * For the other samples of a batch, use toLocalTime() on their DofFrame::getTimestamp().
+     *
+     * @return the acquisition time of the most recent data
+     */
+    unsigned long getSampleTime();
+    
+    /**
+     * Tells the 9DoF to start (or stop) every sample with the time it was acquired at. While
+     * timestamps are on, checkStream() keeps the 9DoF's clock synced (see syncClock()), so every
+     * sample can be placed on this Arduino's clock regardless of how long it took to arrive.
+     * Adds DOF_TIMESTAMP_SIZE bytes to every sample.
+     * 
+     * @param enable true to turn timestamps on, false to turn them off
+     */
+    void setTimestamps(boolean enable);
+    
+    /**
+     * Sends a clock request to the 9DoF, which answers with its micros(). The answers are used
+     * to estimate the offset and drift between its clock and micros() here; answers that took
+     * longer than the quickest ones are left out, as their timing is the least certain.
+     * checkStream() calls this by itself while timestamps are on.
+     */
+    void syncClock();
+    
+    /**
+     * Returns true once a clock answer has come in, so toLocalTime() can be used.
+     */
+    boolean isClockSynced() { return clockSyncs > 0; }
+    
+    /**
+     * Converts a time on the 9DoF's clock (see DofFrame::getTimestamp()) to micros() here.
+     * 
+     * @param time microseconds on the 9DoF's clock
+     * 
+     * @return the same time in micros()
+     */
+    unsigned long toLocalTime(uint32_t time) {
+      long elapsed = (int32_t)(time - clockDevice);
+      return clockLocal + elapsed + (long)(elapsed * clockDrift);
+    }
+    
+    /**
+     * Returns the estimated drift between the 9DoF's clock and micros() here, as the fraction
+     * of time micros() runs ahead (about -0.0001 to 0.0001 for crystal clocks).
+     */
+    float getClockDrift() { return clockDrift; }
+    
+    /**
+     * Returns true if the last received packet was valid; false otherwise.
+     *
+     * @return true if the last packet was valid and well formed, false otherwise
+     */
+    boolean isPacketGood() { return lastPacketGood; }
+    
+    /**
+     * Returns the sequence number of the last good packet. The 9DoF increments the
+     * sequence number (wrapping after 255) for every packet it sends, so gaps show lost packets.
+     *
+     * @return the sequence number of the last good packet
+     */
+    byte getLastSequence() { return lastSequence; }
+    
+    /**
+     * Prints out the sensor data to the passed in stream.
+     */
+    void printData(Stream &out);
+  
+  private:
+    StreamType *stream;
+    boolean open; // Has stream->begin been called?
+    boolean interruptMode; // True if serviceInterrupt() parses the stream instead of checkStream()
+    volatile byte locks; // Number of lock() calls not undone yet; serviceInterrupt() waits for 0
+    volatile boolean servicing; // True while serviceInterrupt() runs (with interrupts on)
+    long baudRate; // Baud rate of stream
+    float linkErrorRate; // Share of lost or garbled answers the last time the link was probed
+    
+    // Converts the baud rate to an ID used to configure baud of 9DoF remotely.
+    int baudRateToId(long rate);
+    boolean tryBaudRate(long rate); // Changes the baud rate on trial, and falls back if the link does not hold up
+    void switchBaudRate(long rate); // Reopens the stream at another rate
+    byte probeLink(); // Probes the link at the current rate; returns the number of lost or garbled answers
+    boolean requestSynch(byte id); // Sends a synch request and waits for its answer
+    boolean waitForBaudReply(long rate); // Waits for the 9DoF's answer to a baud rate command
+    void waitForBaudTrial(unsigned long trialStart); // Waits until a baud rate trial that started at trialStart is over
+    boolean waitForText(const char *text, unsigned long timeout); // Skips incoming bytes up to text
+    unsigned long getReplyTimeout(); // Milliseconds a text answer may take at the current rate
+    boolean _checkStream(); // Private version of checkStream(boolean).
+    void fillBuffer(); // Moves every available stream byte into the receive buffer
+    boolean parseBuffer(); // Parses (at most) one packet out of the receive buffer
+    void consumeBuffer(byte *next); // Marks everything in the receive buffer before next as parsed
+    boolean rejectedPacket(boolean rejected); // Reports rejected packets from parseBuffer()
+    boolean readPacket(byte mode, byte sequence, const byte *packet, byte length); // Stores the packet data
+    boolean readCompactPacket(byte sequence, const byte *packet, byte length, byte *out); // Applies a compact packet, writes the keyframe to out
+    void answerRequest(byte tag); // Matches the answer to a tagged request to the request
+    void expireRequests(); // Gives up on tagged requests that have timed out
+    void removeRequests(byte count); // Removes the oldest tagged requests
+    static boolean isValidHeader(byte mode, byte length); // Checks the data mode and length of a packet
+    void readClockPacket(const byte *packet); // Takes the answer to a clock request
+    void updateClock(uint32_t device, unsigned long local); // Adds a clock sample to the estimate
+    void countDiscarded(const byte *next); // Counts the unparsed bytes before next as skipped
+    static void countTime(uint32_t *histogram, uint32_t &max, unsigned long time); // Adds a time to the stats
+    void decodePacket(byte structs); // Decodes the stored packet data into the DOF_DECODED_* structs it has not been yet
+    boolean startDecoding(byte decoded); // Marks a DOF_DECODED_* struct as decoded, returns true if it was not yet
+    void pushSamples(const DofFrame &frame); // Decodes the samples of a packet into the sample ring
+    void decodePacketFixed(); // Same as decodePacket(), into the fixed point data structs
     void clearBuffer(); // Clears packet data buffer and resets state
-    void read_double(byte startIndex, double &out); // Read a double from a set of bytes
-    void read_short(byte startIndex, double &out); // Read a short from a set of bytes
-    byte packetState; // The packet's state (Finite state machine)
-    byte dataBuffer[DOF_DATA_SIZE]; // Buffer for packet data
-    byte dataBufferSize; // Amount of data stored in the buffer
-    byte dataModeSize; // Size of the current mode's packet data
+    byte rxBuffer[DOF_RX_BUFFER_SIZE]; // Bytes read from the stream that have not been parsed yet
+    byte rxStart; // Index of the first unparsed byte in the receive buffer
+    byte rxSize; // Amount of data stored in the receive buffer (including parsed bytes before rxStart)
     byte dataMode;
     byte lastPacketMode;
     
     short updateInterval; // Number of milliseconds between updates sent by 9DoF
+    short fusionInterval; // Number of milliseconds between sensor reads on the 9DoF
     boolean continuousStream; // True if the 9DoF is configured to send a continous stream, false otherwise
     
+    byte packetBuffer[DOF_DATA_SIZE]; // Data of the last good packet, once it is no longer in rxBuffer
+    const byte *packetData; // Data of the last good packet: in rxBuffer until the buffer is refilled, or in packetBuffer
+    byte packetLength; // Length of the data of the last good packet
+    byte packetMode; // Data mode byte of the last good packet (including DOF_DATA_MODE_FIXED_POINT and DOF_DATA_MODE_BATCH)
+    byte packetDecoded; // DOF_DECODED_* structs that the packet data has been decoded into (or has no data for)
+    boolean packetDecodedFixed; // True once the packet data has been decoded into the fixed point structs
+    int16_t compactValues[DOF_COMPACT_VALUES]; // Values of the last decoded compact packet
+    byte compactSequence; // Sequence number of the last decoded compact packet
+    boolean compactValid; // True if compactValues can take the next delta packet
+    DofFrameHandler frameHandler; // Called for every good packet, if set
+    DofRing *sampleRing; // Gets every sample, if set
+    
+    // Tagged requests in flight, the oldest first (the 9DoF answers them in order)
+    byte requestTags[DOF_MAX_REQUESTS];
+    unsigned long requestTimes[DOF_MAX_REQUESTS]; // Time each request was sent (micros())
+    byte requestCount; // Number of requests in flight
+    byte pipelineDepth; // Requests requestDataPipelined() keeps in flight
+    byte nextRequestTag; // Tag of the next request
+    byte lastRequestTag; // Tag of the last answered request
+    unsigned long requestLatency; // Microseconds the last answered request took
+    
+    // Clock sync (see syncClock()): local time = clockLocal + elapsed + elapsed * clockDrift,
+    // elapsed being the 9DoF's time since clockDevice
+    boolean timestamps; // True if the 9DoF was told to send timestamps
+    boolean clockPending; // True while a clock request is waiting for its answer
+    uint16_t clockId; // ID of the last clock request
+    unsigned long clockSent; // Time the last clock request was sent (micros())
+    unsigned long clockMinRtt; // Time the quickest clock requests take (micros, 0 if none yet)
+    uint32_t clockDevice; // 9DoF time of the reference point
+    unsigned long clockLocal; // Local time of the reference point (micros())
+    float clockDrift; // Estimated drift, see getClockDrift()
+    uint16_t clockSyncs; // Number of clock answers used (stops counting at DOF_CLOCK_SETTLE_SYNCS)
+    
     DofData data; // Holds the data retrieved from the 9DoF
     EulerData eulerData;
     GyroData gyroData;
-    unsigned long dataTime; // Stores the time that the data was read (millis())
-    boolean newData;
+    QuatData quatData;
+    DofDataFixed dataFixed;
+    EulerDataFixed eulerDataFixed;
+    QuatDataFixed quatDataFixed;
+    volatile boolean newData;
     
     
     // Statistics
-    short goodCount; // Number of good data frames retreived.
-    short badCount; // Number of bad data frames retreived.
-    // True if the last incoming packet was good (goodCount was incremented); false otherwise
+    byte lastSequence; // Sequence number of the last good packet
+    DofStats stats;
+    boolean statsSequenceValid; // True once lastSequence can be compared to for lost packets
+    unsigned long lastPacketMicros; // Time the last good packet was received (micros())
+    // True if the last incoming packet was good (stats.goodPackets was incremented); false otherwise
     boolean lastPacketGood;
     
     
@@ -266,7 +1181,7 @@ template <class StreamType> class DofHandler {
 // Implementation code required in header file to take care of template instantiation.
 
 template <class StreamType>
-DofHandler<StreamType>::DofHandler(StreamType *dofStream, int baud) {
+DofHandler<StreamType>::DofHandler(StreamType *dofStream, long baud) {
   stream = dofStream;
   
   // Check optional parameter presence
@@ -278,41 +1193,59 @@ DofHandler<StreamType>::DofHandler(StreamType *dofStream, int baud) {
     baudRate = 0;
   }
   // Initialize data members
+  interruptMode = false;
+  locks = 0;
+  servicing = false;
   updateInterval = -1;
+  fusionInterval = -1;
   continuousStream = false;
   lastPacketGood = false;
-  dataModeSize = DOF_DATA_MODE_SIZE[DOF_DATA_MODE_DEFAULT];
   dataMode = DOF_DATA_MODE_DEFAULT;
+  lastPacketMode = DOF_DATA_MODE_DEFAULT;
+  packetMode = DOF_DATA_MODE_DEFAULT;
+  memset(packetBuffer, 0, sizeof(packetBuffer)); // getFrame() before the first packet: all zeros
+  packetData = packetBuffer;
+  packetLength = 0;
+  packetDecoded = DOF_DECODED_ALL;
+  packetDecodedFixed = true;
+  compactValid = false;
+  frameHandler = NULL;
+  sampleRing = NULL;
+  requestCount = 0;
+  pipelineDepth = 1;
+  nextRequestTag = 0;
+  lastRequestTag = 0;
+  requestLatency = 0;
+  timestamps = false;
+  clockPending = false;
+  clockId = 0;
+  clockSent = 0;
+  clockMinRtt = 0;
+  clockDevice = 0;
+  clockLocal = 0;
+  clockDrift = 0;
+  clockSyncs = 0;
+  linkErrorRate = 0;
+  newData = false;
+  lastSequence = 0;
+  lastPacketMicros = 0;
+  resetStats();
+  clearBuffer();
 }
 
 template <class StreamType>
-void DofHandler<StreamType>::begin(int initalBaud, int baud) {
+void DofHandler<StreamType>::begin(long initalBaud, long baud) {
   if (open) return; // If the stream is already open, don't begin it again.
   
   stream->begin(initalBaud);
-  
-  if (baud != 0 && baud != initalBaud) {
-    int baudId = baudRateToId(baud);
-    // Only change the baud rate if the rate is supported
-    if (baudId >= 0) {
-      delay(100);
-      stream->print("#b");
-      stream->print(baudId);
-      stream->flush();
-      stream->end();
-      delay(100);
-      stream->begin(baud);
-      delay(10);
-    } else {
-      baud = initalBaud;
-    }
-  } else {
-    baud = initalBaud;
-  }
-  
-  baudRate = baud;
+  baudRate = initalBaud;
   open = true;
   
+  if (baud > initalBaud) {
+    negotiateBaudRate(baud);
+  } else if (baud != 0 && baud != initalBaud) {
+    setBaudRate(baud);
+  }
 }
 
 template <class StreamType>
@@ -325,7 +1258,7 @@ void DofHandler<StreamType>::end() {
 }
 
 template <class StreamType>
-void DofHandler<StreamType>::markOpen(int baud) {
+void DofHandler<StreamType>::markOpen(long baud) {
   open = true;
   baudRate = baud;
 }
@@ -333,16 +1266,29 @@ void DofHandler<StreamType>::markOpen(int baud) {
 template <class StreamType>
 boolean DofHandler<StreamType>::checkStream(boolean loop) {
   // If loop is true, run _checkStream within a while loop, otherwise, at max once.
+  // _checkStream is always run at least once, since a previous call may have
+  // buffered more than one packet.
+  if (timestamps) {
+    // Keep the clock synced: a request every DOF_CLOCK_SYNC_INTERVAL, more often until the
+    // first answer is in, and a new one if an answer does not come within DOF_REQUEST_TIMEOUT
+    unsigned long sinceSync = micros() - clockSent;
+    if (sinceSync > (isClockSynced() && !clockPending ? DOF_CLOCK_SYNC_INTERVAL : DOF_REQUEST_TIMEOUT) * 1000UL) {
+      syncClock();
+    }
+  }
+  
+  if (interruptMode) {
+    return newData; // Parsed by serviceInterrupt()
+  }
+  
   if (loop) {
-    while (stream->available()) {
+    do {
       if (_checkStream()) {
         return true;
       }
-    }
+    } while (stream->available());
   } else {
-    if (stream->available()) {
-      return _checkStream();
-    }
+    return _checkStream();
   }
   
   return false;
@@ -366,169 +1312,603 @@ boolean DofHandler<StreamType>::checkStreamValid(boolean loop) {
 }
 
 template <class StreamType>
-boolean DofHandler<StreamType>::_checkStream() {
-  byte in = (byte)stream->read();
-  boolean packet = false;
-  // Finite state machine to read beginning "9DoF" magic number
-  // at the start of a packet (for alignment purposes)
-  switch (packetState) {
-    case 0:
-      if (in == '9') {
-        packetState = 1;
-      }
-      break;
-    case 1:
-      if (in == 'D')
-        packetState = 2;
-      else
-        packetState = 0;
-      break;
-    case 2:
-      if (in == 'o')
-        packetState = 3;
-      else
-        packetState = 0;
-        
-      break;
-    case 3:
-      if (in == 'F')
-        packetState = 4;
-      else
-        packetState = 0;
-      break;
-    default:
-      if (dataBufferSize >= dataModeSize) {
-        // The next byte should be an end line character
-        if (in == '\n') {
-          // Good 
-          readPacket();
-          lastPacketGood = true;
-          // Statistics collecting to check both average age of data,
-          // And for seeing how old current data is
-          goodCount++;
-          dataTime = millis();
-          /*Serial.print("Avg "); // The average time between new data
-          Serial.println(dofDataTime / dof_good_count);
-          Serial.print((double)dof_bad_count / dof_good_count);
-          Serial.print(" (");
-          Serial.print(dof_bad_count);
-          Serial.println(")");*/
-          //printDofData();
-        } else {
-          // Bad line
-          //Serial.println("Bad");
-          badCount++;
-          lastPacketGood = false;
-        }
-        packet = true;
-        newData = true;
-        clearBuffer();
-      } else {
-        dataBuffer[dataBufferSize] = in;
-        dataBufferSize++;
-        //dof_data_buffer[dof_data_buffer_size] = 0;
-      }
-      break;
+void DofHandler<StreamType>::serviceInterrupt() {
+  // Interrupts are off until the flag is set, so another call cannot get in between. A call
+  // that interrupts the last one (still parsing) returns right away.
+  if (!interruptMode || locks > 0 || servicing) return;
+  servicing = true;
+  interrupts();
+  
+  // Unlike checkStream(), go on until everything received is parsed
+  while (_checkStream() || stream->available()) {}
+  
+  noInterrupts(); // Returning from the interrupt turns them back on
+  servicing = false;
+}
+
+template <class StreamType>
+inline boolean DofHandler<StreamType>::_checkStream() {
+  // Packets already in the buffer come first, so the stream is only read (and the buffer
+  // only moved) once the buffer is out of whole packets
+  if (rxStart < rxSize && parseBuffer()) {
+    return true;
   }
-  return packet;
+  fillBuffer();
+  return parseBuffer();
 }
 
 template <class StreamType>
-void DofHandler<StreamType>::readPacket() {
-  // Format:
-  // MMMMAAAABBBBCCCCIIIIJJJJKKKKXXYYZZN (35 bytes long; 30 bytes of data)
-  // Where MMMM is the magic number "9DoF" (no null terminator),
-  // AAAA, BBBB, and CCCC are the X, Y and Z values (respectively) of the accelerometer
-  // IIII, JJJJ, and KKKK are the X, Y and Z values (respectively) of the magnetometer
-  // XX, YY, and ZZ are the X, Y and Z values (respectively) of the gyroscope
-  // N is a new line character (\n)
-  // MMMM and N are stripped as data is coming in.
+void DofHandler<StreamType>::fillBuffer() {
+  // The last good packet is about to be moved over, so its data goes where it is kept for
+  // good; then the unparsed bytes (less than a packet, see _checkStream()) go to the front
+  if (packetData != packetBuffer) {
+    memcpy(packetBuffer, packetData, packetLength);
+    packetData = packetBuffer;
+  }
+  if (rxStart > 0) {
+    rxSize -= rxStart;
+    if (rxSize > 0) memmove(rxBuffer, rxBuffer + rxStart, rxSize);
+    rxStart = 0;
+  }
   
-  // Packet size is already 36 bytes long
-  //DofData data;
-  //EulerData euler;
+  // Drain the stream in one go, rather than going through the packet
+  // parser once per byte
+  int count = stream->available();
+  if (count > DOF_RX_BUFFER_SIZE - rxSize)
+    count = DOF_RX_BUFFER_SIZE - rxSize;
   
-  if (dataMode == DOF_DATA_MODE_ALL) {
-    read_double(0, data.accelX);
-    read_double(4, data.accelY);
-    read_double(8, data.accelZ);
-    
-    read_double(12, data.magX);
-    read_double(16, data.magY);
-    read_double(20, data.magZ);
-    
-    read_short(24, data.gyroX);
-    read_short(26, data.gyroY);
-    read_short(28, data.gyroZ);
+#ifdef __AVR__
+  // The AVR core's readBytes() looks at the clock for every byte, which costs more than the read()
+  byte *in = rxBuffer + rxSize;
+  byte *end = in + count;
+  while (in < end) {
+    *in++ = (byte)stream->read();
+  }
+  rxSize = end - rxBuffer;
+#else
+  rxSize += stream->readBytes((char *)rxBuffer + rxSize, count);
+#endif
+}
+
+template <class StreamType>
+boolean DofHandler<StreamType>::parseBuffer() {
+  byte *end = rxBuffer + rxSize;
+  byte *search = rxBuffer + rxStart;
+  boolean rejected = false;
+  
+  while (search < end) {
+    // Find the first character of the "9DoF" magic number (for alignment purposes)
+    byte *magic = *search == DOF_MAGIC[0] ? search : (byte *)memchr(search, DOF_MAGIC[0], end - search);
+    if (magic == NULL) {
+      break;
+    }
     
-    data.gyroX *= DOF_GYRO_SCALE;
-    data.gyroY *= DOF_GYRO_SCALE;
-    data.gyroZ *= DOF_GYRO_SCALE;
+    byte remaining = end - magic;
+    if (remaining < DOF_MAGIC_SIZE) {
+      // The magic number may be split across reads; keep what we have of it
+      if (memcmp(magic, DOF_MAGIC, remaining) == 0) {
+        countDiscarded(magic);
+        consumeBuffer(magic);
+        return rejectedPacket(rejected);
+      }
+      search = magic + 1;
+      continue;
+    }
     
-    gyroData.x = data.gyroX * 100;
-    gyroData.y = data.gyroY * 100;
-    gyroData.z = data.gyroZ * 100;
+    if (memcmp(magic, DOF_MAGIC, DOF_MAGIC_SIZE) != 0) {
+      search = magic + 1;
+      continue;
+    }
     
-    gyroData.checkSum = (gyroData.x + gyroData.y + gyroData.z) % 10;
+    if (remaining < DOF_MAGIC_SIZE + DOF_HEADER_SIZE) {
+      // Wait for the rest of the header
+      countDiscarded(magic);
+      consumeBuffer(magic);
+      return rejectedPacket(rejected);
+    }
     
-    lastPacketMode = DOF_DATA_MODE_ALL;
-  } else if (dataMode == DOF_DATA_MODE_GYRO) {
-    read_short(0, data.gyroX);
-    read_short(2, data.gyroY);
-    read_short(4, data.gyroZ);
+    const byte *header = magic + DOF_MAGIC_SIZE;
+    byte length = header[3];
+    if (header[0] != DOF_FRAME_VERSION || !isValidHeader(header[2], length)) {
+      // Not a header we understand; most likely "9DoF" showed up in another packet's data
+      search = magic + 1;
+      continue;
+    }
     
-    data.gyroX *= DOF_GYRO_SCALE;
-    data.gyroY *= DOF_GYRO_SCALE;
-    data.gyroZ *= DOF_GYRO_SCALE;
+    byte packetSize = DOF_FRAME_OVERHEAD + length;
+    if (remaining < packetSize) {
+      // Wait for the rest of the packet
+      countDiscarded(magic);
+      consumeBuffer(magic);
+      return rejectedPacket(rejected);
+    }
     
-    gyroData.x = data.gyroX * 100;
-    gyroData.y = data.gyroY * 100;
-    gyroData.z = data.gyroZ * 100;
+    uint16_t crc = dofCrc16(0xFFFF, header, DOF_HEADER_SIZE + length);
+    const byte *crcBytes = header + DOF_HEADER_SIZE + length;
+    if (crc != (((uint16_t)crcBytes[0] << 8) | crcBytes[1])) {
+      // Bad packet. Rather than throwing the whole packet away, resynchronize from just
+      // after its magic number, in case a good packet starts inside of it (a dropped byte).
+      stats.badPackets++;
+      rejected = true;
+      search = magic + 1;
+      continue;
+    }
     
-    gyroData.checkSum = (gyroData.x + gyroData.y + gyroData.z) % 10;
+    if (header[2] == DOF_DATA_MODE_CLOCK) {
+      // Not a sample, so parsing goes on after it. Clock packets do not use up a sequence number.
+      readClockPacket(header + DOF_HEADER_SIZE);
+      countDiscarded(magic);
+      consumeBuffer(magic + packetSize);
+      search = magic + packetSize;
+      continue;
+    }
     
-    lastPacketMode = DOF_DATA_MODE_GYRO;
-  } else if (dataMode == DOF_DATA_MODE_EULER) {
-    read_double(0, eulerData.roll);
-    read_double(4, eulerData.pitch);
-    read_double(8, eulerData.yaw);
+    if (statsSequenceValid) {
+      stats.lostPackets += (byte)(header[1] - lastSequence - 1);
+    }
+    statsSequenceValid = true;
+    lastSequence = header[1];
+    if (!readPacket(header[2], header[1], header + DOF_HEADER_SIZE, length)) {
+      // Well formed, but a compact delta packet whose previous packet was lost (nothing can
+      // be decoded until the next keyframe), or a batch packet with a wrong sample count.
+      stats.badPackets++;
+      rejected = true;
+      search = magic + packetSize;
+      continue;
+    }
     
-    lastPacketMode = DOF_DATA_MODE_EULER;
+    // Good
+    lastPacketGood = true;
+    unsigned long now = micros();
+    if (stats.goodPackets > 0) {
+      countTime(stats.intervalHistogram, stats.maxInterval, now - lastPacketMicros);
+    }
+    stats.goodPackets++;
+    lastPacketMicros = now;
+    newData = true;
+    countDiscarded(magic);
+    consumeBuffer(magic + packetSize);
+    return true;
+  }
+  
+  // No magic number left in the buffer; nothing in it is worth keeping
+  countDiscarded(end);
+  clearBuffer();
+  return rejectedPacket(rejected);
+}
+
+template <class StreamType>
+inline boolean DofHandler<StreamType>::isValidHeader(byte mode, byte length) {
+  if (mode == DOF_DATA_MODE_CLOCK) {
+    return length == DOF_CLOCK_SIZE;
+  }
+  
+  byte dataMode = mode & ~DOF_DATA_MODE_FLAGS;
+  if (dataMode >= DOF_DATA_MODE_COUNT) {
+    return false;
+  }
+  byte stampSize = (mode & DOF_DATA_MODE_TIMESTAMP) ? DOF_TIMESTAMP_SIZE : 0;
+  byte sampleSize = DOF_DATA_MODE_SIZE[dataMode] + stampSize;
+  
+  if (mode & DOF_DATA_MODE_BATCH) {
+    // A sample count and whole samples; compact and tagged packets are never batched
+    return !(mode & DOF_DATA_MODE_TAGGED) && dataMode != DOF_DATA_MODE_COMPACT && length <= DOF_DATA_SIZE
+      && length >= 1 + sampleSize && (length - 1) % sampleSize == 0;
+  }
+  
+  if (mode & DOF_DATA_MODE_TAGGED) {
+    if (length == 0) return false;
+    length--; // The tag
+  }
+  return length == sampleSize
+    || (dataMode == DOF_DATA_MODE_COMPACT && length == stampSize + DOF_COMPACT_DELTA_SIZE);
+}
+
+template <class StreamType>
+boolean DofHandler<StreamType>::rejectedPacket(boolean rejected) {
+  // A bad packet counts as a received packet, but only once per parse
+  if (rejected) {
+    lastPacketGood = false;
+    newData = true;
+  }
+  return rejected;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::countDiscarded(const byte *next) {
+  byte discarded = next - (rxBuffer + rxStart);
+  if (discarded > 0) {
+    stats.resyncs++;
+    stats.bytesDiscarded += discarded;
+  }
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::countTime(uint32_t *histogram, uint32_t &max, unsigned long time) {
+  byte bin = 0;
+  for (unsigned long limit = time >> DOF_STATS_FIRST_BIN; limit > 0 && bin < DOF_STATS_BINS - 1; limit >>= 1) {
+    bin++;
+  }
+  histogram[bin]++;
+  if (time > max) max = time;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::writeStats(Stream &out) {
+  out.print(DOF_STATS_MAGIC);
+  uint16_t crc = dofCrc16Update(0xFFFF, DOF_STATS_VERSION);
+  out.write(DOF_STATS_VERSION);
+  
+  const uint32_t *fields = (const uint32_t *)&stats;
+  for (byte i = 0; i < sizeof(stats) / sizeof(uint32_t); i++) {
+    for (int8_t shift = 24; shift >= 0; shift -= 8) {
+      byte b = fields[i] >> shift;
+      out.write(b);
+      crc = dofCrc16Update(crc, b);
+    }
+  }
+  
+  out.write(crc >> 8);
+  out.write(crc & 0xFF);
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::consumeBuffer(byte *next) {
+  rxStart = next - rxBuffer;
+}
+
+template <class StreamType>
+inline boolean DofHandler<StreamType>::readPacket(byte mode, byte sequence, const byte *packet, byte length) {
+  // Format (framing version 1):
+  // MMMMVSDL<data>CC (10 bytes + data long)
+  // Where MMMM is the magic number "9DoF" (no null terminator),
+  // V is the framing version (DOF_FRAME_VERSION),
+  // S is the packet's sequence number,
+  // D is the data mode of the packet (with DOF_DATA_MODE_FIXED_POINT set for fixed point
+  // packets) and L is the length of its data,
+  // CC is the CRC-16 (CCITT, big endian) of VSDL<data>.
+  // For DOF_DATA_MODE_ALL, <data> is AAAABBBBCCCCIIIIJJJJKKKKXXYYZZ (30 bytes), where
+  // AAAA, BBBB, and CCCC are the X, Y and Z values (respectively) of the accelerometer
+  // IIII, JJJJ, and KKKK are the X, Y and Z values (respectively) of the magnetometer
+  // XX, YY, and ZZ are the X, Y and Z values (respectively) of the gyroscope
+  // The accelerometer, magnetometer and Euler angle values are floats, or Q16.16
+  // fixed point numbers in fixed point packets.
+  // For batch packets (DOF_DATA_MODE_BATCH), <data> is N<sample 1>...<sample N>, N being the
+  // number of samples, each the <data> of a packet of its own.
+  // For tagged packets (DOF_DATA_MODE_TAGGED), <data> is T<sample>, T being the tag of the
+  // request it answers (see requestDataTagged()).
+  // With DOF_DATA_MODE_TIMESTAMP, every sample starts with TTTT, its acquisition time.
+  // Clock packets (DOF_DATA_MODE_CLOCK) are not read here, see readClockPacket().
+  // packet points at the first data byte (just after L).
+  // See DofFrame for how the data is decoded, and readCompactPacket() for DOF_DATA_MODE_COMPACT.
+  
+  byte tag = 0;
+  boolean tagged = mode & DOF_DATA_MODE_TAGGED;
+  if (tagged) {
+    tag = packet[0];
+    mode &= ~DOF_DATA_MODE_TAGGED;
+    packet++;
+    length--;
+  }
+  
+  byte stampSize = (mode & DOF_DATA_MODE_TIMESTAMP) ? DOF_TIMESTAMP_SIZE : 0;
+  if (mode & DOF_DATA_MODE_BATCH) {
+    byte size = DOF_DATA_MODE_SIZE[mode & ~DOF_DATA_MODE_FLAGS] + stampSize;
+    if (packet[0] == 0 || 1 + packet[0] * size != length) {
+      return false;
+    }
+  }
+  
+  if ((mode & ~DOF_DATA_MODE_FLAGS) == DOF_DATA_MODE_COMPACT) {
+    // Compact packets are rebuilt into a keyframe in packetBuffer, after the timestamp
+    if (!readCompactPacket(sequence, packet + stampSize, length - stampSize, packetBuffer + stampSize)) {
+      return false;
+    }
+    memcpy(packetBuffer, packet, stampSize);
+    packet = packetBuffer;
+  }
+  // Only keep the raw data around, where it is; it is decoded when it is asked for, and
+  // copied out of rxBuffer only when the buffer is refilled (see fillBuffer()).
+  packetData = packet;
+  packetLength = length;
+  
+  // Only a packet that checks out answers its request
+  if (tagged) {
+    answerRequest(tag);
+  }
+  
+  packetMode = mode;
+  lastPacketMode = mode & ~DOF_DATA_MODE_FLAGS;
+  // The structs the mode has no data for keep what they have, so they count as decoded
+  packetDecoded = DOF_DECODED_ALL & ~DOF_DATA_MODE_DECODED[lastPacketMode];
+  packetDecodedFixed = false;
+  
+  if (sampleRing != NULL) {
+    pushSamples(DofFrame(packetMode, packet));
+  }
+  if (frameHandler != NULL) {
+    frameHandler(DofFrame(packetMode, packet));
+  }
+  return true;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::pushSamples(const DofFrame &frame) {
+  // Samples without a timestamp (or before the clock is synced) get the time they came in
+  boolean timed = frame.hasTimestamp() && isClockSynced();
+  unsigned long now = micros();
+  
+  for (byte i = 0; i < frame.getSampleCount(); i++) {
+    DofSample *sample = sampleRing->reserve();
+    if (sample == NULL) {
+      continue; // Full, so the sample is dropped (and counted)
+    }
+    DofFrame view = frame.getSample(i);
+    sample->time = timed ? toLocalTime(view.getTimestamp()) : now;
+    sample->mode = view.getMode();
+    switch (sample->mode) {
+      case DOF_DATA_MODE_EULER:
+        view.getEulerData(sample->euler);
+        break;
+      case DOF_DATA_MODE_QUATERNION:
+        view.getQuatData(sample->quat);
+        break;
+      default:
+        memset(&sample->data, 0, sizeof(sample->data));
+        view.getData(sample->data);
+    }
+    sampleRing->commit();
+  }
+}
+
+template <class StreamType>
+boolean DofHandler<StreamType>::readCompactPacket(byte sequence, const byte *packet, byte length, byte *out) {
+  // DOF_DATA_MODE_COMPACT packets are either
+  // keyframes: AAAAAAIIIIIIXXXXXX (18 bytes), the accelerometer (in 1/256 g), magnetometer and
+  //   gyroscope X, Y and Z values as signed shorts
+  // or deltas: AAAIIIXXX (DOF_COMPACT_DELTA_SIZE bytes), the same nine values as signed bytes,
+  //   to be added to the values of the packet right before it (by sequence number).
+  if (length == DOF_DATA_MODE_SIZE[DOF_DATA_MODE_COMPACT]) {
+    for (byte i = 0; i < DOF_COMPACT_VALUES; i++) {
+      compactValues[i] = DofFrame::readShort(packet + i * 2);
+    }
+  } else {
+    if (!compactValid || sequence != (byte)(compactSequence + 1)) {
+      compactValid = false;
+      return false;
+    }
+    for (byte i = 0; i < DOF_COMPACT_VALUES; i++) {
+      compactValues[i] += (int8_t)packet[i];
+    }
+  }
+  compactValid = true;
+  compactSequence = sequence;
+  
+  for (byte i = 0; i < DOF_COMPACT_VALUES; i++) {
+    out[i * 2] = compactValues[i] >> 8;
+    out[i * 2 + 1] = compactValues[i];
+  }
+  return true;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::readClockPacket(const byte *packet) {
+  // Clock packets are XYTTTT (DOF_CLOCK_SIZE bytes): the ID of the clock request they answer
+  // and the 9DoF's micros() when it read the request.
+  uint16_t id = ((uint16_t)packet[0] << 8) | packet[1];
+  if (!clockPending || id != clockId) {
+    return; // Answer to a request that was given up on
+  }
+  clockPending = false;
+  
+  unsigned long rtt = micros() - clockSent;
+  if (clockMinRtt == 0 || rtt < clockMinRtt) {
+    clockMinRtt = rtt;
+  } else {
+    clockMinRtt += DOF_CLOCK_RTT_AGING; // Forget a quickest time that does not come back
+  }
+  if (rtt > clockMinRtt + DOF_CLOCK_RTT_MARGIN) {
+    return; // Held up somewhere, so it is unclear when the 9DoF's time was taken
   }
-  //this->data = data;
+  
+  // The 9DoF read its clock once the request was in; its answer took longer to send. Split
+  // the rest of the round trip evenly.
+  long requestTime = 0;
+  long answerTime = 0;
+  if (baudRate > 0) {
+    long byteTime = 10000000L / baudRate; // 10 bits per byte
+    requestTime = 4 * byteTime; // "#t" and the ID
+    answerTime = (DOF_FRAME_OVERHEAD + DOF_CLOCK_SIZE) * byteTime;
+  }
+  long transit = ((long)rtt + requestTime - answerTime) / 2;
+  transit = constrain(transit, 0, (long)rtt);
+  
+  updateClock(DofFrame::readLong(packet + 2), clockSent + transit);
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::updateClock(uint32_t device, unsigned long local) {
+  if (clockSyncs < DOF_CLOCK_SETTLE_SYNCS) {
+    // Not enough answers in for the drift to make sense yet; take this one as it is
+    clockDevice = device;
+    clockLocal = local;
+    clockSyncs++;
+    return;
+  }
+  
+  unsigned long predicted = toLocalTime(device);
+  long error = (long)(local - predicted);
+  long elapsed = (int32_t)(device - clockDevice);
+  if (elapsed > 0) {
+    clockDrift += DOF_CLOCK_DRIFT_GAIN * error / elapsed;
+  }
+  clockDevice = device;
+  clockLocal = predicted + (long)(DOF_CLOCK_OFFSET_GAIN * error);
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::syncClock() {
+  lock(); // The answer may be parsed by serviceInterrupt()
+  clockId++;
+  clockPending = true;
+  stream->print("#t"); // Request _t_ime
+  stream->write(clockId >> 8);
+  stream->write(clockId & 0xFF);
+  clockSent = micros();
+  unlock();
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::setTimestamps(boolean enable) {
+  lock();
+  stream->print(enable ? "#T1" : "#T0");
+  timestamps = enable;
+  if (enable && !isClockSynced()) {
+    syncClock();
+  }
+  unlock();
+}
+
+template <class StreamType>
+unsigned long DofHandler<StreamType>::getSampleTime() {
+  DofFrame frame(packetMode, packetData);
+  if (frame.hasTimestamp() && isClockSynced()) {
+    return toLocalTime(frame.getTimestamp());
+  }
+  return lastPacketMicros;
+}
+
+template <class StreamType>
+unsigned long DofHandler<StreamType>::getDataAge() {
+  // The estimate can put a brand new sample slightly in the future
+  long age = (long)(micros() - getSampleTime());
+  return age > 0 ? age / 1000 : 0;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::answerRequest(byte tag) {
+  for (byte i = 0; i < requestCount; i++) {
+    if (requestTags[i] == tag) {
+      // The 9DoF answers in order, so the requests before this one were lost
+      requestLatency = micros() - requestTimes[i];
+      lastRequestTag = tag;
+      countTime(stats.latencyHistogram, stats.maxLatency, requestLatency);
+      stats.lostRequests += i;
+      removeRequests(i + 1);
+      return;
+    }
+  }
+  // An answer to a request that was already given up on
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::expireRequests() {
+  byte expired = 0;
+  unsigned long now = micros();
+  while (expired < requestCount && now - requestTimes[expired] > DOF_REQUEST_TIMEOUT * 1000UL) {
+    expired++;
+  }
+  stats.lostRequests += expired;
+  removeRequests(expired);
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::removeRequests(byte count) {
+  if (count == 0) return;
+  requestCount -= count;
+  for (byte i = 0; i < requestCount; i++) {
+    requestTags[i] = requestTags[i + count];
+    requestTimes[i] = requestTimes[i + count];
+  }
+}
+
+template <class StreamType>
+byte DofHandler<StreamType>::getBatch(DofData *out, byte maxCount) {
+  newData = false;
+  DofFrame frame(packetMode, packetData);
+  byte count = min(frame.getSampleCount(), maxCount);
+  for (byte i = 0; i < count; i++) {
+    frame.getSample(i).getData(out[i]);
+  }
+  return count;
+}
+
+template <class StreamType>
+byte DofHandler<StreamType>::getBatch(DofDataFixed *out, byte maxCount) {
+  newData = false;
+  DofFrame frame(packetMode, packetData);
+  byte count = min(frame.getSampleCount(), maxCount);
+  for (byte i = 0; i < count; i++) {
+    frame.getSample(i).getDataFixed(out[i]);
+  }
+  return count;
+}
+
+template <class StreamType>
+byte DofHandler<StreamType>::getBatch(EulerData *out, byte maxCount) {
+  newData = false;
+  DofFrame frame(packetMode, packetData);
+  byte count = min(frame.getSampleCount(), maxCount);
+  for (byte i = 0; i < count; i++) {
+    frame.getSample(i).getEulerData(out[i]);
+  }
+  return count;
+}
+
+template <class StreamType>
+byte DofHandler<StreamType>::getBatch(QuatData *out, byte maxCount) {
+  newData = false;
+  DofFrame frame(packetMode, packetData);
+  byte count = min(frame.getSampleCount(), maxCount);
+  for (byte i = 0; i < count; i++) {
+    frame.getSample(i).getQuatData(out[i]);
+  }
+  return count;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::decodePacket(byte structs) {
+  structs &= ~packetDecoded;
+  if (structs == 0) return;
+  
+  DofFrame frame(packetMode, packetData);
+  if (structs & DOF_DECODED_DATA) frame.getData(data);
+  if (structs & DOF_DECODED_EULER) frame.getEulerData(eulerData);
+  if (structs & DOF_DECODED_GYRO) frame.getGyroData(gyroData);
+  if (structs & DOF_DECODED_QUAT) frame.getQuatData(quatData);
+  packetDecoded |= structs;
 }
 
 template <class StreamType>
-void DofHandler<StreamType>::read_double(byte startIndex, double &out) {
-  // Dirty casting and shifting magic, undoing what was done on the 9Dof
-  long val = 0;
-  val |= dataBuffer[startIndex]; val <<= 8;
-  val |= dataBuffer[startIndex + 1]; val <<= 8;
-  val |= dataBuffer[startIndex + 2]; val <<= 8;
-  val |= dataBuffer[startIndex + 3];
-  out = *((double *)&val);
+boolean DofHandler<StreamType>::startDecoding(byte decoded) {
+  if (packetDecoded & decoded) return false;
+  packetDecoded |= decoded;
+  return true;
 }
 
 template <class StreamType>
-void DofHandler<StreamType>::read_short(byte startIndex, double &out) {
-  short val = 0;
-  val |= dataBuffer[startIndex]; val <<= 8;
-  val |= dataBuffer[startIndex + 1];
-  out = val;
+void DofHandler<StreamType>::decodePacketFixed() {
+  if (packetDecodedFixed) return;
+  
+  DofFrame frame(packetMode, packetData);
+  frame.getDataFixed(dataFixed);
+  frame.getEulerDataFixed(eulerDataFixed);
+  frame.getQuatDataFixed(quatDataFixed);
+  packetDecodedFixed = true;
 }
 
 template <class StreamType>
 void DofHandler<StreamType>::clearBuffer() {
-  dataBuffer[0] = 0;
-  dataBufferSize = 0;
-  packetState = 0;
+  rxStart = 0;
+  rxSize = 0;
 }
 
 template <class StreamType>
 void DofHandler<StreamType>::printData(Stream &out) {
   //out.println("\n9DoF Data:");
+  decodePacket(DOF_DECODED_ALL);
   
-  if (lastPacketMode == DOF_DATA_MODE_ALL) {
+  if (lastPacketMode == DOF_DATA_MODE_ALL || lastPacketMode == DOF_DATA_MODE_COMPACT) {
     out.print("(A){ { ");
     out.print(data.accelX);
     out.print(", ");
@@ -564,6 +1944,16 @@ void DofHandler<StreamType>::printData(Stream &out) {
     out.print(", ");
     out.print(eulerData.roll);
     out.println(" }");
+  } else if (lastPacketMode == DOF_DATA_MODE_QUATERNION) {
+    out.print("(Q){ ");
+    out.print(quatData.w, 4);
+    out.print(", ");
+    out.print(quatData.x, 4);
+    out.print(", ");
+    out.print(quatData.y, 4);
+    out.print(", ");
+    out.print(quatData.z, 4);
+    out.println(" }");
   }
   
 }
@@ -577,88 +1967,308 @@ void DofHandler<StreamType>::debugRead(Stream &out) {
 }
 
 template <class StreamType>
-void DofHandler<StreamType>::setBaudRate(int rate, boolean internal) {
-  if (!open) return;
+boolean DofHandler<StreamType>::setBaudRate(long rate, boolean internal) {
+  if (!open || baudRateToId(rate) < 0) {
+    return false;
+  }
   
-  int baudId = baudRateToId(rate);
-  if (baudId < 0) {
-    return;
+  lock(); // Keep serviceInterrupt() off the stream while it is closed
+  boolean changed = true;
+  if (internal) {
+    switchBaudRate(rate);
+  } else {
+    changed = tryBaudRate(rate);
   }
+  unlock();
+  return changed;
+}
+
+template <class StreamType>
+long DofHandler<StreamType>::negotiateBaudRate(long maxBaud) {
+  if (!open) return 0;
+  
+  lock(); // The link is read here, rather than by serviceInterrupt()
+  
+  // The 9DoF may still be starting up
+  unsigned long start = millis();
+  while (!requestSynch('W')) {
+    if (millis() - start > DOF_BAUD_STARTUP_TIMEOUT) {
+      unlock();
+      return 0;
+    }
+  }
+  
+  // The rate the link starts at is the one to fall back to, so it has to hold up itself
+  if (probeLink() > DOF_BAUD_MAX_ERRORS) {
+    unlock();
+    return 0;
+  }
+  
+  // The ID of a rate is the index of the next faster one
+  for (int next = baudRateToId(baudRate); next > 0 && next < DOF_BAUD_RATE_COUNT; next++) {
+    if (DOF_BAUD_RATES[next] > maxBaud || !tryBaudRate(DOF_BAUD_RATES[next])) {
+      break;
+    }
+  }
+  
+  unlock();
+  return baudRate;
+}
+
+template <class StreamType>
+boolean DofHandler<StreamType>::tryBaudRate(long rate) {
+  int baudId = baudRateToId(rate);
+  long previous = baudRate;
   
-  if (!internal) {
-    stream->print("#b");
-    stream->print(baudId);
+  // The 9DoF answers at the old rate, then changes
+  stream->print("#B"); // Try out _B_aud rate
+  stream->print(baudId);
+  boolean answered = waitForBaudReply(rate);
+  unsigned long trialStart = millis();
+  
+  if (answered) {
+    switchBaudRate(rate);
+    delay(DOF_BAUD_SWITCH_TIME);
+    
+    if (probeLink() <= DOF_BAUD_MAX_ERRORS) {
+      // Keep the rate: the 9DoF takes it for good once "#B<n>" comes in at it
+      for (byte i = 0; i < DOF_BAUD_MAX_ERRORS + 1; i++) {
+        stream->print("#B");
+        stream->print(baudId);
+        if (waitForBaudReply(rate)) {
+          return true;
+        }
+      }
+      
+      // A confirmation may have got through with its answer lost, and then the 9DoF stays at
+      // the new rate. Once the trial is over it is at one rate or the other, so ask at this one.
+      waitForBaudTrial(trialStart);
+      for (byte i = 0; i < DOF_BAUD_MAX_ERRORS + 1; i++) {
+        if (requestSynch('R')) {
+          return true;
+        }
+      }
+    }
+    switchBaudRate(previous);
   }
   
+  // The answer may have been the part that got lost, so wait for the 9DoF to fall back
+  // either way (it goes back to the old rate once the trial is over)
+  waitForBaudTrial(trialStart);
+  while (stream->available()) {
+    stream->read(); // Sent at the rate on trial
+  }
+  clearBuffer();
+  probeLink(); // For getLinkErrorRate()
+  return false;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::switchBaudRate(long rate) {
   stream->flush(); // SoftwareSerial does not flush() when end() is called.
   stream->end();
-  delay(internal ? 10 : 100);
-  
   stream->begin(rate);
-  delay(10);
-  
   baudRate = rate;
 }
 
+template <class StreamType>
+byte DofHandler<StreamType>::probeLink() {
+  // Synch tokens first, each one answered right away. No use going on with a link that drops them.
+  byte errors = 0;
+  for (byte i = 0; i < DOF_BAUD_PROBE_SYNCHS; i++) {
+    if (!requestSynch('A' + i)) {
+      errors++;
+    }
+  }
+  if (errors > DOF_BAUD_MAX_ERRORS) {
+    linkErrorRate = (float)errors / DOF_BAUD_PROBE_SYNCHS;
+    return errors;
+  }
+  
+  // Then a burst of test frames, answered one per sensor fusion step. The test frames take up
+  // the whole pipeline, and a frame with a bad CRC shows as a request that is never answered.
+  stats.lostRequests += requestCount;
+  removeRequests(requestCount);
+  clearBuffer();
+  uint32_t lostRequests = stats.lostRequests;
+  for (byte i = 0; i < DOF_BAUD_PROBE_FRAMES; i++) {
+    requestDataTagged();
+  }
+  
+  unsigned long timeout = DOF_BAUD_FRAME_TIMEOUT + (fusionInterval > 0 ? fusionInterval : 0);
+  unsigned long lastAnswer = millis();
+  byte pending = requestCount;
+  while (requestCount > 0 && millis() - lastAnswer <= timeout) {
+    _checkStream();
+    if (requestCount != pending) {
+      pending = requestCount;
+      lastAnswer = millis();
+    }
+  }
+  errors += requestCount + (byte)(stats.lostRequests - lostRequests);
+  stats.lostRequests += requestCount;
+  removeRequests(requestCount);
+  
+  linkErrorRate = (float)errors / (DOF_BAUD_PROBE_SYNCHS + DOF_BAUD_PROBE_FRAMES);
+  return errors;
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::waitForBaudTrial(unsigned long trialStart) {
+  unsigned long trialLeft = DOF_BAUD_TRIAL_TIME + DOF_BAUD_SWITCH_TIME;
+  if (millis() - trialStart < trialLeft) {
+    delay(trialLeft - (millis() - trialStart));
+  }
+}
+
+template <class StreamType>
+boolean DofHandler<StreamType>::requestSynch(byte id) {
+  // Answered with "#SYNCH<xy>", x and y being the ID
+  stream->print("#sL"); // _s_ynch request, ID "L<id>"
+  stream->write(id);
+  char reply[] = "#SYNCHL?";
+  reply[7] = id;
+  return waitForText(reply, getReplyTimeout());
+}
+
+template <class StreamType>
+boolean DofHandler<StreamType>::waitForBaudReply(long rate) {
+  // Answered with "#BAUD<rate>\r\n"; the line end comes right before the 9DoF changes its rate.
+  // The digits are written out here, as ltoa() is not in every C library.
+  char digits[10];
+  byte count = 0;
+  do {
+    digits[count++] = '0' + rate % 10;
+    rate /= 10;
+  } while (rate > 0);
+  char reply[16] = "#BAUD";
+  byte length = 5;
+  while (count > 0) {
+    reply[length++] = digits[--count];
+  }
+  reply[length++] = '\r';
+  reply[length++] = '\n';
+  reply[length] = '\0';
+  return waitForText(reply, getReplyTimeout());
+}
+
+template <class StreamType>
+boolean DofHandler<StreamType>::waitForText(const char *text, unsigned long timeout) {
+  byte length = strlen(text);
+  byte matched = 0;
+  unsigned long start = millis();
+  while (millis() - start <= timeout) {
+    if (!stream->available()) {
+      continue;
+    }
+    byte in = (byte)stream->read();
+    if (in == (byte)text[matched]) {
+      matched++;
+    } else {
+      matched = (in == (byte)text[0]) ? 1 : 0;
+    }
+    if (matched == length) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <class StreamType>
+unsigned long DofHandler<StreamType>::getReplyTimeout() {
+  // Time for about 20 bytes to go back and forth, at 10 bits per byte
+  return DOF_BAUD_REPLY_TIMEOUT + 200000L / baudRate;
+}
+
 template <class StreamType>
 void DofHandler<StreamType>::setUpdateInterval(short interval) {
+  lock();
   stream->print("#i");
   stream->write(interval >> 8);
   stream->write(interval);
   updateInterval = interval;
+  unlock();
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::setFusionInterval(short interval) {
+  lock();
+  stream->print("#I");
+  stream->write(interval >> 8);
+  stream->write(interval);
+  fusionInterval = interval;
+  unlock();
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::setSensorProfile(byte profile) {
+  lock();
+  stream->print("#p");
+  stream->print(profile);
+  fusionInterval = (profile == DOF_SENSOR_PROFILE_HIGH_RATE) ? 2 : 20;
+  unlock();
 }
 
 template <class StreamType>
 void DofHandler<StreamType>::setContinuousStream(boolean continuous) {
+  lock();
   if (continuous) {
     stream->println("#o1");
   } else {
     stream->println("#o0");
   }
+  unlock();
 }
 
 template <class StreamType>
 void DofHandler<StreamType>::requestData(byte mode) {
+  lock();
   setDataMode(mode);
   stream->print("#f"); // Request _f_rame
+  unlock();
 }
 
 template <class StreamType>
-int DofHandler<StreamType>::baudRateToId(int rate) {
-/*
-Baud ID values:
-  1 -> 2400 baud
-  2 -> 4800
-  3 -> 9600 baud (default)
-  4 -> 14400 baud
-  5 -> 19200 baud
-  6 -> 28800 baud (recommended)
-  7 -> 38400 baud
-  8 -> 57600 baud
-  9 -> 115200 baud
-  
-Baud rates above 28800 do not seem to work with sofware serial.
-*/
-
-  switch (rate) {
-    case 2400:
-      return 1;
-    case 4800:
-      return 2;
-    case 9600:
-      return 3;
-    case 14400:
-      return 4;
-    case 19200:
-      return 5;
-    case 28800:
-      return 6;
-    case 38400:
-      return 7;
-    case 57600:
-      return 8;
-    case 115200:
-      return 9;
+byte DofHandler<StreamType>::requestDataTagged() {
+  lock(); // The answer may be parsed by serviceInterrupt()
+  
+  // Make room for the request; the oldest one is the most likely to be lost
+  if (requestCount == DOF_MAX_REQUESTS) {
+    stats.lostRequests++;
+    removeRequests(1);
+  }
+  
+  byte tag = nextRequestTag++;
+  stream->print("#F"); // Request tagged _F_rame
+  stream->write(tag);
+  requestTags[requestCount] = tag;
+  requestTimes[requestCount] = micros();
+  requestCount++;
+  unlock();
+  return tag;
+}
+
+template <class StreamType>
+byte DofHandler<StreamType>::requestDataPipelined() {
+  lock();
+  expireRequests();
+  byte sent = 0;
+  while (requestCount < pipelineDepth) {
+    requestDataTagged();
+    sent++;
+  }
+  unlock();
+  return sent;
+}
+
+template <class StreamType>
+int DofHandler<StreamType>::baudRateToId(long rate) {
+  // The 9DoF starts at 9600 baud (3). Baud rates above 28800 do not seem to work with software
+  // serial; negotiateBaudRate() finds out what works.
+  for (byte i = 0; i < DOF_BAUD_RATE_COUNT; i++) {
+    if (DOF_BAUD_RATES[i] == rate) {
+      return i + 1;
+    }
   }
   return -1;
 }
@@ -669,25 +2279,37 @@ void DofHandler<StreamType>::setDataMode(byte mode, boolean force) {
     case DOF_DATA_MODE_ALL:
     case DOF_DATA_MODE_GYRO:
     case DOF_DATA_MODE_EULER:
+    case DOF_DATA_MODE_COMPACT:
+    case DOF_DATA_MODE_QUATERNION:
       break;
     default:
       mode = DOF_DATA_MODE_DEFAULT;
   }
   
-  clearBuffer();
+  // Packets already received are kept: each one is decoded by the data mode in its header
+  lock();
   if (force || dataMode != mode) {
     stream->print("#m");
     stream->write(mode);
   }
   
-  dataModeSize = DOF_DATA_MODE_SIZE[mode];
   dataMode = mode;
-  
+  unlock();
+}
+
+template <class StreamType>
+void DofHandler<StreamType>::setBatchSize(byte size) {
+  lock();
+  stream->print("#k");
+  stream->write(size);
+  unlock();
 }
 
 template <class StreamType>
 void DofHandler<StreamType>::zeroCalibrate() {
+  lock();
   stream->print("#z"); // _z_ero calibrate
+  unlock();
 }
 
 #endif
@@ -0,0 +1,396 @@
+#include "Arduino.h"
+
+#include "DofData.h"
+#include "DofHandler.h"
+
+#ifndef DofManager_h
+#define DofManager_h
+
+#define DOF_MANAGER_SOURCES 4 // Most 9DoFs a DofManager handles
+#define DOF_MANAGER_VALUES 9 // Values kept per sample (see DofManager::readValues())
+#define DOF_MANAGER_MAX_PASSES 4 // Most packets parsed per source and call of service()
+#define DOF_MANAGER_DEFAULT_SKEW 50000 // Default alignment window (micros, see setMaxSkew())
+
+#define DOF_FUSE_MEDIAN 0 // Per value median of the sources (outvotes a single bad 9DoF out of three)
+#define DOF_FUSE_AVERAGE 1 // Per value average of the sources, weighted by their weights
+
+/**
+ * The part of a DofHandler that does not depend on its stream type, so that handlers on
+ * HardwareSerial and SoftwareSerial can be serviced together by a DofManager.
+ * See DofHandler for what the methods do.
+ */
+class DofSource {
+  public:
+    virtual boolean checkStream(boolean loop = false) = 0;
+    virtual boolean isPacketGood() = 0;
+    virtual DofFrame getFrame() = 0;
+    virtual unsigned long getSampleTime() = 0;
+    virtual boolean isClockSynced() = 0;
+    virtual unsigned long toLocalTime(uint32_t time) = 0;
+};
+
+/**
+ * The DofSource of a DofHandler, to add it to a DofManager with. DofHandler has no virtual
+ * methods of its own, so a sketch with a single 9DoF has no vtable to pay for; only the
+ * DofManager calls through one.
+ */
+template <class StreamType> class DofHandlerSource : public DofSource {
+  public:
+    /**
+     * @param handler the DofHandler (must outlive the DofHandlerSource)
+     */
+    DofHandlerSource(DofHandler<StreamType> *handler) : handler(handler) {}
+
+    boolean checkStream(boolean loop = false) { return handler->checkStream(loop); }
+    boolean isPacketGood() { return handler->isPacketGood(); }
+    DofFrame getFrame() { return handler->getFrame(); }
+    unsigned long getSampleTime() { return handler->getSampleTime(); }
+    boolean isClockSynced() { return handler->isClockSynced(); }
+    unsigned long toLocalTime(uint32_t time) { return handler->toLocalTime(time); }
+
+  private:
+    DofHandler<StreamType> *handler;
+};
+
+/**
+ * DofManager services several 9DoFs, each with its own DofHandler (added through a
+ * DofHandlerSource), and fuses their data for redundancy. All of them should be set up to send the same data mode, either as a continuous
+ * stream or with pipelined requests (see DofHandler::requestDataPipelined()).
+ *
+ * service() gives every handler a turn at parsing its stream, round-robin. The most recent
+ * samples are aligned to the time of the newest one: with timestamps turned on (see
+ * DofHandler::setTimestamps()), a 9DoF's last two samples are extrapolated to that time, so
+ * boards that run out of phase or whose data arrives late still line up. Samples that are
+ * more than the alignment window (setMaxSkew()) older are left out, so a 9DoF that stops
+ * sending is dropped from the fused data rather than holding it back.
+ *
+ * Euler angles are fused across the +-PI wrap around, and quaternions are sign aligned before
+ * they are fused and normalized after.
+ *
+ * Note that only one SoftwareSerial can listen at a time, so all but one of the 9DoFs should be
+ * on HardwareSerial (Serial1, Serial2, Serial3 on an Arduino Mega).
+ */
+class DofManager {
+  public:
+    /**
+     * Constructs a DofManager without any 9DoFs.
+     */
+    DofManager();
+
+    /**
+     * Adds a 9DoF.
+     *
+     * @param source the DofHandlerSource of the 9DoF's DofHandler (must outlive the DofManager)
+     * @param weight Weight of the 9DoF in DOF_FUSE_AVERAGE. Optional, defaults to 1.
+     *
+     * @return false if the DofManager already handles DOF_MANAGER_SOURCES 9DoFs
+     */
+    boolean add(DofSource *source, float weight = 1);
+
+    /**
+     * Parses the incoming data of every 9DoF. Run this in the loop() function. Every 9DoF gets
+     * a turn to parse one packet, over and over, until none has a packet left or every one has had
+     * DOF_MANAGER_MAX_PASSES turns. The 9DoF that goes first changes with every call, so a busy
+     * stream cannot starve the others.
+     *
+     * @return the number of good packets received
+     */
+    byte service();
+
+    /**
+     * Returns true when a good packet has been received from any 9DoF since the flag was last
+     * cleared.
+     *
+     * @param clear clears the flag after returning its state
+     */
+    boolean isNewDataAvailable(boolean clear = false)
+      { if (newData) { newData = !clear; return true; } return false; }
+
+    /**
+     * Sets how the 9DoFs' data is fused.
+     *
+     * @param mode DOF_FUSE_MEDIAN (the default) or DOF_FUSE_AVERAGE
+     */
+    void setFusionMode(byte mode) { fusionMode = mode; }
+
+    /**
+     * Sets the alignment window: samples older than this before the newest sample are left out.
+     *
+     * @param skew the window in microseconds
+     */
+    void setMaxSkew(unsigned long skew) { maxSkew = skew; }
+
+    /**
+     * Fuses the sensor data of DOF_DATA_MODE_ALL, DOF_DATA_MODE_COMPACT and DOF_DATA_MODE_GYRO
+     * (gyroscope only) samples. Clears the new data flag.
+     *
+     * @param out the fused data
+     *
+     * @return the number of 9DoFs fused, 0 if there was no data to fuse (out is left untouched)
+     */
+    byte getData(DofData &out);
+
+    /**
+     * Same as getData(), for DOF_DATA_MODE_EULER samples.
+     */
+    byte getEulerData(EulerData &out);
+
+    /**
+     * Same as getData(), for DOF_DATA_MODE_QUATERNION samples.
+     */
+    byte getQuatData(QuatData &out);
+
+    /**
+     * Returns the time (micros()) the fused data is aligned to: the acquisition time of the
+     * newest sample.
+     */
+    unsigned long getSampleTime() { return fusedTime; }
+
+    /**
+     * Returns the number of 9DoFs added.
+     */
+    byte getSourceCount() { return count; }
+
+  private:
+    // The last two samples of a 9DoF
+    struct Track {
+      DofSource *source;
+      float weight;
+      byte mode; // Data mode of the samples
+      byte samples; // Number of valid samples (0 to 2)
+      double values[2][DOF_MANAGER_VALUES]; // The previous and the newest sample
+      unsigned long times[2]; // Acquisition times of the samples (micros())
+    };
+
+    void readFrame(Track &track, const DofFrame &frame); // Adds the samples of a packet
+    static void readValues(const DofFrame &frame, double *values); // Decodes a sample's values
+    byte fuse(byte mode, byte valueCount, double *out); // Aligns and fuses the values
+    double fuseValue(const double *values, const float *weights, byte n); // Fuses one value
+
+    Track tracks[DOF_MANAGER_SOURCES];
+    byte count; // Number of 9DoFs
+    byte first; // 9DoF that goes first in the next service()
+    byte fusionMode;
+    unsigned long maxSkew;
+    unsigned long fusedTime; // Time of the last fused data (micros())
+    boolean newData;
+};
+
+inline DofManager::DofManager() {
+  count = 0;
+  first = 0;
+  fusionMode = DOF_FUSE_MEDIAN;
+  maxSkew = DOF_MANAGER_DEFAULT_SKEW;
+  fusedTime = 0;
+  newData = false;
+}
+
+inline boolean DofManager::add(DofSource *source, float weight) {
+  if (count == DOF_MANAGER_SOURCES) return false;
+
+  Track &track = tracks[count++];
+  track.source = source;
+  track.weight = weight;
+  track.mode = DOF_DATA_MODE_DEFAULT;
+  track.samples = 0;
+  return true;
+}
+
+inline byte DofManager::service() {
+  byte received = 0;
+  for (byte pass = 0; pass < DOF_MANAGER_MAX_PASSES; pass++) {
+    boolean parsed = false;
+    for (byte i = 0; i < count; i++) {
+      Track &track = tracks[(first + i) % count];
+      if (!track.source->checkStream()) continue;
+      parsed = true;
+      if (track.source->isPacketGood()) {
+        readFrame(track, track.source->getFrame());
+        received++;
+      }
+    }
+    if (!parsed) break;
+  }
+
+  if (count > 0) first = (first + 1) % count;
+  if (received > 0) newData = true;
+  return received;
+}
+
+inline void DofManager::readFrame(Track &track, const DofFrame &frame) {
+  if (frame.getMode() != track.mode) {
+    track.mode = frame.getMode();
+    track.samples = 0;
+  }
+
+  // Samples without timestamps are all placed at the time they were received
+  boolean timed = frame.hasTimestamp() && track.source->isClockSynced();
+  unsigned long received = track.source->getSampleTime();
+  for (byte i = 0; i < frame.getSampleCount(); i++) {
+    DofFrame sample = frame.getSample(i);
+    memcpy(track.values[0], track.values[1], sizeof(track.values[0]));
+    track.times[0] = track.times[1];
+    readValues(sample, track.values[1]);
+    track.times[1] = timed ? track.source->toLocalTime(sample.getTimestamp()) : received;
+    if (track.samples < 2) track.samples++;
+  }
+}
+
+inline void DofManager::readValues(const DofFrame &frame, double *values) {
+  // DOF_DATA_MODE_ALL, DOF_DATA_MODE_COMPACT and DOF_DATA_MODE_GYRO: the accelerometer,
+  // magnetometer and gyroscope X, Y and Z, in DofData order
+  // DOF_DATA_MODE_EULER: roll, pitch and yaw
+  // DOF_DATA_MODE_QUATERNION: W, X, Y and Z
+  memset(values, 0, DOF_MANAGER_VALUES * sizeof(double));
+  switch (frame.getMode()) {
+    case DOF_DATA_MODE_EULER:
+      values[0] = frame.getRoll(); values[1] = frame.getPitch(); values[2] = frame.getYaw();
+      break;
+    case DOF_DATA_MODE_QUATERNION:
+      values[0] = frame.getQuatW(); values[1] = frame.getQuatX();
+      values[2] = frame.getQuatY(); values[3] = frame.getQuatZ();
+      break;
+    default:
+      values[0] = frame.getAccelX(); values[1] = frame.getAccelY(); values[2] = frame.getAccelZ();
+      values[3] = frame.getMagX(); values[4] = frame.getMagY(); values[5] = frame.getMagZ();
+      values[6] = frame.getGyroX(); values[7] = frame.getGyroY(); values[8] = frame.getGyroZ();
+  }
+}
+
+inline byte DofManager::getData(DofData &out) {
+  double values[DOF_MANAGER_VALUES];
+  byte n = fuse(DOF_DATA_MODE_ALL, 9, values);
+  if (n == 0) return 0;
+  out.accelX = values[0]; out.accelY = values[1]; out.accelZ = values[2];
+  out.magX = values[3]; out.magY = values[4]; out.magZ = values[5];
+  out.gyroX = values[6]; out.gyroY = values[7]; out.gyroZ = values[8];
+  return n;
+}
+
+inline byte DofManager::getEulerData(EulerData &out) {
+  double values[DOF_MANAGER_VALUES];
+  byte n = fuse(DOF_DATA_MODE_EULER, 3, values);
+  if (n == 0) return 0;
+  out.roll = values[0]; out.pitch = values[1]; out.yaw = values[2];
+  return n;
+}
+
+inline byte DofManager::getQuatData(QuatData &out) {
+  double values[DOF_MANAGER_VALUES];
+  byte n = fuse(DOF_DATA_MODE_QUATERNION, 4, values);
+  if (n == 0) return 0;
+  out.w = values[0]; out.x = values[1]; out.y = values[2]; out.z = values[3];
+  return n;
+}
+
+inline byte DofManager::fuse(byte mode, byte valueCount, double *out) {
+  newData = false;
+
+  // Sensor data modes all decode to the same values
+  boolean sensorMode = mode != DOF_DATA_MODE_EULER && mode != DOF_DATA_MODE_QUATERNION;
+
+  // Align to the newest sample
+  boolean found = false;
+  unsigned long newest = 0;
+  for (byte i = 0; i < count; i++) {
+    Track &track = tracks[i];
+    if (track.samples == 0) continue;
+    if (sensorMode ? (track.mode == DOF_DATA_MODE_EULER || track.mode == DOF_DATA_MODE_QUATERNION) : track.mode != mode) continue;
+    if (!found || (long)(track.times[1] - newest) > 0) newest = track.times[1];
+    found = true;
+  }
+  if (!found) return 0;
+
+  double values[DOF_MANAGER_VALUES][DOF_MANAGER_SOURCES];
+  float weights[DOF_MANAGER_SOURCES];
+  byte n = 0;
+  for (byte i = 0; i < count; i++) {
+    Track &track = tracks[i];
+    if (track.samples == 0) continue;
+    if (sensorMode ? (track.mode == DOF_DATA_MODE_EULER || track.mode == DOF_DATA_MODE_QUATERNION) : track.mode != mode) continue;
+    unsigned long lag = newest - track.times[1];
+    if (lag > maxSkew) continue; // Stale
+
+    // Extrapolate the last two samples to the newest sample's time
+    double step = 0;
+    long span = (long)(track.times[1] - track.times[0]);
+    if (track.samples == 2 && span > 0) {
+      step = (double)lag / span;
+    }
+    for (byte v = 0; v < valueCount; v++) {
+      double delta = track.values[1][v] - track.values[0][v];
+      if (mode == DOF_DATA_MODE_EULER) {
+        // Take the short way around
+        if (delta > PI) delta -= 2 * PI;
+        else if (delta < -PI) delta += 2 * PI;
+      }
+      values[v][n] = track.values[1][v] + delta * step;
+    }
+    weights[n] = track.weight;
+    n++;
+  }
+  if (n == 0) return 0;
+
+  if (mode == DOF_DATA_MODE_EULER) {
+    // Unwrap the angles around the first 9DoF's, so they are fused on the same side of +-PI
+    for (byte v = 0; v < valueCount; v++) {
+      for (byte i = 1; i < n; i++) {
+        double diff = values[v][i] - values[v][0];
+        if (diff > PI) values[v][i] -= 2 * PI;
+        else if (diff < -PI) values[v][i] += 2 * PI;
+      }
+    }
+  } else if (mode == DOF_DATA_MODE_QUATERNION) {
+    // q and -q are the same orientation; turn them all to the first 9DoF's side
+    for (byte i = 1; i < n; i++) {
+      double dot = 0;
+      for (byte v = 0; v < 4; v++) dot += values[v][i] * values[v][0];
+      if (dot < 0) {
+        for (byte v = 0; v < 4; v++) values[v][i] = -values[v][i];
+      }
+    }
+  }
+
+  for (byte v = 0; v < valueCount; v++) {
+    out[v] = fuseValue(values[v], weights, n);
+    if (mode == DOF_DATA_MODE_EULER) {
+      if (out[v] > PI) out[v] -= 2 * PI;
+      else if (out[v] < -PI) out[v] += 2 * PI;
+    }
+  }
+
+  if (mode == DOF_DATA_MODE_QUATERNION) {
+    double norm = sqrt(out[0] * out[0] + out[1] * out[1] + out[2] * out[2] + out[3] * out[3]);
+    if (norm > 0) {
+      for (byte v = 0; v < 4; v++) out[v] /= norm;
+    }
+  }
+
+  fusedTime = newest;
+  return n;
+}
+
+inline double DofManager::fuseValue(const double *values, const float *weights, byte n) {
+  if (fusionMode == DOF_FUSE_AVERAGE) {
+    double sum = 0;
+    float weightSum = 0;
+    for (byte i = 0; i < n; i++) {
+      sum += values[i] * weights[i];
+      weightSum += weights[i];
+    }
+    return weightSum > 0 ? sum / weightSum : values[0];
+  }
+
+  // Median: insertion sort the (at most DOF_MANAGER_SOURCES) values
+  double sorted[DOF_MANAGER_SOURCES];
+  for (byte i = 0; i < n; i++) {
+    byte j = i;
+    for (; j > 0 && sorted[j - 1] > values[i]; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = values[i];
+  }
+  return (n % 2 == 1) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+#endif
@@ -33,6 +33,24 @@ MotorController controller;
 #include "DofHandler.h"
 DofHandler<SoftwareSerial> dofHandler(&dofSerial);
 //DofHandler<HardwareSerial> dofHandler(&Serial1);
+// For redundancy, more 9DoFs can go on the other hardware serial ports (Arduino Mega), with
+// their data fused by a DofManager: dofManager.add() each handler's DofHandlerSource in
+// setup(), call dofManager.service() in loop() instead of checkStreamValid(), and read the
+// median of the boards with dofManager.getEulerData().
+//#include "DofManager.h"
+//DofHandler<HardwareSerial> dofHandler2(&Serial2);
+//DofHandler<HardwareSerial> dofHandler3(&Serial3);
+//DofHandlerSource<SoftwareSerial> dofSource(&dofHandler);
+//DofHandlerSource<HardwareSerial> dofSource2(&dofHandler2);
+//DofHandlerSource<HardwareSerial> dofSource3(&dofHandler3);
+//DofManager dofManager;
+// On a hardware serial port, the 9DoF can be read from an interrupt instead, so the printing
+// in loop() cannot make it miss packets: call dofHandler.setInterruptMode(true) and
+// dofHandler.setSampleRing(&dofSamples) in setup(), call dofHandler.serviceInterrupt() from the
+// timer interrupt below, and take the samples with dofSamples.pop() in loop().
+//DofRingBuffer<8> dofSamples;
+//ISR(TIMER0_COMPA_vect) { dofHandler.serviceInterrupt(); } // Every 1.024 ms, once setup() does
+//                                                           // OCR0A = 0x80; TIMSK0 |= _BV(OCIE0A);
 #define INCREMENT 2
 #define WTHRESHOLD 0.02
 #define CHANGE_MULTIPLIER 25
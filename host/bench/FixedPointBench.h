@@ -0,0 +1,21 @@
+#ifndef FixedPointBench_h
+#define FixedPointBench_h
+
+#include <stdint.h>
+
+/**
+ * The firmware half of bench_fixed_point, which builds the firmware in a translation unit of
+ * its own (bench_fixed_point_firmware.cpp).
+ */
+struct CalibrationResult {
+  double floatCycles; // Per sample, compensate_sensor_errors() and the float conversions before it
+  double fixedCycles; // Per sample, compensate_sensor_errors_fixed()
+  double accelError; // Largest difference of the fixed point result to the float one, in g
+  double magnError; // The same for the magnetometer (calibrated units)
+  double gyroError; // The same for the gyroscope (sensor counts)
+};
+
+// Calibrates samples random raw readings both ways, repeats times over
+CalibrationResult benchmarkCalibration(uint32_t samples, uint32_t repeats);
+
+#endif
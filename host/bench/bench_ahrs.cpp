@@ -0,0 +1,267 @@
+// The Madgwick or Mahony C library (built as bench_madgwick and bench_mahony: the two share the
+// names of their globals) on a synthetic trajectory: a board turning about all three axes, with
+// exact gyroscope, accelerometer and magnetometer readings of the true orientation. Reports the
+// updates per second of the fixed rate and measured time step updates, and how far the filter's
+// quaternion is from the truth when the samples come at a steady rate and when they jitter the
+// way the Razor's main loop does.
+//
+// Usage: bench_madgwick|bench_mahony [--quick]
+//   --quick   a short run (for ctest)
+//
+// Fails if the fixed rate updates do not give exactly what the measured time step ones give at
+// the same period (also after the gain has been changed), or if the orientation error with the
+// right time step is not small.
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Check.h"
+#include "Host.h"
+
+extern "C" {
+#ifdef AHRS_MAHONY
+#include "MahonyAHRS.h"
+extern volatile float integralFBx, integralFBy, integralFBz;
+#else
+#include "MadgwickAHRS.h"
+#endif
+}
+
+#ifdef AHRS_MAHONY
+#define FILTER_NAME "Mahony"
+#define GAIN twoKi
+#define ahrsSetSampleFreq MahonyAHRSsetSampleFreq
+#define ahrsUpdate MahonyAHRSupdate
+#define ahrsUpdateIMU MahonyAHRSupdateIMU
+#define ahrsUpdateDt MahonyAHRSupdateDt
+#define ahrsUpdateIMUDt MahonyAHRSupdateIMUDt
+#else
+#define FILTER_NAME "Madgwick"
+#define GAIN beta
+#define ahrsSetSampleFreq MadgwickAHRSsetSampleFreq
+#define ahrsUpdate MadgwickAHRSupdate
+#define ahrsUpdateIMU MadgwickAHRSupdateIMU
+#define ahrsUpdateDt MadgwickAHRSupdateDt
+#define ahrsUpdateIMUDt MadgwickAHRSupdateIMUDt
+#endif
+
+#define DEG_PER_RAD (180.0 / M_PI)
+
+// One sample: the readings at the end of a time step, and the true orientation there
+struct Sample {
+  float dt; // Seconds since the last sample
+  float gyro[3]; // rad/s
+  float accel[3];
+  float magnetom[3];
+  double truth[4]; // Quaternion of the sensor frame relative to the earth frame
+};
+
+static void multiply(const double *a, const double *b, double *out) {
+  double r[4] = {
+    a[0] * b[0] - a[1] * b[1] - a[2] * b[2] - a[3] * b[3],
+    a[0] * b[1] + a[1] * b[0] + a[2] * b[3] - a[3] * b[2],
+    a[0] * b[2] - a[1] * b[3] + a[2] * b[0] + a[3] * b[1],
+    a[0] * b[3] + a[1] * b[2] - a[2] * b[1] + a[3] * b[0]};
+  memcpy(out, r, sizeof(r));
+}
+
+// Earth frame vector v in the sensor frame of orientation q
+static void toSensor(const double *q, const double *v, float *out) {
+  double conj[4] = {q[0], -q[1], -q[2], -q[3]};
+  double p[4] = {0, v[0], v[1], v[2]};
+  multiply(conj, p, p);
+  multiply(p, q, p);
+  for (int axis = 0; axis < 3; axis++) out[axis] = p[axis + 1];
+}
+
+static void angularRate(double t, double *w) {
+  w[0] = 0.8 * sin(0.7 * t);
+  w[1] = 0.6 * sin(0.45 * t + 1.0);
+  w[2] = 0.5 * cos(0.3 * t);
+}
+
+/**
+ * count samples, period seconds apart give or take jitter seconds (uniformly). The gyroscope
+ * reading is the rate halfway through the time step; the truth is integrated in fine steps.
+ */
+static std::vector<Sample> trajectory(uint32_t count, double period, double jitter) {
+  const double gravity[3] = {0, 0, 1};
+  const double field[3] = {0.45, 0, -0.89}; // Pointing down into the ground, as up north
+  const int steps = 20;
+  std::vector<Sample> samples(count);
+  double q[4] = {1, 0, 0, 0};
+  double t = 0;
+  srand(1);
+  for (uint32_t i = 0; i < count; i++) {
+    Sample &sample = samples[i];
+    double dt = period + jitter * (2.0 * rand() / RAND_MAX - 1.0);
+    sample.dt = dt;
+    double w[3];
+    angularRate(t + dt / 2, w);
+    for (int axis = 0; axis < 3; axis++) sample.gyro[axis] = w[axis];
+    for (int s = 0; s < steps; s++) {
+      double h = dt / steps;
+      angularRate(t + (s + 0.5) * h, w);
+      double norm = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+      double angle = norm * h / 2;
+      double k = norm > 0 ? sin(angle) / norm : 0;
+      double step[4] = {cos(angle), w[0] * k, w[1] * k, w[2] * k};
+      multiply(q, step, q);
+    }
+    t += dt;
+    memcpy(sample.truth, q, sizeof(q));
+    toSensor(q, gravity, sample.accel);
+    toSensor(q, field, sample.magnetom);
+  }
+  return samples;
+}
+
+static void reset() {
+  q0 = 1.0f;
+  q1 = q2 = q3 = 0.0f;
+#ifdef AHRS_MAHONY
+  integralFBx = integralFBy = integralFBz = 0.0f;
+#endif
+}
+
+// Angle between the filter's orientation and the truth. The filter's quaternion is normalised
+// with the fast inverse square root, and is only within a few parts in a thousand of unit length.
+static double errorDegrees(const double *truth) {
+  double norm = sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+  double dot = fabs(q0 * truth[0] + q1 * truth[1] + q2 * truth[2] + q3 * truth[3]) / norm;
+  return 2 * acos(std::min(dot, 1.0)) * DEG_PER_RAD;
+}
+
+struct Accuracy {
+  double mean; // Degrees
+  double max;
+};
+
+// Runs the samples through the filter, from the start orientation, with the time step measured
+// (sampleFreq 0) or at sampleFreq
+static Accuracy track(const std::vector<Sample> &samples, float sampleFreq) {
+  reset();
+  if (sampleFreq > 0) ahrsSetSampleFreq(sampleFreq);
+  Accuracy accuracy = {0, 0};
+  for (size_t i = 0; i < samples.size(); i++) {
+    const Sample &s = samples[i];
+    if (sampleFreq > 0) {
+      ahrsUpdate(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2],
+        s.magnetom[0], s.magnetom[1], s.magnetom[2]);
+    } else {
+      ahrsUpdateDt(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2],
+        s.magnetom[0], s.magnetom[1], s.magnetom[2], s.dt);
+    }
+    double error = errorDegrees(s.truth);
+    accuracy.mean += error;
+    accuracy.max = std::max(accuracy.max, error);
+  }
+  accuracy.mean /= samples.size();
+  return accuracy;
+}
+
+// True if the fixed rate updates at sampleFreq give bit for bit what the measured time step ones
+// give with a time step of 1 / sampleFreq, with and without the magnetometer. The gain is
+// changed halfway, after the rate has been set.
+static boolean fixedRateMatches(const std::vector<Sample> &samples, float sampleFreq, float gain) {
+  const float dt = 1.0f / sampleFreq;
+  const float startGain = GAIN;
+  for (int imu = 0; imu < 2; imu++) {
+    std::vector<float> expected;
+    for (int fixed = 0; fixed < 2; fixed++) {
+      reset();
+      GAIN = startGain;
+      ahrsSetSampleFreq(sampleFreq);
+      for (size_t i = 0; i < samples.size(); i++) {
+        const Sample &s = samples[i];
+        if (i == samples.size() / 2) GAIN = gain;
+        if (imu && fixed) ahrsUpdateIMU(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2]);
+        else if (imu) ahrsUpdateIMUDt(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2], dt);
+        else if (fixed) {
+          ahrsUpdate(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2],
+            s.magnetom[0], s.magnetom[1], s.magnetom[2]);
+        } else {
+          ahrsUpdateDt(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2],
+            s.magnetom[0], s.magnetom[1], s.magnetom[2], dt);
+        }
+        const float q[] = {q0, q1, q2, q3};
+        for (int j = 0; j < 4; j++) {
+          if (!fixed) expected.push_back(q[j]);
+          else if (q[j] != expected[i * 4 + j]) {
+            GAIN = startGain;
+            return false;
+          }
+        }
+      }
+    }
+  }
+  GAIN = startGain;
+  return true;
+}
+
+// Updates per second of one of the update functions over the samples, the best of a few runs
+static double updatesPerSecond(const std::vector<Sample> &samples, uint32_t repeats, boolean fixed, boolean imu) {
+  double best = 0;
+  ahrsSetSampleFreq(1.0f / samples[0].dt);
+  for (int run = 0; run < 3; run++) {
+    reset();
+    double start = hostSeconds();
+    for (uint32_t r = 0; r < repeats; r++) {
+      for (size_t i = 0; i < samples.size(); i++) {
+        const Sample &s = samples[i];
+        if (imu && fixed) ahrsUpdateIMU(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2]);
+        else if (imu) ahrsUpdateIMUDt(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2], s.dt);
+        else if (fixed) {
+          ahrsUpdate(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2],
+            s.magnetom[0], s.magnetom[1], s.magnetom[2]);
+        } else {
+          ahrsUpdateDt(s.gyro[0], s.gyro[1], s.gyro[2], s.accel[0], s.accel[1], s.accel[2],
+            s.magnetom[0], s.magnetom[1], s.magnetom[2], s.dt);
+        }
+      }
+    }
+    double seconds = hostSeconds() - start;
+    best = std::max(best, repeats * samples.size() / seconds);
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  boolean quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  uint32_t repeats = quick ? 5 : 200;
+  const uint32_t count = 6000;
+
+  // Steady 100 Hz, and the Razor's 50 Hz loop (20 ms) with its ticks 4 ms early or late
+  std::vector<Sample> steady = trajectory(count, 0.01, 0);
+  std::vector<Sample> jittered = trajectory(count, 0.02, 0.004);
+
+  printf(FILTER_NAME " filter, %u samples\n", count);
+  printf("Updates per second (best of 3)\n");
+  printf("  fixed rate:         AHRS %5.2fM, IMU %5.2fM\n", updatesPerSecond(steady, repeats, true, false) / 1e6,
+    updatesPerSecond(steady, repeats, true, true) / 1e6);
+  printf("  measured time step: AHRS %5.2fM, IMU %5.2fM\n", updatesPerSecond(steady, repeats, false, false) / 1e6,
+    updatesPerSecond(steady, repeats, false, true) / 1e6);
+
+  CHECK(fixedRateMatches(steady, 100.0f, GAIN + 0.2f));
+  CHECK(fixedRateMatches(jittered, 50.0f, GAIN + 0.2f));
+
+  printf("Orientation error against the truth (degrees, mean / max)\n");
+  Accuracy steadyDt = track(steady, 0);
+  Accuracy steadyFixed = track(steady, 100.0f);
+  printf("  steady 100 Hz:          measured time step %6.2f / %6.2f, fixed 100 Hz  %6.2f / %6.2f\n",
+    steadyDt.mean, steadyDt.max, steadyFixed.mean, steadyFixed.max);
+  Accuracy jitteredDt = track(jittered, 0);
+  Accuracy jitteredFixed = track(jittered, 50.0f);
+  printf("  50 Hz, +-4 ms jitter:   measured time step %6.2f / %6.2f, fixed 50 Hz   %6.2f / %6.2f\n",
+    jitteredDt.mean, jitteredDt.max, jitteredFixed.mean, jitteredFixed.max);
+  Accuracy unset = track(jittered, 512.0f);
+  printf("  50 Hz, +-4 ms jitter:   fixed at the default 512 Hz         %6.2f / %6.2f\n", unset.mean, unset.max);
+
+  CHECK(steadyDt.max < 1.0);
+  CHECK(jitteredDt.max < 2.0);
+  CHECK(jitteredDt.mean <= jitteredFixed.mean);
+  return checkResult();
+}
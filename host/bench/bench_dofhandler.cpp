@@ -0,0 +1,158 @@
+// Packet throughput of DofHandler: feeds synthetic and recorded 9DoF byte streams through
+// checkStream(true) and reports packets/s, bytes/s and cycles/packet for every data mode.
+//
+// Usage: bench_dofhandler [--quick] [--replay <capture file>]
+//   --quick   a short run (for ctest)
+//   --replay  also replays a raw capture of a 9DoF's serial output
+
+#include <vector>
+#include <string>
+
+#include "DofHandler.h"
+#include "Host.h"
+#include "PacketWriter.h"
+#include "ReplayStream.h"
+
+struct Scenario {
+  std::string name;
+  std::vector<byte> bytes;
+  uint32_t packets; // Good packets in one replay (0 if unknown)
+};
+
+static std::vector<byte> readFile(const char *path) {
+  std::vector<byte> bytes;
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return bytes;
+  int c;
+  while ((c = fgetc(file)) != EOF) bytes.push_back(c);
+  fclose(file);
+  return bytes;
+}
+
+// Packets of one data mode, sample after sample
+static Scenario makeModeStream(const char *name, byte mode, uint32_t count) {
+  PacketWriter writer;
+  for (uint32_t i = 0; i < count; i++) writer.sample(mode, i);
+  return Scenario{name, writer.bytes, count};
+}
+
+// Batch packets of batchSize samples each
+static Scenario makeBatchStream(const char *name, byte mode, byte batchSize, uint32_t count) {
+  PacketWriter writer;
+  for (uint32_t i = 0; i < count; i++) writer.batch(mode, i * batchSize, batchSize);
+  return Scenario{name, writer.bytes, count};
+}
+
+// DOF_DATA_MODE_ALL packets with the Razor's recorded text output (exampleOutput.txt) between
+// every few of them, as when the 9DoF is switched between text and binary output
+static Scenario makeRecordedTextStream(const std::vector<byte> &text, uint32_t count) {
+  PacketWriter writer;
+  for (uint32_t i = 0; i < count; i++) {
+    writer.sample(DOF_DATA_MODE_ALL, i);
+    if (i % 4 == 3) writer.raw(text.data(), text.size());
+  }
+  return Scenario{"all+recorded text", writer.bytes, count};
+}
+
+// DOF_DATA_MODE_ALL packets of which one in every hundred has a flipped bit
+static Scenario makeCorruptStream(uint32_t count) {
+  PacketWriter writer;
+  uint32_t good = 0;
+  srand(1);
+  for (uint32_t i = 0; i < count; i++) {
+    size_t start = writer.bytes.size();
+    writer.sample(DOF_DATA_MODE_ALL, i);
+    if (i % 100 == 99) {
+      size_t at = start + DOF_MAGIC_SIZE + rand() % (writer.bytes.size() - start - DOF_MAGIC_SIZE);
+      writer.bytes[at] ^= 1 << (rand() % 8);
+    } else {
+      good++;
+    }
+  }
+  return Scenario{"all, 1% bit flips", writer.bytes, good};
+}
+
+// Runs a scenario until at least minPackets packets went through; false if the packet counts
+// are not what the stream holds
+static boolean runScenario(const Scenario &scenario, uint32_t minPackets) {
+  ReplayStream stream;
+  stream.load(scenario.bytes);
+  DofHandler<ReplayStream> handler(&stream, 115200);
+
+  uint32_t perReplay = scenario.packets > 0 ? scenario.packets : 1000;
+  uint32_t replays = (minPackets + perReplay - 1) / perReplay;
+  volatile double sink = 0;
+  uint32_t packets = 0;
+
+  double seconds = hostSeconds();
+  uint64_t cycles = hostCycles();
+  for (uint32_t r = 0; r < replays; r++) {
+    stream.rewind();
+    while (true) {
+      if (handler.checkStream(true)) {
+        packets++;
+        if (handler.isPacketGood()) {
+          DofFrame frame = handler.getFrame();
+          sink = sink + frame.getGyroZ() + frame.getYaw() + frame.getQuatW();
+        }
+      } else if (stream.isDone()) {
+        break;
+      }
+    }
+  }
+  cycles = hostCycles() - cycles;
+  seconds = hostSeconds() - seconds;
+
+  const DofStats &stats = handler.getStats();
+  double bytes = (double)scenario.bytes.size() * replays;
+  printf("%-22s %10lu %9.1f %12.0f %12.0f %10.1f %10lu %6lu\n", scenario.name.c_str(),
+    (unsigned long)packets, bytes / packets, packets / seconds, bytes / seconds,
+    (double)cycles / packets, (unsigned long)stats.goodPackets, (unsigned long)stats.badPackets);
+
+  if (scenario.packets > 0 && stats.goodPackets != scenario.packets * replays) {
+    printf("  expected %lu good packets\n", (unsigned long)scenario.packets * replays);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  boolean quick = false;
+  const char *replay = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) quick = true;
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay = argv[++i];
+  }
+  uint32_t minPackets = quick ? 20000 : 2000000;
+  const uint32_t count = 1000;
+
+  std::vector<Scenario> scenarios;
+  scenarios.push_back(makeModeStream("all", DOF_DATA_MODE_ALL, count));
+  scenarios.push_back(makeModeStream("all, fixed point", DOF_DATA_MODE_ALL | DOF_DATA_MODE_FIXED_POINT, count));
+  scenarios.push_back(makeModeStream("gyro", DOF_DATA_MODE_GYRO, count));
+  scenarios.push_back(makeModeStream("euler", DOF_DATA_MODE_EULER, count));
+  scenarios.push_back(makeModeStream("compact", DOF_DATA_MODE_COMPACT, count));
+  scenarios.push_back(makeModeStream("quaternion", DOF_DATA_MODE_QUATERNION, count));
+  scenarios.push_back(makeModeStream("gyro, timestamped", DOF_DATA_MODE_GYRO | DOF_DATA_MODE_TIMESTAMP, count));
+  scenarios.push_back(makeBatchStream("all, batches of 4", DOF_DATA_MODE_ALL, 4, count));
+  std::vector<byte> text = readFile(HOST_REPO_DIR "/exampleOutput.txt");
+  if (!text.empty()) scenarios.push_back(makeRecordedTextStream(text, count));
+  scenarios.push_back(makeCorruptStream(count));
+  if (replay != NULL) {
+    std::vector<byte> capture = readFile(replay);
+    if (capture.empty()) {
+      printf("Cannot read %s\n", replay);
+      return 1;
+    }
+    scenarios.push_back(Scenario{replay, capture, 0});
+  }
+
+  std::string perPacket = std::string(hostCycleUnit()) + "/pkt";
+  printf("%-22s %10s %9s %12s %12s %10s %10s %6s\n", "stream", "packets", "bytes/pkt",
+    "packets/s", "bytes/s", perPacket.c_str(), "good", "bad");
+  boolean ok = true;
+  for (size_t i = 0; i < scenarios.size(); i++) {
+    ok &= runScenario(scenarios[i], minPackets);
+  }
+  return ok ? 0 : 1;
+}
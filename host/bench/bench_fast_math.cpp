@@ -0,0 +1,267 @@
+// The approximations of FastMath.h against the math library: cycles per call and the largest
+// error of fast_sin, fast_cos, fast_atan2 and fast_asin, and then the firmware's fusion filters
+// (FusionFilter.h) built both ways, on the same synthetic motion: time per update and how far
+// the Euler angles of the two builds get apart.
+//
+// Usage: bench_fast_math [--quick]
+//   --quick   a short run (for ctest)
+//
+// Fails if an approximation is off by more than FastMath.h says, or if the filters built with
+// FUSION__FAST_MATH give angles more than 0.1 degrees from the ones of the math library build.
+//
+// The host has a floating point unit and a fast math library, so the timings here say little
+// about the ATmega328, where every float operation is a library call.
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Check.h"
+#include "Host.h"
+
+// FastMath.h with FUSION__FAST_MATH false: the FUSION_* macros are the math library functions
+#include "FastMath.h"
+#include "FusionCore.h"
+
+namespace library {
+#include "FusionFilter.h"
+}
+
+// The same filters again, with the FUSION_* macros switched to the approximations
+#undef FusionFilter_h
+#undef FUSION_SIN
+#undef FUSION_COS
+#undef FUSION_ATAN2
+#undef FUSION_ASIN
+#define FUSION_SIN(x) fast_sin(x)
+#define FUSION_COS(x) fast_cos(x)
+#define FUSION_ATAN2(y, x) fast_atan2(y, x)
+#define FUSION_ASIN(x) fast_asin(x)
+
+namespace fast {
+#include "FusionFilter.h"
+}
+
+#define INPUTS 4096
+#define DEG_PER_RAD (180.0 / M_PI)
+
+// The firmware's settings (Vars.h and Config.h)
+#define GRAVITY 256.0f
+#define Kp_ROLLPITCH 0.02f
+#define Ki_ROLLPITCH 0.00002f
+#define Kp_YAW 1.2f
+#define Ki_YAW 0.00002f
+#define MADGWICK_BETA 0.1f
+#define MAHONY_TWO_KP (2.0f * 0.5f)
+#define MAHONY_TWO_KI (2.0f * 0.0f)
+
+static volatile float sink;
+
+// Cycles per call of function over inputs, the best of a few runs
+template <class Function>
+static double cyclesPerCall(const std::vector<float> &x, const std::vector<float> &y, uint32_t repeats, Function function) {
+  double best = 1e30;
+  for (int run = 0; run < 3; run++) {
+    float sum = 0;
+    uint64_t start = hostCycles();
+    for (uint32_t r = 0; r < repeats; r++) {
+      for (size_t i = 0; i < x.size(); i++) sum += function(x[i], y[i]);
+    }
+    best = std::min(best, (double)(hostCycles() - start) / (repeats * x.size()));
+    sink = sum;
+  }
+  return best;
+}
+
+static float librarySin(float x, float) { return sin(x); }
+static float fastSin(float x, float) { return fast_sin(x); }
+static float libraryCos(float x, float) { return cos(x); }
+static float fastCos(float x, float) { return fast_cos(x); }
+static float libraryAtan2(float y, float x) { return atan2(y, x); }
+static float fastAtan2(float y, float x) { return fast_atan2(y, x); }
+static float libraryAsin(float x, float) { return asin(x); }
+static float fastAsin(float x, float) { return fast_asin(x); }
+
+// Largest errors over dense sweeps of the inputs, against double precision
+struct Errors {
+  double sin, cos, atan2, asin;
+};
+
+static Errors measureErrors(uint32_t points) {
+  Errors errors = {0, 0, 0, 0};
+  for (uint32_t i = 0; i <= points; i++) {
+    float x = (float)(-4 * M_PI + 8 * M_PI * i / points);
+    errors.sin = std::max(errors.sin, fabs(fast_sin(x) - sin((double)x)));
+    errors.cos = std::max(errors.cos, fabs(fast_cos(x) - cos((double)x)));
+
+    float a = (float)(-M_PI + 2 * M_PI * i / points);
+    for (float r = 1e-3f; r < 1e4f; r *= 10) {
+      float y = r * sinf(a), x = r * cosf(a);
+      double error = fabs(fast_atan2(y, x) - atan2((double)y, (double)x));
+      errors.atan2 = std::max(errors.atan2, std::min(error, 2 * M_PI - error)); // Either side of +-pi
+    }
+
+    x = (float)(-1.0 + 2.0 * i / points);
+    errors.asin = std::max(errors.asin, fabs(fast_asin(x) - asin((double)x)));
+  }
+  return errors;
+}
+
+// One sample of the motion: the sensor readings, in the firmware's frame and units
+struct Sample {
+  float gyro[3]; // rad/s
+  float accel[3];
+  float magnetom[3];
+};
+
+static void eulerRates(double t, double angles[3], double rates[3]) {
+  angles[0] = 1.5 * sin(0.2 * t) + 0.3 * t; // Yaw
+  angles[1] = 0.9 * sin(0.37 * t); // Pitch, within +-52 degrees
+  angles[2] = 1.2 * sin(0.29 * t); // Roll
+  rates[0] = 0.3 * cos(0.2 * t) + 0.3;
+  rates[1] = 0.9 * 0.37 * cos(0.37 * t);
+  rates[2] = 1.2 * 0.29 * cos(0.29 * t);
+}
+
+// Earth frame vector v (north, east, down) in the sensor frame at yaw, pitch and roll
+static void toSensor(const double angles[3], const double v[3], float out[3]) {
+  double cy = cos(angles[0]), sy = sin(angles[0]);
+  double cp = cos(angles[1]), sp = sin(angles[1]);
+  double cr = cos(angles[2]), sr = sin(angles[2]);
+  out[0] = cp * cy * v[0] + cp * sy * v[1] - sp * v[2];
+  out[1] = (sr * sp * cy - cr * sy) * v[0] + (sr * sp * sy + cr * cy) * v[1] + sr * cp * v[2];
+  out[2] = (cr * sp * cy + sr * sy) * v[0] + (cr * sp * sy - sr * cy) * v[1] + cr * cp * v[2];
+}
+
+// A board swinging about all three axes, sampled every dt seconds
+static std::vector<Sample> motion(uint32_t count, float dt) {
+  const double gravity[3] = {0, 0, GRAVITY}; // The accelerometer vector is gravity (see FusionFilter.h)
+  const double field[3] = {200, 0, 400};
+  std::vector<Sample> samples(count);
+  for (uint32_t i = 0; i < count; i++) {
+    double angles[3], rates[3];
+    eulerRates((i - 0.5) * dt, angles, rates); // Rates halfway through the time step
+    double sr = sin(angles[2]), cr = cos(angles[2]), sp = sin(angles[1]), cp = cos(angles[1]);
+    samples[i].gyro[0] = rates[2] - rates[0] * sp;
+    samples[i].gyro[1] = rates[1] * cr + rates[0] * sr * cp;
+    samples[i].gyro[2] = -rates[1] * sr + rates[0] * cr * cp;
+    eulerRates(i * dt, angles, rates);
+    toSensor(angles, gravity, samples[i].accel);
+    toSensor(angles, field, samples[i].magnetom);
+  }
+  return samples;
+}
+
+static double angleDifference(double a, double b) {
+  double d = fabs(a - b) * DEG_PER_RAD;
+  d = fmod(d, 360);
+  return std::min(d, 360 - d);
+}
+
+struct FilterResult {
+  double libraryNs, fastNs; // Per update (and Euler angles)
+  double difference; // Largest difference between the Euler angles of the two builds (degrees)
+  double truthError; // Largest error of the library build's angles against the motion (degrees)
+};
+
+// Runs the library and fast builds of one filter over the samples
+template <class LibraryFilter, class FastFilter>
+static FilterResult compareFilters(LibraryFilter libraryFilter, FastFilter fastFilter,
+    const std::vector<Sample> &samples, float dt, uint32_t repeats) {
+  FilterResult result = {0, 0, 0, 0};
+  for (size_t i = 0; i < samples.size(); i++) {
+    float angles[2][3];
+    libraryFilter.update(samples[i].gyro, samples[i].accel, samples[i].magnetom, dt);
+    libraryFilter.getEuler(angles[0][0], angles[0][1], angles[0][2]);
+    fastFilter.update(samples[i].gyro, samples[i].accel, samples[i].magnetom, dt);
+    fastFilter.getEuler(angles[1][0], angles[1][1], angles[1][2]);
+    double truth[3], rates[3];
+    eulerRates(i * dt, truth, rates);
+    for (int axis = 0; axis < 3; axis++) {
+      result.difference = std::max(result.difference, angleDifference(angles[0][axis], angles[1][axis]));
+      if (i > samples.size() / 10) { // Once the filter has settled
+        result.truthError = std::max(result.truthError, angleDifference(angles[0][axis], truth[axis]));
+      }
+    }
+  }
+
+  for (int build = 0; build < 2; build++) {
+    double best = 1e30;
+    for (int run = 0; run < 3; run++) {
+      float yaw, pitch, roll, sum = 0;
+      double start = hostSeconds();
+      for (uint32_t r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < samples.size(); i++) {
+          if (build == 0) {
+            libraryFilter.update(samples[i].gyro, samples[i].accel, samples[i].magnetom, dt);
+            libraryFilter.getEuler(yaw, pitch, roll);
+          } else {
+            fastFilter.update(samples[i].gyro, samples[i].accel, samples[i].magnetom, dt);
+            fastFilter.getEuler(yaw, pitch, roll);
+          }
+          sum += yaw + pitch + roll;
+        }
+      }
+      best = std::min(best, (hostSeconds() - start) * 1e9 / (repeats * samples.size()));
+      sink = sum;
+    }
+    (build == 0 ? result.libraryNs : result.fastNs) = best;
+  }
+  return result;
+}
+
+int main(int argc, char **argv) {
+  boolean quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  uint32_t repeats = quick ? 20 : 2000;
+  const char *unit = hostCycleUnit();
+
+  srand(1);
+  std::vector<float> angles(INPUTS), ones(INPUTS), ys(INPUTS), xs(INPUTS);
+  for (int i = 0; i < INPUTS; i++) {
+    angles[i] = (float)(8 * M_PI * rand() / RAND_MAX - 4 * M_PI);
+    ones[i] = (float)(2.0 * rand() / RAND_MAX - 1.0);
+    ys[i] = (float)(rand() % 2001 - 1000);
+    xs[i] = (float)(rand() % 2001 - 1000);
+  }
+
+  printf("Approximations (%s per call: math library, FastMath.h)\n", unit);
+  Errors errors = measureErrors(quick ? 100000 : 2000000);
+  printf("  sin    %5.1f  %5.1f   largest error %.1e\n", cyclesPerCall(angles, ones, repeats, librarySin),
+    cyclesPerCall(angles, ones, repeats, fastSin), errors.sin);
+  printf("  cos    %5.1f  %5.1f   largest error %.1e\n", cyclesPerCall(angles, ones, repeats, libraryCos),
+    cyclesPerCall(angles, ones, repeats, fastCos), errors.cos);
+  printf("  atan2  %5.1f  %5.1f   largest error %.1e rad\n", cyclesPerCall(ys, xs, repeats, libraryAtan2),
+    cyclesPerCall(ys, xs, repeats, fastAtan2), errors.atan2);
+  printf("  asin   %5.1f  %5.1f   largest error %.1e rad\n", cyclesPerCall(ones, ones, repeats, libraryAsin),
+    cyclesPerCall(ones, ones, repeats, fastAsin), errors.asin);
+  // The bounds FastMath.h documents
+  CHECK(errors.sin <= 7.6e-5);
+  CHECK(errors.cos <= 7.6e-5);
+  CHECK(errors.atan2 <= 1.2e-5);
+  CHECK(errors.asin <= 6.8e-5);
+
+  const float dt = 0.02f;
+  std::vector<Sample> samples = motion(quick ? 5000 : 50000, dt);
+  uint32_t filterRepeats = quick ? 1 : 10;
+  printf("Fusion filters at 50 Hz, %u samples (ns per update: math library, FUSION__FAST_MATH)\n",
+    (unsigned)samples.size());
+  FilterResult results[3] = {
+    compareFilters(library::DcmFilter(GRAVITY, Kp_ROLLPITCH, Ki_ROLLPITCH, Kp_YAW, Ki_YAW),
+      fast::DcmFilter(GRAVITY, Kp_ROLLPITCH, Ki_ROLLPITCH, Kp_YAW, Ki_YAW), samples, dt, filterRepeats),
+    compareFilters(library::MadgwickFilter(MADGWICK_BETA), fast::MadgwickFilter(MADGWICK_BETA), samples, dt,
+      filterRepeats),
+    compareFilters(library::MahonyFilter(MAHONY_TWO_KP, MAHONY_TWO_KI),
+      fast::MahonyFilter(MAHONY_TWO_KP, MAHONY_TWO_KI), samples, dt, filterRepeats)};
+  const char *names[] = {"DCM", "Madgwick", "Mahony"};
+  for (int f = 0; f < 3; f++) {
+    printf("  %-9s %6.1f  %6.1f (%.2fx)   largest difference %.4f deg (%.2f deg from the motion)\n", names[f],
+      results[f].libraryNs, results[f].fastNs, results[f].libraryNs / results[f].fastNs, results[f].difference,
+      results[f].truthError);
+    CHECK(results[f].difference < 0.1);
+  }
+  printf("(The host has a floating point unit; on the ATmega328 the math library functions take\n"
+    " thousands of cycles each, so the approximations save much more there.)\n");
+  return checkResult();
+}
@@ -0,0 +1,108 @@
+// Fixed point against float, on both ends of the link: the firmware's sensor calibration
+// (compensate_sensor_errors_fixed() against compensate_sensor_errors()) and DofHandler decoding
+// fixed point packets with getDataFixed()/getEulerDataFixed() against float packets with
+// getData()/getEulerData(). Reports cycles and the largest error of the fixed point results.
+//
+// Usage: bench_fixed_point [--quick]
+//   --quick   a short run (for ctest)
+//
+// Fails if a fixed point result is off by more than its resolution allows.
+
+#include <vector>
+
+#include "DofHandler.h"
+#include "FixedPointBench.h"
+#include "Host.h"
+#include "PacketWriter.h"
+#include "ReplayStream.h"
+
+struct DecodeResult {
+  double cycles; // Per packet
+  double error; // Largest difference to the float packets' values
+};
+
+// Decodes count packets of mode (fixed or float) repeats times over
+static DecodeResult decode(byte mode, uint32_t count, uint32_t repeats) {
+  boolean fixed = mode & DOF_DATA_MODE_FIXED_POINT;
+  boolean euler = (mode & ~DOF_DATA_MODE_FLAGS) == DOF_DATA_MODE_EULER;
+  PacketWriter writer;
+  for (uint32_t i = 0; i < count; i++) writer.sample(mode, i);
+  ReplayStream stream;
+  stream.load(writer.bytes);
+  DofHandler<ReplayStream> handler(&stream, 115200);
+
+  DecodeResult result = {0, 0};
+  volatile double floatSink = 0;
+  volatile int32_t fixedSink = 0;
+  uint32_t packets = 0;
+  uint64_t cycles = hostCycles();
+  for (uint32_t r = 0; r < repeats; r++) {
+    stream.rewind();
+    for (uint32_t i = 0; handler.checkStream(true); i++) {
+      packets++;
+      if (fixed && euler) {
+        EulerDataFixed angles = handler.getEulerDataFixed();
+        fixedSink = fixedSink + angles.roll + angles.pitch + angles.yaw;
+      } else if (fixed) {
+        DofDataFixed data = handler.getDataFixed();
+        fixedSink = fixedSink + data.accelX + data.magX + data.gyroX;
+      } else if (euler) {
+        EulerData angles = handler.getEulerData();
+        floatSink = floatSink + angles.roll + angles.pitch + angles.yaw;
+      } else {
+        DofData data = handler.getData();
+        floatSink = floatSink + data.accelX + data.magX + data.gyroX;
+      }
+
+      // What a float packet would have had
+      if (r > 0 || !fixed) continue;
+      if (euler) {
+        EulerDataFixed angles = handler.getEulerDataFixed();
+        const int32_t values[] = {angles.roll, angles.pitch, angles.yaw};
+        for (byte axis = 0; axis < 3; axis++) {
+          result.error = max(result.error, fabs(values[axis] / DOF_FIXED_ONE - PacketWriter::eulerValue(i, axis)));
+        }
+      } else {
+        DofDataFixed data = handler.getDataFixed();
+        const int32_t values[] = {data.accelX, data.accelY, data.accelZ, data.magX, data.magY, data.magZ};
+        for (byte value = 0; value < 6; value++) {
+          result.error = max(result.error, fabs(values[value] / DOF_FIXED_ONE - PacketWriter::sensorValue(i, value)));
+        }
+      }
+    }
+  }
+  result.cycles = (double)(hostCycles() - cycles) / packets;
+  return result;
+}
+
+int main(int argc, char **argv) {
+  boolean quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  uint32_t repeats = quick ? 20 : 2000;
+  const uint32_t count = 1000;
+  const char *unit = hostCycleUnit();
+  boolean ok = true;
+
+  CalibrationResult calibration = benchmarkCalibration(count, repeats);
+  printf("Firmware sensor calibration (%s per sample)\n", unit);
+  printf("  float %.1f, fixed point %.1f (%.2fx)\n", calibration.floatCycles,
+    calibration.fixedCycles, calibration.floatCycles / calibration.fixedCycles);
+  printf("  largest fixed point error: accelerometer %.6f g, magnetometer %.4f, gyroscope %.2f counts\n",
+    calibration.accelError, calibration.magnError, calibration.gyroError);
+  // Accelerometer scale constants are Q23 (and the result Q16), the magnetometer transform Q12 on
+  // readings of a few hundred, and the gyroscope offsets are rounded to whole counts
+  ok &= calibration.accelError < 1e-3 && calibration.magnError < 0.5 && calibration.gyroError <= 0.5;
+
+  printf("DofHandler decoding (%s per packet)\n", unit);
+  const byte modes[] = {DOF_DATA_MODE_ALL, DOF_DATA_MODE_EULER};
+  const char *names[] = {"all", "euler"};
+  for (byte m = 0; m < 2; m++) {
+    DecodeResult floats = decode(modes[m], count, repeats);
+    DecodeResult fixed = decode(modes[m] | DOF_DATA_MODE_FIXED_POINT, count, repeats);
+    printf("  %-6s float %.1f, fixed point %.1f (%.2fx), largest fixed point error %.7f\n", names[m],
+      floats.cycles, fixed.cycles, floats.cycles / fixed.cycles, fixed.error);
+    ok &= fixed.error <= 0.5 / DOF_FIXED_ONE;
+  }
+  printf("(The host has a floating point unit; the ATmega328 does not, so there every float\n"
+    " operation is a library call of tens to hundreds of cycles.)\n");
+  return ok ? 0 : 1;
+}
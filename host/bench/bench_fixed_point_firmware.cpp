@@ -0,0 +1,75 @@
+// The firmware half of bench_fixed_point (see FixedPointBench.h)
+
+#include "Firmware.h"
+#include "Host.h"
+#include "FixedPointBench.h"
+
+#include <vector>
+
+struct RawSample {
+  int accel[3];
+  int magnetom[3];
+  int gyro[3];
+};
+
+CalibrationResult benchmarkCalibration(uint32_t samples, uint32_t repeats) {
+  init_fixed_point_calibration();
+
+  // Readings over the sensors' whole calibrated range
+  srand(1);
+  std::vector<RawSample> raw(samples);
+  for (uint32_t i = 0; i < samples; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      raw[i].accel[axis] = rand() % 601 - 300;
+      raw[i].magnetom[axis] = rand() % 1401 - 700;
+      raw[i].gyro[axis] = rand() % 4001 - 2000;
+    }
+  }
+
+  CalibrationResult result = {0, 0, 0, 0, 0};
+  volatile float floatSink = 0;
+  volatile long fixedSink = 0;
+
+  // Float path, as loop() runs it: read_sensors() converts the raw readings, then the calibration
+  uint64_t cycles = hostCycles();
+  for (uint32_t r = 0; r < repeats; r++) {
+    for (uint32_t i = 0; i < samples; i++) {
+      for (int axis = 0; axis < 3; axis++) {
+        accel[axis] = raw[i].accel[axis];
+        magnetom[axis] = raw[i].magnetom[axis];
+        gyro[axis] = raw[i].gyro[axis];
+      }
+      compensate_sensor_errors();
+      floatSink = floatSink + accel[0] + magnetom[0] + gyro[0];
+    }
+  }
+  result.floatCycles = (double)(hostCycles() - cycles) / samples / repeats;
+
+  cycles = hostCycles();
+  for (uint32_t r = 0; r < repeats; r++) {
+    for (uint32_t i = 0; i < samples; i++) {
+      memcpy(accel_raw, raw[i].accel, sizeof(accel_raw));
+      memcpy(magnetom_raw, raw[i].magnetom, sizeof(magnetom_raw));
+      memcpy(gyro_raw, raw[i].gyro, sizeof(gyro_raw));
+      compensate_sensor_errors_fixed();
+      fixedSink = fixedSink + accel_fixed[0] + magnetom_fixed[0] + gyro_fixed[0];
+    }
+  }
+  result.fixedCycles = (double)(hostCycles() - cycles) / samples / repeats;
+
+  for (uint32_t i = 0; i < samples; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      accel[axis] = accel_raw[axis] = raw[i].accel[axis];
+      magnetom[axis] = magnetom_raw[axis] = raw[i].magnetom[axis];
+      gyro[axis] = gyro_raw[axis] = raw[i].gyro[axis];
+    }
+    compensate_sensor_errors();
+    compensate_sensor_errors_fixed();
+    for (int axis = 0; axis < 3; axis++) {
+      result.accelError = max(result.accelError, fabs(accel_fixed[axis] / 65536.0 - accel[axis] / GRAVITY));
+      result.magnError = max(result.magnError, fabs(magnetom_fixed[axis] / 65536.0 - magnetom[axis]));
+      result.gyroError = max(result.gyroError, fabs(gyro_fixed[axis] - gyro[axis]));
+    }
+  }
+  return result;
+}
@@ -0,0 +1,268 @@
+// DofHandler's bulk buffer parser against the per-byte state machine it replaced: cycles per
+// packet and good/bad packet counts on the same streams.
+//
+// Usage: bench_parser [--quick]
+//   --quick   a short run (for ctest)
+//
+// Fails if the two parsers count different numbers of good or bad packets, or if the bulk
+// parser does not take TARGET_SPEEDUP times fewer cycles per packet on every stream.
+
+#include <vector>
+#include <string>
+
+#include "DofHandler.h"
+#include "Host.h"
+#include "PacketWriter.h"
+#include "ReplayStream.h"
+
+#define RUNS 9 // Runs per parser and stream, the best counts
+#define TARGET_SPEEDUP 3
+
+/**
+ * The parser DofHandler had before the bulk receive buffer (its _checkStream() and
+ * readPacket()), brought up to framing version 1 so it reads the same streams: a read() per
+ * byte, a state machine for the "9DoF" magic number, header, data and CRC, and every field
+ * decoded as soon as a packet is in. Only the data modes it knew are decoded.
+ */
+template <class StreamType> class LegacyParser {
+  public:
+    LegacyParser(StreamType *stream) : stream(stream), packetState(0), dataBufferSize(0),
+      crcHigh(0), data(), eulerData(), gyroData(), lastPacketGood(false), newData(false), goodCount(0), badCount(0), dataTime(0) {}
+
+    boolean checkStream(boolean loop = false) {
+      if (loop) {
+        while (stream->available()) {
+          if (_checkStream()) {
+            return true;
+          }
+        }
+      } else if (stream->available()) {
+        return _checkStream();
+      }
+      return false;
+    }
+
+    boolean isPacketGood() { return lastPacketGood; }
+    DofData getData() { newData = false; return data; }
+    EulerData getEulerData() { newData = false; return eulerData; }
+    uint32_t goodPackets() { return goodCount; }
+    uint32_t badPackets() { return badCount; }
+
+  private:
+    boolean _checkStream() {
+      byte in = (byte)stream->read();
+      boolean packet = false;
+      switch (packetState) {
+        case 0:
+          if (in == '9') packetState = 1;
+          break;
+        case 1:
+          packetState = (in == 'D') ? 2 : 0;
+          break;
+        case 2:
+          packetState = (in == 'o') ? 3 : 0;
+          break;
+        case 3:
+          packetState = (in == 'F') ? 4 : 0;
+          break;
+        case 4: // Header
+          header[dataBufferSize++] = in;
+          if (dataBufferSize == DOF_HEADER_SIZE) {
+            dataBufferSize = 0;
+            packetState = (header[0] == DOF_FRAME_VERSION && header[3] <= DOF_DATA_SIZE) ? 5 : 0;
+            if (packetState == 5 && header[3] == 0) packetState = 6;
+          }
+          break;
+        case 5: // Data
+          dataBuffer[dataBufferSize++] = in;
+          if (dataBufferSize == header[3]) packetState = 6;
+          break;
+        case 6: // CRC, high byte
+          crcHigh = in;
+          packetState = 7;
+          break;
+        default: { // CRC, low byte
+          uint16_t crc = 0xFFFF;
+          for (byte i = 0; i < DOF_HEADER_SIZE; i++) crc = dofCrc16Update(crc, header[i]);
+          for (byte i = 0; i < header[3]; i++) crc = dofCrc16Update(crc, dataBuffer[i]);
+          if (crc == (((uint16_t)crcHigh << 8) | in)) {
+            readPacket();
+            lastPacketGood = true;
+            goodCount++;
+            dataTime = millis();
+          } else {
+            badCount++;
+            lastPacketGood = false;
+          }
+          packet = true;
+          newData = true;
+          packetState = 0;
+          dataBufferSize = 0;
+        }
+      }
+      return packet;
+    }
+
+    void readPacket() {
+      switch (header[2]) {
+        case DOF_DATA_MODE_ALL:
+          data.accelX = DofFrame::readFloat(dataBuffer);
+          data.accelY = DofFrame::readFloat(dataBuffer + 4);
+          data.accelZ = DofFrame::readFloat(dataBuffer + 8);
+          data.magX = DofFrame::readFloat(dataBuffer + 12);
+          data.magY = DofFrame::readFloat(dataBuffer + 16);
+          data.magZ = DofFrame::readFloat(dataBuffer + 20);
+          readGyro(dataBuffer + 24);
+          break;
+        case DOF_DATA_MODE_GYRO:
+          readGyro(dataBuffer);
+          break;
+        case DOF_DATA_MODE_EULER:
+          eulerData.roll = DofFrame::readFloat(dataBuffer);
+          eulerData.pitch = DofFrame::readFloat(dataBuffer + 4);
+          eulerData.yaw = DofFrame::readFloat(dataBuffer + 8);
+          break;
+      }
+    }
+
+    void readGyro(const byte *in) {
+      data.gyroX = DofFrame::readShort(in) * DOF_GYRO_SCALE;
+      data.gyroY = DofFrame::readShort(in + 2) * DOF_GYRO_SCALE;
+      data.gyroZ = DofFrame::readShort(in + 4) * DOF_GYRO_SCALE;
+      gyroData.x = data.gyroX * 100;
+      gyroData.y = data.gyroY * 100;
+      gyroData.z = data.gyroZ * 100;
+      gyroData.checkSum = (gyroData.x + gyroData.y + gyroData.z) % 10;
+    }
+
+    StreamType *stream;
+    byte packetState;
+    byte header[DOF_HEADER_SIZE];
+    byte dataBuffer[DOF_DATA_SIZE];
+    byte dataBufferSize;
+    byte crcHigh;
+    DofData data;
+    EulerData eulerData;
+    GyroData gyroData;
+    boolean lastPacketGood;
+    boolean newData;
+    uint32_t goodCount;
+    uint32_t badCount;
+    unsigned long dataTime;
+};
+
+/**
+ * DofHandler, with the packet counts where measure() looks for them.
+ */
+class BulkParser : public DofHandler<ReplayStream> {
+  public:
+    BulkParser(ReplayStream *stream) : DofHandler<ReplayStream>(stream, 115200) {}
+    uint32_t goodPackets() { return getStats().goodPackets; }
+    uint32_t badPackets() { return getStats().badPackets; }
+};
+
+struct Result {
+  uint32_t good;
+  uint32_t bad;
+  double cyclesPerPacket;
+};
+
+// Replays the stream through checkStream(true) the given number of times, reading the
+// sensor data and Euler angles of every good packet like an application would
+template <class Parser> static double cyclesPerPacket(Parser &parser, ReplayStream &stream, uint32_t replays) {
+  volatile double sink = 0;
+  uint32_t packets = 0;
+  uint64_t cycles = hostCycles();
+  for (uint32_t r = 0; r < replays; r++) {
+    stream.rewind();
+    while (true) {
+      if (parser.checkStream(true)) {
+        packets++;
+        if (parser.isPacketGood()) sink = sink + parser.getData().gyroZ + parser.getEulerData().yaw;
+      } else if (stream.isDone()) {
+        break;
+      }
+    }
+  }
+  cycles = hostCycles() - cycles;
+  return (double)cycles / packets;
+}
+
+// One run, with a parser of its own
+template <class Parser> static Result measure(const std::vector<byte> &bytes, uint32_t replays) {
+  ReplayStream stream;
+  stream.load(bytes);
+  Parser parser(&stream);
+  Result result;
+  result.cyclesPerPacket = cyclesPerPacket(parser, stream, replays);
+  result.good = parser.goodPackets();
+  result.bad = parser.badPackets();
+  return result;
+}
+
+static boolean compare(const char *name, const std::vector<byte> &bytes, uint32_t minPackets,
+    uint32_t packetsPerReplay, boolean &fast) {
+  uint32_t replays = (minPackets + packetsPerReplay - 1) / packetsPerReplay;
+  // The runs of the two parsers take turns, so a change in the machine's load or clock
+  // speed hits both; the best run of each counts
+  Result before = {0, 0, 0}, after = {0, 0, 0};
+  for (byte run = 0; run < RUNS; run++) {
+    Result legacy = measure<LegacyParser<ReplayStream> >(bytes, replays);
+    Result bulk = measure<BulkParser>(bytes, replays);
+    if (run == 0 || legacy.cyclesPerPacket < before.cyclesPerPacket) before = legacy;
+    if (run == 0 || bulk.cyclesPerPacket < after.cyclesPerPacket) after = bulk;
+  }
+
+  double speedup = before.cyclesPerPacket / after.cyclesPerPacket;
+  printf("%-22s %12.1f %12.1f %8.2fx %10lu %10lu %6lu %6lu\n", name, before.cyclesPerPacket,
+    after.cyclesPerPacket, speedup, (unsigned long)before.good, (unsigned long)after.good,
+    (unsigned long)before.bad, (unsigned long)after.bad);
+
+  boolean ok = true;
+  if (before.good != after.good || before.bad != after.bad) {
+    printf("  good/bad packet counts differ\n");
+    ok = false;
+  }
+  if (speedup < TARGET_SPEEDUP) {
+    printf("  less than %dx fewer %s per packet\n", TARGET_SPEEDUP, hostCycleUnit());
+    fast = false;
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  boolean quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  uint32_t minPackets = quick ? 20000 : 2000000;
+  const uint32_t count = 1000;
+
+  printf("%-22s %12s %12s %9s %10s %10s %6s %6s\n", "stream", "per-byte", "bulk", "speedup",
+    "good", "good", "bad", "bad");
+
+  boolean ok = true;
+  boolean fast = true;
+  const byte modes[] = {DOF_DATA_MODE_ALL, DOF_DATA_MODE_GYRO, DOF_DATA_MODE_EULER};
+  const char *names[] = {"all", "gyro", "euler"};
+  for (byte m = 0; m < 3; m++) {
+    PacketWriter writer;
+    for (uint32_t i = 0; i < count; i++) writer.sample(modes[m], i);
+    ok &= compare(names[m], writer.bytes, minPackets, count, fast);
+  }
+
+  // The Razor's recorded text output between the packets
+  FILE *file = fopen(HOST_REPO_DIR "/exampleOutput.txt", "rb");
+  std::vector<byte> text;
+  int c;
+  while (file != NULL && (c = fgetc(file)) != EOF) text.push_back(c);
+  if (file != NULL) fclose(file);
+  PacketWriter recorded;
+  for (uint32_t i = 0; i < count; i++) {
+    recorded.sample(DOF_DATA_MODE_ALL, i);
+    if (i % 4 == 3) recorded.raw(text.data(), text.size());
+  }
+  ok &= compare("all+recorded text", recorded.bytes, minPackets, count, fast);
+
+  printf("(%s per packet, best of %d; good and bad counts per-byte / bulk)\n", hostCycleUnit(), RUNS);
+  printf("%s %dx fewer %s per packet on every stream\n", fast ? "At least" : "Not", TARGET_SPEEDUP,
+    hostCycleUnit());
+  return ok && fast ? 0 : 1;
+}
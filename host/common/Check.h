@@ -0,0 +1,35 @@
+#ifndef Check_h
+#define Check_h
+
+#include <stdio.h>
+
+/**
+ * Bare bones checks for the host tests: CHECK() reports a failed condition and goes on, and
+ * checkResult() gives main() its exit code.
+ */
+
+#define CHECK(condition) checkCondition((condition), #condition, __FILE__, __LINE__)
+
+inline int &checkFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+inline bool checkCondition(bool ok, const char *condition, const char *file, int line) {
+  if (!ok) {
+    printf("%s:%d: check failed: %s\n", file, line, condition);
+    checkFailures()++;
+  }
+  return ok;
+}
+
+inline int checkResult() {
+  if (checkFailures() > 0) {
+    printf("%d check(s) failed\n", checkFailures());
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
+
+#endif
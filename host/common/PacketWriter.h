@@ -0,0 +1,140 @@
+#ifndef PacketWriter_h
+#define PacketWriter_h
+
+#include "DofHandler.h"
+
+#include <vector>
+
+/**
+ * Builds a 9DoF byte stream the way the firmware frames it (output_packet() in Output.ino):
+ * "9DoF", version, sequence number, data mode, length, data and the CRC-16. The sample
+ * helpers make data for every data mode out of a sample index, so a receiver can check what it
+ * decoded (see expectedGyroZ()).
+ */
+class PacketWriter {
+  public:
+    PacketWriter() : sequence(0), compactToKey(0) {}
+
+    std::vector<byte> bytes;
+    byte sequence; // Sequence number of the next packet
+
+    // Frames data as one packet; clock packets do not use up a sequence number
+    void packet(byte mode, const byte *data, byte length) {
+      const byte header[DOF_HEADER_SIZE] = {DOF_FRAME_VERSION,
+        (byte)(mode == DOF_DATA_MODE_CLOCK ? sequence : sequence++), mode, length};
+      bytes.insert(bytes.end(), DOF_MAGIC, DOF_MAGIC + DOF_MAGIC_SIZE);
+      uint16_t crc = 0xFFFF;
+      for (byte i = 0; i < DOF_HEADER_SIZE; i++) {
+        bytes.push_back(header[i]);
+        crc = dofCrc16Update(crc, header[i]);
+      }
+      for (byte i = 0; i < length; i++) {
+        bytes.push_back(data[i]);
+        crc = dofCrc16Update(crc, data[i]);
+      }
+      bytes.push_back(crc >> 8);
+      bytes.push_back(crc & 0xFF);
+    }
+    void packet(byte mode, const std::vector<byte> &data) { packet(mode, data.data(), data.size()); }
+
+    // Appends bytes that are not a packet (text output, line noise)
+    void raw(const byte *data, size_t length) { bytes.insert(bytes.end(), data, data + length); }
+
+    /**
+     * Sends sample index in a packet of mode (which may have DOF_DATA_MODE_FIXED_POINT and
+     * DOF_DATA_MODE_TIMESTAMP set). Compact samples are sent as keyframes and deltas, like the
+     * firmware does.
+     */
+    void sample(byte mode, uint32_t index) {
+      std::vector<byte> data;
+      putSample(data, mode, index);
+      packet(mode, data);
+    }
+
+    // Sends count samples, starting at index, in one batch packet
+    void batch(byte mode, uint32_t index, byte count) {
+      std::vector<byte> data(1, count);
+      for (byte i = 0; i < count; i++) putSample(data, mode, index + i);
+      packet(mode | DOF_DATA_MODE_BATCH, data);
+    }
+
+    // The gyroscope Z value (scaled like DofFrame::getGyroZ()) of sample index
+    static double expectedGyroZ(uint32_t index) { return gyroValue(index, 2) * DOF_GYRO_SCALE; }
+
+    // Values of sample index: a different slow ramp per value, so deltas stay small
+    static int16_t gyroValue(uint32_t index, byte axis) { return (int16_t)(index * (axis + 1) - 1000 * axis); }
+    static float sensorValue(uint32_t index, byte value) { return (float)((int)(index % 512) - 256 + value * 10) / 8; }
+    static float eulerValue(uint32_t index, byte axis) { return (float)((index % 628) / 100.0 - 3.14 + axis * 0.1); }
+
+    static void putShort(std::vector<byte> &out, int16_t value) {
+      out.push_back(value >> 8);
+      out.push_back(value & 0xFF);
+    }
+    static void putLong(std::vector<byte> &out, uint32_t value) {
+      for (int8_t shift = 24; shift >= 0; shift -= 8) out.push_back(value >> shift);
+    }
+    static void putFloat(std::vector<byte> &out, float value) {
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      putLong(out, bits);
+    }
+    static void putNumber(std::vector<byte> &out, float value, boolean fixed) {
+      if (fixed) putLong(out, (uint32_t)(int32_t)lround(value * DOF_FIXED_ONE));
+      else putFloat(out, value);
+    }
+
+  private:
+    void putSample(std::vector<byte> &out, byte mode, uint32_t index) {
+      boolean fixed = mode & DOF_DATA_MODE_FIXED_POINT;
+      if (mode & DOF_DATA_MODE_TIMESTAMP) putLong(out, index * 1000);
+      switch (mode & ~DOF_DATA_MODE_FLAGS) {
+        case DOF_DATA_MODE_ALL:
+          for (byte i = 0; i < 6; i++) putNumber(out, sensorValue(index, i), fixed);
+          for (byte i = 0; i < 3; i++) putShort(out, gyroValue(index, i));
+          break;
+        case DOF_DATA_MODE_GYRO:
+          for (byte i = 0; i < 3; i++) putShort(out, gyroValue(index, i));
+          break;
+        case DOF_DATA_MODE_EULER:
+          for (byte i = 0; i < 3; i++) putNumber(out, eulerValue(index, i), fixed);
+          break;
+        case DOF_DATA_MODE_COMPACT:
+          putCompact(out, index);
+          break;
+        case DOF_DATA_MODE_QUATERNION: {
+          double half = eulerValue(index, 2) / 2;
+          putShort(out, lround(cos(half) * DOF_QUAT_ONE));
+          putShort(out, 0);
+          putShort(out, 0);
+          putShort(out, lround(sin(half) * DOF_QUAT_ONE));
+          break;
+        }
+      }
+    }
+
+    // A keyframe every 16 packets and whenever a value moved too far, deltas in between
+    void putCompact(std::vector<byte> &out, uint32_t index) {
+      int16_t values[DOF_COMPACT_VALUES];
+      for (byte i = 0; i < 3; i++) {
+        values[i] = lround(sensorValue(index, i) * 256 / 8);
+        values[3 + i] = lround(sensorValue(index, 3 + i));
+        values[6 + i] = gyroValue(index, i);
+      }
+      boolean delta = compactToKey > 0;
+      for (byte i = 0; i < DOF_COMPACT_VALUES; i++) {
+        int diff = values[i] - compactValues[i];
+        if (diff < -128 || diff > 127) delta = false;
+      }
+      compactToKey = delta ? compactToKey - 1 : 15;
+      for (byte i = 0; i < DOF_COMPACT_VALUES; i++) {
+        if (delta) out.push_back((byte)(values[i] - compactValues[i]));
+        else putShort(out, values[i]);
+        compactValues[i] = values[i];
+      }
+    }
+
+    byte compactToKey;
+    int16_t compactValues[DOF_COMPACT_VALUES];
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef Firmware_h
+#define Firmware_h
+
+/**
+ * Builds the Razor AHRS firmware into the file that includes this, the way the Arduino IDE
+ * builds the sketch: the main tab first, then the others in alphabetical order, with the
+ * prototypes of all their functions up front (generated by tools/prototypes.cpp).
+ *
+ * To change settings for a test, include Arduino.h and Config.h first, and #undef and
+ * #define them before including this.
+ */
+
+#include "Arduino.h"
+#include "RazorPrototypes.h"
+
+#include "Razor_AHRS.ino"
+#include "Commands.ino"
+#include "Compass.ino"
+#include "Math.ino"
+#include "Output.ino"
+#include "Output_unused.ino"
+#include "Sensors.ino"
+
+#endif
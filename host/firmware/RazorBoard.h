@@ -0,0 +1,127 @@
+#ifndef RazorBoard_h
+#define RazorBoard_h
+
+/**
+ * The board around the firmware, for tests that run setup() and loop(): the ITG-3200 gyroscope,
+ * ADXL345 accelerometer and HMC5883L magnetometer on the simulated I2C bus (see HostI2cBus.h),
+ * and Timer1, which calls the sensor tick interrupt on the virtual clock.
+ *
+ * Include after Firmware.h. The sensors hold whatever the test puts in their data registers
+ * with setGyro(), setAccel() and setMagn() (in the sensors' own axes).
+ */
+
+#include "Host.h"
+#include "HostI2cBus.h"
+
+class RazorBoard {
+  public:
+    RazorBoard() : loopMicros(10), loops(0), loopTime(0), longestLoop(0), ticks(0), nextTick(0) {
+      hostI2cBus().attach(GYRO_ADDRESS, &gyro);
+      hostI2cBus().attach(ACCEL_ADDRESS, &accel);
+      hostI2cBus().attach(MAGN_ADDRESS, &magn);
+    }
+
+    // Runs setup(), with the bus answering at once. The clock only moves on with delays, the
+    // bus and run() from here on.
+    void begin() {
+      hostSetClockStep(0);
+      hostI2cBus().setMode(HostI2cBus::BUS_IMMEDIATE);
+      setup();
+      startTimer();
+    }
+
+    /**
+     * Runs loop() for us microseconds. Every pass takes loopMicros, plus the time it waits on
+     * the bus; the interrupts that come in meanwhile are called at their time after the pass.
+     */
+    void run(unsigned long us) {
+      unsigned long end = hostMicros() + us;
+      while (hostMicros() < end) {
+        unsigned long start = hostMicros();
+        loop();
+        unsigned long time = hostMicros() - start + loopMicros;
+        loops++;
+        loopTime += time;
+        if (time > longestLoop) longestLoop = time;
+        advance(hostMicros() + loopMicros);
+      }
+    }
+
+    // Switches the bus mode, after the transfer on the bus (if any) is done
+    void setBusMode(HostI2cBus::Mode mode) {
+      while (hostI2cBus().isBusy()) advance((unsigned long)ceil(hostI2cBus().nextEventMicros()));
+      hostI2cBus().setMode(mode);
+    }
+
+    // Restarts Timer1 if the firmware has set it up anew (set_fusion_interval() clears TCNT1)
+    void startTimer() {
+      if (TCNT1 != 0) return;
+      TCNT1 = 1; // Marks the timer as running
+      nextTick = hostMicros() + tickMicros();
+    }
+
+    // Sensor data registers, as the sensors have them
+    void setGyro(int x, int y, int z) { setBigEndian(gyro, 0x1D, x, y, z); }
+    void setAccel(int x, int y, int z) { setLittleEndian(accel, 0x32, x, y, z); }
+    void setMagn(int x, int y, int z) { setBigEndian(magn, 0x03, x, z, y); } // HMC5883L order: X, Z, Y
+
+    void resetStats() {
+      loops = 0;
+      loopTime = 0;
+      longestLoop = 0;
+      ticks = 0;
+    }
+
+    HostI2cDevice gyro, accel, magn;
+    unsigned long loopMicros; // Time of one loop() pass
+    unsigned long loops; // Passes of loop() since resetStats()
+    unsigned long loopTime; // Their time in total (us)
+    unsigned long longestLoop;
+    unsigned long ticks; // Sensor ticks
+
+  private:
+    // Timer1 period: OCR1A + 1 counts of the prescaler of Timer_Init()
+    unsigned long tickMicros() const {
+      return (OCR1A + 1UL) * SENSOR_TICK_PRESCALER / (F_CPU / 1000000UL);
+    }
+
+    // Moves the clock on to time, calling the interrupts that come in on the way, in order
+    void advance(unsigned long time) {
+      while (true) {
+        startTimer();
+        double bus = hostI2cBus().isBusy() ? hostI2cBus().nextEventMicros() : 1e300;
+        if (nextTick <= time && nextTick <= bus) {
+          if (nextTick > hostMicros()) hostSetMicros(nextTick); // Late if loop() waited on the bus
+          nextTick += tickMicros();
+          ticks++;
+          hostTimer1CompareInterrupt();
+        } else if (bus <= time) {
+          if (bus > hostMicros()) hostSetMicros((unsigned long)ceil(bus));
+          hostI2cBus().run();
+        } else {
+          break;
+        }
+      }
+      if (time > hostMicros()) hostSetMicros(time);
+    }
+
+    static void setBigEndian(HostI2cDevice &device, byte reg, int x, int y, int z) {
+      const int values[] = {x, y, z};
+      for (int i = 0; i < 3; i++) {
+        device.registers[reg + 2 * i] = (values[i] >> 8) & 0xFF;
+        device.registers[reg + 2 * i + 1] = values[i] & 0xFF;
+      }
+    }
+
+    static void setLittleEndian(HostI2cDevice &device, byte reg, int x, int y, int z) {
+      const int values[] = {x, y, z};
+      for (int i = 0; i < 3; i++) {
+        device.registers[reg + 2 * i] = values[i] & 0xFF;
+        device.registers[reg + 2 * i + 1] = (values[i] >> 8) & 0xFF;
+      }
+    }
+
+    unsigned long nextTick;
+};
+
+#endif
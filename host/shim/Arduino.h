@@ -0,0 +1,140 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+/**
+ * Host (Linux g++) stand-in for the Arduino core: just enough of it to build DofHandler and the
+ * Razor AHRS firmware off the Arduino toolchain, for the tests and benchmarks in host/.
+ *
+ * Time is virtual (see Host.h): it only moves when the host code moves it, so runs are
+ * repeatable and busy loops over millis() still come to an end.
+ *
+ * Unlike on the AVR, int is 32 bits and double is 8 bytes wide here.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "avr/interrupt.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define PI 3.1415926535897932384626433832795
+#define HALF_PI 1.5707963267948966192313216916398
+#define TWO_PI 6.283185307179586476925286766559
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+
+#ifndef F_CPU
+#define F_CPU 8000000UL // The 3.3V boards the 9DoF runs on
+#endif
+
+#define _BV(bit) (1 << (bit))
+#define F(string) (string)
+
+// Pins the TWI runs on (ATmega328)
+#define SDA 18
+#define SCL 19
+
+// Functions rather than the AVR core's macros, so they do not clash with the C++ library
+template <class T, class L> inline auto min(const T &a, const L &b) -> decltype(b < a ? b : a)
+  { return (b < a) ? b : a; }
+template <class T, class L> inline auto max(const T &a, const L &b) -> decltype(b < a ? b : a)
+  { return (a < b) ? b : a; }
+template <class T, class L, class H> inline T constrain(const T &x, const L &low, const H &high)
+  { return (x < low) ? low : ((x > high) ? high : x); }
+
+#define radians(deg) ((deg) * DEG_TO_RAD)
+#define degrees(rad) ((rad) * RAD_TO_DEG)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+void interrupts();
+void noInterrupts();
+
+/**
+ * Text and binary output, like the Arduino core's Print. Only write(uint8_t) has to be
+ * implemented.
+ */
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return str == NULL ? 0 : write((const uint8_t *)str, strlen(str)); }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println() { return write("\r\n"); }
+    template <class T> size_t println(const T &value) { size_t n = print(value); return n + println(); }
+    template <class T> size_t println(const T &value, int format)
+      { size_t n = print(value, format); return n + println(); }
+};
+
+/**
+ * Byte input on top of Print, like the Arduino core's Stream.
+ */
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+    // Like the Arduino core's (without its timeout): reads until length bytes are in or read() comes up empty
+    size_t readBytes(char *buffer, size_t length) {
+      size_t count = 0;
+      while (count < length) {
+        int c = read();
+        if (c < 0) break;
+        buffer[count++] = (char)c;
+      }
+      return count;
+    }
+};
+
+/**
+ * A serial port with the interface of the Arduino core's HardwareSerial (see HostSerial in
+ * HostSerial.h for the one behind Serial).
+ */
+class HardwareSerial : public Stream {
+  public:
+    virtual void begin(unsigned long baud) = 0;
+    virtual void end() = 0;
+    virtual int availableForWrite() = 0;
+    using Print::write;
+};
+
+extern HardwareSerial &Serial;
+
+#endif
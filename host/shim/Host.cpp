@@ -0,0 +1,109 @@
+#include "Host.h"
+#include "HostSerial.h"
+
+#include <time.h>
+
+HostRegister TWCR;
+volatile uint8_t TWBR;
+volatile uint8_t TWSR;
+volatile uint8_t TWDR;
+volatile uint8_t TWAR;
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint8_t TIMSK1;
+volatile uint16_t OCR1A;
+volatile uint16_t TCNT1;
+
+static unsigned long clockMicros = 0;
+static unsigned long clockStep = 1;
+static byte pinValues[32];
+
+void hostSetMicros(unsigned long now) { clockMicros = now; }
+void hostAdvanceMicros(unsigned long us) { clockMicros += us; }
+void hostSetClockStep(unsigned long us) { clockStep = us; }
+unsigned long hostMicros() { return clockMicros; }
+
+unsigned long micros() {
+  clockMicros += clockStep;
+  return clockMicros;
+}
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+  clockMicros += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+  clockMicros += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < sizeof(pinValues)) pinValues[pin] = value;
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < sizeof(pinValues) ? pinValues[pin] : LOW;
+}
+
+int hostPinValue(uint8_t pin) {
+  return digitalRead(pin);
+}
+
+void interrupts() {}
+void noInterrupts() {}
+
+const char *hostCycleUnit() {
+#if defined(__x86_64__) || defined(__i386__)
+  return "cycles";
+#else
+  return "ns";
+#endif
+}
+
+double hostSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size-- > 0) n += write(*buffer++);
+  return n;
+}
+
+size_t Print::print(long n, int base) {
+  if (n < 0 && base == DEC) return print('-') + print((unsigned long)-n, base);
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char digits[8 * sizeof(long) + 1];
+  char *out = digits + sizeof(digits) - 1;
+  *out = '\0';
+  if (base < 2) base = DEC;
+  do {
+    byte digit = n % base;
+    *--out = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n > 0);
+  return write(out);
+}
+
+size_t Print::print(double n, int digits) {
+  char text[64];
+  snprintf(text, sizeof(text), "%.*f", digits, n);
+  return write(text);
+}
+
+static HostSerial serialPort;
+HardwareSerial &Serial = serialPort;
+
+HostSerial &hostSerial() {
+  return serialPort;
+}
@@ -0,0 +1,43 @@
+#ifndef Host_h
+#define Host_h
+
+#include "Arduino.h"
+
+#include <time.h>
+
+/**
+ * Host side controls of the Arduino shim (see Arduino.h).
+ */
+
+// Virtual clock. Every millis() and micros() call moves it on by the clock step (1 us unless
+// set otherwise), so code that waits on the clock gets there; delay() moves it on by the delay.
+void hostSetMicros(unsigned long now);
+void hostAdvanceMicros(unsigned long us);
+void hostSetClockStep(unsigned long us);
+// The virtual clock, without moving it on
+unsigned long hostMicros();
+
+// Last value written to a pin with digitalWrite()
+int hostPinValue(uint8_t pin);
+
+/**
+ * Reads a cycle counter, for the benchmarks: the time stamp counter on x86, nanoseconds
+ * elsewhere (see hostCycleUnit()).
+ */
+inline uint64_t hostCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+// Unit of hostCycles()
+const char *hostCycleUnit();
+
+// Seconds of wall clock time, for rates in the benchmark reports
+double hostSeconds();
+
+#endif
@@ -0,0 +1,125 @@
+#include "HostI2cBus.h"
+#include "Host.h"
+
+#include <util/twi.h>
+
+HostI2cBus::HostI2cBus()
+  : mode(BUS_IMMEDIATE), phase(PHASE_IDLE), device(NULL), pointerSet(false), pointer(0), inTransfer(false),
+    pending(false), pendingDue(0), pendingStatus(0), pendingData(-1), delivering(false), lastEventMicros(0),
+    interruptCount(0), transfers(0), busMicros(0) {}
+
+// One bit on the bus: SCL = F_CPU / (16 + 2 * TWBR * prescaler)
+double HostI2cBus::bitMicros() const {
+  static const int prescalers[] = {1, 4, 16, 64};
+  return (16.0 + 2.0 * TWBR * prescalers[TWSR & 3]) * 1e6 / F_CPU;
+}
+
+// Has the bus event of the operation just started come in after bits bit times. Operations
+// started from the interrupt follow the event it was called for without a gap.
+void HostI2cBus::schedule(int bits, byte status, int data) {
+  double start = delivering ? lastEventMicros : (double)hostMicros();
+  double duration = bits * bitMicros();
+  busMicros += duration;
+  pending = true;
+  pendingDue = start + duration;
+  pendingStatus = status;
+  pendingData = data;
+}
+
+void HostI2cBus::registerWritten(uint8_t value) {
+  if (!(value & _BV(TWEN))) { // TWI off
+    phase = PHASE_IDLE;
+    inTransfer = false;
+    pending = false;
+    return;
+  }
+  if (value & _BV(TWSTO)) { // Stop condition, done at once
+    phase = PHASE_IDLE;
+    inTransfer = false;
+    TWCR.value &= ~(_BV(TWSTO) | _BV(TWINT));
+    return;
+  }
+  if (!(value & _BV(TWINT)) || pending) return; // Only the interrupt enable changed
+
+  TWCR.value &= ~_BV(TWINT); // Writing one clears the flag and starts the next operation
+  if (value & _BV(TWSTA)) {
+    transfers++;
+    phase = PHASE_ADDRESS;
+    schedule(1, inTransfer ? TW_REP_START : TW_START);
+    inTransfer = true;
+  } else {
+    transferred(value);
+  }
+
+  if (mode == BUS_IMMEDIATE && !delivering) {
+    while (pending) {
+      if (pendingDue > hostMicros()) hostSetMicros((unsigned long)pendingDue);
+      deliver();
+    }
+  }
+}
+
+// Sends or receives the next byte of the transfer
+void HostI2cBus::transferred(uint8_t value) {
+  switch (phase) {
+    case PHASE_ADDRESS: { // TWDR holds the address and the direction
+      std::map<byte, HostI2cDevice *>::iterator found = devices.find(TWDR >> 1);
+      boolean reading = TWDR & TW_READ;
+      device = found == devices.end() ? NULL : found->second;
+      if (device == NULL) {
+        phase = PHASE_IDLE;
+        schedule(9, reading ? TW_MR_SLA_NACK : TW_MT_SLA_NACK);
+      } else if (reading) {
+        phase = PHASE_RECEIVE;
+        schedule(9, TW_MR_SLA_ACK);
+      } else {
+        phase = PHASE_TRANSMIT;
+        pointerSet = false;
+        schedule(9, TW_MT_SLA_ACK);
+      }
+      break;
+    }
+    case PHASE_TRANSMIT:
+      if (!pointerSet) {
+        pointer = TWDR;
+        pointerSet = true;
+      } else {
+        device->writeRegister(pointer++, TWDR);
+      }
+      schedule(9, TW_MT_DATA_ACK);
+      break;
+    case PHASE_RECEIVE: // TWEA acknowledges the byte, asking for another one
+      schedule(9, value & _BV(TWEA) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK, device->readRegister(pointer++));
+      break;
+    case PHASE_IDLE:
+      break;
+  }
+}
+
+void HostI2cBus::run() {
+  while (pending && pendingDue <= hostMicros()) deliver();
+}
+
+void HostI2cBus::deliver() {
+  pending = false;
+  TWSR = (TWSR & 3) | pendingStatus;
+  if (pendingData >= 0) TWDR = pendingData;
+  TWCR.value |= _BV(TWINT);
+  if (!(TWCR & _BV(TWIE))) return;
+
+  interruptCount++;
+  delivering = true;
+  lastEventMicros = pendingDue;
+  hostTwiInterrupt();
+  delivering = false;
+}
+
+static void twcrWritten(uint8_t value) {
+  hostI2cBus().registerWritten(value);
+}
+
+HostI2cBus &hostI2cBus() {
+  static HostI2cBus bus;
+  TWCR.onWrite = twcrWritten;
+  return bus;
+}
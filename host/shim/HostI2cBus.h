@@ -0,0 +1,91 @@
+#ifndef HostI2cBus_h
+#define HostI2cBus_h
+
+#include "Arduino.h"
+
+#include <map>
+
+/**
+ * A device on the simulated I2C bus: 256 registers, with a register pointer that the first byte
+ * of a write sets and that moves on by one with every byte read or written after it. Devices
+ * with registers that do more than hold a byte override readRegister() and writeRegister().
+ */
+class HostI2cDevice {
+  public:
+    HostI2cDevice() { memset(registers, 0, sizeof(registers)); }
+    virtual ~HostI2cDevice() {}
+
+    virtual byte readRegister(byte reg) { return registers[reg]; }
+    virtual void writeRegister(byte reg, byte value) { registers[reg] = value; }
+
+    byte registers[256];
+};
+
+/**
+ * The ATmega328's TWI (I2C) peripheral and the bus behind it, on the virtual clock (see Host.h).
+ * The simulation answers the writes to TWCR (see HostRegister in avr/io.h) the way the TWI
+ * does: every start condition or byte takes its time on the bus at the clock set by TWBR and
+ * TWSR, then TWSR has the status code and TWINT is set, and the TWI interrupt (ISR(TWI_vect)) is
+ * called if TWIE is set. Addresses without a device attached are not acknowledged.
+ *
+ * In BUS_IMMEDIATE mode, the bus events are delivered from the TWCR write that starts them,
+ * with the virtual clock moved on by their bus time, so the code that starts a transfer waits
+ * for all of it (including the transfers started from the interrupt), as it would with Wire.
+ * In BUS_BACKGROUND mode, events are only delivered by run() once the clock has got to them,
+ * so the main loop goes on meanwhile; code that spins on a transfer being done hangs there.
+ */
+class HostI2cBus {
+  public:
+    enum Mode { BUS_IMMEDIATE, BUS_BACKGROUND };
+
+    HostI2cBus();
+
+    void attach(byte address, HostI2cDevice *device) { devices[address] = device; }
+    void setMode(Mode mode) { this->mode = mode; }
+
+    // Delivers the events that are due on the virtual clock (BUS_BACKGROUND mode)
+    void run();
+    // True if a bus event is on its way, and then the time it is due at (us)
+    boolean isBusy() const { return pending; }
+    double nextEventMicros() const { return pendingDue; }
+
+    // Counts since the start
+    unsigned long getInterrupts() const { return interruptCount; } // TWI interrupts called
+    unsigned long getTransfers() const { return transfers; } // Start conditions, repeated or not
+    double getBusMicros() const { return busMicros; } // Time the bus was busy
+
+    // Called with every write to TWCR
+    void registerWritten(uint8_t value);
+
+  private:
+    enum Phase { PHASE_IDLE, PHASE_ADDRESS, PHASE_TRANSMIT, PHASE_RECEIVE };
+
+    double bitMicros() const;
+    void schedule(int bits, byte status, int data = -1);
+    void transferred(uint8_t value);
+    void deliver();
+
+    std::map<byte, HostI2cDevice *> devices;
+    Mode mode;
+    Phase phase;
+    HostI2cDevice *device; // Addressed device
+    boolean pointerSet; // The register pointer was written in this transfer
+    byte pointer;
+    boolean inTransfer; // Started, not stopped yet
+
+    boolean pending;
+    double pendingDue;
+    byte pendingStatus;
+    int pendingData; // Byte received, or -1
+    boolean delivering;
+    double lastEventMicros; // End of the event being delivered
+
+    unsigned long interruptCount;
+    unsigned long transfers;
+    double busMicros;
+};
+
+// The bus behind TWCR (hooked up the first time this is called)
+HostI2cBus &hostI2cBus();
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef HostSerial_h
+#define HostSerial_h
+
+#include "Arduino.h"
+
+#include <deque>
+#include <vector>
+
+/**
+ * The serial port behind Serial in the host build (see hostSerial()). Tests put the bytes the
+ * other end sends with receive(), and get everything written to the port with getWritten().
+ *
+ * The transmit buffer always has the room set by setWriteRoom() (64 bytes, as on the Arduino,
+ * unless set otherwise); the UART drains it at once.
+ */
+class HostSerial : public HardwareSerial {
+  public:
+    HostSerial() : baud(0), opened(false), writeRoom(64) {}
+
+    // Bytes from the other end of the link, to be read by the firmware
+    void receive(const byte *bytes, size_t size) { received.insert(received.end(), bytes, bytes + size); }
+    void receive(const char *text) { receive((const byte *)text, strlen(text)); }
+    void clearReceived() { received.clear(); }
+
+    // Bytes written to the port
+    const std::vector<byte> &getWritten() const { return written; }
+    void clearWritten() { written.clear(); }
+
+    void setWriteRoom(int room) { writeRoom = room; }
+
+    // Baud rate of the last begin(), and false after end()
+    unsigned long getBaudRate() const { return baud; }
+    boolean isOpen() const { return opened; }
+
+    void begin(unsigned long rate) { baud = rate; opened = true; }
+    void end() { opened = false; }
+    int available() { return received.size(); }
+    int read() {
+      if (received.empty()) return -1;
+      byte b = received.front();
+      received.pop_front();
+      return b;
+    }
+    int peek() { return received.empty() ? -1 : received.front(); }
+    int availableForWrite() { return writeRoom; }
+    size_t write(uint8_t b) { written.push_back(b); return 1; }
+    using Print::write;
+
+  private:
+    std::deque<byte> received;
+    std::vector<byte> written;
+    unsigned long baud;
+    boolean opened;
+    int writeRoom;
+};
+
+// The port behind Serial
+HostSerial &hostSerial();
+
+#endif
@@ -0,0 +1,28 @@
+#include "ReplayStream.h"
+
+int ReplayStream::available() {
+  size_t left = length - position;
+  if (chunk > 0 && left > chunk) left = chunk;
+  return left > 0x7FFF ? 0x7FFF : (int)left;
+}
+
+int ReplayStream::read() {
+  return position < length ? data[position++] : -1;
+}
+
+size_t ReplayStream::readBytes(char *buffer, size_t size) {
+  size_t left = length - position;
+  if (size > left) size = left;
+  memcpy(buffer, data + position, size);
+  position += size;
+  return size;
+}
+
+int ReplayStream::peek() {
+  return position < length ? data[position] : -1;
+}
+
+size_t ReplayStream::write(uint8_t b) {
+  written.push_back(b);
+  return 1;
+}
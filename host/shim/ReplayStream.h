@@ -0,0 +1,70 @@
+#ifndef ReplayStream_h
+#define ReplayStream_h
+
+#include "Arduino.h"
+
+#include <vector>
+
+/**
+ * A Stream that replays a recorded (or generated) byte stream, for feeding a DofHandler on the
+ * host. It has the begin() and end() a DofHandler calls on its stream, and keeps everything
+ * written to it (the commands sent to the 9DoF).
+ *
+ * The bytes are not copied, so they have to outlive the stream. rewind() replays them again.
+ */
+class ReplayStream : public Stream {
+  public:
+    ReplayStream() : data(NULL), length(0), position(0), chunk(0), baud(0), opened(false) {}
+
+    /**
+     * Sets the bytes to replay and rewinds.
+     */
+    void load(const byte *bytes, size_t size) { data = bytes; length = size; position = 0; }
+    void load(const std::vector<byte> &bytes) { load(bytes.data(), bytes.size()); }
+
+    /**
+     * Starts the replay over.
+     */
+    void rewind() { position = 0; }
+
+    /**
+     * Limits the bytes available at a time to size, like a serial port's receive buffer that
+     * is read as it fills. 0 (the default) makes everything left available at once.
+     */
+    void setChunkSize(size_t size) { chunk = size; }
+
+    // Position in the replay, and true once every byte has been read
+    size_t getPosition() const { return position; }
+    boolean isDone() const { return position == length; }
+
+    // Bytes written to the stream
+    const std::vector<byte> &getWritten() const { return written; }
+    void clearWritten() { written.clear(); }
+
+    // Baud rate of the last begin(), and false after end()
+    long getBaudRate() const { return baud; }
+    boolean isOpen() const { return opened; }
+
+    void begin(long rate) { baud = rate; opened = true; }
+    void end() { opened = false; }
+
+    // Out of line (in ReplayStream.cpp), so every call costs what a call into the serial
+    // port's driver does on the Arduino
+    int available();
+    int read();
+    size_t readBytes(char *buffer, size_t size); // A single copy, like the drivers that read their buffer in bulk
+    int peek();
+    size_t write(uint8_t b);
+    using Print::write;
+
+  private:
+    const byte *data;
+    size_t length;
+    size_t position;
+    size_t chunk;
+    long baud;
+    boolean opened;
+    std::vector<byte> written;
+};
+
+#endif
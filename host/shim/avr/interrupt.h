@@ -0,0 +1,13 @@
+#ifndef avr_interrupt_h
+#define avr_interrupt_h
+
+#include "avr/io.h"
+
+// An interrupt handler is a plain function on the host, called by whatever simulates the
+// interrupt (see avr/io.h for the vector names)
+#define ISR(vector) void vector()
+
+#define sei() interrupts()
+#define cli() noInterrupts()
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef avr_io_h
+#define avr_io_h
+
+/**
+ * Host stand-ins for the ATmega328 registers the Razor AHRS firmware uses: the TWI (I2C) and
+ * Timer1. They are plain variables, except for TWCR, whose writes go to a hook (see
+ * HostRegister) so that a simulated bus can answer them.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An 8 bit register that calls onWrite with every value written to it. It has no constructor:
+ * registers are globals, zeroed before any constructor runs, so a simulation set up from a
+ * constructor can hook up onWrite without it being reset.
+ */
+class HostRegister {
+  public:
+    operator uint8_t() const { return value; }
+    HostRegister &operator=(uint8_t b) {
+      value = b;
+      if (onWrite != NULL) onWrite(b);
+      return *this;
+    }
+    HostRegister &operator|=(uint8_t b) { return *this = value | b; }
+    HostRegister &operator&=(uint8_t b) { return *this = value & b; }
+
+    volatile uint8_t value; // Set directly by the simulation, without calling onWrite
+    void (*onWrite)(uint8_t b);
+};
+
+// TWI
+extern HostRegister TWCR;
+extern volatile uint8_t TWBR;
+extern volatile uint8_t TWSR;
+extern volatile uint8_t TWDR;
+extern volatile uint8_t TWAR;
+
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+#define TWPS1 1
+#define TWPS0 0
+
+// Timer1
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TIMSK1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t TCNT1;
+
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define OCIE1A 1
+
+// Interrupt vectors: ISR(TWI_vect) defines hostTwiInterrupt(), which the simulation calls
+#define TWI_vect hostTwiInterrupt
+#define TIMER1_COMPA_vect hostTimer1CompareInterrupt
+void hostTwiInterrupt();
+void hostTimer1CompareInterrupt();
+
+#endif
@@ -0,0 +1,205 @@
+// The accelerometer FIFO reads (ACCEL__USE_FIFO) against a register level model of the ADXL345
+// FIFO on the simulated bus (see RazorBoard.h): every acquisition has to drain the FIFO with one
+// transfer per sample and average what it held, a tick that finds the FIFO empty has to keep the
+// last reading, and after the main loop stalls long enough for the FIFO to overrun, the overrun
+// has to be counted and the reads have to catch up with the newest samples.
+
+#include "Arduino.h"
+#include "Config.h"
+#undef ACCEL__USE_FIFO
+#define ACCEL__USE_FIFO true
+
+#include "Firmware.h"
+
+#include <deque>
+
+#include "Check.h"
+#include "HostSerial.h"
+#include "RazorBoard.h"
+
+/**
+ * The ADXL345 with its FIFO in stream mode. Measures at the output data rate of the BW_RATE
+ * register once the POWER_CTL measure bit is set; sample n reads x = 2n, y = -n, z = 256. The
+ * data registers hold the oldest sample in the FIFO, which is popped once DATAZ1 (0x37) is read.
+ * A sample that comes in while the FIFO is full pushes out the oldest one and sets the overrun
+ * bit of INT_SOURCE, which stays set until the next pop. A read of several registers sees them
+ * as they were when it started, so the samples that come in during a read wait for the next one.
+ */
+class Adxl345 : public HostI2cDevice {
+  public:
+    Adxl345() : next(0), measured(0), dropped(0), popped(0), poppedX(0), last(0), overrun(false), lastMicros(0), nextRegister(-1) {}
+
+    byte readRegister(byte reg) {
+      if (reg != nextRegister) measure(); // A new read
+      nextRegister = reg + 1;
+      if (reg == 0x30) return (fifo.empty() ? 0 : 0x80) | (overrun ? 0x01 : 0); // INT_SOURCE
+      if (reg == 0x39) return fifo.size(); // FIFO_STATUS: entries
+      if (reg < 0x32 || reg > 0x37) return registers[reg];
+
+      long n = fifo.empty() ? last : fifo.front();
+      int values[] = {(int)(2 * n), (int)-n, 256};
+      int value = values[(reg - 0x32) / 2];
+      byte data = (reg & 1) ? (value >> 8) & 0xFF : value & 0xFF; // Little endian
+      if (reg == 0x37 && !fifo.empty()) {
+        last = fifo.front();
+        fifo.pop_front();
+        popped++;
+        poppedX += 2 * last;
+        overrun = false;
+      }
+      return data;
+    }
+
+    void writeRegister(byte reg, byte value) {
+      measure(); // At the old rate, up to now
+      nextRegister = -1;
+      HostI2cDevice::writeRegister(reg, value);
+      if (reg == 0x2C || reg == 0x2D) lastMicros = hostMicros();
+    }
+
+    unsigned long periodMicros() const {
+      return (625UL << (15 - (registers[0x2C] & 0x0F))) / 2; // 3200Hz at rate code 15, halving per step
+    }
+
+    // Count and sum of x of the samples popped since the last call
+    void resetPopped() {
+      popped = 0;
+      poppedX = 0;
+    }
+
+    std::deque<long> fifo;
+    long next; // Number of the next sample measured
+    long measured, dropped; // Samples measured, and pushed out of the full FIFO
+    long popped, poppedX;
+    long last; // Last sample popped
+    boolean overrun;
+
+  private:
+    // Takes the samples due by now
+    void measure() {
+      if (!(registers[0x2D] & 0x08)) return; // Standby
+      unsigned long period = periodMicros();
+      while (hostMicros() - lastMicros >= period) {
+        lastMicros += period;
+        if (fifo.size() == 32) {
+          fifo.pop_front();
+          dropped++;
+          overrun = true;
+        }
+        fifo.push_back(next++);
+        measured++;
+      }
+    }
+
+    unsigned long lastMicros; // Time of the last sample measured
+    int nextRegister; // Register the read going on reads next
+};
+
+static RazorBoard board;
+static Adxl345 adxl;
+
+// Runs to the end of the next sample, that is until the main loop has taken it
+static void nextSample() {
+  while (!sensor_sample_pending) board.run(1);
+  while (sensor_sample_pending) board.run(1);
+}
+
+// Average x of the samples popped, rounded as Read_Accel() rounds it
+static int poppedAverage() {
+  long sum = adxl.poppedX, count = adxl.popped;
+  return (sum + (sum < 0 ? -count : count) / 2) / count;
+}
+
+struct FifoRun {
+  int samples;
+  long drained; // FIFO samples drained in total
+  int empty; // Acquisitions that found the FIFO empty
+  int minCount, maxCount; // FIFO samples per acquisition
+  int wrongAverage;
+  int extraTransfers; // Transfers other than one per gyro, magn and FIFO sample read
+};
+
+static FifoRun runSamples(int samples) {
+  FifoRun run = {samples, 0, 0, 255, 0, 0, 0};
+  for (int i = 0; i < samples; i++) {
+    adxl.resetPopped();
+    unsigned long transfers = hostI2cBus().getTransfers();
+    int lastReading = accel_raw[1];
+    nextSample();
+    // A read is a start and a repeated start: gyro, accelerometer (at least the first read), magn
+    long reads = (hostI2cBus().getTransfers() - transfers) / 2;
+    long expected = 1 + (adxl.popped > 0 ? adxl.popped : 1) + ((sensor_read_mask & _BV(SENSOR_MAGN)) ? 1 : 0);
+    if (reads != expected) run.extraTransfers++;
+    if (accel_fifo_count != adxl.popped) run.wrongAverage++;
+    if (adxl.popped == 0) {
+      run.empty++;
+      if (accel_raw[1] != lastReading) run.wrongAverage++;
+    } else {
+      if (accel_raw[1] != poppedAverage() || accel_raw[2] != 256) run.wrongAverage++;
+    }
+    run.drained += adxl.popped;
+    if (accel_fifo_count < run.minCount) run.minCount = accel_fifo_count;
+    if (accel_fifo_count > run.maxCount) run.maxCount = accel_fifo_count;
+  }
+  return run;
+}
+
+static void report(const char *name, const FifoRun &run) {
+  printf("%s: %d samples, %d to %d FIFO samples each (%d found it empty), %ld drained\n", name, run.samples,
+    run.minCount, run.maxCount, run.empty, run.drained);
+  CHECK(run.wrongAverage == 0);
+  CHECK(run.extraTransfers == 0);
+  CHECK(num_accel_errors == 0);
+}
+
+int main() {
+  hostI2cBus().attach(ACCEL_ADDRESS, &adxl);
+  board.begin();
+  CHECK(adxl.registers[0x38] == 0x80); // Stream mode
+  CHECK(adxl.registers[0x2C] == 0x0B); // 200Hz
+  board.setBusMode(HostI2cBus::BUS_BACKGROUND);
+  board.run(100000);
+
+  // Standard profile: four samples per 20ms tick, none lost
+  FifoRun standard = runSamples(50);
+  report("standard", standard);
+  CHECK(standard.minCount == 4 && standard.maxCount == 4);
+  CHECK(adxl.dropped == 0 && num_accel_overruns == 0);
+
+  // Overrun: the main loop stalls for 300ms, the FIFO holds the newest 32 of the 60 samples
+  unsigned long loopMicros = board.loopMicros;
+  board.loopMicros = 300000;
+  board.run(1);
+  board.loopMicros = loopMicros;
+  adxl.resetPopped();
+  nextSample();
+  CHECK(adxl.dropped > 0);
+  printf("overrun: %ld samples dropped by the FIFO, %d drained after it\n", adxl.dropped, accel_fifo_count);
+  CHECK(accel_fifo_overrun);
+  CHECK(num_accel_overruns == 1);
+  CHECK(accel_fifo_count == ACCEL_FIFO_SIZE);
+  CHECK(accel_raw[1] == poppedAverage());
+
+  // The reads catch up with what came in meanwhile, then go on at four per tick
+  FifoRun after = runSamples(20);
+  report("after the overrun", after);
+  CHECK(num_accel_overruns == 1);
+  CHECK(adxl.fifo.size() <= 1);
+  runSamples(5);
+  CHECK(accel_fifo_count == 4);
+
+  // High rate profile: 400Hz read every 2ms, so some ticks find the FIFO empty
+  board.setBusMode(HostI2cBus::BUS_IMMEDIATE);
+  hostSerial().receive("#p1");
+  board.run(board.loopMicros);
+  board.startTimer();
+  board.setBusMode(HostI2cBus::BUS_BACKGROUND);
+  CHECK(adxl.registers[0x2C] == 0x0C);
+  nextSample();
+  long dropped = adxl.dropped;
+  FifoRun high = runSamples(500);
+  report("high rate", high);
+  CHECK(high.empty > 0 && high.maxCount <= 2);
+  CHECK(adxl.dropped == dropped && num_accel_overruns == 1);
+  return checkResult();
+}
@@ -0,0 +1,168 @@
+// The batch Madgwick or Mahony filter against the scalar one (built as test_madgwick_batch and
+// test_mahony_batch: the scalar libraries share the names of their globals). Every filter of a
+// batch, with its own gains and time steps and now and then a zero accelerometer or magnetometer
+// vector, has to end up with bit for bit the quaternion the scalar *UpdateDt() functions give
+// on the same inputs. Also reports the updates per second of both.
+
+#include <string.h>
+
+#include <vector>
+
+#include "Check.h"
+#include "Host.h"
+
+extern "C" {
+#ifdef AHRS_MAHONY
+#include "MahonyAHRS.h"
+#include "MahonyAHRSbatch.h"
+extern volatile float integralFBx, integralFBy, integralFBz;
+#else
+#include "MadgwickAHRS.h"
+#include "MadgwickAHRSbatch.h"
+#endif
+}
+
+#define FILTERS 1024
+#define STEPS 200
+
+// Inputs of one step, an array per channel
+struct Step {
+  std::vector<float> channel[10]; // gx, gy, gz, ax, ay, az, mx, my, mz, dt
+};
+
+static float uniform(float low, float high) {
+  return low + (high - low) * rand() / RAND_MAX;
+}
+
+static std::vector<Step> randomSteps() {
+  std::vector<Step> steps(STEPS);
+  for (int s = 0; s < STEPS; s++) {
+    for (int c = 0; c < 10; c++) steps[s].channel[c].resize(FILTERS);
+    for (int i = 0; i < FILTERS; i++) {
+      float *v[10];
+      for (int c = 0; c < 10; c++) v[c] = &steps[s].channel[c][i];
+      for (int axis = 0; axis < 3; axis++) {
+        *v[axis] = uniform(-4.0f, 4.0f);
+        *v[3 + axis] = uniform(-2.0f, 2.0f);
+        *v[6 + axis] = uniform(-600.0f, 600.0f);
+      }
+      if (rand() % 10 == 0) *v[3] = *v[4] = *v[5] = 0.0f;
+      if (rand() % 10 == 0) *v[6] = *v[7] = *v[8] = 0.0f;
+      *v[9] = uniform(0.001f, 0.05f);
+    }
+  }
+  return steps;
+}
+
+#ifdef AHRS_MAHONY
+
+#define FILTER_NAME "Mahony"
+
+struct Filters {
+  std::vector<float> twoKp, twoKi, q0, q1, q2, q3, fbx, fby, fbz;
+  MahonyAHRSbatch batch;
+
+  Filters() : twoKp(FILTERS), twoKi(FILTERS), q0(FILTERS), q1(FILTERS), q2(FILTERS), q3(FILTERS),
+      fbx(FILTERS), fby(FILTERS), fbz(FILTERS) {
+    MahonyAHRSbatch b = {FILTERS, &twoKp[0], &twoKi[0], &q0[0], &q1[0], &q2[0], &q3[0], &fbx[0], &fby[0], &fbz[0]};
+    batch = b;
+    MahonyAHRSbatchInit(&batch, 1.0f, 0.0f);
+    srand(2); // The same gains for every Filters
+    for (int i = 0; i < FILTERS; i++) {
+      twoKp[i] = uniform(0.2f, 5.0f);
+      twoKi[i] = i % 2 ? uniform(0.01f, 0.5f) : 0.0f; // With and without integral feedback
+    }
+  }
+
+  void updateBatch(Step &s) {
+    float **c = channelPointers(s);
+    MahonyAHRSbatchUpdate(&batch, c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], c[8], c[9]);
+  }
+
+  // Filter i, through the scalar functions
+  void updateScalar(int i, const Step &s) {
+    ::twoKp = twoKp[i];
+    ::twoKi = twoKi[i];
+    ::q0 = q0[i]; ::q1 = q1[i]; ::q2 = q2[i]; ::q3 = q3[i];
+    integralFBx = fbx[i]; integralFBy = fby[i]; integralFBz = fbz[i];
+    MahonyAHRSupdateDt(s.channel[0][i], s.channel[1][i], s.channel[2][i], s.channel[3][i], s.channel[4][i],
+      s.channel[5][i], s.channel[6][i], s.channel[7][i], s.channel[8][i], s.channel[9][i]);
+    q0[i] = ::q0; q1[i] = ::q1; q2[i] = ::q2; q3[i] = ::q3;
+    fbx[i] = integralFBx; fby[i] = integralFBy; fbz[i] = integralFBz;
+  }
+
+#else
+
+#define FILTER_NAME "Madgwick"
+
+struct Filters {
+  std::vector<float> beta, q0, q1, q2, q3;
+  MadgwickAHRSbatch batch;
+
+  Filters() : beta(FILTERS), q0(FILTERS), q1(FILTERS), q2(FILTERS), q3(FILTERS) {
+    MadgwickAHRSbatch b = {FILTERS, &beta[0], &q0[0], &q1[0], &q2[0], &q3[0]};
+    batch = b;
+    MadgwickAHRSbatchInit(&batch, 0.1f);
+    srand(2); // The same gains for every Filters
+    for (int i = 0; i < FILTERS; i++) beta[i] = uniform(0.01f, 1.0f);
+  }
+
+  void updateBatch(Step &s) {
+    float **c = channelPointers(s);
+    MadgwickAHRSbatchUpdate(&batch, c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], c[8], c[9]);
+  }
+
+  // Filter i, through the scalar functions
+  void updateScalar(int i, const Step &s) {
+    ::beta = beta[i];
+    ::q0 = q0[i]; ::q1 = q1[i]; ::q2 = q2[i]; ::q3 = q3[i];
+    MadgwickAHRSupdateDt(s.channel[0][i], s.channel[1][i], s.channel[2][i], s.channel[3][i], s.channel[4][i],
+      s.channel[5][i], s.channel[6][i], s.channel[7][i], s.channel[8][i], s.channel[9][i]);
+    q0[i] = ::q0; q1[i] = ::q1; q2[i] = ::q2; q3[i] = ::q3;
+  }
+
+#endif
+
+  static float **channelPointers(Step &s) {
+    static float *pointers[10];
+    for (int c = 0; c < 10; c++) pointers[c] = &s.channel[c][0];
+    return pointers;
+  }
+
+  // Index of the first filter whose quaternion is not the one of other, or -1
+  int firstDifference(const Filters &other) const {
+    for (int i = 0; i < FILTERS; i++) {
+      if (q0[i] != other.q0[i] || q1[i] != other.q1[i] || q2[i] != other.q2[i] || q3[i] != other.q3[i]) return i;
+    }
+    return -1;
+  }
+};
+
+int main() {
+  srand(1);
+  std::vector<Step> steps = randomSteps();
+  Filters batch, scalar;
+
+  double batchSeconds = 0, scalarSeconds = 0;
+  for (int s = 0; s < STEPS; s++) {
+    double start = hostSeconds();
+    batch.updateBatch(steps[s]);
+    batchSeconds += hostSeconds() - start;
+    start = hostSeconds();
+    for (int i = 0; i < FILTERS; i++) scalar.updateScalar(i, steps[s]);
+    scalarSeconds += hostSeconds() - start;
+
+    int difference = batch.firstDifference(scalar);
+    if (!CHECK(difference == -1)) {
+      printf("  step %d, filter %d: batch %.9g %.9g %.9g %.9g, scalar %.9g %.9g %.9g %.9g\n", s, difference,
+        batch.q0[difference], batch.q1[difference], batch.q2[difference], batch.q3[difference],
+        scalar.q0[difference], scalar.q1[difference], scalar.q2[difference], scalar.q3[difference]);
+      break;
+    }
+  }
+
+  const double updates = (double)FILTERS * STEPS;
+  printf(FILTER_NAME " batch of %d filters, %d steps: %.1fM updates/s, scalar %.1fM updates/s\n", FILTERS, STEPS,
+    updates / batchSeconds / 1e6, updates / scalarSeconds / 1e6);
+  return checkResult();
+}
@@ -0,0 +1,126 @@
+// DofHandler's baud rate negotiation against the firmware (see RazorBoard.h), over a link
+// that only passes bytes while both ends are at the same rate: the handler has to step the
+// rate up to the fastest one, and when the answers to its confirmation of a new rate are lost
+// (so the 9DoF keeps the rate while the handler does not hear it), both ends still have to
+// end up at the same rate and keep talking.
+
+#include "Firmware.h"
+
+#include <deque>
+#include <string>
+
+#include "Check.h"
+#include "DofHandler.h"
+#include "HostSerial.h"
+#include "RazorBoard.h"
+
+#define STEP_MICROS 100 // Firmware time per available() call
+
+static RazorBoard board;
+
+/**
+ * The handler's end of the link to the firmware's Serial. Bytes get through only while both
+ * ends are open at the same rate, and that rate is no faster than maxRate; the rest are lost,
+ * as a UART garbles them. With dropBaudAnswers set, the "#BAUD" answers after the first one
+ * are lost on their way back.
+ */
+class LinkStream : public Stream {
+  public:
+    LinkStream() : rate(0), maxRate(115200), dropBaudAnswers(false), baudAnswers(0) {}
+
+    void begin(long baud) { rate = baud; }
+    void end() { rate = 0; }
+    // Runs the firmware a step. It writes an answer before it changes its rate, so what it
+    // writes goes out at the rate it was at before the step.
+    int available() {
+      boolean through = isThrough();
+      board.run(STEP_MICROS);
+      const std::vector<byte> &written = hostSerial().getWritten();
+      std::string text(written.begin(), written.end());
+      hostSerial().clearWritten();
+      if (!through) return rx.size();
+      size_t answer = text.find("#BAUD");
+      if (answer != std::string::npos && dropBaudAnswers && ++baudAnswers > 1) {
+        text.erase(answer, text.find('\n', answer) + 1 - answer);
+      }
+      rx.insert(rx.end(), text.begin(), text.end());
+      return rx.size();
+    }
+    int read() {
+      if (rx.empty() && available() == 0) return -1;
+      byte b = rx.front();
+      rx.pop_front();
+      return b;
+    }
+    int peek() { return available() ? rx.front() : -1; }
+    size_t write(uint8_t b) {
+      if (isThrough()) hostSerial().receive(&b, 1);
+      return 1;
+    }
+    using Print::write;
+
+    boolean isThrough() const {
+      return hostSerial().isOpen() && (long)hostSerial().getBaudRate() == rate && rate <= maxRate;
+    }
+
+    long rate; // Rate of this end, 0 while closed
+    long maxRate;
+    boolean dropBaudAnswers;
+    int baudAnswers; // "#BAUD" answers since dropBaudAnswers was set
+    std::deque<byte> rx;
+};
+
+static LinkStream dofLink;
+
+// True if a synch request at the handler's rate is answered
+static boolean answersSynch() {
+  dofLink.rx.clear();
+  dofLink.print("#s42");
+  for (int i = 0; i < 1000; i++) {
+    dofLink.available();
+    std::string text(dofLink.rx.begin(), dofLink.rx.end());
+    if (text.find("#SYNCH42") != std::string::npos) return true;
+  }
+  return false;
+}
+
+static void report(const char *name, long handlerRate) {
+  printf("%s: handler at %ld baud, firmware at %lu\n", name, handlerRate, hostSerial().getBaudRate());
+}
+
+int main() {
+  hostSetClockStep(0);
+  board.begin();
+  hostSerial().receive("#o0");
+  board.run(100000);
+  hostSerial().clearWritten();
+
+  // Up to 57600 baud, every step confirmed
+  dofLink.begin(OUTPUT__BAUD_RATE);
+  DofHandler<LinkStream> handler(&dofLink, OUTPUT__BAUD_RATE);
+  long rate = handler.negotiateBaudRate(57600);
+  report("negotiated up to 57600", rate);
+  CHECK(rate == 57600 && hostSerial().getBaudRate() == 57600);
+  CHECK(handler.getLinkErrorRate() == 0);
+  CHECK(answersSynch());
+
+  // A rate the link does not hold up at: both ends fall back
+  dofLink.maxRate = 57600;
+  CHECK(!handler.setBaudRate(115200));
+  board.run(2000000); // Past the trial
+  report("115200 garbled", handler.getBaudRate());
+  CHECK(handler.getBaudRate() == 57600 && hostSerial().getBaudRate() == 57600);
+  CHECK(answersSynch());
+
+  // The answers to the confirmation of 115200 lost: the 9DoF keeps the rate, so the handler
+  // has to as well
+  dofLink.maxRate = 115200;
+  dofLink.dropBaudAnswers = true;
+  CHECK(handler.setBaudRate(115200));
+  board.run(2000000);
+  report("115200 with the confirmation answers lost", handler.getBaudRate());
+  CHECK(dofLink.baudAnswers > 1);
+  CHECK(handler.getBaudRate() == 115200 && hostSerial().getBaudRate() == 115200);
+  CHECK(answersSynch());
+  return checkResult();
+}
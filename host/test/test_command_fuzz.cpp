@@ -0,0 +1,113 @@
+// Fuzzes the serial command parser (Commands.ino) with the firmware running on the simulated
+// board (see RazorBoard.h): random bytes, stray '#'s, command names cut short and commands with
+// random arguments come in a few bytes at a time, with pauses in between, some of them longer
+// than COMMAND_TIMEOUT. The main loop has to keep taking its samples all along, and the parser
+// has to answer a good command right after.
+//
+// A parser that waits for the rest of a command never returns from loop(), as no more bytes
+// come in while it runs; the test then hangs and ctest stops it (see the TIMEOUT in
+// CMakeLists.txt).
+
+#include "Firmware.h"
+
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "HostSerial.h"
+#include "RazorBoard.h"
+
+#define FUZZ_CHUNKS 5000
+#define LONGEST_COMMAND_WAIT 20000UL // The delays commands take on purpose (us): #b 10ms, #p 5ms
+
+static RazorBoard board;
+
+static void addRandomBytes(std::vector<byte> &bytes, int count) {
+  for (int i = 0; i < count; i++) bytes.push_back(rand() % 4 == 0 ? '#' : rand() % 256);
+}
+
+// One piece of fuzz input: random bytes, or a command from the table that is whole, cut short
+// or followed by random bytes. Not "#I": random sensor tick intervals are mostly shorter than the
+// sensor reads take, and the ticks missed then would hide the ones missed on the parser's account.
+static void addChunk(std::vector<byte> &bytes) {
+  const Command *found;
+  do found = &commands[rand() % COMMAND_COUNT]; while (strcmp(found->name, "I") == 0);
+  const Command &command = *found;
+  int name = strlen(command.name);
+  switch (rand() % 4) {
+    case 0:
+      addRandomBytes(bytes, 1 + rand() % 8);
+      break;
+    case 1: // Cut short
+      bytes.push_back('#');
+      bytes.insert(bytes.end(), command.name, command.name + rand() % (name + 1));
+      break;
+    default: // Whole, with random arguments, or some of them
+      bytes.push_back('#');
+      bytes.insert(bytes.end(), command.name, command.name + name);
+      addRandomBytes(bytes, rand() % 3 == 0 ? rand() % (command.args + 1) : command.args);
+      break;
+  }
+}
+
+// Sends text and returns what the firmware has written back after a few loop passes
+static std::string answer(const char *text) {
+  hostSerial().clearWritten();
+  hostSerial().receive(text);
+  board.run(10 * board.loopMicros);
+  const std::vector<byte> &written = hostSerial().getWritten();
+  return std::string(written.begin(), written.end());
+}
+
+int main() {
+  srand(18);
+  board.begin(); // The bus answers at once: #p waits for its writes
+  board.loopMicros = 100;
+  board.run(100000);
+
+  unsigned long longestLoop = 0, longestDelay = 0, ticks = 0, samples = 0, missed = 0;
+  unsigned long lastSample = sensor_sample_micros;
+  for (int chunk = 0; chunk < FUZZ_CHUNKS; chunk++) {
+    std::vector<byte> bytes;
+    addChunk(bytes);
+    hostSerial().receive(&bytes[0], bytes.size());
+
+    // Mostly short pauses, now and then one the parser drops a half command after
+    unsigned long pause = rand() % 10 == 0 ? (COMMAND_TIMEOUT + rand() % COMMAND_TIMEOUT) * 1000UL : rand() % 5000;
+    board.resetStats();
+    unsigned int missedBefore = num_missed_ticks;
+    unsigned long end = hostMicros() + pause;
+    do {
+      board.run(1);
+      if (sensor_sample_micros != lastSample) { // Time from the tick to its sample taken
+        samples++;
+        lastSample = sensor_sample_micros;
+        if (hostMicros() - lastSample > longestDelay) longestDelay = hostMicros() - lastSample;
+      }
+    } while (hostMicros() < end);
+    if (board.longestLoop > longestLoop) longestLoop = board.longestLoop;
+    // Unless random bytes made up an "#I" (see addChunk())
+    if (fusion_data_interval >= sensor_profiles[sensor_profile].fusion_interval) {
+      ticks += board.ticks;
+      missed += num_missed_ticks - missedBefore;
+    }
+    hostSerial().clearWritten();
+  }
+  printf("%d pieces of input: %lu samples taken; at the profile's interval or longer %lu ticks, %lu missed\n",
+    FUZZ_CHUNKS, samples, ticks, missed);
+  printf("  longest loop() pass %lu us, longest from a tick to its sample %lu us\n", longestLoop, longestDelay);
+  CHECK(longestLoop < LONGEST_COMMAND_WAIT);
+  CHECK(longestDelay < LONGEST_COMMAND_WAIT);
+  CHECK(missed * 100 < ticks); // Only around the waits of "#b" and "#p", at 2ms ticks
+
+  // Back to a known state: streaming off, then a command cut short is dropped after the timeout
+  // and a whole one is answered
+  board.run(2 * COMMAND_TIMEOUT * 1000UL);
+  answer("#o0");
+  board.run(2 * COMMAND_TIMEOUT * 1000UL);
+  CHECK(answer("#s0") == "");
+  board.run((COMMAND_TIMEOUT + 1) * 1000UL);
+  CHECK(answer("#s42") == "#SYNCH42\r\n");
+  CHECK(answer("x\xff#q#s43") == "#SYNCH43\r\n"); // Unknown command and stray bytes skipped
+  return checkResult();
+}
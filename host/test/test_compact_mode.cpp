@@ -0,0 +1,165 @@
+// Round trip of DATA_MODE_COMPACT: the firmware's output_sensors_binary_packet() encodes a
+// simulated motion, DofHandler decodes it, and every sample it hands out has to be within the
+// mode's resolution of the values the firmware had (1/256 g, whole magnetometer units, exact
+// gyroscope counts). With packets lost on the way, deltas must only be applied while nothing
+// since the last keyframe is missing.
+//
+// Also reports the bandwidth against DATA_MODE_ALL: bytes per sample, and samples per second at
+// 28800 baud.
+
+#include "Firmware.h"
+
+#include <vector>
+
+#include "Check.h"
+#include "DofHandler.h"
+#include "Host.h"
+#include "HostSerial.h"
+#include "ReplayStream.h"
+
+#define SAMPLES 4000
+#define LINK_BAUD 28800L
+
+// The calibrated sensor values of one sample, as the firmware has them after compensate_sensor_errors()
+struct Sample {
+  float accel[3];
+  float magnetom[3];
+  float gyro[3];
+};
+
+// A board being moved about: small steps (and sensor noise) every sample, and now and then a
+// jump too large for a delta
+static std::vector<Sample> simulateMotion(uint32_t count) {
+  srand(1);
+  Sample now = {{0, 0, GRAVITY}, {120.4f, -35.7f, 260.2f}, {0, 0, 0}};
+  std::vector<Sample> samples;
+  for (uint32_t i = 0; i < count; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      now.accel[axis] = constrain(now.accel[axis] + rand() % 9 - 4, -2 * GRAVITY, 2 * GRAVITY);
+      now.magnetom[axis] = constrain(now.magnetom[axis] + (rand() % 501 - 250) / 100.0f, -600.0f, 600.0f);
+      now.gyro[axis] = constrain(now.gyro[axis] + rand() % 21 - 10, -2000.0f, 2000.0f);
+    }
+    if (rand() % 250 == 0) now.gyro[rand() % 3] += rand() % 2 ? 400 : -400;
+    samples.push_back(now);
+  }
+  return samples;
+}
+
+// Has the firmware send sample in the current data mode, and returns the packet it sent
+static std::vector<byte> sendSample(const Sample &sample) {
+  memcpy(accel, sample.accel, sizeof(accel));
+  memcpy(magnetom, sample.magnetom, sizeof(magnetom));
+  memcpy(gyro, sample.gyro, sizeof(gyro));
+  output_sensors_binary_packet();
+  output_queue.sendAll(Serial);
+  std::vector<byte> packet = hostSerial().getWritten();
+  hostSerial().clearWritten();
+  return packet;
+}
+
+// Encodes every sample in mode, one packet per sample
+static std::vector<std::vector<byte> > encode(const std::vector<Sample> &samples, byte mode) {
+  command_data_mode(&mode);
+  std::vector<std::vector<byte> > packets;
+  for (size_t i = 0; i < samples.size(); i++) packets.push_back(sendSample(samples[i]));
+  return packets;
+}
+
+// True if data holds sample, to the resolution of DATA_MODE_COMPACT (or of the floats of
+// DATA_MODE_ALL if exact)
+static boolean matches(const DofData &data, const Sample &sample, boolean exact) {
+  const double accelError = exact ? 1e-6 : 0.5 / 256 + 1e-6;
+  const double magnError = exact ? 1e-4 : 0.5 + 1e-4;
+  const double got[] = {data.accelX, data.accelY, data.accelZ, data.magX, data.magY, data.magZ};
+  for (int axis = 0; axis < 3; axis++) {
+    if (fabs(got[axis] - sample.accel[axis] / GRAVITY) > accelError) return false;
+    if (fabs(got[3 + axis] - sample.magnetom[axis]) > magnError) return false;
+  }
+  const double gyroGot[] = {data.gyroX, data.gyroY, data.gyroZ};
+  for (int axis = 0; axis < 3; axis++) {
+    if (gyroGot[axis] != sample.gyro[axis] * DOF_GYRO_SCALE) return false;
+  }
+  return true;
+}
+
+// A DATA_MODE_COMPACT keyframe, rather than a delta
+static boolean isKeyframe(const std::vector<byte> &packet) {
+  return packet[DOF_MAGIC_SIZE + 3] == DOF_DATA_MODE_SIZE[DOF_DATA_MODE_COMPACT];
+}
+
+/**
+ * Sends packets (minus the ones in lost) through a DofHandler, and checks that it hands out
+ * the samples expected, in order: all of them in keep, and nothing else.
+ */
+static void decode(const std::vector<std::vector<byte> > &packets, const std::vector<Sample> &samples,
+    const std::vector<boolean> &keep, boolean exact) {
+  std::vector<byte> stream;
+  std::vector<uint32_t> expected;
+  boolean chain = false; // Nothing lost since the last keyframe
+  for (size_t i = 0; i < packets.size(); i++) {
+    if (!keep[i]) {
+      chain = false;
+      continue;
+    }
+    stream.insert(stream.end(), packets[i].begin(), packets[i].end());
+    if (exact || isKeyframe(packets[i])) chain = true;
+    if (chain) expected.push_back(i);
+  }
+
+  ReplayStream replay;
+  replay.load(stream);
+  replay.setChunkSize(64);
+  DofHandler<ReplayStream> handler(&replay, LINK_BAUD);
+  size_t next = 0;
+  uint32_t wrong = 0;
+  while (true) {
+    if (handler.checkStream(true)) {
+      if (!handler.isPacketGood()) continue;
+      if (next >= expected.size() || !matches(handler.getData(), samples[expected[next]], exact)) wrong++;
+      next++;
+    } else if (replay.isDone()) {
+      break;
+    }
+  }
+  CHECK(wrong == 0);
+  CHECK(next == expected.size());
+  CHECK(handler.getStats().goodPackets == expected.size());
+}
+
+static size_t totalSize(const std::vector<std::vector<byte> > &packets) {
+  size_t size = 0;
+  for (size_t i = 0; i < packets.size(); i++) size += packets[i].size();
+  return size;
+}
+
+int main() {
+  output_batch_size = 1;
+  output_timestamps = false;
+  std::vector<Sample> samples = simulateMotion(SAMPLES);
+  std::vector<std::vector<byte> > all = encode(samples, DATA_MODE_ALL);
+  std::vector<std::vector<byte> > compact = encode(samples, DATA_MODE_COMPACT);
+
+  // Every packet through
+  std::vector<boolean> keep(SAMPLES, true);
+  decode(all, samples, keep, true);
+  decode(compact, samples, keep, false);
+
+  // One packet in 20 lost, and a burst of 40
+  srand(2);
+  for (uint32_t i = 0; i < SAMPLES; i++) keep[i] = rand() % 20 != 0 && (i < 1000 || i >= 1040);
+  decode(compact, samples, keep, false);
+
+  uint32_t keyframes = 0;
+  for (size_t i = 0; i < compact.size(); i++) keyframes += isKeyframe(compact[i]);
+  double allSize = (double)totalSize(all) / SAMPLES;
+  double compactSize = (double)totalSize(compact) / SAMPLES;
+  const double bytesPerSecond = LINK_BAUD / 10.0; // 8N1: 10 bits per byte
+  printf("Bandwidth at %ld baud, %d samples:\n", LINK_BAUD, SAMPLES);
+  printf("  DATA_MODE_ALL      %5.1f bytes/sample, %5.1f samples/s\n", allSize, bytesPerSecond / allSize);
+  printf("  DATA_MODE_COMPACT  %5.1f bytes/sample, %5.1f samples/s (%.1f%% keyframes)\n", compactSize,
+    bytesPerSecond / compactSize, 100.0 * keyframes / SAMPLES);
+  printf("  %.2fx the samples per second\n", allSize / compactSize);
+  CHECK(allSize / compactSize >= 2.0);
+
+  return checkResult();
+}
@@ -0,0 +1,276 @@
+// DofHandler's interrupt mode on a simulated UART, on the virtual clock: the 9DoF streams
+// packets into a 64 byte receive buffer (as HardwareSerial has) that drops what does not fit,
+// while a main loop that takes 20ms per pass sends commands and reads the statistics. A 1ms
+// timer interrupt calls serviceInterrupt(), and its frame handler sends tagged requests from
+// the interrupt. Every packet has to get through, and every command has to be on the wire in
+// one piece, wherever the interrupt comes.
+//
+// Polling the same stream from the same main loop loses packets, for comparison.
+
+#include <deque>
+#include <vector>
+
+#include "Check.h"
+#include "DofHandler.h"
+#include "Host.h"
+#include "PacketWriter.h"
+
+#define BAUD 115200
+#define BYTE_MICROS (10000000UL / BAUD)
+#define UART_RX_SIZE 64
+#define TIMER_MICROS 1000 // Timer interrupt period
+#define STEP_MICROS 10 // Resolution of the simulation
+#define PACKET_PERIOD 5000 // The 9DoF sends a 40 byte packet every 5ms (3.5ms on the wire)
+#define LOOP_WORK 20000 // Time the main loop spends on its own work per pass
+#define RUN_PASSES 200
+#define PASS_COMMANDS 8 // Commands the main loop sends per pass
+
+/**
+ * A UART: the bytes the 9DoF sends come in at the baud rate into a receive buffer of
+ * UART_RX_SIZE bytes, and are dropped when it is full. Writing a byte takes a byte time, and
+ * the simulation (with the timer interrupt) runs on meanwhile.
+ */
+class UartStream : public Stream {
+  public:
+    UartStream() : lineFree(0), overflows(0) {}
+
+    void send(const std::vector<byte> &bytes) {
+      unsigned long at = lineFree > hostMicros() ? lineFree : hostMicros();
+      for (size_t i = 0; i < bytes.size(); i++) {
+        at += BYTE_MICROS;
+        incoming.push_back(std::make_pair(at, bytes[i]));
+      }
+      lineFree = at;
+    }
+
+    // The receive interrupt: takes in the bytes that are in by now
+    void receive() {
+      while (!incoming.empty() && incoming.front().first <= hostMicros()) {
+        if (rx.size() < UART_RX_SIZE) rx.push_back(incoming.front().second);
+        else overflows++;
+        incoming.pop_front();
+      }
+    }
+
+    void begin(long) {}
+    void end() {}
+    int available() { return rx.size(); }
+    int read() {
+      if (rx.empty()) return -1;
+      byte b = rx.front();
+      rx.pop_front();
+      return b;
+    }
+    int peek() { return rx.empty() ? -1 : rx.front(); }
+    size_t write(uint8_t b);
+    using Print::write;
+
+    std::deque<std::pair<unsigned long, byte> > incoming; // Time each byte is in, and the byte
+    std::deque<byte> rx;
+    std::vector<byte> written;
+    unsigned long lineFree;
+    unsigned long overflows; // Bytes dropped by the full receive buffer
+};
+
+static UartStream uart;
+static DofHandler<UartStream> handler(&uart, BAUD);
+static DofRingBuffer<16> ring;
+static PacketWriter writer;
+static unsigned long nextPacket, nextTimer;
+static uint32_t nextIndex; // Sample index of the next packet
+static boolean sending;
+static unsigned long frames; // Frames the frame handler got
+static unsigned long handlerRequests; // Tagged requests the frame handler sent
+
+// Runs the 9DoF, the UART and the timer interrupt for micros
+static void elapse(unsigned long micros) {
+  unsigned long end = hostMicros() + micros;
+  while (hostMicros() < end) {
+    hostAdvanceMicros(STEP_MICROS);
+    while (sending && hostMicros() >= nextPacket) {
+      writer.bytes.clear();
+      writer.sample(DOF_DATA_MODE_ALL, nextIndex++);
+      uart.send(writer.bytes);
+      nextPacket += PACKET_PERIOD;
+    }
+    uart.receive();
+    if (hostMicros() >= nextTimer) {
+      nextTimer += TIMER_MICROS;
+      handler.serviceInterrupt();
+    }
+  }
+}
+
+size_t UartStream::write(uint8_t b) {
+  written.push_back(b);
+  elapse(BYTE_MICROS);
+  return 1;
+}
+
+// Called from the timer interrupt: a tagged request per frame, which goes on the wire between
+// the main loop's commands only if they lock
+static void onFrame(const DofFrame &) {
+  frames++;
+  handler.requestDataTagged();
+  handlerRequests++;
+}
+
+// The commands the main loop sends
+enum { SENT_DATA_MODE, SENT_FRAME, SENT_BATCH, SENT_STREAM, SENT_TAGGED, SENT_KINDS };
+
+// Splits the bytes written into commands, counting each kind; returns the number of bytes
+// that are not part of a whole command
+static size_t countCommands(const std::vector<byte> &bytes, unsigned long counts[SENT_KINDS]) {
+  size_t i = 0, stray = 0;
+  while (i < bytes.size()) {
+    size_t left = bytes.size() - i;
+    if (left >= 3 && bytes[i] == '#' && bytes[i + 1] == 'm') {
+      counts[SENT_DATA_MODE]++;
+      i += 3;
+    } else if (left >= 2 && bytes[i] == '#' && bytes[i + 1] == 'f') {
+      counts[SENT_FRAME]++;
+      i += 2;
+    } else if (left >= 3 && bytes[i] == '#' && bytes[i + 1] == 'k') {
+      counts[SENT_BATCH]++;
+      i += 3;
+    } else if (left >= 5 && bytes[i] == '#' && bytes[i + 1] == 'o' && (bytes[i + 2] == '0' || bytes[i + 2] == '1')
+        && bytes[i + 3] == '\r' && bytes[i + 4] == '\n') {
+      counts[SENT_STREAM]++;
+      i += 5;
+    } else if (left >= 3 && bytes[i] == '#' && bytes[i + 1] == 'F') {
+      counts[SENT_TAGGED]++;
+      i += 3;
+    } else {
+      stray++;
+      i++;
+    }
+  }
+  return stray;
+}
+
+struct LoadRun {
+  uint32_t sent; // Packets the 9DoF sent
+  uint32_t good, bad, lost;
+  unsigned long overflows;
+  unsigned long samples, dropped, outOfOrder; // Samples taken from the ring
+};
+
+// RUN_PASSES passes of a main loop doing LOOP_WORK of its own work, then PASS_COMMANDS commands
+// and a look at the statistics; polling takes the packets with checkStream() instead
+static LoadRun runLoop(boolean polling, unsigned long sent[SENT_KINDS]) {
+  LoadRun run = {0, 0, 0, 0, 0, 0, 0, 0};
+  uint32_t firstIndex = nextIndex;
+  uint32_t expected = firstIndex;
+  DofSample sample;
+  sending = true;
+  nextPacket = hostMicros();
+  for (int pass = 0; pass < RUN_PASSES; pass++) {
+    elapse(LOOP_WORK);
+    if (polling) {
+      while (handler.checkStream()) handler.clearNewDataFlag();
+    }
+
+    for (int i = 0; i < PASS_COMMANDS; i++) {
+      switch (rand() % 5) {
+        case 0:
+          handler.requestData(rand() % 2 ? DOF_DATA_MODE_ALL : DOF_DATA_MODE_GYRO);
+          sent[SENT_FRAME]++;
+          break;
+        case 1:
+          handler.setDataMode(rand() % 2 ? DOF_DATA_MODE_ALL : DOF_DATA_MODE_GYRO, true);
+          sent[SENT_DATA_MODE]++;
+          break;
+        case 2:
+          handler.setBatchSize(1);
+          sent[SENT_BATCH]++;
+          break;
+        case 3:
+          handler.setContinuousStream(true);
+          sent[SENT_STREAM]++;
+          break;
+        default:
+          handler.requestData();
+          sent[SENT_FRAME]++;
+          break;
+      }
+    }
+
+    handler.lock();
+    DofStats stats = handler.getStats();
+    handler.unlock();
+    if (!polling) CHECK(stats.badPackets == 0); // Polling overflows the receive buffer
+
+    while (ring.pop(sample)) {
+      uint32_t index = (uint32_t)lround(sample.data.gyroX / DOF_GYRO_SCALE);
+      if (index != expected) run.outOfOrder++;
+      expected = index + 1;
+      run.samples++;
+    }
+  }
+
+  // Let the last packets in
+  sending = false;
+  elapse(PACKET_PERIOD + LOOP_WORK);
+  if (polling) {
+    while (handler.checkStream(true)) handler.clearNewDataFlag();
+  }
+  while (ring.pop(sample)) run.samples++;
+
+  run.sent = nextIndex - firstIndex;
+  handler.lock();
+  run.good = handler.getStats().goodPackets;
+  run.bad = handler.getStats().badPackets;
+  run.lost = handler.getStats().lostPackets;
+  handler.unlock();
+  run.overflows = uart.overflows;
+  run.dropped = ring.getDropped();
+  return run;
+}
+
+int main() {
+  hostSetClockStep(0);
+  hostSetMicros(1000000);
+  nextTimer = hostMicros();
+  srand(24);
+
+  // Interrupt mode, the samples into a ring and the frame handler sending tagged requests
+  handler.setInterruptMode(true);
+  handler.setSampleRing(&ring);
+  handler.onFrame(onFrame);
+  unsigned long sent[SENT_KINDS] = {0};
+  uart.written.clear();
+  LoadRun run = runLoop(false, sent);
+  printf("interrupt mode: %u packets sent, %u good, %u bad, %u lost; %lu bytes overflowed, %lu samples taken, "
+    "%lu dropped by the ring\n", run.sent, run.good, run.bad, run.lost, run.overflows, run.samples, run.dropped);
+  CHECK(run.good == run.sent);
+  CHECK(run.bad == 0 && run.lost == 0);
+  CHECK(run.overflows == 0);
+  CHECK(run.samples == run.sent && run.dropped == 0 && run.outOfOrder == 0);
+  CHECK(frames == run.sent);
+
+  // Every command whole: the data mode changes requestData() makes count as "#m"
+  unsigned long counts[SENT_KINDS] = {0};
+  size_t stray = countCommands(uart.written, counts);
+  printf("  %u bytes written: %lu frame requests, %lu data modes, %lu batch sizes, %lu streams, "
+    "%lu tagged requests (%lu from the frame handler); %u stray bytes\n", (unsigned)uart.written.size(),
+    counts[SENT_FRAME], counts[SENT_DATA_MODE], counts[SENT_BATCH], counts[SENT_STREAM], counts[SENT_TAGGED],
+    handlerRequests, (unsigned)stray);
+  CHECK(stray == 0);
+  CHECK(counts[SENT_FRAME] == sent[SENT_FRAME]);
+  CHECK(counts[SENT_DATA_MODE] >= sent[SENT_DATA_MODE]);
+  CHECK(counts[SENT_BATCH] == sent[SENT_BATCH]);
+  CHECK(counts[SENT_STREAM] == sent[SENT_STREAM]);
+  CHECK(counts[SENT_TAGGED] == handlerRequests && handlerRequests > 0);
+
+  // The same load, polled
+  handler.setInterruptMode(false);
+  handler.onFrame(NULL);
+  uart.overflows = 0;
+  DofStats before = handler.getStats();
+  LoadRun poll = runLoop(true, sent);
+  printf("polled: %u packets sent, %u good, %u lost; %lu bytes overflowed\n", poll.sent,
+    poll.good - before.goodPackets, poll.lost - before.lostPackets, poll.overflows);
+  CHECK(poll.overflows > 0);
+  CHECK(poll.good - before.goodPackets < poll.sent);
+  return checkResult();
+}
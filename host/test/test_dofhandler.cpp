@@ -0,0 +1,90 @@
+// DofHandler tests that need no more than a replayed stream.
+
+#include <new>
+
+#include "Check.h"
+#include "DofHandler.h"
+#include "Host.h"
+#include "PacketWriter.h"
+#include "ReplayStream.h"
+
+// Packets that are in (or on their way in) when the data mode is changed are still received,
+// each decoded by the data mode in its header
+static void testModeChangeKeepsPackets() {
+  PacketWriter writer;
+  for (uint32_t i = 0; i < 3; i++) writer.sample(DOF_DATA_MODE_ALL, i);
+  writer.sample(DOF_DATA_MODE_GYRO, 3);
+  ReplayStream stream;
+  stream.load(writer.bytes);
+  DofHandler<ReplayStream> handler(&stream, 115200);
+
+  CHECK(handler.checkStream());
+  handler.requestData(DOF_DATA_MODE_GYRO);
+  CHECK(handler.checkStream(true));
+  handler.setDataMode(DOF_DATA_MODE_GYRO, true);
+  CHECK(handler.checkStream(true));
+  CHECK(handler.isPacketGood());
+  CHECK(handler.getData().gyroZ == PacketWriter::expectedGyroZ(2));
+  CHECK(handler.checkStream(true));
+  CHECK(handler.getData().gyroZ == PacketWriter::expectedGyroZ(3));
+  CHECK(!handler.checkStream(true));
+
+  const DofStats &stats = handler.getStats();
+  CHECK(stats.goodPackets == 4);
+  CHECK(stats.badPackets == 0);
+  CHECK(stats.lostPackets == 0);
+  CHECK(!stream.getWritten().empty());
+}
+
+// A tagged packet answers its request only once it checks out: a compact delta packet with no
+// keyframe before it leaves the request in flight for the answer that does
+static void testBadTaggedPacketKeepsRequest() {
+  ReplayStream stream;
+  DofHandler<ReplayStream> handler(&stream, 115200);
+  byte tag = handler.requestDataTagged();
+  CHECK(handler.getRequestsInFlight() == 1);
+
+  PacketWriter writer;
+  std::vector<byte> data(1, tag);
+  data.resize(1 + DOF_COMPACT_DELTA_SIZE);
+  writer.packet(DOF_DATA_MODE_COMPACT | DOF_DATA_MODE_TAGGED, data);
+  std::vector<byte> bad = writer.bytes;
+  stream.load(bad);
+  handler.checkStream(true);
+  CHECK(!handler.isPacketGood());
+  CHECK(handler.getStats().badPackets == 1);
+  CHECK(handler.getRequestsInFlight() == 1);
+
+  writer.bytes.clear();
+  data.resize(1);
+  for (byte axis = 0; axis < 3; axis++) PacketWriter::putShort(data, PacketWriter::gyroValue(2, axis));
+  writer.packet(DOF_DATA_MODE_GYRO | DOF_DATA_MODE_TAGGED, data);
+  stream.load(writer.bytes);
+  CHECK(handler.checkStream(true));
+  CHECK(handler.getData().gyroZ == PacketWriter::expectedGyroZ(2));
+  CHECK(handler.getStats().badPackets == 1);
+  CHECK(handler.getRequestsInFlight() == 0);
+  CHECK(handler.getLastRequestTag() == tag);
+  CHECK(handler.getLostRequests() == 0);
+}
+
+// Before the first good packet, getFrame() views zeros (the handler is built over garbage, as
+// it would be on the stack)
+static void testFrameBeforeFirstPacket() {
+  ReplayStream stream;
+  static byte storage[sizeof(DofHandler<ReplayStream>)];
+  memset(storage, 0xA5, sizeof(storage));
+  DofHandler<ReplayStream> *handler = new (storage) DofHandler<ReplayStream>(&stream, 115200);
+  DofFrame frame = handler->getFrame();
+  CHECK(frame.getMode() == DOF_DATA_MODE_DEFAULT && frame.getSampleCount() == 1);
+  CHECK(frame.getAccelX() == 0 && frame.getMagZ() == 0 && frame.getGyroZ() == 0);
+  CHECK(frame.getRoll() == 0 && frame.getYaw() == 0);
+  handler->~DofHandler<ReplayStream>();
+}
+
+int main() {
+  testModeChangeKeepsPackets();
+  testBadTaggedPacketKeepsRequest();
+  testFrameBeforeFirstPacket();
+  return checkResult();
+}
@@ -0,0 +1,291 @@
+// DofManager with several 9DoFs on mock serial streams that send at different rates and baud
+// rates, on the virtual clock: every stream has to be serviced while a faster one keeps its
+// stream busy, the fused data has to line up with the signal at the time it is aligned to, a
+// 9DoF that sends wrong data has to be outvoted, and one that stops has to be dropped.
+//
+// Every 9DoF measures the same signal: sample index i (see PacketWriter) is its value i
+// milliseconds into the test, so the values are a ramp in time that every 9DoF samples at
+// its own times.
+
+#include <deque>
+#include <vector>
+
+#include "Check.h"
+#include "DofHandler.h"
+#include "DofManager.h"
+#include "Host.h"
+#include "PacketWriter.h"
+
+#define SERVICE_MICROS 50 // Time between service() calls
+#define SETTLE_MICROS 50000 // Time every 9DoF below takes to send two samples
+
+/**
+ * A serial stream whose bytes come in one by one at the baud rate, on the virtual clock.
+ */
+class TimedStream : public Stream {
+  public:
+    TimedStream() : lineFree(0) {}
+
+    // Sends bytes, starting when the line is free; returns the time the last one is in
+    unsigned long send(const std::vector<byte> &bytes, long baud) {
+      unsigned long byteMicros = 10000000UL / baud;
+      unsigned long at = lineFree > hostMicros() ? lineFree : hostMicros();
+      for (size_t i = 0; i < bytes.size(); i++) {
+        at += byteMicros;
+        incoming.push_back(std::make_pair(at, bytes[i]));
+      }
+      lineFree = at;
+      return at;
+    }
+
+    void begin(long) {}
+    void end() {}
+    int available() {
+      int count = 0;
+      while (count < (int)incoming.size() && incoming[count].first <= hostMicros()) count++;
+      return count;
+    }
+    int read() {
+      if (available() == 0) return -1;
+      byte b = incoming.front().second;
+      incoming.pop_front();
+      return b;
+    }
+    int peek() { return available() ? incoming.front().second : -1; }
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+
+  private:
+    std::deque<std::pair<unsigned long, byte> > incoming; // Time each byte is in, and the byte
+    unsigned long lineFree;
+};
+
+// A 9DoF sending DOF_DATA_MODE_ALL samples every period microseconds
+struct Board {
+  Board(unsigned long period, long baud, long indexError = 0)
+    : handler(&stream, baud), source(&handler), period(period), baud(baud), indexError(indexError), next(0),
+      stopped(false), received(0), longestWait(0) {}
+
+  // Sends the samples due by now; start is the time of sample index 0
+  void send(unsigned long start) {
+    while (!stopped && hostMicros() >= next) {
+      writer.bytes.clear();
+      writer.sample(DOF_DATA_MODE_ALL, (next - start) / 1000 + indexError);
+      arrivals.push_back(stream.send(writer.bytes, baud));
+      next += period;
+    }
+  }
+
+  // Takes the packets parsed since the last call off the ones on their way, keeping the
+  // longest time one was in before it was parsed
+  void parsed() {
+    unsigned long good = handler.getStats().goodPackets;
+    for (; received < good; received++) {
+      unsigned long wait = hostMicros() - arrivals.front();
+      if (wait > longestWait) longestWait = wait;
+      arrivals.pop_front();
+    }
+  }
+
+  TimedStream stream;
+  DofHandler<TimedStream> handler;
+  DofHandlerSource<TimedStream> source;
+  PacketWriter writer;
+  unsigned long period;
+  long baud;
+  long indexError; // Sends the sample this many milliseconds off
+  unsigned long next; // Time of the next sample
+  boolean stopped;
+  std::deque<unsigned long> arrivals; // Times the packets on their way are in
+  unsigned long received; // Packets parsed
+  unsigned long longestWait;
+};
+
+// Packet time at 115200 baud: 40 bytes (see PacketWriter)
+#define PACKET_MICROS (40 * (10000000UL / 115200))
+
+// The signal at time (ms into the test): value v of DofData order
+static double signal(double ms, byte v) {
+  if (v < 6) return (ms - 256 + v * 10) / 8; // PacketWriter::sensorValue()
+  byte axis = v - 6;
+  return (ms * (axis + 1) - 1000 * axis) * DOF_GYRO_SCALE; // PacketWriter::gyroValue()
+}
+
+// Slope of the signal (per ms)
+static double slope(byte v) {
+  return v < 6 ? 1.0 / 8 : (v - 5) * DOF_GYRO_SCALE;
+}
+
+struct FuseRun {
+  int fused; // getData() calls with data
+  byte fewestSources, mostSources;
+  double worstError; // Largest error of a fused value, in ms of the signal
+};
+
+// Runs boards for micros, servicing manager, and fuses every time new data is in. The samples
+// are in PACKET_MICROS after they are taken (at 115200 baud), so the fused data is checked
+// against the signal that long before the time it is aligned to. A 9DoF's first sample is not
+// extrapolated, so the check starts after every 9DoF has sent two (SETTLE_MICROS in).
+static FuseRun run(DofManager &manager, std::vector<Board *> &boards, unsigned long micros, unsigned long start) {
+  FuseRun result = {0, 255, 0, 0};
+  unsigned long settled = hostMicros() + SETTLE_MICROS;
+  unsigned long end = hostMicros() + micros;
+  while (hostMicros() < end) {
+    for (size_t i = 0; i < boards.size(); i++) boards[i]->send(start);
+    manager.service();
+    for (size_t i = 0; i < boards.size(); i++) boards[i]->parsed();
+    if (manager.isNewDataAvailable() && hostMicros() >= settled) {
+      DofData data = DofData(); // getData() leaves it alone without sources
+      byte n = manager.getData(data);
+      const double values[] = {data.accelX, data.accelY, data.accelZ, data.magX, data.magY, data.magZ,
+        data.gyroX, data.gyroY, data.gyroZ};
+      double ms = (manager.getSampleTime() - PACKET_MICROS - start) / 1000.0;
+      for (byte v = 0; v < 9; v++) {
+        double error = fabs(values[v] - signal(ms, v)) / slope(v);
+        if (error > result.worstError) result.worstError = error;
+      }
+      result.fused++;
+      if (n < result.fewestSources) result.fewestSources = n;
+      if (n > result.mostSources) result.mostSources = n;
+    }
+    hostAdvanceMicros(SERVICE_MICROS);
+  }
+  return result;
+}
+
+static void report(const char *name, const FuseRun &run) {
+  printf("%s: %d fused, %d to %d 9DoFs, worst error %.3f ms\n", name, run.fused, run.fewestSources,
+    run.mostSources, run.worstError);
+}
+
+// Three 9DoFs at 100Hz, 50Hz and 143Hz, and a fourth that floods its stream at 1kHz and 1Mbaud
+static void testRates() {
+  unsigned long start = hostMicros();
+  Board a(10000, 115200), b(20000, 115200), c(7000, 115200), flood(1000, 1000000);
+  a.next = start + 3000;
+  b.next = start + 11000;
+  c.next = start;
+  flood.next = start;
+  std::vector<Board *> boards;
+  boards.push_back(&a);
+  boards.push_back(&b);
+  boards.push_back(&c);
+  boards.push_back(&flood);
+  DofManager manager;
+  for (size_t i = 0; i < boards.size(); i++) CHECK(manager.add(&boards[i]->source));
+
+  // The fused values first, without the flood: at 1Mbaud its samples are in sooner after they
+  // are taken than the others' (see run())
+  flood.stopped = true;
+  FuseRun result = run(manager, boards, 400000, start);
+  report("100Hz, 50Hz and 143Hz", result);
+  CHECK(result.mostSources == 3);
+  CHECK(result.worstError < 0.5);
+
+  flood.stopped = false;
+  flood.next = hostMicros();
+  run(manager, boards, 100000, start);
+  printf("  with a 1kHz 9DoF flooding its stream: longest wait for a packet %lu / %lu / %lu us, flood %lu us\n",
+    a.longestWait, b.longestWait, c.longestWait, flood.longestWait);
+  for (size_t i = 0; i < boards.size(); i++) {
+    CHECK(boards[i]->arrivals.size() <= 1); // Nothing left behind
+    CHECK(boards[i]->longestWait <= 2 * SERVICE_MICROS);
+  }
+
+  // The loop is held up for 12ms: the flood has a dozen packets waiting, the others one or two.
+  // The first service() takes DOF_MANAGER_MAX_PASSES of the flood's and all of the others'.
+  unsigned long held = hostMicros() + 12000;
+  while (hostMicros() < held) {
+    for (size_t i = 0; i < boards.size(); i++) boards[i]->send(start);
+    hostAdvanceMicros(SERVICE_MICROS);
+  }
+  size_t waiting[4];
+  for (size_t i = 0; i < boards.size(); i++) {
+    waiting[i] = boards[i]->stream.available() / 40; // Whole packets in
+  }
+  manager.service();
+  for (size_t i = 0; i < boards.size(); i++) boards[i]->parsed();
+  printf("  after the loop was held up for 12ms: %u / %u / %u packets waiting, flood %u; %u of the flood's left\n",
+    (unsigned)waiting[0], (unsigned)waiting[1], (unsigned)waiting[2], (unsigned)waiting[3],
+    (unsigned)(flood.stream.available() / 40));
+  CHECK(waiting[3] >= 10);
+  for (size_t i = 0; i < 3; i++) CHECK(boards[i]->stream.available() < 40);
+  CHECK((size_t)flood.stream.available() / 40 == waiting[3] - DOF_MANAGER_MAX_PASSES);
+  run(manager, boards, 20000, start);
+  CHECK(flood.arrivals.size() <= 1); // Caught up
+  for (size_t i = 0; i < boards.size(); i++) CHECK(boards[i]->handler.getStats().badPackets == 0);
+}
+
+// Three 9DoFs at the same rate, one of them sending samples 40ms off
+static void testVoting() {
+  unsigned long start = hostMicros();
+  Board a(10000, 115200), b(10000, 115200), bad(10000, 115200, 40);
+  a.next = start;
+  b.next = start + 2000;
+  bad.next = start + 4000;
+  std::vector<Board *> boards;
+  boards.push_back(&a);
+  boards.push_back(&bad);
+  boards.push_back(&b);
+
+  DofManager median;
+  for (size_t i = 0; i < boards.size(); i++) median.add(&boards[i]->source);
+  FuseRun result = run(median, boards, 200000, start);
+  report("median, one 9DoF 40ms off", result);
+  CHECK(result.mostSources == 3 && result.worstError < 0.5);
+
+  // The average, with the bad 9DoF weighted out and then in
+  start = hostMicros();
+  for (size_t i = 0; i < boards.size(); i++) boards[i]->next = start + 2000 * i;
+  DofManager average;
+  average.setFusionMode(DOF_FUSE_AVERAGE);
+  average.add(&a.source);
+  average.add(&bad.source, 0);
+  average.add(&b.source);
+  result = run(average, boards, 200000, start);
+  report("average, the 9DoF off weighted 0", result);
+  CHECK(result.worstError < 0.5);
+
+  DofManager weighted;
+  weighted.setFusionMode(DOF_FUSE_AVERAGE);
+  for (size_t i = 0; i < boards.size(); i++) weighted.add(&boards[i]->source);
+  start = hostMicros();
+  for (size_t i = 0; i < boards.size(); i++) boards[i]->next = start + 2000 * i;
+  result = run(weighted, boards, 200000, start);
+  report("average, the 9DoF off weighted 1", result);
+  CHECK(result.worstError > 40 / 3.0 - 0.5 && result.worstError < 40 / 3.0 + 0.5);
+}
+
+// A 9DoF that stops is dropped once its last sample is older than the alignment window
+static void testDropout() {
+  unsigned long start = hostMicros();
+  Board a(10000, 115200), b(20000, 115200), c(7000, 115200);
+  a.next = start;
+  b.next = start + 5000;
+  c.next = start + 1000;
+  std::vector<Board *> boards;
+  boards.push_back(&a);
+  boards.push_back(&b);
+  boards.push_back(&c);
+  DofManager manager;
+  manager.setMaxSkew(30000);
+  for (size_t i = 0; i < boards.size(); i++) manager.add(&boards[i]->source);
+
+  FuseRun before = run(manager, boards, 100000, start);
+  b.stopped = true;
+  run(manager, boards, 30000, start); // Within the window and out of it
+  FuseRun after = run(manager, boards, 100000, start);
+  report("a 9DoF stopped", after);
+  CHECK(before.mostSources == 3);
+  CHECK(after.mostSources == 2 && after.fewestSources == 2);
+  CHECK(after.worstError < 0.5);
+}
+
+int main() {
+  hostSetClockStep(0);
+  hostSetMicros(1000000);
+  testRates();
+  testVoting();
+  testDropout();
+  return checkResult();
+}
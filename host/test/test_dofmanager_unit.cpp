@@ -0,0 +1,5 @@
+// A second translation unit of test_dofmanager with DofManager.h in it, so the header's
+// definitions have to link when more than one source includes it
+
+#include "DofHandler.h"
+#include "DofManager.h"
@@ -0,0 +1,116 @@
+// Fuzzes the packet framing: streams with bit flips and dropped bytes go through DofHandler,
+// which must never pass off wrong data as good, and must get the packets that were not damaged
+// (it resynchronizes from inside a rejected packet rather than skipping all of it).
+
+#include <vector>
+#include <set>
+
+#include "Check.h"
+#include "DofHandler.h"
+#include "Host.h"
+#include "PacketWriter.h"
+#include "ReplayStream.h"
+
+#define FUZZ_PACKETS 2000
+#define FUZZ_ROUNDS 20
+
+enum Damage { DAMAGE_BIT_FLIP, DAMAGE_BYTE_DROP, DAMAGE_BOTH };
+
+// The sample index a good packet carries: the gyroscope X value is the index (see PacketWriter)
+static uint32_t sampleIndex(const DofFrame &frame) {
+  return (uint16_t)lround(frame.getGyroX() / DOF_GYRO_SCALE);
+}
+
+// True if every value of the packet is the one sample index was sent with
+static boolean isSample(const DofFrame &frame, byte mode, uint32_t index) {
+  if (frame.getGyroX() != PacketWriter::gyroValue(index, 0) * DOF_GYRO_SCALE) return false;
+  if (frame.getGyroY() != PacketWriter::gyroValue(index, 1) * DOF_GYRO_SCALE) return false;
+  if (frame.getGyroZ() != PacketWriter::expectedGyroZ(index)) return false;
+  if (mode == DOF_DATA_MODE_ALL) {
+    const double sensors[] = {frame.getAccelX(), frame.getAccelY(), frame.getAccelZ(),
+      frame.getMagX(), frame.getMagY(), frame.getMagZ()};
+    for (byte value = 0; value < 6; value++) {
+      if (sensors[value] != PacketWriter::sensorValue(index, value)) return false;
+    }
+  }
+  return true;
+}
+
+// One stream of FUZZ_PACKETS packets, about one in damageRate of them damaged
+static void fuzz(byte mode, Damage damage, uint32_t damageRate, unsigned int seed) {
+  srand(seed);
+  PacketWriter writer;
+  std::vector<byte> stream;
+  std::set<uint32_t> intact;
+  for (uint32_t i = 0; i < FUZZ_PACKETS; i++) {
+    writer.bytes.clear();
+    writer.sample(mode, i);
+    std::vector<byte> &packet = writer.bytes;
+    if ((uint32_t)rand() % damageRate == 0) {
+      boolean drop = damage == DAMAGE_BYTE_DROP || (damage == DAMAGE_BOTH && rand() % 2 == 0);
+      size_t at = rand() % packet.size();
+      if (drop) packet.erase(packet.begin() + at);
+      else packet[at] ^= 1 << (rand() % 8);
+    } else {
+      intact.insert(i);
+    }
+    stream.insert(stream.end(), packet.begin(), packet.end());
+  }
+
+  ReplayStream replay;
+  replay.load(stream);
+  replay.setChunkSize(1 + rand() % 64); // Packets split across reads too
+  DofHandler<ReplayStream> handler(&replay, 115200);
+
+  std::set<uint32_t> received;
+  uint32_t damaged = 0;
+  uint32_t duplicates = 0;
+  while (true) {
+    if (handler.checkStream(true)) {
+      if (!handler.isPacketGood()) continue;
+      DofFrame frame = handler.getFrame();
+      uint32_t index = sampleIndex(frame);
+      if (index >= FUZZ_PACKETS || !isSample(frame, mode, index)) damaged++;
+      else if (!received.insert(index).second) duplicates++;
+    } else if (replay.isDone()) {
+      break;
+    }
+  }
+
+  // The one way to lose a packet that was not damaged: the packet before it lost the last byte
+  // of its CRC, and the "9" of the magic number that came in its place was the byte it lost. The
+  // packet before is then good (nothing in it is wrong), and takes the magic number's first byte.
+  uint32_t missed = 0;
+  for (std::set<uint32_t>::const_iterator i = intact.begin(); i != intact.end(); ++i) {
+    boolean takenByPrevious = *i > 0 && intact.count(*i - 1) == 0 && received.count(*i - 1) > 0;
+    if (received.count(*i) == 0 && !takenByPrevious) missed++;
+  }
+  CHECK(damaged == 0);
+  CHECK(duplicates == 0);
+  CHECK(missed == 0);
+  CHECK(handler.getStats().goodPackets == received.size());
+  // Every damaged packet is either rejected or lost to a broken magic number
+  CHECK(handler.getStats().badPackets + handler.getStats().lostPackets >= FUZZ_PACKETS - intact.size());
+  if (damaged > 0 || duplicates > 0 || missed > 0) {
+    printf("  mode %d, damage %d, 1 in %lu, seed %u: %lu damaged, %lu duplicate, %lu missed\n", mode,
+      damage, (unsigned long)damageRate, seed, (unsigned long)damaged, (unsigned long)duplicates,
+      (unsigned long)missed);
+  }
+}
+
+int main() {
+  const byte modes[] = {DOF_DATA_MODE_ALL, DOF_DATA_MODE_GYRO};
+  const Damage damages[] = {DAMAGE_BIT_FLIP, DAMAGE_BYTE_DROP, DAMAGE_BOTH};
+  const uint32_t rates[] = {100, 10, 2};
+  unsigned int seed = 1;
+  for (byte m = 0; m < 2; m++) {
+    for (byte d = 0; d < 3; d++) {
+      for (byte r = 0; r < 3; r++) {
+        for (byte round = 0; round < FUZZ_ROUNDS; round++) {
+          fuzz(modes[m], damages[d], rates[r], seed++);
+        }
+      }
+    }
+  }
+  return checkResult();
+}
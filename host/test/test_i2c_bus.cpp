@@ -0,0 +1,174 @@
+// The firmware's interrupt driven sensor reads (I2C.h and Sensors.ino) on a simulated bus with
+// the three sensors of the board (see RazorBoard.h): the setup writes have to reach the sensors,
+// every sensor tick has to come back with the readings the sensors held, and the main loop has
+// to go on (and answer commands) while the reads are on the bus. A stuck bus must not hang the
+// setup writes.
+//
+// Also reports the loop time this saves: the same reads, with loop() waiting for them to be done
+// the way it did with the Wire library, against the reads running in the background, in both
+// sensor profiles.
+
+#include "Firmware.h"
+
+#include <string>
+
+#include "Check.h"
+#include "HostSerial.h"
+#include "RazorBoard.h"
+
+#define RUN_MICROS 1000000UL // One second per measurement
+
+static RazorBoard board;
+
+// Sets the sensor profile; set_sensor_profile() waits for its writes, so the bus answers at once
+static void setProfile(byte profile, HostI2cBus::Mode mode) {
+  board.setBusMode(HostI2cBus::BUS_IMMEDIATE);
+  set_sensor_profile(profile);
+  board.startTimer();
+  board.setBusMode(mode);
+}
+
+// Puts readings in the sensors that tell the sample apart
+static void setReadings(int sample) {
+  board.setGyro(sample, -sample, 2 * sample);
+  board.setAccel(sample + 1, -sample - 1, 256);
+  board.setMagn(3 * sample, 100 - sample, -sample);
+}
+
+// True if the firmware has the readings of sample, in its axes (SEN-10736, see Sensors.ino)
+static boolean hasReadings(int sample) {
+  return gyro_raw[0] == sample && gyro_raw[1] == -sample && gyro_raw[2] == -2 * sample
+    && accel_raw[0] == -sample - 1 && accel_raw[1] == sample + 1 && accel_raw[2] == 256
+    && magnetom_raw[0] == -(100 - sample) && magnetom_raw[1] == -3 * sample && magnetom_raw[2] == sample;
+}
+
+static void checkSetup() {
+  CHECK(board.accel.registers[0x2D] == 0x08); // Measurement mode
+  CHECK(board.accel.registers[0x31] == 0x08); // Full resolution
+  CHECK(board.accel.registers[0x2C] == sensor_profiles[SENSOR__STARTUP_PROFILE].accel_bw_rate);
+  CHECK(board.gyro.registers[0x3E] == 0x00);
+  CHECK(board.gyro.registers[0x16] == sensor_profiles[SENSOR__STARTUP_PROFILE].gyro_dlpf_fs);
+  CHECK(board.gyro.registers[0x15] == sensor_profiles[SENSOR__STARTUP_PROFILE].gyro_smplrt_div);
+  CHECK(board.magn.registers[0x02] == 0x00); // Continuous mode
+  CHECK(board.magn.registers[0x00] == sensor_profiles[SENSOR__STARTUP_PROFILE].magn_cra);
+}
+
+// Every tick gets its own readings, and the loop goes on while they are read
+static void checkBackgroundReads() {
+  setProfile(SENSOR__PROFILE_STANDARD, HostI2cBus::BUS_BACKGROUND);
+  board.run(100000);
+  unsigned int missed = num_missed_ticks;
+  int wrong = 0;
+  for (int sample = 1; sample <= 50; sample++) {
+    setReadings(sample);
+    // To the next sample, and then until the main loop has taken it
+    while (!sensor_sample_pending) board.run(1);
+    unsigned long loopsBefore = board.loops;
+    while (sensor_sample_pending) board.run(1);
+    if (!hasReadings(sample)) wrong++;
+    CHECK(board.loops - loopsBefore > 10); // The loop ran on while the bus was busy
+  }
+  CHECK(wrong == 0);
+  CHECK(num_missed_ticks == missed);
+  CHECK(num_gyro_errors == 0 && num_accel_errors == 0 && num_magn_errors == 0);
+
+  // A command sent while the sensors are read is answered before they are done
+  while (!sensor_sample_pending) board.run(1);
+  hostSerial().clearWritten();
+  hostSerial().receive("#s01");
+  board.run(3 * board.loopMicros);
+  const std::vector<byte> &written = hostSerial().getWritten();
+  CHECK(std::string(written.begin(), written.end()) == "#SYNCH01\r\n");
+  CHECK(sensor_sample_pending);
+  board.run(100000);
+}
+
+// A bus that does not move (in BUS_BACKGROUND mode nothing delivers its events while the setup
+// spins on them): the setup writes give up after I2C_TIMEOUT, a read left running is aborted
+// first, and the failed writes count as errors. Then the reads go on once the bus moves again.
+// The clock moves on by 1us per micros() call meanwhile, so the wait can run out.
+static void checkStuckBus() {
+  setProfile(SENSOR__PROFILE_STANDARD, HostI2cBus::BUS_BACKGROUND);
+  board.run(100000);
+  hostSetClockStep(1);
+  int accelErrors = num_accel_errors;
+  unsigned long start = hostMicros();
+  write_sensor(ACCEL_ADDRESS, 0x2C, 0x0A);
+  CHECK(hostMicros() - start < 2 * I2C_TIMEOUT);
+  CHECK(num_accel_errors == accelErrors + 1);
+  CHECK(board.accel.registers[0x2C] != 0x0A);
+
+  // With a read on the bus: waited for, given up on, and then the write too. The aborted read
+  // counts as an error when the loop takes its sample.
+  while (!sensor_sample_pending) board.run(1);
+  int errors = num_gyro_errors + num_accel_errors + num_magn_errors;
+  accelErrors = num_accel_errors;
+  start = hostMicros();
+  write_sensor(ACCEL_ADDRESS, 0x2C, 0x0A);
+  unsigned long waited = hostMicros() - start;
+  printf("Stuck bus: setup write given up on after %lu us, with a read running first\n", waited);
+  CHECK(waited < 3 * I2C_TIMEOUT);
+  CHECK(num_accel_errors == accelErrors + 1);
+  hostSetClockStep(0);
+  board.run(100000);
+  CHECK(num_gyro_errors + num_accel_errors + num_magn_errors >= errors + 2); // The read and the write
+
+  // The reads go on
+  errors = num_gyro_errors + num_accel_errors + num_magn_errors;
+  unsigned int missed = num_missed_ticks;
+  setReadings(7);
+  board.run(100000);
+  CHECK(hasReadings(7));
+  CHECK(num_gyro_errors + num_accel_errors + num_magn_errors == errors);
+  CHECK(num_missed_ticks == missed);
+  setProfile(SENSOR__PROFILE_STANDARD, HostI2cBus::BUS_IMMEDIATE);
+  CHECK(board.accel.registers[0x2C] == sensor_profiles[SENSOR__PROFILE_STANDARD].accel_bw_rate);
+}
+
+struct LoopTime {
+  double waitMicros; // Time per sample loop() spent waiting on the bus
+  unsigned long longestLoop; // Longest pass of loop() (us)
+  double interrupts; // TWI interrupts per sample
+  unsigned long missedTicks;
+};
+
+static LoopTime measure(byte profile, HostI2cBus::Mode mode) {
+  setProfile(profile, mode);
+  board.run(100000);
+  unsigned int missed = num_missed_ticks;
+  unsigned long interrupts = hostI2cBus().getInterrupts();
+  board.resetStats();
+  board.run(RUN_MICROS);
+  LoopTime time;
+  time.waitMicros = (double)(board.loopTime - board.loops * board.loopMicros) / board.ticks;
+  time.longestLoop = board.longestLoop;
+  time.interrupts = (double)(hostI2cBus().getInterrupts() - interrupts) / board.ticks;
+  time.missedTicks = num_missed_ticks - missed;
+  return time;
+}
+
+int main() {
+  board.begin();
+  checkSetup();
+  checkBackgroundReads();
+  checkStuckBus();
+
+  const char *names[] = {"standard (100kHz bus, 20ms ticks)", "high rate (400kHz bus, 2ms ticks)"};
+  printf("Loop time per sample: waiting for the sensor reads (as with Wire) / reads in the background\n");
+  for (byte profile = 0; profile < SENSOR__PROFILE_COUNT; profile++) {
+    LoopTime waiting = measure(profile, HostI2cBus::BUS_IMMEDIATE);
+    LoopTime background = measure(profile, HostI2cBus::BUS_BACKGROUND);
+    double tick = sensor_profiles[profile].fusion_interval * 1000.0;
+    printf("  %s\n", names[profile]);
+    printf("    waiting on the bus   %6.1f us / %6.1f us (%.1f%% / %.1f%% of the tick)\n", waiting.waitMicros,
+      background.waitMicros, 100 * waiting.waitMicros / tick, 100 * background.waitMicros / tick);
+    printf("    longest loop() pass  %6lu us / %6lu us\n", waiting.longestLoop, background.longestLoop);
+    printf("    TWI interrupts %.1f per sample, missed ticks %lu / %lu\n", background.interrupts,
+      waiting.missedTicks, background.missedTicks);
+    CHECK(background.waitMicros == 0);
+    CHECK(background.longestLoop == board.loopMicros);
+    CHECK(background.missedTicks == 0);
+    CHECK(waiting.waitMicros > 0);
+  }
+  return checkResult();
+}
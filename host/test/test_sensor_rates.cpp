@@ -0,0 +1,149 @@
+// The sensor profiles on the simulated bus (see RazorBoard.h), with sensors that take a new
+// sample at their output data rate: "#p1" has to switch the sensors and the tick to the high
+// rate, every tick has to be taken (2ms apart, read before the next one), the gyroscope has to
+// be read on every tick and the accelerometer and magnetometer often enough that none of their
+// samples is missed.
+
+#include "Firmware.h"
+
+#include <string>
+
+#include "Check.h"
+#include "HostSerial.h"
+#include "RazorBoard.h"
+
+/**
+ * A sensor that takes a sample every period microseconds and has the number of its sample in
+ * all three axes of its data registers, from the time the data registers are read.
+ */
+class RateSensor : public HostI2cDevice {
+  public:
+    RateSensor(byte dataRegister, boolean bigEndian) : period(0), dataRegister(dataRegister), bigEndian(bigEndian) {}
+
+    byte readRegister(byte reg) {
+      if (reg == dataRegister && period > 0) {
+        int sample = (int)(hostMicros() / period);
+        for (int i = 0; i < 3; i++) {
+          registers[dataRegister + 2 * i + (bigEndian ? 0 : 1)] = (sample >> 8) & 0xFF;
+          registers[dataRegister + 2 * i + (bigEndian ? 1 : 0)] = sample & 0xFF;
+        }
+      }
+      return HostI2cDevice::readRegister(reg);
+    }
+
+    unsigned long period; // Output data period (us), 0 for none
+  private:
+    byte dataRegister;
+    boolean bigEndian;
+};
+
+static RazorBoard board;
+static RateSensor gyroSensor(0x1D, true), accelSensor(0x32, false), magnSensor(0x03, true);
+
+// Sample numbers the firmware got, in its axes (SEN-10736, see Sensors.ino)
+static int gyroSample() { return -gyro_raw[0]; }
+static int accelSample() { return accel_raw[1]; }
+static int magnSample() { return -magnetom_raw[2]; }
+
+// Sends a command; the profile switch waits for its writes, so the bus answers at once meanwhile
+static void command(const char *text) {
+  board.setBusMode(HostI2cBus::BUS_IMMEDIATE);
+  hostSerial().receive(text);
+  board.run(board.loopMicros);
+  board.startTimer();
+  board.setBusMode(HostI2cBus::BUS_BACKGROUND);
+}
+
+// Runs to the end of the next sample, that is until the main loop has taken it
+static void nextSample() {
+  while (!sensor_sample_pending) board.run(1);
+  while (sensor_sample_pending) board.run(1);
+}
+
+struct RateCheck {
+  int samples;
+  unsigned long tickMicros; // Sensor tick interval of the profile
+  unsigned long longestDelay; // Longest time from a tick to its sample taken (us)
+  int badIntervals; // Samples not one tick after the last one
+  int gyroSkipped, accelSkipped, magnSkipped; // Sensor samples never read
+  int gyroRepeated; // Gyro samples read twice
+  unsigned long missedTicks;
+};
+
+// Takes samples ticks and checks what came in with them against the output data rates
+static RateCheck runSamples(int samples) {
+  RateCheck check = {samples, fusion_data_interval * 1000UL, 0, 0, 0, 0, 0, 0, 0};
+  unsigned int missed = num_missed_ticks;
+  nextSample();
+  int lastGyro = gyroSample(), lastAccel = accelSample(), lastMagn = magnSample();
+  unsigned long lastMicros = sensor_sample_micros;
+  for (int i = 0; i < samples; i++) {
+    nextSample();
+    unsigned long delay = hostMicros() - sensor_sample_micros;
+    if (delay > check.longestDelay) check.longestDelay = delay;
+    if (sensor_sample_micros - lastMicros != check.tickMicros) check.badIntervals++;
+    // The gyroscope is read on every tick, so it moves on by the samples it takes per tick
+    int gyroStep = gyroSample() - lastGyro;
+    int gyroExpected = (int)(check.tickMicros / gyroSensor.period);
+    if (gyroStep > gyroExpected) check.gyroSkipped++;
+    if (gyroStep == 0) check.gyroRepeated++;
+    // The others are read at least once per sample they take
+    if (accelSample() - lastAccel > 1) check.accelSkipped++;
+    if (magnSample() - lastMagn > 1) check.magnSkipped++;
+    lastGyro = gyroSample();
+    lastAccel = accelSample();
+    lastMagn = magnSample();
+    lastMicros = sensor_sample_micros;
+  }
+  check.missedTicks = num_missed_ticks - missed;
+  return check;
+}
+
+// allSamples: the profile reads every sample the sensors take (the standard one reads at 50Hz)
+static void report(const char *name, const RateCheck &check, boolean allSamples) {
+  printf("%s: %d samples %lu us apart, longest tick to sample %lu us, missed ticks %lu\n", name, check.samples,
+    check.tickMicros, check.longestDelay, check.missedTicks);
+  printf("  skipped sensor samples: gyro %d (%d read twice), accel %d, magn %d\n", check.gyroSkipped,
+    check.gyroRepeated, check.accelSkipped, check.magnSkipped);
+  CHECK(check.badIntervals == 0);
+  CHECK(check.longestDelay < check.tickMicros);
+  CHECK(check.missedTicks == 0);
+  if (!allSamples) return;
+  CHECK(check.gyroSkipped == 0 && check.gyroRepeated == 0);
+  CHECK(check.accelSkipped == 0);
+  CHECK(check.magnSkipped == 0);
+}
+
+int main() {
+  hostI2cBus().attach(GYRO_ADDRESS, &gyroSensor);
+  hostI2cBus().attach(ACCEL_ADDRESS, &accelSensor);
+  hostI2cBus().attach(MAGN_ADDRESS, &magnSensor);
+  board.begin();
+  board.loopMicros = 100; // A loop() pass with the fusion and output in it
+  board.setBusMode(HostI2cBus::BUS_BACKGROUND);
+
+  // Standard profile: gyro 1kHz / 11, accel 50Hz, magn 75Hz (HMC5883L), read every 20ms
+  gyroSensor.period = 11000;
+  accelSensor.period = 20000;
+  magnSensor.period = 13334;
+  report("standard", runSamples(100), false);
+
+  // High rate profile: gyro 1kHz, accel 400Hz, magn 75Hz, read every 2ms
+  command("#p1");
+  CHECK(sensor_profile == SENSOR__PROFILE_HIGH_RATE);
+  CHECK(gyroSensor.registers[0x15] == 0x00 && gyroSensor.registers[0x16] == 0x19);
+  CHECK(accelSensor.registers[0x2C] == 0x0C);
+  CHECK(fusion_data_interval == 2);
+  gyroSensor.period = 1000;
+  accelSensor.period = 2500;
+  report("high rate", runSamples(1000), true);
+  CHECK(G_Dt == 0.002f);
+
+  // And back
+  command("#p0");
+  CHECK(sensor_profile == SENSOR__PROFILE_STANDARD && fusion_data_interval == 20);
+  gyroSensor.period = 11000;
+  accelSensor.period = 20000;
+  report("standard again", runSamples(50), false);
+  return checkResult();
+}
@@ -0,0 +1,138 @@
+// Writes the function prototypes the Arduino IDE generates for a sketch: one for every function
+// defined in the given .ino files, so the host build can compile the tabs in one translation
+// unit the way the IDE does.
+//
+// Usage: prototypes <output header> <sketch file>...
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// The file without comments and preprocessor lines (newlines are kept)
+static std::string stripSource(const std::string &in) {
+  std::string out;
+  size_t i = 0;
+  bool lineStart = true;
+  while (i < in.size()) {
+    char c = in[i];
+    if (lineStart && (c == ' ' || c == '\t')) {
+      out += c;
+      i++;
+      continue;
+    }
+    if (lineStart && c == '#') {
+      // Preprocessor line, with its continuations
+      while (i < in.size() && !(in[i] == '\n' && in[i - 1] != '\\')) i++;
+      continue;
+    }
+    lineStart = false;
+    if (c == '/' && i + 1 < in.size() && in[i + 1] == '/') {
+      while (i < in.size() && in[i] != '\n') i++;
+      continue;
+    }
+    if (c == '/' && i + 1 < in.size() && in[i + 1] == '*') {
+      size_t end = in.find("*/", i + 2);
+      end = end == std::string::npos ? in.size() : end + 2;
+      for (; i < end; i++) {
+        if (in[i] == '\n') out += '\n';
+      }
+      continue;
+    }
+    if (c == '"' || c == '\'') {
+      // Literals are kept, but braces in them must not count
+      out += c;
+      for (i++; i < in.size() && in[i] != c; i++) {
+        if (in[i] == '\\') i++;
+        out += ' ';
+      }
+      if (i < in.size()) out += c;
+      i++;
+      continue;
+    }
+    if (c == '\n') lineStart = true;
+    out += c;
+    i++;
+  }
+  return out;
+}
+
+static std::string collapse(const std::string &text) {
+  std::istringstream words(text);
+  std::string word, out;
+  while (words >> word) {
+    if (!out.empty()) out += ' ';
+    out += word;
+  }
+  return out;
+}
+
+// The prototype of a declaration that is followed by a body, or "" if it is not a function
+static std::string prototype(const std::string &declaration) {
+  std::string text = collapse(declaration);
+  size_t open = text.find('(');
+  if (open == std::string::npos || text.empty() || text[text.size() - 1] != ')') return "";
+  if (text.find('=') < open) return "";
+
+  // A return type and a name before the parameters (ISR(...) has neither)
+  std::istringstream head(text.substr(0, open));
+  std::string word;
+  int words = 0;
+  while (head >> word) {
+    if (word == "class" || word == "struct" || word == "enum" || word == "union"
+        || word == "namespace" || word == "extern" || word == "else" || word == "if") return "";
+    words++;
+  }
+  return words >= 2 ? text + ";" : "";
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <output header> <sketch file>...\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<std::string> prototypes;
+  std::set<std::string> seen;
+  for (int f = 2; f < argc; f++) {
+    std::ifstream file(argv[f]);
+    if (!file) {
+      fprintf(stderr, "Cannot read %s\n", argv[f]);
+      return 1;
+    }
+    std::stringstream content;
+    content << file.rdbuf();
+    std::string source = stripSource(content.str());
+
+    int depth = 0;
+    std::string declaration;
+    for (size_t i = 0; i < source.size(); i++) {
+      char c = source[i];
+      if (c == '{') {
+        if (depth == 0) {
+          std::string p = prototype(declaration);
+          if (!p.empty() && seen.insert(p).second) prototypes.push_back(p);
+          declaration.clear();
+        }
+        depth++;
+      } else if (c == '}') {
+        if (depth > 0) depth--;
+        declaration.clear();
+      } else if (depth == 0) {
+        if (c == ';') declaration.clear();
+        else declaration += c;
+      }
+    }
+  }
+
+  std::ofstream out(argv[1]);
+  out << "// Generated by host/tools/prototypes from the Razor AHRS sketch; do not edit\n\n";
+  for (size_t i = 0; i < prototypes.size(); i++) {
+    out << prototypes[i] << "\n";
+  }
+  return out ? 0 : 1;
+}
@@ -3,6 +3,7 @@
 #define DOF_DATA_INTERVAL 30 // Interval (milliseconds) between data sending, between 1 and 255 (inclusive)
 #define DOF_DATA_CONTINUOUS false // Set to true to enable a continuous data stream on startup, false otherwise
 #define DOF_SERIAL_DEBUG false // Set to true to echo the 9DoF stream to Serial and do no processesing on data
+#define DOF_PIPELINE_DEPTH 4 // Tagged requests kept in flight, 1 to DOF_MAX_REQUESTS (1 waits for every answer before asking again)
 
 SoftwareSerial dofSerial(2, 3); // RX, TX
 #include "DofHandler.h"
@@ -14,17 +15,15 @@ void setup() {
   pinMode(13, OUTPUT);
   digitalWrite(13, LOW);
 
-  // Initialize at 9600 baud, but change to 28800
+  // Initialize at 9600 baud, but step up to 28800 (as far as the link holds up)
   dofHandler.begin(9600, 28800);
   dofHandler.setContinuousStream(DOF_DATA_CONTINUOUS);
   dofHandler.setUpdateInterval(DOF_DATA_INTERVAL);
   dofHandler.setDataMode(DOF_DATA_MODE_ALL);
+  dofHandler.setPipelineDepth(DOF_PIPELINE_DEPTH);
 
 }
 
-boolean sending = false;
-unsigned long time = 0;
-
 void loop() {
 #if DOF_SERIAL_DEBUG == true
   dofHandler.debugRead(Serial);
@@ -36,24 +35,16 @@ void loop() {
       Serial.println("Bad");
     }
   }*/
-  if (!sending) {
-    time = millis();
-    dofHandler.requestData();
-    sending = true;
-  } 
-  else {
-    if (dofHandler.checkStream(true)) {
-      sending = false;
-      time = millis() - time;
-      if (dofHandler.isPacketGood()) {
-        //dofHandler.printData(Serial);
-        Serial.println(time);
-        digitalWrite(13, LOW);
-      } else {
-        Serial.println("Bad");
-        digitalWrite(13, HIGH);
-      }
-      delay(100);
+  // Keep the requests in flight, and print the latency (in microseconds) of every answer
+  dofHandler.requestDataPipelined();
+  if (dofHandler.checkStream(true)) {
+    if (dofHandler.isPacketGood()) {
+      //dofHandler.printData(Serial);
+      Serial.println(dofHandler.getRequestLatency());
+      digitalWrite(13, LOW);
+    } else {
+      Serial.println("Bad");
+      digitalWrite(13, HIGH);
     }
   }
   if (Serial.available()) {